@@ -30,6 +30,7 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include "fmacros.h"
 #include <stdio.h>
 #include <sys/time.h>
 #include <sys/types.h>
@@ -46,6 +47,9 @@
 
 /* Include the best multiplexing layer supported by this system.
  * The following should be ordered by performances, descending. */
+#ifdef HAVE_IOURING
+#include "ae_iouring.c"
+#else
 #ifdef HAVE_EVPORT
 #include "ae_evport.c"
 #else
@@ -59,6 +63,7 @@
         #endif
     #endif
 #endif
+#endif
 
 aeEventLoop *aeCreateEventLoop(int setsize) {
     aeEventLoop *eventLoop;
@@ -70,7 +75,13 @@ aeEventLoop *aeCreateEventLoop(int setsize) {
     if (eventLoop->events == NULL || eventLoop->fired == NULL) goto err;
     eventLoop->setsize = setsize;
     eventLoop->lastTime = time(NULL);
-    eventLoop->timeEventHead = NULL;
+    eventLoop->timeEventHeap = NULL;
+    eventLoop->timeEventHeapLen = 0;
+    eventLoop->timeEventHeapSize = 0;
+    eventLoop->timeEventTable = NULL;
+    eventLoop->timeEventTableSize = 0;
+    eventLoop->timeEventCount = 0;
+    eventLoop->timeEventDeleted = NULL;
     eventLoop->timeEventNextId = 0;
     eventLoop->stop = 0;
     eventLoop->maxfd = -1;
@@ -123,7 +134,19 @@ int aeResizeSetSize(aeEventLoop *eventLoop, int setsize) {
 }
 
 void aeDeleteEventLoop(aeEventLoop *eventLoop) {
+    aeTimeEvent *te;
+    int j;
+
     aeApiFree(eventLoop);
+    /* Every live event is in the heap, the deleted ones in the list. */
+    for (j = 0; j < eventLoop->timeEventHeapLen; j++)
+        zfree(eventLoop->timeEventHeap[j]);
+    while((te = eventLoop->timeEventDeleted) != NULL) {
+        eventLoop->timeEventDeleted = te->next;
+        zfree(te);
+    }
+    zfree(eventLoop->timeEventHeap);
+    zfree(eventLoop->timeEventTable);
     zfree(eventLoop->events);
     zfree(eventLoop->fired);
     zfree(eventLoop);
@@ -205,6 +228,144 @@ static void aeAddMillisecondsToNow(long long milliseconds, long *sec, long *ms)
     *ms = when_ms;
 }
 
+/* Time events are kept in a binary min-heap ordered by expire time, so that
+ * the nearest timer is always at the root, and in a small hash table indexed
+ * by ID, so that aeDeleteTimeEvent() does not need to scan all the timers.
+ * Every event stores its own position in the heap in order to be removed
+ * in O(log(N)) from any position. */
+
+#define AE_TIME_EVENT_TABLE_INITIAL_SIZE 16
+
+/* Return non-zero if the time event 'a' expires before 'b'. */
+static int aeTimeEventBefore(aeTimeEvent *a, aeTimeEvent *b) {
+    return a->when_sec < b->when_sec ||
+           (a->when_sec == b->when_sec && a->when_ms < b->when_ms);
+}
+
+static void aeTimeEventHeapSet(aeEventLoop *eventLoop, int idx, aeTimeEvent *te) {
+    eventLoop->timeEventHeap[idx] = te;
+    te->heapIndex = idx;
+}
+
+static void aeTimeEventHeapUp(aeEventLoop *eventLoop, int idx) {
+    aeTimeEvent **heap = eventLoop->timeEventHeap;
+    aeTimeEvent *te = heap[idx];
+
+    while (idx > 0) {
+        int parent = (idx-1)/2;
+        if (!aeTimeEventBefore(te,heap[parent])) break;
+        aeTimeEventHeapSet(eventLoop,idx,heap[parent]);
+        idx = parent;
+    }
+    aeTimeEventHeapSet(eventLoop,idx,te);
+}
+
+static void aeTimeEventHeapDown(aeEventLoop *eventLoop, int idx) {
+    aeTimeEvent **heap = eventLoop->timeEventHeap;
+    aeTimeEvent *te = heap[idx];
+    int len = eventLoop->timeEventHeapLen;
+
+    while (1) {
+        int child = idx*2+1;
+        if (child >= len) break;
+        if (child+1 < len && aeTimeEventBefore(heap[child+1],heap[child]))
+            child++;
+        if (!aeTimeEventBefore(heap[child],te)) break;
+        aeTimeEventHeapSet(eventLoop,idx,heap[child]);
+        idx = child;
+    }
+    aeTimeEventHeapSet(eventLoop,idx,te);
+}
+
+static void aeTimeEventHeapPush(aeEventLoop *eventLoop, aeTimeEvent *te) {
+    if (eventLoop->timeEventHeapLen == eventLoop->timeEventHeapSize) {
+        eventLoop->timeEventHeapSize = eventLoop->timeEventHeapSize ?
+            eventLoop->timeEventHeapSize*2 : AE_TIME_EVENT_TABLE_INITIAL_SIZE;
+        eventLoop->timeEventHeap = zrealloc(eventLoop->timeEventHeap,
+            sizeof(aeTimeEvent*)*eventLoop->timeEventHeapSize);
+    }
+    aeTimeEventHeapSet(eventLoop,eventLoop->timeEventHeapLen++,te);
+    aeTimeEventHeapUp(eventLoop,te->heapIndex);
+}
+
+static void aeTimeEventHeapRemove(aeEventLoop *eventLoop, aeTimeEvent *te) {
+    int idx = te->heapIndex;
+    aeTimeEvent *last = eventLoop->timeEventHeap[--eventLoop->timeEventHeapLen];
+
+    te->heapIndex = -1;
+    if (last == te) return;
+    /* Move the last element in the hole, then restore the heap property
+     * in the direction it is violated, if any. */
+    aeTimeEventHeapSet(eventLoop,idx,last);
+    if (idx > 0 && aeTimeEventBefore(last,
+                   eventLoop->timeEventHeap[(idx-1)/2]))
+        aeTimeEventHeapUp(eventLoop,idx);
+    else
+        aeTimeEventHeapDown(eventLoop,idx);
+}
+
+static aeTimeEvent **aeTimeEventBucket(aeEventLoop *eventLoop, long long id) {
+    return &eventLoop->timeEventTable[(unsigned long long)id &
+                                      (eventLoop->timeEventTableSize-1)];
+}
+
+static void aeTimeEventTableAdd(aeEventLoop *eventLoop, aeTimeEvent *te) {
+    aeTimeEvent **bucket;
+
+    /* Grow the table when the load factor reaches 1. IDs are sequential,
+     * so the low bits are enough to distribute them evenly. */
+    if (eventLoop->timeEventCount >= eventLoop->timeEventTableSize) {
+        int oldsize = eventLoop->timeEventTableSize, j;
+        aeTimeEvent **old = eventLoop->timeEventTable;
+
+        eventLoop->timeEventTableSize = oldsize ? oldsize*2 :
+                                        AE_TIME_EVENT_TABLE_INITIAL_SIZE;
+        eventLoop->timeEventTable = zcalloc(sizeof(aeTimeEvent*)*
+                                            eventLoop->timeEventTableSize);
+        for (j = 0; j < oldsize; j++) {
+            aeTimeEvent *e = old[j];
+            while(e) {
+                aeTimeEvent *next = e->idNext;
+                bucket = aeTimeEventBucket(eventLoop,e->id);
+                e->idNext = *bucket;
+                *bucket = e;
+                e = next;
+            }
+        }
+        zfree(old);
+    }
+    bucket = aeTimeEventBucket(eventLoop,te->id);
+    te->idNext = *bucket;
+    *bucket = te;
+    eventLoop->timeEventCount++;
+}
+
+/* Unlink the event with the specified ID from the table and return it,
+ * or return NULL if there is no such event. */
+static aeTimeEvent *aeTimeEventTableRemove(aeEventLoop *eventLoop, long long id) {
+    aeTimeEvent **link;
+
+    if (eventLoop->timeEventTableSize == 0) return NULL;
+    link = aeTimeEventBucket(eventLoop,id);
+    while(*link) {
+        aeTimeEvent *te = *link;
+        if (te->id == id) {
+            *link = te->idNext;
+            te->idNext = NULL;
+            eventLoop->timeEventCount--;
+            return te;
+        }
+        link = &te->idNext;
+    }
+    return NULL;
+}
+
+static void aeFreeTimeEvent(aeEventLoop *eventLoop, aeTimeEvent *te) {
+    if (te->finalizerProc)
+        te->finalizerProc(eventLoop, te->clientData);
+    zfree(te);
+}
+
 long long aeCreateTimeEvent(aeEventLoop *eventLoop, long long milliseconds,
         aeTimeProc *proc, void *clientData,
         aeEventFinalizerProc *finalizerProc)
@@ -219,22 +380,32 @@ long long aeCreateTimeEvent(aeEventLoop *eventLoop, long long milliseconds,
     te->timeProc = proc;
     te->finalizerProc = finalizerProc;
     te->clientData = clientData;
-    te->next = eventLoop->timeEventHead;
-    eventLoop->timeEventHead = te;
+    te->next = NULL;
+    aeTimeEventTableAdd(eventLoop,te);
+    aeTimeEventHeapPush(eventLoop,te);
     return id;
 }
 
+/* Delete the time event with the specified ID. The finalizer is not called
+ * synchronously but only at the next processTimeEvents() call, so it is
+ * safe for a time event to delete itself (or other events) from its own
+ * timer callback. */
 int aeDeleteTimeEvent(aeEventLoop *eventLoop, long long id)
 {
-    aeTimeEvent *te = eventLoop->timeEventHead;
-    while(te) {
-        if (te->id == id) {
-            te->id = AE_DELETED_EVENT_ID;
-            return AE_OK;
-        }
-        te = te->next;
+    aeTimeEvent *te;
+
+    if (id < 0) return AE_ERR;
+    te = aeTimeEventTableRemove(eventLoop,id);
+    if (te == NULL) return AE_ERR; /* NO event with the specified ID found */
+    te->id = AE_DELETED_EVENT_ID;
+    /* Events not in the heap are being fired right now by
+     * processTimeEvents(), that will take care of releasing them. */
+    if (te->heapIndex != -1) {
+        aeTimeEventHeapRemove(eventLoop,te);
+        te->next = eventLoop->timeEventDeleted;
+        eventLoop->timeEventDeleted = te;
     }
-    return AE_ERR; /* NO event with the specified ID found */
+    return AE_OK;
 }
 
 /* Search the first timer to fire.
@@ -242,32 +413,17 @@ int aeDeleteTimeEvent(aeEventLoop *eventLoop, long long id)
  * put in sleep without to delay any event.
  * If there are no timers NULL is returned.
  *
- * Note that's O(N) since time events are unsorted.
- * Possible optimizations (not needed by Redis so far, but...):
- * 1) Insert the event in order, so that the nearest is just the head.
- *    Much better but still insertion or deletion of timers is O(N).
- * 2) Use a skiplist to have this operation as O(1) and insertion as O(log(N)).
- */
+ * This is O(1) since the nearest timer is always the root of the heap. */
 static aeTimeEvent *aeSearchNearestTimer(aeEventLoop *eventLoop)
 {
-    aeTimeEvent *te = eventLoop->timeEventHead;
-    aeTimeEvent *nearest = NULL;
-
-    while(te) {
-        if (!nearest || te->when_sec < nearest->when_sec ||
-                (te->when_sec == nearest->when_sec &&
-                 te->when_ms < nearest->when_ms))
-            nearest = te;
-        te = te->next;
-    }
-    return nearest;
+    return eventLoop->timeEventHeapLen ? eventLoop->timeEventHeap[0] : NULL;
 }
 
 /* Process time events */
 static int processTimeEvents(aeEventLoop *eventLoop) {
     int processed = 0;
-    aeTimeEvent *te, *prev;
-    long long maxId;
+    aeTimeEvent *te, *firing = NULL, **tail = &firing;
+    long now_sec, now_ms;
     time_t now = time(NULL);
 
     /* If the system clock is moved to the future, and then set back to the
@@ -277,63 +433,59 @@ static int processTimeEvents(aeEventLoop *eventLoop) {
      * Here we try to detect system clock skews, and force all the time
      * events to be processed ASAP when this happens: the idea is that
      * processing events earlier is less dangerous than delaying them
-     * indefinitely, and practice suggests it is. */
+     * indefinitely, and practice suggests it is. Setting the same expire
+     * second to every event does not break the heap ordering. */
     if (now < eventLoop->lastTime) {
-        te = eventLoop->timeEventHead;
-        while(te) {
-            te->when_sec = 0;
-            te = te->next;
-        }
+        int j;
+        for (j = 0; j < eventLoop->timeEventHeapLen; j++)
+            eventLoop->timeEventHeap[j]->when_sec = 0;
     }
     eventLoop->lastTime = now;
 
-    prev = NULL;
-    te = eventLoop->timeEventHead;
-    maxId = eventLoop->timeEventNextId-1;
-    while(te) {
-        long now_sec, now_ms;
-        long long id;
+    /* Release events scheduled for deletion. */
+    while((te = eventLoop->timeEventDeleted) != NULL) {
+        eventLoop->timeEventDeleted = te->next;
+        aeFreeTimeEvent(eventLoop,te);
+    }
+
+    /* Detach all the expired events from the heap before calling them, so
+     * that time events created or rescheduled by time events in this
+     * iteration are not processed until the next one. */
+    aeGetTime(&now_sec, &now_ms);
+    while(eventLoop->timeEventHeapLen) {
+        te = eventLoop->timeEventHeap[0];
+        if (now_sec < te->when_sec ||
+            (now_sec == te->when_sec && now_ms < te->when_ms)) break;
+        aeTimeEventHeapRemove(eventLoop,te);
+        *tail = te;
+        tail = &te->next;
+    }
+
+    while(firing) {
+        int retval;
+
+        te = firing;
+        firing = te->next;
+        te->next = NULL;
 
-        /* Remove events scheduled for deletion. */
+        /* Deleted by a timer that fired before in this iteration. */
         if (te->id == AE_DELETED_EVENT_ID) {
-            aeTimeEvent *next = te->next;
-            if (prev == NULL)
-                eventLoop->timeEventHead = te->next;
-            else
-                prev->next = te->next;
-            if (te->finalizerProc)
-                te->finalizerProc(eventLoop, te->clientData);
-            zfree(te);
-            te = next;
+            aeFreeTimeEvent(eventLoop,te);
             continue;
         }
 
-        /* Make sure we don't process time events created by time events in
-         * this iteration. Note that this check is currently useless: we always
-         * add new timers on the head, however if we change the implementation
-         * detail, this check may be useful again: we keep it here for future
-         * defense. */
-        if (te->id > maxId) {
-            te = te->next;
-            continue;
-        }
-        aeGetTime(&now_sec, &now_ms);
-        if (now_sec > te->when_sec ||
-            (now_sec == te->when_sec && now_ms >= te->when_ms))
-        {
-            int retval;
-
-            id = te->id;
-            retval = te->timeProc(eventLoop, id, te->clientData);
-            processed++;
-            if (retval != AE_NOMORE) {
-                aeAddMillisecondsToNow(retval,&te->when_sec,&te->when_ms);
-            } else {
-                te->id = AE_DELETED_EVENT_ID;
-            }
+        retval = te->timeProc(eventLoop, te->id, te->clientData);
+        processed++;
+        if (te->id == AE_DELETED_EVENT_ID) {
+            /* Deleted by its own callback. */
+            aeFreeTimeEvent(eventLoop,te);
+        } else if (retval != AE_NOMORE) {
+            aeAddMillisecondsToNow(retval,&te->when_sec,&te->when_ms);
+            aeTimeEventHeapPush(eventLoop,te);
+        } else {
+            aeTimeEventTableRemove(eventLoop,te->id);
+            aeFreeTimeEvent(eventLoop,te);
         }
-        prev = te;
-        te = te->next;
     }
     return processed;
 }
@@ -83,7 +83,9 @@ typedef struct aeTimeEvent {
     aeTimeProc *timeProc;
     aeEventFinalizerProc *finalizerProc;
     void *clientData;
-    struct aeTimeEvent *next;
+    int heapIndex; /* Position in the timers heap, -1 if not in the heap. */
+    struct aeTimeEvent *idNext; /* Next event in the same ID table bucket. */
+    struct aeTimeEvent *next; /* Next event in the deleted/firing list. */
 } aeTimeEvent;
 
 /* A fired event */
@@ -100,7 +102,13 @@ typedef struct aeEventLoop {
     time_t lastTime;     /* Used to detect system clock skew */
     aeFileEvent *events; /* Registered events */
     aeFiredEvent *fired; /* Fired events */
-    aeTimeEvent *timeEventHead;
+    aeTimeEvent **timeEventHeap; /* Binary min-heap ordered by expire time. */
+    int timeEventHeapLen;        /* Number of events in the heap. */
+    int timeEventHeapSize;       /* Allocated slots of the heap. */
+    aeTimeEvent **timeEventTable; /* ID -> event hash table, for deletion. */
+    int timeEventTableSize;      /* Buckets of the table, power of two. */
+    int timeEventCount;          /* Number of events in the table. */
+    aeTimeEvent *timeEventDeleted; /* Deleted events to finalize. */
     int stop;
     void *apidata; /* This is used for polling API specific data */
     aeBeforeSleepProc *beforesleep;
@@ -0,0 +1,397 @@
+/* Linux io_uring(7) based ae.c module
+ *
+ * Readiness is tracked with IORING_OP_POLL_ADD requests, one per monitored
+ * file descriptor. The point is the syscall count: adding, modifying and
+ * removing events just queues submission entries, and all the pending ones
+ * are submitted by the same io_uring_enter(2) call that waits for the
+ * events, while epoll needs an epoll_ctl(2) call for every change (for
+ * instance every time a client write handler is installed or removed).
+ *
+ * We use one-shot polls, re-armed with the current mask before waiting
+ * again: multishot polls only post a new completion when the file is woken
+ * up again, that is, they are edge triggered, while ae.c and its users
+ * expect level triggered events (a read handler may leave data in the
+ * socket buffer). Since re-arming is just another queued entry it costs no
+ * additional syscall.
+ *
+ * Every poll request carries the descriptor and a per descriptor generation
+ * number, bumped every time the descriptor is armed, so that completions of
+ * requests that were removed in the meantime (or of a previous descriptor
+ * with the same number) are recognized and ignored.
+ *
+ * The module needs Linux 5.11 or greater. If io_uring is not available the
+ * epoll module, compiled in as well, is used instead.
+ *
+ * Copyright (c) 2009-2012, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <stdint.h>
+
+/* The epoll module, with its functions renamed, is our fallback. */
+#define aeApiState aeEpollApiState
+#define aeApiCreate aeEpollApiCreate
+#define aeApiResize aeEpollApiResize
+#define aeApiFree aeEpollApiFree
+#define aeApiAddEvent aeEpollApiAddEvent
+#define aeApiDelEvent aeEpollApiDelEvent
+#define aeApiPoll aeEpollApiPoll
+#define aeApiName aeEpollApiName
+#include "ae_epoll.c"
+#undef aeApiState
+#undef aeApiCreate
+#undef aeApiResize
+#undef aeApiFree
+#undef aeApiAddEvent
+#undef aeApiDelEvent
+#undef aeApiPoll
+#undef aeApiName
+
+#define AE_IOURING_MAX_ENTRIES 4096
+#define AE_IOURING_REMOVE_TAG UINT64_MAX /* user_data of POLL_REMOVE. */
+
+/* Set by the first aeApiCreate() call: io_uring availability is a property
+ * of the kernel, so all the event loops of the process use the same module. */
+static int aeIOUringFallback = -1;
+
+typedef struct aeIOUringFd {
+    uint32_t gen;           /* Generation of the last poll request. */
+    unsigned char armed;    /* A poll request is in flight. */
+    unsigned char dirty;    /* Queued in 'dirty', must be re-armed. */
+} aeIOUringFd;
+
+typedef struct aeApiState {
+    int ringfd;
+    /* Submission queue. */
+    unsigned *sq_khead, *sq_ktail, *sq_array;
+    unsigned sq_mask, sq_entries, sq_tail;
+    struct io_uring_sqe *sqes;
+    /* Completion queue. */
+    unsigned *cq_khead, *cq_ktail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+    /* Mappings to release. */
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size, sqes_size;
+    /* Per file descriptor state, and the descriptors to re-arm. */
+    aeIOUringFd *fds;
+    int *dirty;
+    int numdirty;
+} aeApiState;
+
+static int aeIOUringEnter(aeApiState *state, unsigned to_submit,
+                          unsigned min_complete, struct timeval *tvp)
+{
+    struct io_uring_getevents_arg arg = {0};
+    struct __kernel_timespec ts;
+    unsigned flags = IORING_ENTER_EXT_ARG;
+
+    if (min_complete || tvp) flags |= IORING_ENTER_GETEVENTS;
+    if (tvp) {
+        ts.tv_sec = tvp->tv_sec;
+        ts.tv_nsec = tvp->tv_usec*1000;
+        arg.ts = (uint64_t)(uintptr_t)&ts;
+    }
+    return syscall(__NR_io_uring_enter,state->ringfd,to_submit,min_complete,
+                   flags,&arg,sizeof(arg));
+}
+
+/* Number of queued entries the kernel did not consume yet. */
+static unsigned aeIOUringPending(aeApiState *state) {
+    return state->sq_tail - __atomic_load_n(state->sq_khead,__ATOMIC_ACQUIRE);
+}
+
+/* Return a zeroed submission entry, submitting the queued ones if the queue
+ * is full. NULL is returned if no entry is available even after that. Once
+ * filled the entry is queued with aeIOUringCommitSqe(). */
+static struct io_uring_sqe *aeIOUringGetSqe(aeApiState *state) {
+    struct io_uring_sqe *sqe;
+
+    if (aeIOUringPending(state) >= state->sq_entries) {
+        aeIOUringEnter(state,aeIOUringPending(state),0,NULL);
+        if (aeIOUringPending(state) >= state->sq_entries) return NULL;
+    }
+    sqe = &state->sqes[state->sq_tail & state->sq_mask];
+    memset(sqe,0,sizeof(*sqe));
+    return sqe;
+}
+
+static void aeIOUringCommitSqe(aeApiState *state) {
+    state->sq_tail++;
+    __atomic_store_n(state->sq_ktail,state->sq_tail,__ATOMIC_RELEASE);
+}
+
+static void aeIOUringMarkDirty(aeApiState *state, int fd) {
+    if (state->fds[fd].dirty) return;
+    state->fds[fd].dirty = 1;
+    state->dirty[state->numdirty++] = fd;
+}
+
+/* Queue the removal of the poll request in flight for 'fd', if any. Its
+ * completion will be ignored because of the generation anyway, but we
+ * don't want the kernel to keep a reference to the file. */
+static void aeIOUringDisarm(aeApiState *state, int fd) {
+    struct io_uring_sqe *sqe;
+
+    if (!state->fds[fd].armed) return;
+    state->fds[fd].armed = 0;
+    if ((sqe = aeIOUringGetSqe(state)) == NULL) return;
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->fd = -1;
+    sqe->addr = ((uint64_t)state->fds[fd].gen << 32) | (uint32_t)fd;
+    sqe->user_data = AE_IOURING_REMOVE_TAG;
+    aeIOUringCommitSqe(state);
+}
+
+static int aeIOUringArm(aeApiState *state, int fd, int mask) {
+    struct io_uring_sqe *sqe;
+
+    if ((sqe = aeIOUringGetSqe(state)) == NULL) return -1;
+    state->fds[fd].gen++;
+    state->fds[fd].armed = 1;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    if (mask & AE_READABLE) sqe->poll32_events |= POLLIN;
+    if (mask & AE_WRITABLE) sqe->poll32_events |= POLLOUT;
+    sqe->user_data = ((uint64_t)state->fds[fd].gen << 32) | (uint32_t)fd;
+    aeIOUringCommitSqe(state);
+    return 0;
+}
+
+static void aeIOUringFreeState(aeApiState *state) {
+    if (state->sqes) munmap(state->sqes,state->sqes_size);
+    if (state->cq_ring && state->cq_ring != state->sq_ring)
+        munmap(state->cq_ring,state->cq_ring_size);
+    if (state->sq_ring) munmap(state->sq_ring,state->sq_ring_size);
+    if (state->ringfd != -1) close(state->ringfd);
+    zfree(state->fds);
+    zfree(state->dirty);
+    zfree(state);
+}
+
+static aeApiState *aeIOUringCreateState(int setsize) {
+    aeApiState *state = zcalloc(sizeof(aeApiState));
+    struct io_uring_params p;
+    unsigned j, entries = setsize;
+
+    state->ringfd = -1;
+    state->fds = zcalloc(sizeof(aeIOUringFd)*setsize);
+    state->dirty = zmalloc(sizeof(int)*setsize);
+
+    if (entries > AE_IOURING_MAX_ENTRIES) entries = AE_IOURING_MAX_ENTRIES;
+    memset(&p,0,sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = entries*4;
+    state->ringfd = syscall(__NR_io_uring_setup,entries,&p);
+    if (state->ringfd == -1) goto err;
+
+    /* We need completions to never be dropped, and the timeout argument
+     * of io_uring_enter(2). */
+    if (!(p.features & IORING_FEAT_NODROP) ||
+        !(p.features & IORING_FEAT_EXT_ARG)) goto err;
+
+    state->sq_ring_size = p.sq_off.array + p.sq_entries*sizeof(unsigned);
+    state->cq_ring_size = p.cq_off.cqes +
+                          p.cq_entries*sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (state->cq_ring_size > state->sq_ring_size)
+            state->sq_ring_size = state->cq_ring_size;
+        state->cq_ring_size = state->sq_ring_size;
+    }
+    state->sq_ring = mmap(NULL,state->sq_ring_size,PROT_READ|PROT_WRITE,
+        MAP_SHARED|MAP_POPULATE,state->ringfd,IORING_OFF_SQ_RING);
+    if (state->sq_ring == MAP_FAILED) {
+        state->sq_ring = NULL;
+        goto err;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        state->cq_ring = state->sq_ring;
+    } else {
+        state->cq_ring = mmap(NULL,state->cq_ring_size,PROT_READ|PROT_WRITE,
+            MAP_SHARED|MAP_POPULATE,state->ringfd,IORING_OFF_CQ_RING);
+        if (state->cq_ring == MAP_FAILED) {
+            state->cq_ring = NULL;
+            goto err;
+        }
+    }
+    state->sqes_size = p.sq_entries*sizeof(struct io_uring_sqe);
+    state->sqes = mmap(NULL,state->sqes_size,PROT_READ|PROT_WRITE,
+        MAP_SHARED|MAP_POPULATE,state->ringfd,IORING_OFF_SQES);
+    if (state->sqes == MAP_FAILED) {
+        state->sqes = NULL;
+        goto err;
+    }
+
+    state->sq_khead = (unsigned*)((char*)state->sq_ring+p.sq_off.head);
+    state->sq_ktail = (unsigned*)((char*)state->sq_ring+p.sq_off.tail);
+    state->sq_array = (unsigned*)((char*)state->sq_ring+p.sq_off.array);
+    state->sq_mask = *(unsigned*)((char*)state->sq_ring+p.sq_off.ring_mask);
+    state->sq_entries = p.sq_entries;
+    state->sq_tail = *state->sq_ktail;
+    state->cq_khead = (unsigned*)((char*)state->cq_ring+p.cq_off.head);
+    state->cq_ktail = (unsigned*)((char*)state->cq_ring+p.cq_off.tail);
+    state->cq_mask = *(unsigned*)((char*)state->cq_ring+p.cq_off.ring_mask);
+    state->cqes = (struct io_uring_cqe*)((char*)state->cq_ring+p.cq_off.cqes);
+
+    /* Entries are always used in order, so the indirection array is just
+     * the identity. */
+    for (j = 0; j < p.sq_entries; j++) state->sq_array[j] = j;
+    return state;
+
+err:
+    aeIOUringFreeState(state);
+    return NULL;
+}
+
+static int aeApiCreate(aeEventLoop *eventLoop) {
+    aeApiState *state;
+
+    if (aeIOUringFallback == 1) return aeEpollApiCreate(eventLoop);
+    state = aeIOUringCreateState(eventLoop->setsize);
+    if (state == NULL) {
+        if (aeIOUringFallback == 0) return -1;
+        aeIOUringFallback = 1;
+        return aeEpollApiCreate(eventLoop);
+    }
+    aeIOUringFallback = 0;
+    eventLoop->apidata = state;
+    return 0;
+}
+
+static int aeApiResize(aeEventLoop *eventLoop, int setsize) {
+    aeApiState *state = eventLoop->apidata;
+
+    if (aeIOUringFallback) return aeEpollApiResize(eventLoop,setsize);
+    state->fds = zrealloc(state->fds,sizeof(aeIOUringFd)*setsize);
+    if (setsize > eventLoop->setsize)
+        memset(state->fds+eventLoop->setsize,0,
+            sizeof(aeIOUringFd)*(setsize-eventLoop->setsize));
+    state->dirty = zrealloc(state->dirty,sizeof(int)*setsize);
+    return 0;
+}
+
+static void aeApiFree(aeEventLoop *eventLoop) {
+    if (aeIOUringFallback) {
+        aeEpollApiFree(eventLoop);
+        return;
+    }
+    aeIOUringFreeState(eventLoop->apidata);
+}
+
+static int aeApiAddEvent(aeEventLoop *eventLoop, int fd, int mask) {
+    aeApiState *state = eventLoop->apidata;
+
+    if (aeIOUringFallback) return aeEpollApiAddEvent(eventLoop,fd,mask);
+
+    /* Nothing to do if the in flight request already covers the mask. */
+    if (state->fds[fd].armed &&
+        (eventLoop->events[fd].mask & mask) == mask) return 0;
+    aeIOUringDisarm(state,fd);
+    aeIOUringMarkDirty(state,fd);
+    return 0;
+}
+
+static void aeApiDelEvent(aeEventLoop *eventLoop, int fd, int delmask) {
+    aeApiState *state = eventLoop->apidata;
+
+    if (aeIOUringFallback) {
+        aeEpollApiDelEvent(eventLoop,fd,delmask);
+        return;
+    }
+    /* The remaining events, if any, are re-armed before the next wait. */
+    aeIOUringDisarm(state,fd);
+    if (eventLoop->events[fd].mask & ~delmask & (AE_READABLE|AE_WRITABLE))
+        aeIOUringMarkDirty(state,fd);
+}
+
+static int aeApiPoll(aeEventLoop *eventLoop, struct timeval *tvp) {
+    aeApiState *state = eventLoop->apidata;
+    unsigned head, tail;
+    int j, numevents = 0, numdirty;
+
+    if (aeIOUringFallback) return aeEpollApiPoll(eventLoop,tvp);
+
+    /* Arm the descriptors with their current mask. The ones we can't arm
+     * because the queue is full and busy stay dirty for the next call. */
+    numdirty = state->numdirty;
+    state->numdirty = 0;
+    for (j = 0; j < numdirty; j++) {
+        int fd = state->dirty[j];
+        int mask = eventLoop->events[fd].mask & (AE_READABLE|AE_WRITABLE);
+
+        state->fds[fd].dirty = 0;
+        if (mask == AE_NONE || state->fds[fd].armed) continue;
+        if (aeIOUringArm(state,fd,mask) == -1) aeIOUringMarkDirty(state,fd);
+    }
+
+    /* Submit and wait with a single syscall. */
+    if (aeIOUringEnter(state,aeIOUringPending(state),
+        (tvp && tvp->tv_sec == 0 && tvp->tv_usec == 0) ? 0 : 1,tvp) == -1 &&
+        errno != ETIME && errno != EINTR && errno != EBUSY)
+    {
+        return 0;
+    }
+
+    head = *state->cq_khead;
+    tail = __atomic_load_n(state->cq_ktail,__ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+        struct io_uring_cqe *cqe = &state->cqes[head & state->cq_mask];
+        int fd = (int)(uint32_t)cqe->user_data, mask = 0;
+        uint32_t gen = cqe->user_data >> 32;
+
+        if (cqe->user_data == AE_IOURING_REMOVE_TAG) continue;
+        if (fd >= eventLoop->setsize || gen != state->fds[fd].gen ||
+            !state->fds[fd].armed) continue;
+
+        /* One-shot request: it will be re-armed before the next wait. */
+        state->fds[fd].armed = 0;
+        aeIOUringMarkDirty(state,fd);
+        if (cqe->res == -ECANCELED) continue;
+        if (cqe->res < 0) {
+            /* Let the handlers find out about the error. */
+            mask = eventLoop->events[fd].mask;
+        } else {
+            if (cqe->res & POLLIN) mask |= AE_READABLE;
+            if (cqe->res & POLLOUT) mask |= AE_WRITABLE;
+            if (cqe->res & POLLERR) mask |= AE_WRITABLE;
+            if (cqe->res & POLLHUP) mask |= AE_WRITABLE;
+        }
+        eventLoop->fired[numevents].fd = fd;
+        eventLoop->fired[numevents].mask = mask;
+        numevents++;
+    }
+    __atomic_store_n(state->cq_khead,head,__ATOMIC_RELEASE);
+    return numevents;
+}
+
+static char *aeApiName(void) {
+    return aeIOUringFallback ? aeEpollApiName() : "io_uring";
+}
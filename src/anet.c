@@ -47,6 +47,7 @@
 #include <stdio.h>
 
 #include "anet.h"
+#include "config.h"
 
 static void anetSetError(char *err, const char *fmt, ...)
 {
@@ -91,16 +92,18 @@ int anetBlock(char *err, int fd) {
 
 /* Set TCP keep alive option to detect dead peers. The interval option
  * is only used for Linux as we are using Linux-specific APIs to set
- * the probe send time, interval, and count. */
+ * the probe send time, interval, and count. An interval of zero disables
+ * the keep alive option instead. */
 int anetKeepAlive(char *err, int fd, int interval)
 {
-    int val = 1;
+    int val = interval ? 1 : 0;
 
     if (setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &val, sizeof(val)) == -1)
     {
         anetSetError(err, "setsockopt SO_KEEPALIVE: %s", strerror(errno));
         return ANET_ERR;
     }
+    if (interval == 0) return ANET_OK;
 
 #ifdef __linux__
     /* Default settings are more or less garbage, with the keepalive time
@@ -528,10 +531,16 @@ int anetUnixServer(char *err, char *path, mode_t perm, int backlog)
     return s;
 }
 
+/* Accept a connection. Where accept4() is available the new socket is
+ * already non blocking and close-on-exec, saving the fcntl() calls. */
 static int anetGenericAccept(char *err, int s, struct sockaddr *sa, socklen_t *len) {
     int fd;
     while(1) {
+#ifdef HAVE_ACCEPT4
+        fd = accept4(s,sa,len,SOCK_NONBLOCK|SOCK_CLOEXEC);
+#else
         fd = accept(s,sa,len);
+#endif
         if (fd == -1) {
             if (errno == EINTR)
                 continue;
@@ -635,6 +635,9 @@ struct client *createFakeClient(void) {
     c->argc = 0;
     c->argv = NULL;
     c->bufpos = 0;
+    c->buf_usable_size = 0;
+    c->buf_peak = 0;
+    c->buf = NULL;
     c->flags = 0;
     c->btype = BLOCKED_NONE;
     /* We set the fake client as a slave waiting for the synchronization
@@ -661,6 +664,7 @@ void freeFakeClientArgv(struct client *c) {
 
 void freeFakeClient(struct client *c) {
     sdsfree(c->querybuf);
+    zfree(c->buf);
     listRelease(c->reply);
     listRelease(c->watched_keys);
     freeClientMultiState(c);
@@ -856,6 +860,25 @@ fmterr: /* Format error. */
  * AOF rewrite
  * ------------------------------------------------------------------------- */
 
+/* Write a sparse bitmap as a bulk string, a chunk at a time, so that the
+ * whole string is never materialized in memory. */
+static size_t rioWriteBulkRoaring(rio *r, roaring *rb) {
+    unsigned char buf[8192];
+    size_t nwritten;
+    uint64_t off;
+
+    if ((nwritten = rioWriteBulkCount(r,'$',rb->len)) == 0) return 0;
+    for (off = 0; off < rb->len; off += sizeof(buf)) {
+        size_t count = rb->len-off;
+
+        if (count > sizeof(buf)) count = sizeof(buf);
+        roaringGetBytes(rb,off,buf,count);
+        if (rioWrite(r,buf,count) == 0) return 0;
+    }
+    if (rioWrite(r,"\r\n",2) == 0) return 0;
+    return nwritten+rb->len+2;
+}
+
 /* Delegate writing an object to writing a bulk string or bulk long long.
  * This is not placed in rio.c since that adds the server.h dependency. */
 int rioWriteBulkObject(rio *r, robj *obj) {
@@ -865,11 +888,53 @@ int rioWriteBulkObject(rio *r, robj *obj) {
         return rioWriteBulkLongLong(r,(long)obj->ptr);
     } else if (sdsEncodedObject(obj)) {
         return rioWriteBulkString(r,obj->ptr,sdslen(obj->ptr));
+    } else if (obj->encoding == OBJ_ENCODING_ROARING) {
+        return rioWriteBulkRoaring(r,obj->ptr);
     } else {
         serverPanic("Unknown string encoding");
     }
 }
 
+static int rioWriteSetbit(rio *r, robj *key, long long offset, int on) {
+    char cmd[]="*4\r\n$6\r\nSETBIT\r\n";
+
+    if (rioWrite(r,cmd,sizeof(cmd)-1) == 0) return 0;
+    if (rioWriteBulkObject(r,key) == 0) return 0;
+    if (rioWriteBulkLongLong(r,offset) == 0) return 0;
+    if (rioWriteBulkLongLong(r,on) == 0) return 0;
+    return 1;
+}
+
+/* Emit the commands needed to rebuild a string object. Sparse bitmaps with
+ * just a few bits set are rebuilt with one SETBIT per set bit, that takes
+ * much less space than the string itself.
+ * The function returns 0 on error, 1 on success. */
+int rewriteStringObject(rio *r, robj *key, robj *o) {
+    roaring *rb = o->ptr;
+    long long pos;
+
+    if (o->encoding != OBJ_ENCODING_ROARING ||
+        rb->card*(40+sdslen(key->ptr)) >= rb->len)
+    {
+        /* Emit a SET command */
+        char cmd[]="*3\r\n$3\r\nSET\r\n";
+        if (rioWrite(r,cmd,sizeof(cmd)-1) == 0) return 0;
+        /* Key and value */
+        if (rioWriteBulkObject(r,key) == 0) return 0;
+        if (rioWriteBulkObject(r,o) == 0) return 0;
+        return 1;
+    }
+
+    /* Start setting the last bit to zero, so that the string is created
+     * with its final length, then set the bits one after the other. */
+    if (rioWriteSetbit(r,key,rb->len*8-1,0) == 0) return 0;
+    pos = -1;
+    while ((pos = roaringNextSetBit(rb,pos+1)) != -1) {
+        if (rioWriteSetbit(r,key,pos,1) == 0) return 0;
+    }
+    return 1;
+}
+
 /* Emit the commands needed to rebuild a list object.
  * The function returns 0 on error, 1 on success. */
 int rewriteListObject(rio *r, robj *key, robj *o) {
@@ -1140,12 +1205,7 @@ int rewriteAppendOnlyFileRio(rio *aof) {
 
             /* Save the key and associated value */
             if (o->type == OBJ_STRING) {
-                /* Emit a SET command */
-                char cmd[]="*3\r\n$3\r\nSET\r\n";
-                if (rioWrite(aof,cmd,sizeof(cmd)-1) == 0) goto werr;
-                /* Key and value */
-                if (rioWriteBulkObject(aof,&key) == 0) goto werr;
-                if (rioWriteBulkObject(aof,o) == 0) goto werr;
+                if (rewriteStringObject(aof,&key,o) == 0) goto werr;
             } else if (o->type == OBJ_LIST) {
                 if (rewriteListObject(aof,&key,o) == 0) goto werr;
             } else if (o->type == OBJ_SET) {
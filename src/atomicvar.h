@@ -80,6 +80,11 @@
     dstvar = __atomic_load_n(&var,__ATOMIC_RELAXED); \
 } while(0)
 #define atomicSet(var,value) __atomic_store_n(&var,value,__ATOMIC_RELAXED)
+#define atomicGetWithSync(var,dstvar) do { \
+    dstvar = __atomic_load_n(&var,__ATOMIC_SEQ_CST); \
+} while(0)
+#define atomicSetWithSync(var,value) \
+    __atomic_store_n(&var,value,__ATOMIC_SEQ_CST)
 #define REDIS_ATOMIC_API "atomic-builtin"
 
 #elif defined(HAVE_ATOMIC)
@@ -96,6 +101,9 @@
 #define atomicSet(var,value) do { \
     while(!__sync_bool_compare_and_swap(&var,var,value)); \
 } while(0)
+/* __sync builtins are already full barriers. */
+#define atomicGetWithSync(var,dstvar) atomicGet(var,dstvar)
+#define atomicSetWithSync(var,value) atomicSet(var,value)
 #define REDIS_ATOMIC_API "sync-builtin"
 
 #else
@@ -127,6 +135,8 @@
     var = value; \
     pthread_mutex_unlock(&var ## _mutex); \
 } while(0)
+#define atomicGetWithSync(var,dstvar) atomicGet(var,dstvar)
+#define atomicSetWithSync(var,value) atomicSet(var,value)
 #define REDIS_ATOMIC_API "pthread-mutex"
 
 #endif
@@ -88,10 +88,6 @@ void lazyfreeFreeObjectFromBioThread(robj *o);
 void lazyfreeFreeDatabaseFromBioThread(dict *ht1, dict *ht2);
 void lazyfreeFreeSlotsMapFromBioThread(zskiplist *sl);
 
-/* Make sure we have enough stack to perform all the things we do in the
- * main thread. */
-#define REDIS_THREAD_STACK_SIZE (1024*1024*4)
-
 /* Initialize the background system, spawning the thread. */
 void bioInit(void) {
     pthread_attr_t attr;
@@ -199,6 +195,9 @@ void *bioProcessBackgroundJobs(void *arg) {
                 lazyfreeFreeDatabaseFromBioThread(job->arg2,job->arg3);
             else if (job->arg3)
                 lazyfreeFreeSlotsMapFromBioThread(job->arg3);
+        } else if (type == BIO_DICT_TABLE) {
+            /* arg1 -> the table to allocate, arg2 -> number of buckets. */
+            dictTableAlloc(job->arg1,(unsigned long)job->arg2);
         } else {
             serverPanic("Wrong job type in bioProcessBackgroundJobs().");
         }
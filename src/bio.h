@@ -27,6 +27,10 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+/* Make sure we have enough stack to perform all the things we do in the
+ * main thread. Also used by the threaded I/O threads in networking.c. */
+#define REDIS_THREAD_STACK_SIZE (1024*1024*4)
+
 /* Exported API */
 void bioInit(void);
 void bioCreateBackgroundJob(int type, void *arg1, void *arg2, void *arg3);
@@ -39,4 +43,5 @@ void bioKillThreads(void);
 #define BIO_CLOSE_FILE    0 /* Deferred close(2) syscall. */
 #define BIO_AOF_FSYNC     1 /* Deferred AOF fsync. */
 #define BIO_LAZY_FREE     2 /* Deferred objects freeing. */
-#define BIO_NUM_OPS       3
+#define BIO_DICT_TABLE    3 /* Allocation of big hash tables. */
+#define BIO_NUM_OPS       4
@@ -30,14 +30,23 @@
 
 #include "server.h"
 
+#ifdef HAVE_X86_SIMD
+#include <immintrin.h>
+#endif
+
 /* -----------------------------------------------------------------------------
  * Helpers and low level bit functions.
  * -------------------------------------------------------------------------- */
 
+#define BITOP_AND   0
+#define BITOP_OR    1
+#define BITOP_XOR   2
+#define BITOP_NOT   3
+
 /* Count number of bits set in the binary array pointed by 's' and long
  * 'count' bytes. The implementation of this function is required to
  * work with a input string length up to 512 MB. */
-size_t redisPopcount(void *s, long count) {
+static size_t popcountGeneric(void *s, long count) {
     size_t bits = 0;
     unsigned char *p = s;
     uint32_t *p4;
@@ -91,6 +100,353 @@ size_t redisPopcount(void *s, long count) {
     return bits;
 }
 
+/* -----------------------------------------------------------------------------
+ * SIMD kernels.
+ *
+ * On x86-64 the popcount, the BITOP operations and the skipping of the
+ * leading bytes in BITPOS have AVX2 and AVX-512 versions. They are compiled
+ * with the target attribute, so that the rest of the server does not need
+ * such instructions, and selected at runtime by bitopsSelectKernels() among
+ * the ones the CPU supports. With big bitmaps the commands are then limited
+ * by the memory bandwidth instead of the number of instructions.
+ *
+ * The AVX-512 BITOP and BITPOS kernels only use AVX512F instructions, while
+ * the AVX-512 popcount also needs VPOPCNTDQ: CPUs with AVX512F but without
+ * VPOPCNTDQ use the AVX2 popcount together with the other AVX-512 kernels.
+ *
+ * Every kernel only processes whole blocks and returns how many bytes it
+ * processed, the rest is left to the generic code.
+ * -------------------------------------------------------------------------- */
+
+/* Count the bits set in the first 'count' bytes at 'p'. */
+typedef size_t popcountKernel(const unsigned char *p, unsigned long count,
+                              unsigned long *done);
+/* Store into 'dst' 'len' bytes of the 'op' between the 'numkeys' strings in
+ * 'src', that are all at least 'len' bytes. */
+typedef unsigned long bitopKernel(int op, unsigned char *dst,
+                                  unsigned char **src, unsigned long numkeys,
+                                  unsigned long len);
+/* Return how many leading bytes at 'p' are all zeros (if 'bit' is 1) or all
+ * ones (if 'bit' is 0), looking at most at 'count' bytes. */
+typedef unsigned long bitposKernel(const unsigned char *p,
+                                   unsigned long count, int bit);
+
+static struct {
+    int selected;
+    const char *name;
+    popcountKernel *popcount;
+    bitopKernel *bitop;
+    bitposKernel *bitpos;
+} bitopsKernels;
+
+/* The generic BITOP kernel, working one unsigned long at a time as far as
+ * we have data for all the input bitmaps, that performs much better than
+ * the vanilla algorithm. On ARM we skip it since it will result in GCC
+ * compiling the code using multiple-words load/store operations that are
+ * not supported even in ARM >= v6. */
+static unsigned long bitopGeneric(int op, unsigned char *res,
+                                  unsigned char **src, unsigned long numkeys,
+                                  unsigned long minlen)
+{
+    unsigned long j = 0;
+
+#ifndef USE_ALIGNED_ACCESS
+    if (minlen >= sizeof(unsigned long)*4 && numkeys <= 16) {
+        unsigned long i, *lp[16];
+        unsigned long *lres = (unsigned long*) res;
+
+        /* Note: sds pointer is always aligned to 8 byte boundary. */
+        memcpy(lp,src,sizeof(unsigned long*)*numkeys);
+        memcpy(res,src[0],minlen);
+
+        /* Different branches per different operations for speed (sorry). */
+        if (op == BITOP_AND) {
+            while(minlen >= sizeof(unsigned long)*4) {
+                for (i = 1; i < numkeys; i++) {
+                    lres[0] &= lp[i][0];
+                    lres[1] &= lp[i][1];
+                    lres[2] &= lp[i][2];
+                    lres[3] &= lp[i][3];
+                    lp[i]+=4;
+                }
+                lres+=4;
+                j += sizeof(unsigned long)*4;
+                minlen -= sizeof(unsigned long)*4;
+            }
+        } else if (op == BITOP_OR) {
+            while(minlen >= sizeof(unsigned long)*4) {
+                for (i = 1; i < numkeys; i++) {
+                    lres[0] |= lp[i][0];
+                    lres[1] |= lp[i][1];
+                    lres[2] |= lp[i][2];
+                    lres[3] |= lp[i][3];
+                    lp[i]+=4;
+                }
+                lres+=4;
+                j += sizeof(unsigned long)*4;
+                minlen -= sizeof(unsigned long)*4;
+            }
+        } else if (op == BITOP_XOR) {
+            while(minlen >= sizeof(unsigned long)*4) {
+                for (i = 1; i < numkeys; i++) {
+                    lres[0] ^= lp[i][0];
+                    lres[1] ^= lp[i][1];
+                    lres[2] ^= lp[i][2];
+                    lres[3] ^= lp[i][3];
+                    lp[i]+=4;
+                }
+                lres+=4;
+                j += sizeof(unsigned long)*4;
+                minlen -= sizeof(unsigned long)*4;
+            }
+        } else if (op == BITOP_NOT) {
+            while(minlen >= sizeof(unsigned long)*4) {
+                lres[0] = ~lres[0];
+                lres[1] = ~lres[1];
+                lres[2] = ~lres[2];
+                lres[3] = ~lres[3];
+                lres+=4;
+                j += sizeof(unsigned long)*4;
+                minlen -= sizeof(unsigned long)*4;
+            }
+        }
+    }
+#else
+    UNUSED(op);
+    UNUSED(res);
+    UNUSED(src);
+    UNUSED(numkeys);
+    UNUSED(minlen);
+#endif
+    return j;
+}
+
+#ifdef HAVE_X86_SIMD
+/* Popcount 64 bits at a time with the POPCNT instruction, for the CPUs
+ * without AVX2. */
+__attribute__((target("popcnt")))
+static size_t popcountPopcnt(const unsigned char *p, unsigned long count,
+                             unsigned long *done)
+{
+    uint64_t w[4];
+    size_t bits = 0;
+    unsigned long j;
+
+    for (j = 0; j+32 <= count; j += 32) {
+        memcpy(w,p+j,sizeof(w));
+        bits += __builtin_popcountll(w[0]) + __builtin_popcountll(w[1]) +
+                __builtin_popcountll(w[2]) + __builtin_popcountll(w[3]);
+    }
+    *done = j;
+    return bits;
+}
+
+/* Popcount of 32 bytes at a time looking up the bits of every nibble in
+ * a 16 entries table with PSHUFB. */
+__attribute__((target("avx2")))
+static size_t popcountAVX2(const unsigned char *p, unsigned long count,
+                           unsigned long *done)
+{
+    const __m256i lookup = _mm256_setr_epi8(0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4,
+                                            0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4);
+    const __m256i low = _mm256_set1_epi8(0x0f);
+    __m256i acc = _mm256_setzero_si256();
+    unsigned long j;
+
+    for (j = 0; j+32 <= count; j += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(p+j));
+        __m256i lo = _mm256_shuffle_epi8(lookup,_mm256_and_si256(v,low));
+        __m256i hi = _mm256_shuffle_epi8(lookup,
+                        _mm256_and_si256(_mm256_srli_epi16(v,4),low));
+        /* Sum the counts of the bytes into the four 64 bits lanes. */
+        acc = _mm256_add_epi64(acc,_mm256_sad_epu8(_mm256_add_epi8(lo,hi),
+                                                   _mm256_setzero_si256()));
+    }
+    *done = j;
+    return _mm256_extract_epi64(acc,0) + _mm256_extract_epi64(acc,1) +
+           _mm256_extract_epi64(acc,2) + _mm256_extract_epi64(acc,3);
+}
+
+__attribute__((target("avx512f,avx512vpopcntdq")))
+static size_t popcountAVX512(const unsigned char *p, unsigned long count,
+                             unsigned long *done)
+{
+    __m512i acc = _mm512_setzero_si512();
+    unsigned long j;
+
+    for (j = 0; j+64 <= count; j += 64) {
+        __m512i v = _mm512_loadu_si512((const void*)(p+j));
+        acc = _mm512_add_epi64(acc,_mm512_popcnt_epi64(v));
+    }
+    *done = j;
+    return _mm512_reduce_add_epi64(acc);
+}
+
+/* The BITOP kernels process 4 registers at a time, applying the operation
+ * between every source and the accumulators before storing them. */
+#define BITOP_KERNEL_LOOP(vec,width,load,store,opfn) do { \
+    for (j = 0; j+(width)*4 <= len; j += (width)*4) { \
+        vec a0 = load((const void*)(src[0]+j)); \
+        vec a1 = load((const void*)(src[0]+j+(width))); \
+        vec a2 = load((const void*)(src[0]+j+(width)*2)); \
+        vec a3 = load((const void*)(src[0]+j+(width)*3)); \
+        for (i = 1; i < numkeys; i++) { \
+            a0 = opfn(a0,load((const void*)(src[i]+j))); \
+            a1 = opfn(a1,load((const void*)(src[i]+j+(width)))); \
+            a2 = opfn(a2,load((const void*)(src[i]+j+(width)*2))); \
+            a3 = opfn(a3,load((const void*)(src[i]+j+(width)*3))); \
+        } \
+        store((void*)(dst+j),a0); \
+        store((void*)(dst+j+(width)),a1); \
+        store((void*)(dst+j+(width)*2),a2); \
+        store((void*)(dst+j+(width)*3),a3); \
+    } \
+} while(0)
+
+#define bitopLoad256(p) _mm256_loadu_si256((const __m256i*)(p))
+#define bitopStore256(p,v) _mm256_storeu_si256((__m256i*)(p),v)
+
+__attribute__((target("avx2")))
+static unsigned long bitopAVX2(int op, unsigned char *dst,
+                               unsigned char **src, unsigned long numkeys,
+                               unsigned long len)
+{
+    unsigned long i, j;
+
+    if (op == BITOP_AND) {
+        BITOP_KERNEL_LOOP(__m256i,32,bitopLoad256,bitopStore256,
+                          _mm256_and_si256);
+    } else if (op == BITOP_OR) {
+        BITOP_KERNEL_LOOP(__m256i,32,bitopLoad256,bitopStore256,
+                          _mm256_or_si256);
+    } else if (op == BITOP_XOR) {
+        BITOP_KERNEL_LOOP(__m256i,32,bitopLoad256,bitopStore256,
+                          _mm256_xor_si256);
+    } else {
+        /* NOT has a single source: XOR it with all ones. */
+        const __m256i ones = _mm256_set1_epi8(-1);
+        for (j = 0; j+32 <= len; j += 32)
+            bitopStore256(dst+j,_mm256_xor_si256(bitopLoad256(src[0]+j),ones));
+    }
+    return j;
+}
+
+__attribute__((target("avx512f")))
+static unsigned long bitopAVX512(int op, unsigned char *dst,
+                                 unsigned char **src, unsigned long numkeys,
+                                 unsigned long len)
+{
+    unsigned long i, j;
+
+    if (op == BITOP_AND) {
+        BITOP_KERNEL_LOOP(__m512i,64,_mm512_loadu_si512,_mm512_storeu_si512,
+                          _mm512_and_si512);
+    } else if (op == BITOP_OR) {
+        BITOP_KERNEL_LOOP(__m512i,64,_mm512_loadu_si512,_mm512_storeu_si512,
+                          _mm512_or_si512);
+    } else if (op == BITOP_XOR) {
+        BITOP_KERNEL_LOOP(__m512i,64,_mm512_loadu_si512,_mm512_storeu_si512,
+                          _mm512_xor_si512);
+    } else {
+        const __m512i ones = _mm512_set1_epi8(-1);
+        for (j = 0; j+64 <= len; j += 64)
+            _mm512_storeu_si512((void*)(dst+j),_mm512_xor_si512(
+                _mm512_loadu_si512((const void*)(src[0]+j)),ones));
+    }
+    return j;
+}
+
+/* Skip 128 bytes at a time, stopping at the first block having a bit that
+ * is not the one to skip. */
+__attribute__((target("avx2")))
+static unsigned long bitposAVX2(const unsigned char *p, unsigned long count,
+                                int bit)
+{
+    const __m256i ones = _mm256_set1_epi8(-1);
+    unsigned long j;
+
+    for (j = 0; j+128 <= count; j += 128) {
+        __m256i a = bitopLoad256(p+j), b = bitopLoad256(p+j+32);
+        __m256i c = bitopLoad256(p+j+64), d = bitopLoad256(p+j+96);
+
+        if (bit) {
+            __m256i any = _mm256_or_si256(_mm256_or_si256(a,b),
+                                          _mm256_or_si256(c,d));
+            if (!_mm256_testz_si256(any,any)) break;
+        } else {
+            __m256i all = _mm256_and_si256(_mm256_and_si256(a,b),
+                                           _mm256_and_si256(c,d));
+            if (!_mm256_testc_si256(all,ones)) break;
+        }
+    }
+    return j;
+}
+
+__attribute__((target("avx512f")))
+static unsigned long bitposAVX512(const unsigned char *p, unsigned long count,
+                                  int bit)
+{
+    const __m512i ones = _mm512_set1_epi8(-1);
+    unsigned long j;
+
+    for (j = 0; j+256 <= count; j += 256) {
+        __m512i a = _mm512_loadu_si512((const void*)(p+j));
+        __m512i b = _mm512_loadu_si512((const void*)(p+j+64));
+        __m512i c = _mm512_loadu_si512((const void*)(p+j+128));
+        __m512i d = _mm512_loadu_si512((const void*)(p+j+192));
+
+        if (bit) {
+            __m512i any = _mm512_or_si512(_mm512_or_si512(a,b),
+                                          _mm512_or_si512(c,d));
+            if (_mm512_test_epi64_mask(any,any)) break;
+        } else {
+            __m512i all = _mm512_and_si512(_mm512_and_si512(a,b),
+                                           _mm512_and_si512(c,d));
+            if (_mm512_cmpneq_epi64_mask(all,ones)) break;
+        }
+    }
+    return j;
+}
+#endif
+
+/* Select the best kernels for this CPU. Without any, the generic code is
+ * used for popcount and BITPOS. */
+static void bitopsSelectKernels(void) {
+    bitopsKernels.selected = 1;
+    bitopsKernels.name = "generic";
+    bitopsKernels.bitop = bitopGeneric;
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+        bitopsKernels.name = "avx512";
+        bitopsKernels.bitop = bitopAVX512;
+        bitopsKernels.bitpos = bitposAVX512;
+        bitopsKernels.popcount =
+            __builtin_cpu_supports("avx512vpopcntdq") ? popcountAVX512 :
+                                                        popcountAVX2;
+    } else if (__builtin_cpu_supports("avx2")) {
+        bitopsKernels.name = "avx2";
+        bitopsKernels.bitop = bitopAVX2;
+        bitopsKernels.bitpos = bitposAVX2;
+        bitopsKernels.popcount = popcountAVX2;
+    } else if (__builtin_cpu_supports("popcnt")) {
+        bitopsKernels.name = "popcnt";
+        bitopsKernels.popcount = popcountPopcnt;
+    }
+#endif
+}
+
+size_t redisPopcount(void *s, long count) {
+    unsigned char *p = s;
+    unsigned long done = 0;
+    size_t bits = 0;
+
+    if (!bitopsKernels.selected) bitopsSelectKernels();
+    if (bitopsKernels.popcount && count > 0)
+        bits = bitopsKernels.popcount(p,count,&done);
+    return bits+popcountGeneric(p+done,count-done);
+}
+
 /* Return the position of the first bit set to one (if 'bit' is 1) or
  * zero (if 'bit' is 0) in the bitmap starting at 's' and long 'count' bytes.
  *
@@ -115,9 +471,18 @@ long redisBitpos(void *s, unsigned long count, int bit) {
      * to sizeof(unsigned long) we consume it byte by byte until it is
      * aligned. */
 
+    /* Skip whole blocks with the SIMD kernel if available. */
+    c = (unsigned char*) s;
+    if (!bitopsKernels.selected) bitopsSelectKernels();
+    if (bitopsKernels.bitpos) {
+        unsigned long skip = bitopsKernels.bitpos(c,count,bit);
+        c += skip;
+        count -= skip;
+        pos += skip*8;
+    }
+
     /* Skip initial bits not aligned to sizeof(unsigned long) byte by byte. */
     skipval = bit ? 0 : UCHAR_MAX;
-    c = (unsigned char*) s;
     found = 0;
     while((unsigned long)c & (sizeof(*l)-1) && count) {
         if (*c != skipval) {
@@ -389,13 +754,57 @@ void printBits(unsigned char *p, unsigned long count) {
 }
 
 /* -----------------------------------------------------------------------------
- * Bits related string commands: GETBIT, SETBIT, BITCOUNT, BITOP.
+ * Sparse bitmaps.
+ *
+ * Bitmaps at least bitmap-roaring-min-bytes long are stored as roaring
+ * bitmaps (see roaring.c) when that takes no more than half the memory of
+ * the plain string. SETBIT and BITOP create them, or convert plain strings,
+ * when this condition is met, and SETBIT converts them back to plain strings
+ * when it is no longer true.
+ *
+ * GETBIT, SETBIT, BITCOUNT, BITPOS and BITOP operate on them directly. All
+ * the other commands see them as plain strings: the ones only reading the
+ * value use a temporary copy, while the ones modifying the string in place
+ * convert it to a plain string with dbUnshareStringValue().
  * -------------------------------------------------------------------------- */
 
-#define BITOP_AND   0
-#define BITOP_OR    1
-#define BITOP_XOR   2
-#define BITOP_NOT   3
+/* Return true if the bitmap 'r' should be stored as a roaring bitmap. */
+static int bitmapRoaringWorthIt(roaring *r) {
+    return server.bitmap_roaring_min_bytes &&
+           r->len >= server.bitmap_roaring_min_bytes &&
+           roaringBytes(r) <= r->len/2;
+}
+
+/* Convert the bitmap in the string object 'o' into the specified encoding,
+ * that is OBJ_ENCODING_RAW or OBJ_ENCODING_ROARING. The object is modified
+ * in place, so it should not be shared. */
+void bitmapTypeConvert(robj *o, int enc) {
+    serverAssertWithInfo(NULL,o,o->type == OBJ_STRING);
+
+    if (enc == OBJ_ENCODING_RAW) {
+        roaring *r = o->ptr;
+        sds s;
+
+        serverAssertWithInfo(NULL,o,o->encoding == OBJ_ENCODING_ROARING);
+        s = sdsnewlen(NULL,r->len);
+        roaringGetBytes(r,0,(unsigned char*)s,r->len);
+        roaringFree(r);
+        o->ptr = s;
+        o->encoding = OBJ_ENCODING_RAW;
+    } else if (enc == OBJ_ENCODING_ROARING) {
+        serverAssertWithInfo(NULL,o,o->encoding == OBJ_ENCODING_RAW);
+        roaring *r = roaringFromBytes(o->ptr,sdslen(o->ptr));
+        sdsfree(o->ptr);
+        o->ptr = r;
+        o->encoding = OBJ_ENCODING_ROARING;
+    } else {
+        serverPanic("Unknown bitmap encoding");
+    }
+}
+
+/* -----------------------------------------------------------------------------
+ * Bits related string commands: GETBIT, SETBIT, BITCOUNT, BITOP.
+ * -------------------------------------------------------------------------- */
 
 #define BITFIELDOP_GET 0
 #define BITFIELDOP_SET 1
@@ -474,17 +883,48 @@ int getBitfieldTypeFromArgument(client *c, robj *o, int *sign, int *bits) {
  * bits to a string object. The command creates or pad with zeroes the string
  * so that the 'maxbit' bit can be addressed. The object is finally
  * returned. Otherwise if the key holds a wrong type NULL is returned and
- * an error is sent to the client. */
-robj *lookupStringForBitCommand(client *c, size_t maxbit) {
+ * an error is sent to the client.
+ *
+ * If 'sparse' is true the caller is able to handle roaring encoded bitmaps:
+ * in this case they are returned as they are, and new keys or strings that
+ * would grow a lot are created or converted as roaring bitmaps when this
+ * saves memory. Roaring bitmaps still need to be padded by the caller, that
+ * is, setting a bit does it. */
+robj *lookupStringForBitCommand(client *c, size_t maxbit, int sparse) {
     size_t byte = maxbit >> 3;
     robj *o = lookupKeyWrite(c->db,c->argv[1]);
+    roaring *r;
 
     if (o == NULL) {
-        o = createObject(OBJ_STRING,sdsnewlen(NULL, byte+1));
+        if (sparse && server.bitmap_roaring_min_bytes &&
+            byte+1 >= server.bitmap_roaring_min_bytes)
+        {
+            o = createRoaringObject(roaringNew());
+        } else {
+            o = createObject(OBJ_STRING,sdsnewlen(NULL, byte+1));
+        }
         dbAdd(c->db,c->argv[1],o);
     } else {
         if (checkType(c,o,OBJ_STRING)) return NULL;
+        if (sparse && o->encoding == OBJ_ENCODING_ROARING) return o;
         o = dbUnshareStringValue(c->db,c->argv[1],o);
+
+        /* Growing a string to more than twice its size: if the result is
+         * sparse enough, convert it instead of padding it with zeroes. */
+        if (sparse && server.bitmap_roaring_min_bytes &&
+            byte+1 >= server.bitmap_roaring_min_bytes &&
+            byte+1 > sdslen(o->ptr)*2)
+        {
+            r = roaringFromBytes(o->ptr,sdslen(o->ptr));
+            r->len = byte+1;
+            if (bitmapRoaringWorthIt(r)) {
+                sdsfree(o->ptr);
+                o->ptr = r;
+                o->encoding = OBJ_ENCODING_ROARING;
+                return o;
+            }
+            roaringFree(r);
+        }
         o->ptr = sdsgrowzero(o->ptr,byte+1);
     }
     return o;
@@ -542,18 +982,26 @@ void setbitCommand(client *c) {
         return;
     }
 
-    if ((o = lookupStringForBitCommand(c,bitoffset)) == NULL) return;
+    if ((o = lookupStringForBitCommand(c,bitoffset,1)) == NULL) return;
 
-    /* Get current values */
-    byte = bitoffset >> 3;
-    byteval = ((uint8_t*)o->ptr)[byte];
-    bit = 7 - (bitoffset & 0x7);
-    bitval = byteval & (1 << bit);
+    if (o->encoding == OBJ_ENCODING_ROARING) {
+        roaring *r = o->ptr;
 
-    /* Update byte with new bit value and return original value */
-    byteval &= ~(1 << bit);
-    byteval |= ((on & 0x1) << bit);
-    ((uint8_t*)o->ptr)[byte] = byteval;
+        bitval = roaringSetBit(r,bitoffset,on);
+        /* Too dense to be worth it: go back to a plain string. */
+        if (roaringBytes(r) > r->len/2) bitmapTypeConvert(o,OBJ_ENCODING_RAW);
+    } else {
+        /* Get current values */
+        byte = bitoffset >> 3;
+        byteval = ((uint8_t*)o->ptr)[byte];
+        bit = 7 - (bitoffset & 0x7);
+        bitval = byteval & (1 << bit);
+
+        /* Update byte with new bit value and return original value */
+        byteval &= ~(1 << bit);
+        byteval |= ((on & 0x1) << bit);
+        ((uint8_t*)o->ptr)[byte] = byteval;
+    }
     signalModifiedKey(c->db,c->argv[1]);
     notifyKeyspaceEvent(NOTIFY_STRING,"setbit",c->argv[1],c->db->id);
     server.dirty++;
@@ -579,6 +1027,8 @@ void getbitCommand(client *c) {
     if (sdsEncodedObject(o)) {
         if (byte < sdslen(o->ptr))
             bitval = ((uint8_t*)o->ptr)[byte] & (1 << bit);
+    } else if (o->encoding == OBJ_ENCODING_ROARING) {
+        bitval = roaringGetBit(o->ptr,bitoffset);
     } else {
         if (byte < (size_t)ll2string(llbuf,sizeof(llbuf),(long)o->ptr))
             bitval = llbuf[byte] & (1 << bit);
@@ -587,6 +1037,63 @@ void getbitCommand(client *c) {
     addReply(c, bitval ? shared.cone : shared.czero);
 }
 
+/* Implement BITOP AND, OR and XOR when some of the input keys are roaring
+ * encoded, without materializing them. The 'objects' array holds the input
+ * string objects, or NULL for missing keys: their reference is released. */
+static void bitopRoaring(client *c, int op, robj **objects, unsigned long numkeys) {
+    robj *targetkey = c->argv[2];
+    roaring **src = zmalloc(sizeof(roaring*)*numkeys), *res;
+    unsigned long j, maxlen;
+    int rop;
+
+    /* Missing keys and plain strings are converted to temporary roaring
+     * bitmaps, which is cheap when they are small. */
+    for (j = 0; j < numkeys; j++) {
+        robj *o = objects[j];
+
+        if (o == NULL) {
+            src[j] = roaringNew();
+        } else if (o->encoding == OBJ_ENCODING_ROARING) {
+            src[j] = o->ptr;
+        } else {
+            robj *decoded = getDecodedObject(o);
+            src[j] = roaringFromBytes(decoded->ptr,sdslen(decoded->ptr));
+            decrRefCount(decoded);
+        }
+    }
+
+    if (op == BITOP_AND) rop = ROARING_OP_AND;
+    else if (op == BITOP_OR) rop = ROARING_OP_OR;
+    else rop = ROARING_OP_XOR;
+    res = roaringBitop(rop,src,numkeys);
+    maxlen = res->len;
+
+    for (j = 0; j < numkeys; j++) {
+        if (objects[j] == NULL || objects[j]->encoding != OBJ_ENCODING_ROARING)
+            roaringFree(src[j]);
+        if (objects[j]) decrRefCount(objects[j]);
+    }
+    zfree(src);
+
+    /* Store the computed value into the target key */
+    if (maxlen) {
+        robj *o = createRoaringObject(res);
+
+        if (!bitmapRoaringWorthIt(res)) bitmapTypeConvert(o,OBJ_ENCODING_RAW);
+        setKey(c->db,targetkey,o);
+        notifyKeyspaceEvent(NOTIFY_STRING,"set",targetkey,c->db->id);
+        decrRefCount(o);
+    } else {
+        roaringFree(res);
+        if (dbDelete(c->db,targetkey)) {
+            signalModifiedKey(c->db,targetkey);
+            notifyKeyspaceEvent(NOTIFY_GENERIC,"del",targetkey,c->db->id);
+        }
+    }
+    server.dirty++;
+    addReplyLongLong(c,maxlen); /* Return the output string length in bytes. */
+}
+
 /* BITOP op_name target_key src_key1 src_key2 src_key3 ... src_keyN */
 void bitopCommand(client *c) {
     char *opname = c->argv[1]->ptr;
@@ -598,6 +1105,7 @@ void bitopCommand(client *c) {
                                        and max len. */
     unsigned long minlen = 0;    /* Min len among the input keys. */
     unsigned char *res = NULL; /* Resulting string. */
+    int sparse = 0;            /* Number of roaring encoded inputs. */
 
     /* Parse the operation name. */
     if ((opname[0] == 'a' || opname[0] == 'A') && !strcasecmp(opname,"and"))
@@ -646,7 +1154,29 @@ void bitopCommand(client *c) {
             zfree(objects);
             return;
         }
+        if (o->encoding == OBJ_ENCODING_ROARING) sparse++;
+        incrRefCount(o);
+        objects[j] = o;
+    }
+
+    /* If some input is a sparse bitmap, compute the result as a sparse
+     * bitmap as well. Not for NOT, that would just produce a dense one. */
+    if (sparse && op != BITOP_NOT) {
+        bitopRoaring(c,op,objects,numkeys);
+        zfree(src);
+        zfree(len);
+        zfree(objects);
+        return;
+    }
+
+    for (j = 0; j < numkeys; j++) {
+        if (objects[j] == NULL) {
+            minlen = 0;
+            continue;
+        }
+        o = objects[j];
         objects[j] = getDecodedObject(o);
+        decrRefCount(o);
         src[j] = objects[j]->ptr;
         len[j] = sdslen(objects[j]->ptr);
         if (len[j] > maxlen) maxlen = len[j];
@@ -659,74 +1189,10 @@ void bitopCommand(client *c) {
         unsigned char output, byte;
         unsigned long i;
 
-        /* Fast path: as far as we have data for all the input bitmaps we
-         * can take a fast path that performs much better than the
-         * vanilla algorithm. On ARM we skip the fast path since it will
-         * result in GCC compiling the code using multiple-words load/store
-         * operations that are not supported even in ARM >= v6. */
-        j = 0;
-        #ifndef USE_ALIGNED_ACCESS
-        if (minlen >= sizeof(unsigned long)*4 && numkeys <= 16) {
-            unsigned long *lp[16];
-            unsigned long *lres = (unsigned long*) res;
-
-            /* Note: sds pointer is always aligned to 8 byte boundary. */
-            memcpy(lp,src,sizeof(unsigned long*)*numkeys);
-            memcpy(res,src[0],minlen);
-
-            /* Different branches per different operations for speed (sorry). */
-            if (op == BITOP_AND) {
-                while(minlen >= sizeof(unsigned long)*4) {
-                    for (i = 1; i < numkeys; i++) {
-                        lres[0] &= lp[i][0];
-                        lres[1] &= lp[i][1];
-                        lres[2] &= lp[i][2];
-                        lres[3] &= lp[i][3];
-                        lp[i]+=4;
-                    }
-                    lres+=4;
-                    j += sizeof(unsigned long)*4;
-                    minlen -= sizeof(unsigned long)*4;
-                }
-            } else if (op == BITOP_OR) {
-                while(minlen >= sizeof(unsigned long)*4) {
-                    for (i = 1; i < numkeys; i++) {
-                        lres[0] |= lp[i][0];
-                        lres[1] |= lp[i][1];
-                        lres[2] |= lp[i][2];
-                        lres[3] |= lp[i][3];
-                        lp[i]+=4;
-                    }
-                    lres+=4;
-                    j += sizeof(unsigned long)*4;
-                    minlen -= sizeof(unsigned long)*4;
-                }
-            } else if (op == BITOP_XOR) {
-                while(minlen >= sizeof(unsigned long)*4) {
-                    for (i = 1; i < numkeys; i++) {
-                        lres[0] ^= lp[i][0];
-                        lres[1] ^= lp[i][1];
-                        lres[2] ^= lp[i][2];
-                        lres[3] ^= lp[i][3];
-                        lp[i]+=4;
-                    }
-                    lres+=4;
-                    j += sizeof(unsigned long)*4;
-                    minlen -= sizeof(unsigned long)*4;
-                }
-            } else if (op == BITOP_NOT) {
-                while(minlen >= sizeof(unsigned long)*4) {
-                    lres[0] = ~lres[0];
-                    lres[1] = ~lres[1];
-                    lres[2] = ~lres[2];
-                    lres[3] = ~lres[3];
-                    lres+=4;
-                    j += sizeof(unsigned long)*4;
-                    minlen -= sizeof(unsigned long)*4;
-                }
-            }
-        }
-        #endif
+        /* Fast path: as far as we have data for all the input bitmaps
+         * process them with the BITOP kernel. */
+        if (!bitopsKernels.selected) bitopsSelectKernels();
+        j = bitopsKernels.bitop(op,res,src,numkeys,minlen);
 
         /* j is set to the next byte to process by the previous loop. */
         for (; j < maxlen; j++) {
@@ -775,7 +1241,12 @@ void bitcountCommand(client *c) {
     /* Lookup, check for type, and return 0 for non existing keys. */
     if ((o = lookupKeyReadOrReply(c,c->argv[1],shared.czero)) == NULL ||
         checkType(c,o,OBJ_STRING)) return;
-    p = getObjectReadOnlyString(o,&strlen,llbuf);
+    if (o->encoding == OBJ_ENCODING_ROARING) {
+        p = NULL;
+        strlen = stringObjectLen(o);
+    } else {
+        p = getObjectReadOnlyString(o,&strlen,llbuf);
+    }
 
     /* Parse start/end range if any. */
     if (c->argc == 4) {
@@ -810,7 +1281,10 @@ void bitcountCommand(client *c) {
     } else {
         long bytes = end-start+1;
 
-        addReplyLongLong(c,redisPopcount(p+start,bytes));
+        if (p)
+            addReplyLongLong(c,redisPopcount(p+start,bytes));
+        else
+            addReplyLongLong(c,roaringCount(o->ptr,start,end));
     }
 }
 
@@ -839,7 +1313,12 @@ void bitposCommand(client *c) {
         return;
     }
     if (checkType(c,o,OBJ_STRING)) return;
-    p = getObjectReadOnlyString(o,&strlen,llbuf);
+    if (o->encoding == OBJ_ENCODING_ROARING) {
+        p = NULL;
+        strlen = stringObjectLen(o);
+    } else {
+        p = getObjectReadOnlyString(o,&strlen,llbuf);
+    }
 
     /* Parse start/end range if any. */
     if (c->argc == 4 || c->argc == 5) {
@@ -874,7 +1353,8 @@ void bitposCommand(client *c) {
         addReplyLongLong(c, -1);
     } else {
         long bytes = end-start+1;
-        long pos = redisBitpos(p+start,bytes,bit);
+        long pos = p ? redisBitpos(p+start,bytes,bit) :
+                       roaringBitpos(o->ptr,start,bytes,bit);
 
         /* If we are looking for clear bits, and the user specified an exact
          * range with start-end, we can't consider the right of the range as
@@ -999,7 +1479,7 @@ void bitfieldCommand(client *c) {
         /* Lookup by making room up to the farest bit reached by
          * this operation. */
         if ((o = lookupStringForBitCommand(c,
-            higest_write_offset)) == NULL) return;
+            higest_write_offset,0)) == NULL) return;
     }
 
     addReplyMultiBulkLen(c,numops);
@@ -1087,7 +1567,7 @@ void bitfieldCommand(client *c) {
             unsigned char *src = NULL;
             char llbuf[LONG_STR_SIZE];
 
-            if (o != NULL)
+            if (o != NULL && o->encoding != OBJ_ENCODING_ROARING)
                 src = getObjectReadOnlyString(o,&strlen,llbuf);
 
             /* For GET we use a trick: before executing the operation
@@ -1097,9 +1577,13 @@ void bitfieldCommand(client *c) {
             memset(buf,0,9);
             int i;
             size_t byte = thisop->offset >> 3;
-            for (i = 0; i < 9; i++) {
-                if (src == NULL || i+byte >= (size_t)strlen) break;
-                buf[i] = src[i+byte];
+            if (o != NULL && o->encoding == OBJ_ENCODING_ROARING) {
+                roaringGetBytes(o->ptr,byte,buf,9);
+            } else {
+                for (i = 0; i < 9; i++) {
+                    if (src == NULL || i+byte >= (size_t)strlen) break;
+                    buf[i] = src[i+byte];
+                }
             }
 
             /* Now operate on the copied buffer which is guaranteed
@@ -1123,3 +1607,143 @@ void bitfieldCommand(client *c) {
     }
     zfree(ops);
 }
+
+#ifdef REDIS_TEST
+#include <assert.h>
+
+#define BITOPS_TEST_MAXKEYS 5
+
+/* The byte at a time implementation of BITOP, used as reference. */
+static void bitopsTestBitop(int op, unsigned char *dst, unsigned char **src,
+                            unsigned long numkeys, unsigned long len)
+{
+    unsigned long i, j;
+
+    for (j = 0; j < len; j++) {
+        unsigned char output = src[0][j];
+        if (op == BITOP_NOT) output = ~output;
+        for (i = 1; i < numkeys; i++) {
+            if (op == BITOP_AND) output &= src[i][j];
+            else if (op == BITOP_OR) output |= src[i][j];
+            else if (op == BITOP_XOR) output ^= src[i][j];
+        }
+        dst[j] = output;
+    }
+}
+
+/* Like BITOP computes the result: the kernel first, then the rest. */
+static void bitopsTestKernelBitop(int op, unsigned char *dst,
+                                  unsigned char **src, unsigned long numkeys,
+                                  unsigned long len)
+{
+    unsigned long done, i;
+    unsigned char *rest[BITOPS_TEST_MAXKEYS];
+
+    done = bitopsKernels.bitop(op,dst,src,numkeys,len);
+    for (i = 0; i < numkeys; i++) rest[i] = src[i]+done;
+    bitopsTestBitop(op,dst+done,rest,numkeys,len-done);
+}
+
+/* Check every kernel the CPU supports against the generic code, and then
+ * report the throughput of each one with a big bitmap. */
+int bitopsTest(int argc, char **argv) {
+    struct {
+        const char *name;
+        int supported;
+        popcountKernel *popcount;
+        bitopKernel *bitop;
+        bitposKernel *bitpos;
+    } kernels[] = {
+        {"generic",1,NULL,bitopGeneric,NULL},
+#ifdef HAVE_X86_SIMD
+        {"popcnt",__builtin_cpu_supports("popcnt"),popcountPopcnt,bitopGeneric,
+         NULL},
+        {"avx2",__builtin_cpu_supports("avx2"),popcountAVX2,bitopAVX2,
+         bitposAVX2},
+        {"avx512",__builtin_cpu_supports("avx512f"),
+         __builtin_cpu_supports("avx512vpopcntdq") ? popcountAVX512 :
+                                                     popcountAVX2,
+         bitopAVX512,bitposAVX512},
+#endif
+    };
+    int numkernels = sizeof(kernels)/sizeof(kernels[0]);
+    size_t buflen = 1024*1024*64;
+    unsigned char *src[BITOPS_TEST_MAXKEYS], *dst, *ref;
+    int j, k, iter;
+    long long start;
+
+    UNUSED(argc);
+    UNUSED(argv);
+    srand(time(NULL));
+    bitopsKernels.selected = 1;
+    for (j = 0; j < BITOPS_TEST_MAXKEYS; j++) src[j] = zmalloc(4096);
+    dst = zmalloc(4096);
+    ref = zmalloc(4096);
+
+    printf("Kernels agree with the generic code: ");
+    for (iter = 0; iter < 20000; iter++) {
+        unsigned long len = rand() % 3000, off = rand() % 64, i;
+        unsigned long numkeys = 1 + rand() % BITOPS_TEST_MAXKEYS;
+        unsigned long zeros = rand() % (len+1);
+        int op = rand() % 4, bit = rand() % 2;
+        unsigned char *p[BITOPS_TEST_MAXKEYS];
+        size_t popcount;
+        long bitpos;
+
+        /* Leading bytes all zeros or all ones, to exercise BITPOS. */
+        for (j = 0; j < BITOPS_TEST_MAXKEYS; j++) {
+            for (i = 0; i < off+len; i++)
+                src[j][i] = (i < off+zeros) ? (bit ? 0 : 0xff) : rand();
+            p[j] = src[j]+off;
+        }
+        if (op == BITOP_NOT) numkeys = 1;
+
+        bitopsKernels.popcount = NULL;
+        bitopsKernels.bitpos = NULL;
+        popcount = redisPopcount(p[0],len);
+        bitpos = redisBitpos(p[0],len,bit);
+        bitopsTestBitop(op,ref,p,numkeys,len);
+        for (k = 0; k < numkernels; k++) {
+            if (!kernels[k].supported) continue;
+            bitopsKernels.popcount = kernels[k].popcount;
+            bitopsKernels.bitop = kernels[k].bitop;
+            bitopsKernels.bitpos = kernels[k].bitpos;
+            assert(redisPopcount(p[0],len) == popcount);
+            assert(redisBitpos(p[0],len,bit) == bitpos);
+            bitopsTestKernelBitop(op,dst,p,numkeys,len);
+            assert(memcmp(dst,ref,len) == 0);
+        }
+    }
+    printf("PASSED\n");
+
+    for (j = 0; j < 3; j++) {
+        zfree(src[j]);
+        src[j] = zcalloc(buflen);
+    }
+    zfree(dst);
+    dst = zmalloc(buflen);
+    for (k = 0; k < numkernels; k++) {
+        double popcount, bitop, bitpos;
+
+        if (!kernels[k].supported) continue;
+        bitopsKernels.popcount = kernels[k].popcount;
+        bitopsKernels.bitop = kernels[k].bitop;
+        bitopsKernels.bitpos = kernels[k].bitpos;
+
+        start = ustime();
+        for (j = 0; j < 10; j++) redisPopcount(src[0],buflen);
+        popcount = (double)buflen*10/(ustime()-start)/1000;
+        start = ustime();
+        for (j = 0; j < 10; j++) redisBitpos(src[0],buflen,1);
+        bitpos = (double)buflen*10/(ustime()-start)/1000;
+        start = ustime();
+        for (j = 0; j < 10; j++)
+            bitopsTestKernelBitop(BITOP_AND,dst,src,3,buflen);
+        bitop = (double)buflen*10/(ustime()-start)/1000;
+        printf("%-8s BITCOUNT %.2f GB/s, BITPOS %.2f GB/s, "
+               "BITOP AND of 3 keys %.2f GB/s\n",
+               kernels[k].name,popcount,bitpos,bitop);
+    }
+    return 0;
+}
+#endif
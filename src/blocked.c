@@ -51,11 +51,15 @@
  * to process the query buffer from unblocked clients and remove the clients
  * from the blocked_clients queue.
  *
- * replyToBlockedClientTimedOut() is called by the cron function when
- * a client blocked reaches the specified timeout (if the timeout is set
+ * replyToBlockedClientTimedOut() is called by handleBlockedClientsTimeout()
+ * when a client blocked reaches the specified timeout (if the timeout is set
  * to 0, no timeout is processed).
  * It usually just needs to send a reply to the client.
  *
+ * Clients blocked with a timeout are indexed by blockClient() in a radix
+ * tree sorted by timeout, so that handleBlockedClientsTimeout(), called in
+ * beforeSleep(), only visits the clients that actually timed out.
+ *
  * When implementing a new type of blocking opeation, the implementation
  * should modify unblockClient() and replyToBlockedClientTimedOut() in order
  * to handle the btype-specific behavior of this two functions.
@@ -101,6 +105,7 @@ void blockClient(client *c, int btype) {
     c->flags |= CLIENT_BLOCKED;
     c->btype = btype;
     server.bpop_blocked_clients++;
+    addClientToTimeoutTable(c);
 }
 
 /* This function is called in the beforeSleep() function of the event loop
@@ -138,9 +143,12 @@ void unblockClient(client *c) {
         unblockClientWaitingReplicas(c);
     } else if (c->btype == BLOCKED_MODULE) {
         unblockClientFromModule(c);
+    } else if (c->btype == BLOCKED_RAFT) {
+        raftUnblockClient(c);
     } else {
         serverPanic("Unknown btype in unblockClient().");
     }
+    removeClientFromTimeoutTable(c);
     /* Clear the flags, and put the client in the unblocked list so that
      * we'll process new commands in its query buffer ASAP. */
     c->flags &= ~CLIENT_BLOCKED;
@@ -164,6 +172,8 @@ void replyToBlockedClientTimedOut(client *c) {
         addReplyLongLong(c,replicationCountAcksByOffset(c->bpop.reploffset));
     } else if (c->btype == BLOCKED_MODULE) {
         moduleBlockedClientTimedOut(c);
+    } else if (c->btype == BLOCKED_RAFT) {
+        raftBlockedClientTimedOut(c);
     } else {
         serverPanic("Unknown btype in replyToBlockedClientTimedOut().");
     }
@@ -193,3 +203,109 @@ void disconnectAllBlockedClients(void) {
         }
     }
 }
+
+/* -----------------------------------------------------------------------------
+ * Blocked clients timeout table
+ *
+ * Clients blocked with a timeout are stored in server.clients_timeout_table,
+ * a radix tree whose keys are the 64 bit big endian timeout followed by the
+ * client pointer: keys are sorted by timeout and are unique even when many
+ * clients share the same timeout. Every time the earliest timeout changes, a
+ * time event is scheduled in order to wake up the event loop, so that clients
+ * are unblocked with millisecond precision instead of at the next cron tick.
+ * -------------------------------------------------------------------------- */
+
+#define CLIENT_TIMEOUT_KEY_LEN (8+sizeof(client*))
+
+/* Encode the timeout table key for the client 'c' into 'buf'. */
+static void encodeTimeoutKey(unsigned char *buf, uint64_t timeout, client *c) {
+    timeout = htonu64(timeout);
+    memcpy(buf,&timeout,sizeof(timeout));
+    memcpy(buf+8,&c,sizeof(c));
+}
+
+/* Decode a key created by encodeTimeoutKey(). */
+static void decodeTimeoutKey(unsigned char *buf, uint64_t *timeout, client **c) {
+    memcpy(timeout,buf,sizeof(*timeout));
+    *timeout = ntohu64(*timeout);
+    memcpy(c,buf+8,sizeof(*c));
+}
+
+static int blockedClientsTimeoutProc(struct aeEventLoop *eventLoop, long long id, void *clientData) {
+    UNUSED(eventLoop);
+    UNUSED(id);
+    UNUSED(clientData);
+
+    server.clients_timeout_timer = -1;
+    handleBlockedClientsTimeout();
+    return AE_NOMORE;
+}
+
+/* Make sure the event loop wakes up at 'when' (unix time in milliseconds),
+ * unless a timer firing not later than that is already scheduled. */
+static void scheduleBlockedClientsTimeout(mstime_t when) {
+    mstime_t now;
+
+    if (server.clients_timeout_timer != -1) {
+        if (server.clients_timeout_timer_when <= when) return;
+        aeDeleteTimeEvent(server.el,server.clients_timeout_timer);
+    }
+    now = mstime();
+    server.clients_timeout_timer = aeCreateTimeEvent(server.el,
+        when > now ? when-now : 0, blockedClientsTimeoutProc, NULL, NULL);
+    server.clients_timeout_timer_when = when;
+}
+
+/* Add the client to the timeout table if it is blocked with a timeout.
+ * This is called by blockClient(), after the blocking operation set the
+ * timeout in c->bpop.timeout. */
+void addClientToTimeoutTable(client *c) {
+    unsigned char buf[CLIENT_TIMEOUT_KEY_LEN];
+
+    if (c->bpop.timeout == 0) return;
+    encodeTimeoutKey(buf,c->bpop.timeout,c);
+    raxInsert(server.clients_timeout_table,buf,sizeof(buf),NULL,NULL);
+    c->flags |= CLIENT_IN_TO_TABLE;
+    scheduleBlockedClientsTimeout(c->bpop.timeout);
+}
+
+/* Remove the client from the timeout table, if it is there. The timer that
+ * may be scheduled for its timeout is left alone: a spurious wake up is
+ * cheaper than rescheduling. */
+void removeClientFromTimeoutTable(client *c) {
+    unsigned char buf[CLIENT_TIMEOUT_KEY_LEN];
+
+    if (!(c->flags & CLIENT_IN_TO_TABLE)) return;
+    c->flags &= ~CLIENT_IN_TO_TABLE;
+    encodeTimeoutKey(buf,c->bpop.timeout,c);
+    raxRemove(server.clients_timeout_table,buf,sizeof(buf),NULL);
+}
+
+/* Reply to and unblock all the clients whose timeout is already reached.
+ * This is called in beforeSleep() and only visits the expired clients. */
+void handleBlockedClientsTimeout(void) {
+    raxIterator ri;
+    mstime_t now;
+
+    if (raxSize(server.clients_timeout_table) == 0) return;
+    now = mstime();
+    raxStart(&ri,server.clients_timeout_table);
+    raxSeek(&ri,"^",NULL,0);
+    while(raxNext(&ri)) {
+        uint64_t timeout;
+        client *c;
+
+        decodeTimeoutKey(ri.key,&timeout,&c);
+        if ((mstime_t)timeout > now) {
+            /* Wake up again when the nearest remaining timeout is due. */
+            scheduleBlockedClientsTimeout(timeout);
+            break;
+        }
+        c->flags &= ~CLIENT_IN_TO_TABLE;
+        raxRemove(server.clients_timeout_table,ri.key,ri.key_len,NULL);
+        replyToBlockedClientTimedOut(c);
+        unblockClient(c);
+        raxSeek(&ri,"^",NULL,0);
+    }
+    raxStop(&ri);
+}
@@ -173,6 +173,7 @@ void loadServerConfigFromString(char *config) {
     char *err = NULL;
     int linenum = 0, totlines, i;
     int slaveof_linenum = 0;
+    int raft_linenum = 0;
     sds *lines;
 
     lines = sdssplitlen(config,strlen(config),"\n",1,&totlines);
@@ -212,6 +213,17 @@ void loadServerConfigFromString(char *config) {
             if (server.tcpkeepalive < 0) {
                 err = "Invalid tcp-keepalive value"; goto loaderr;
             }
+        } else if (!strcasecmp(argv[0],"io-threads") && argc == 2) {
+            server.io_threads_num = atoi(argv[1]);
+            if (server.io_threads_num < 1 ||
+                server.io_threads_num > CONFIG_MAX_IO_THREADS)
+            {
+                err = "Invalid number of I/O threads"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"io-threads-do-reads") && argc == 2) {
+            if ((server.io_threads_do_reads = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
         } else if (!strcasecmp(argv[0],"protected-mode") && argc == 2) {
             if ((server.protected_mode = yesnotoi(argv[1])) == -1) {
                 err = "argument must be 'yes' or 'no'"; goto loaderr;
@@ -411,6 +423,14 @@ void loadServerConfigFromString(char *config) {
             if ((server.activerehashing = yesnotoi(argv[1])) == -1) {
                 err = "argument must be 'yes' or 'no'"; goto loaderr;
             }
+        } else if (!strcasecmp(argv[0],"keyspace-fast-hash") && argc == 2) {
+            if ((server.keyspace_fast_hash = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"keyspace-prefix-index") && argc == 2) {
+            if ((server.keyspace_prefix_index = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
         } else if (!strcasecmp(argv[0],"lazyfree-lazy-eviction") && argc == 2) {
             if ((server.lazyfree_lazy_eviction = yesnotoi(argv[1])) == -1) {
                 err = "argument must be 'yes' or 'no'"; goto loaderr;
@@ -560,6 +580,8 @@ void loadServerConfigFromString(char *config) {
             server.zset_max_ziplist_value = memtoll(argv[1], NULL);
         } else if (!strcasecmp(argv[0],"hll-sparse-max-bytes") && argc == 2) {
             server.hll_sparse_max_bytes = memtoll(argv[1], NULL);
+        } else if (!strcasecmp(argv[0],"bitmap-roaring-min-bytes") && argc == 2) {
+            server.bitmap_roaring_min_bytes = memtoll(argv[1], NULL);
         } else if (!strcasecmp(argv[0],"rename-command") && argc == 3) {
             struct redisCommand *cmd = lookupCommand(argv[1]);
             int retval;
@@ -584,6 +606,7 @@ void loadServerConfigFromString(char *config) {
                     err = "Target command name already exists"; goto loaderr;
                 }
             }
+            invalidateCommandLookupTable();
         } else if (!strcasecmp(argv[0],"cluster-enabled") && argc == 2) {
             if ((server.cluster_enabled = yesnotoi(argv[1])) == -1) {
                 err = "argument must be 'yes' or 'no'"; goto loaderr;
@@ -591,6 +614,22 @@ void loadServerConfigFromString(char *config) {
         } else if (!strcasecmp(argv[0],"cluster-config-file") && argc == 2) {
             zfree(server.cluster_configfile);
             server.cluster_configfile = zstrdup(argv[1]);
+        } else if (!strcasecmp(argv[0],"raft-id") && argc == 2) {
+            raft_linenum = linenum;
+            server.raft_id = atoi(argv[1]);
+            if (server.raft_id < 1 || server.raft_id > 255) {
+                err = "Raft id must be between 1 and 255"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"raft-peer") && argc == 4) {
+            err = raftAddPeer(atoi(argv[1]),argv[2],atoi(argv[3]));
+            if (err) goto loaderr;
+        } else if (!strcasecmp(argv[0],"raft-log-filename") && argc == 2) {
+            if (!pathIsBaseName(argv[1])) {
+                err = "raft-log-filename can't be a path, just a filename";
+                goto loaderr;
+            }
+            zfree(server.raft_log_filename);
+            server.raft_log_filename = zstrdup(argv[1]);
         } else if (!strcasecmp(argv[0],"cluster-announce-ip") && argc == 2) {
             zfree(server.cluster_announce_ip);
             server.cluster_announce_ip = zstrdup(argv[1]);
@@ -754,6 +793,21 @@ void loadServerConfigFromString(char *config) {
         err = "slaveof directive not allowed in cluster mode";
         goto loaderr;
     }
+    if (server.raft_id) {
+        /* The raft log already replicates and persists the dataset. */
+        linenum = raft_linenum;
+        i = linenum-1;
+        if (server.cluster_enabled) {
+            err = "raft mode is not compatible with cluster mode";
+            goto loaderr;
+        } else if (server.masterhost) {
+            err = "slaveof directive not allowed in raft mode";
+            goto loaderr;
+        } else if (server.aof_state != AOF_OFF) {
+            err = "appendonly is not supported in raft mode";
+            goto loaderr;
+        }
+    }
 
     sdsfreesplitres(lines,totlines);
     return;
@@ -895,6 +949,10 @@ void configSetCommand(client *c) {
         int enable = yesnotoi(o->ptr);
 
         if (enable == -1) goto badfmt;
+        if (enable && server.raft_id) {
+            addReplyError(c,"AOF is not supported in raft mode");
+            return;
+        }
         if (enable == 0 && server.aof_state != AOF_OFF) {
             stopAppendOnly();
         } else if (enable && server.aof_state == AOF_OFF) {
@@ -1053,6 +1111,7 @@ void configSetCommand(client *c) {
      * config_set_numerical_field(name,var,min,max) */
     } config_set_numerical_field(
       "tcp-keepalive",server.tcpkeepalive,0,LLONG_MAX) {
+        setClientListenersOptions();
     } config_set_numerical_field(
       "maxmemory-samples",server.maxmemory_samples,1,LLONG_MAX) {
     } config_set_numerical_field(
@@ -1089,6 +1148,8 @@ void configSetCommand(client *c) {
       "zset-max-ziplist-value",server.zset_max_ziplist_value,0,LLONG_MAX) {
     } config_set_numerical_field(
       "hll-sparse-max-bytes",server.hll_sparse_max_bytes,0,LLONG_MAX) {
+    } config_set_numerical_field(
+      "bitmap-roaring-min-bytes",server.bitmap_roaring_min_bytes,0,LLONG_MAX) {
     } config_set_numerical_field(
       "lua-time-limit",server.lua_time_limit,0,LLONG_MAX) {
     } config_set_numerical_field(
@@ -1188,8 +1249,11 @@ badfmt: /* Bad format errors */
  * CONFIG GET implementation
  *----------------------------------------------------------------------------*/
 
+#define config_get_match(_name) \
+    stringmatchCompiled(pattern,_name,strlen(_name))
+
 #define config_get_string_field(_name,_var) do { \
-    if (stringmatch(pattern,_name,1)) { \
+    if (config_get_match(_name)) { \
         addReplyBulkCString(c,_name); \
         addReplyBulkCString(c,_var ? _var : ""); \
         matches++; \
@@ -1197,7 +1261,7 @@ badfmt: /* Bad format errors */
 } while(0);
 
 #define config_get_bool_field(_name,_var) do { \
-    if (stringmatch(pattern,_name,1)) { \
+    if (config_get_match(_name)) { \
         addReplyBulkCString(c,_name); \
         addReplyBulkCString(c,_var ? "yes" : "no"); \
         matches++; \
@@ -1205,7 +1269,7 @@ badfmt: /* Bad format errors */
 } while(0);
 
 #define config_get_numerical_field(_name,_var) do { \
-    if (stringmatch(pattern,_name,1)) { \
+    if (config_get_match(_name)) { \
         ll2string(buf,sizeof(buf),_var); \
         addReplyBulkCString(c,_name); \
         addReplyBulkCString(c,buf); \
@@ -1214,7 +1278,7 @@ badfmt: /* Bad format errors */
 } while(0);
 
 #define config_get_enum_field(_name,_var,_enumvar) do { \
-    if (stringmatch(pattern,_name,1)) { \
+    if (config_get_match(_name)) { \
         addReplyBulkCString(c,_name); \
         addReplyBulkCString(c,configEnumGetNameOrUnknown(_enumvar,_var)); \
         matches++; \
@@ -1224,10 +1288,11 @@ badfmt: /* Bad format errors */
 void configGetCommand(client *c) {
     robj *o = c->argv[2];
     void *replylen = addDeferredMultiBulkLength(c);
-    char *pattern = o->ptr;
+    stringmatchPattern *pattern;
     char buf[128];
     int matches = 0;
     serverAssertWithInfo(c,o,sdsEncodedObject(o));
+    pattern = stringmatchCompile(o->ptr,strlen(o->ptr),1);
 
     /* String values */
     config_get_string_field("dbfilename",server.rdb_filename);
@@ -1238,6 +1303,7 @@ void configGetCommand(client *c) {
     config_get_string_field("logfile",server.logfile);
     config_get_string_field("pidfile",server.pidfile);
     config_get_string_field("slave-announce-ip",server.slave_announce_ip);
+    config_get_string_field("raft-log-filename",server.raft_log_filename);
 
     /* Numerical values */
     config_get_numerical_field("maxmemory",server.maxmemory);
@@ -1272,6 +1338,8 @@ void configGetCommand(client *c) {
             server.zset_max_ziplist_value);
     config_get_numerical_field("hll-sparse-max-bytes",
             server.hll_sparse_max_bytes);
+    config_get_numerical_field("bitmap-roaring-min-bytes",
+            server.bitmap_roaring_min_bytes);
     config_get_numerical_field("lua-time-limit",server.lua_time_limit);
     config_get_numerical_field("slowlog-log-slower-than",
             server.slowlog_log_slower_than);
@@ -1281,6 +1349,7 @@ void configGetCommand(client *c) {
             server.slowlog_max_len);
     config_get_numerical_field("port",server.port);
     config_get_numerical_field("cluster-announce-port",server.cluster_announce_port);
+    config_get_numerical_field("raft-id",server.raft_id);
     config_get_numerical_field("cluster-announce-bus-port",server.cluster_announce_bus_port);
     config_get_numerical_field("tcp-backlog",server.tcp_backlog);
     config_get_numerical_field("databases",server.dbnum);
@@ -1300,6 +1369,7 @@ void configGetCommand(client *c) {
     config_get_numerical_field("cluster-slave-validity-factor",server.cluster_slave_validity_factor);
     config_get_numerical_field("repl-diskless-sync-delay",server.repl_diskless_sync_delay);
     config_get_numerical_field("tcp-keepalive",server.tcpkeepalive);
+    config_get_numerical_field("io-threads",server.io_threads_num);
 
     /* Bool (yes/no) values */
     config_get_bool_field("cluster-require-full-coverage",
@@ -1318,6 +1388,9 @@ void configGetCommand(client *c) {
     config_get_bool_field("rdbcompression", server.rdb_compression);
     config_get_bool_field("rdbchecksum", server.rdb_checksum);
     config_get_bool_field("activerehashing", server.activerehashing);
+    config_get_bool_field("keyspace-fast-hash", server.keyspace_fast_hash);
+    config_get_bool_field("keyspace-prefix-index",
+            server.keyspace_prefix_index);
     config_get_bool_field("activedefrag", server.active_defrag_enabled);
     config_get_bool_field("protected-mode", server.protected_mode);
     config_get_bool_field("repl-disable-tcp-nodelay",
@@ -1338,6 +1411,8 @@ void configGetCommand(client *c) {
             server.lazyfree_lazy_server_del);
     config_get_bool_field("slave-lazy-flush",
             server.repl_slave_lazy_flush);
+    config_get_bool_field("io-threads-do-reads",
+            server.io_threads_do_reads);
 
     /* Enum values */
     config_get_enum_field("maxmemory-policy",
@@ -1353,12 +1428,12 @@ void configGetCommand(client *c) {
 
     /* Everything we can't handle with macros follows. */
 
-    if (stringmatch(pattern,"appendonly",1)) {
+    if (config_get_match("appendonly")) {
         addReplyBulkCString(c,"appendonly");
         addReplyBulkCString(c,server.aof_state == AOF_OFF ? "no" : "yes");
         matches++;
     }
-    if (stringmatch(pattern,"dir",1)) {
+    if (config_get_match("dir")) {
         char buf[1024];
 
         if (getcwd(buf,sizeof(buf)) == NULL)
@@ -1368,7 +1443,7 @@ void configGetCommand(client *c) {
         addReplyBulkCString(c,buf);
         matches++;
     }
-    if (stringmatch(pattern,"save",1)) {
+    if (config_get_match("save")) {
         sds buf = sdsempty();
         int j;
 
@@ -1384,7 +1459,7 @@ void configGetCommand(client *c) {
         sdsfree(buf);
         matches++;
     }
-    if (stringmatch(pattern,"client-output-buffer-limit",1)) {
+    if (config_get_match("client-output-buffer-limit")) {
         sds buf = sdsempty();
         int j;
 
@@ -1402,14 +1477,14 @@ void configGetCommand(client *c) {
         sdsfree(buf);
         matches++;
     }
-    if (stringmatch(pattern,"unixsocketperm",1)) {
+    if (config_get_match("unixsocketperm")) {
         char buf[32];
         snprintf(buf,sizeof(buf),"%o",server.unixsocketperm);
         addReplyBulkCString(c,"unixsocketperm");
         addReplyBulkCString(c,buf);
         matches++;
     }
-    if (stringmatch(pattern,"slaveof",1)) {
+    if (config_get_match("slaveof")) {
         char buf[256];
 
         addReplyBulkCString(c,"slaveof");
@@ -1421,7 +1496,7 @@ void configGetCommand(client *c) {
         addReplyBulkCString(c,buf);
         matches++;
     }
-    if (stringmatch(pattern,"notify-keyspace-events",1)) {
+    if (config_get_match("notify-keyspace-events")) {
         robj *flagsobj = createObject(OBJ_STRING,
             keyspaceEventsFlagsToString(server.notify_keyspace_events));
 
@@ -1430,7 +1505,7 @@ void configGetCommand(client *c) {
         decrRefCount(flagsobj);
         matches++;
     }
-    if (stringmatch(pattern,"bind",1)) {
+    if (config_get_match("bind")) {
         sds aux = sdsjoin(server.bindaddr,server.bindaddr_count," ");
 
         addReplyBulkCString(c,"bind");
@@ -1438,6 +1513,7 @@ void configGetCommand(client *c) {
         sdsfree(aux);
         matches++;
     }
+    stringmatchFree(pattern);
     setDeferredMultiBulkLength(c,replylen,matches*2);
 }
 
@@ -1450,7 +1526,7 @@ void configGetCommand(client *c) {
 /* We use the following dictionary type to store where a configuration
  * option is mentioned in the old configuration file, so it's
  * like "maxmemory" -> list of line numbers (first line is zero). */
-uint64_t dictSdsCaseHash(const void *key);
+uint64_t dictSdsFastCaseHash(const void *key);
 int dictSdsKeyCaseCompare(void *privdata, const void *key1, const void *key2);
 void dictSdsDestructor(void *privdata, void *val);
 void dictListDestructor(void *privdata, void *val);
@@ -1460,7 +1536,7 @@ void dictListDestructor(void *privdata, void *val);
 void rewriteConfigSentinelOption(struct rewriteConfigState *state);
 
 dictType optionToLineDictType = {
-    dictSdsCaseHash,            /* hash function */
+    dictSdsFastCaseHash,        /* hash function */
     NULL,                       /* key dup */
     NULL,                       /* val dup */
     dictSdsKeyCaseCompare,      /* key compare */
@@ -1469,7 +1545,7 @@ dictType optionToLineDictType = {
 };
 
 dictType optionSetDictType = {
-    dictSdsCaseHash,            /* hash function */
+    dictSdsFastCaseHash,        /* hash function */
     NULL,                       /* key dup */
     NULL,                       /* val dup */
     dictSdsKeyCaseCompare,      /* key compare */
@@ -1985,6 +2061,8 @@ int rewriteConfig(char *path) {
     rewriteConfigOctalOption(state,"unixsocketperm",server.unixsocketperm,CONFIG_DEFAULT_UNIX_SOCKET_PERM);
     rewriteConfigNumericalOption(state,"timeout",server.maxidletime,CONFIG_DEFAULT_CLIENT_TIMEOUT);
     rewriteConfigNumericalOption(state,"tcp-keepalive",server.tcpkeepalive,CONFIG_DEFAULT_TCP_KEEPALIVE);
+    rewriteConfigNumericalOption(state,"io-threads",server.io_threads_num,CONFIG_DEFAULT_IO_THREADS_NUM);
+    rewriteConfigYesNoOption(state,"io-threads-do-reads",server.io_threads_do_reads,CONFIG_DEFAULT_IO_THREADS_DO_READS);
     rewriteConfigNumericalOption(state,"slave-announce-port",server.slave_announce_port,CONFIG_DEFAULT_SLAVE_ANNOUNCE_PORT);
     rewriteConfigEnumOption(state,"loglevel",server.verbosity,loglevel_enum,CONFIG_DEFAULT_VERBOSITY);
     rewriteConfigStringOption(state,"logfile",server.logfile,CONFIG_DEFAULT_LOGFILE);
@@ -2055,7 +2133,10 @@ int rewriteConfig(char *path) {
     rewriteConfigNumericalOption(state,"zset-max-ziplist-entries",server.zset_max_ziplist_entries,OBJ_ZSET_MAX_ZIPLIST_ENTRIES);
     rewriteConfigNumericalOption(state,"zset-max-ziplist-value",server.zset_max_ziplist_value,OBJ_ZSET_MAX_ZIPLIST_VALUE);
     rewriteConfigNumericalOption(state,"hll-sparse-max-bytes",server.hll_sparse_max_bytes,CONFIG_DEFAULT_HLL_SPARSE_MAX_BYTES);
+    rewriteConfigNumericalOption(state,"bitmap-roaring-min-bytes",server.bitmap_roaring_min_bytes,CONFIG_DEFAULT_BITMAP_ROARING_MIN_BYTES);
     rewriteConfigYesNoOption(state,"activerehashing",server.activerehashing,CONFIG_DEFAULT_ACTIVE_REHASHING);
+    rewriteConfigYesNoOption(state,"keyspace-fast-hash",server.keyspace_fast_hash,CONFIG_DEFAULT_KEYSPACE_FAST_HASH);
+    rewriteConfigYesNoOption(state,"keyspace-prefix-index",server.keyspace_prefix_index,CONFIG_DEFAULT_KEYSPACE_PREFIX_INDEX);
     rewriteConfigYesNoOption(state,"activedefrag",server.active_defrag_enabled,CONFIG_DEFAULT_ACTIVE_DEFRAG);
     rewriteConfigYesNoOption(state,"protected-mode",server.protected_mode,CONFIG_DEFAULT_PROTECTED_MODE);
     rewriteConfigClientoutputbufferlimitOption(state);
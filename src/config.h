@@ -76,6 +76,17 @@
 #define HAVE_EPOLL 1
 #endif
 
+/* Test for accept4() */
+#ifdef __linux__
+#define HAVE_ACCEPT4 1
+#endif
+
+/* io_uring is opt-in at build time (make USE_IOURING=yes), falling back to
+ * epoll at runtime if the kernel does not support it. */
+#if defined(__linux__) && defined(USE_IOURING)
+#define HAVE_IOURING 1
+#endif
+
 #if (defined(__APPLE__) && defined(MAC_OS_X_VERSION_10_6)) || defined(__FreeBSD__) || defined(__OpenBSD__) || defined (__NetBSD__)
 #define HAVE_KQUEUE 1
 #endif
@@ -114,6 +125,21 @@
 #define rdb_fsync_range(fd,off,size) fsync(fd)
 #endif
 
+/* Hint the CPU to bring the memory at 'addr' into the caches. */
+#if defined(__GNUC__) || defined(__clang__)
+#define redis_prefetch(addr) __builtin_prefetch(addr)
+#else
+#define redis_prefetch(addr) ((void)(addr))
+#endif
+
+/* Test for x86-64 SIMD kernels selected at runtime (see bitops.c): the
+ * compiler must support the target function attribute for AVX-512. */
+#if defined(__x86_64__) && \
+    ((defined(__clang__) && __clang_major__ >= 8) || \
+     (!defined(__clang__) && defined(__GNUC__) && __GNUC__ >= 8))
+#define HAVE_X86_SIMD 1
+#endif
+
 /* Check if we can use setproctitle().
  * BSD systems have support for it, we provide an implementation for
  * Linux and osx. */
@@ -165,12 +165,13 @@ robj *lookupKeyWriteOrReply(client *c, robj *key, robj *reply) {
  *
  * The program is aborted if the key already exists. */
 void dbAdd(redisDb *db, robj *key, robj *val) {
-    sds copy = sdsdup(key->ptr);
-    int retval = dictAdd(db->dict, copy, val);
+    /* No need to duplicate the key: the dict copies it inside the entry. */
+    int retval = dictAdd(db->dict, key->ptr, val);
 
     serverAssertWithInfo(NULL,key,retval == DICT_OK);
     if (val->type == OBJ_LIST) signalListAsReady(db, key);
     if (server.cluster_enabled) slotToKeyAdd(key);
+    if (db->keys_index) keysIndexAdd(db,key);
  }
 
 /* Overwrite an existing key with a new value. Incrementing the reference
@@ -224,6 +225,8 @@ int dbExists(redisDb *db, robj *key) {
  * The function makes sure to return keys not already expired. */
 robj *dbRandomKey(redisDb *db) {
     dictEntry *de;
+    int maxtries = 100;
+    int allvolatile = dictSize(db->dict) == dictSize(db->expires);
 
     while(1) {
         sds key;
@@ -235,6 +238,13 @@ robj *dbRandomKey(redisDb *db) {
         key = dictGetKey(de);
         keyobj = createStringObject(key,sdslen(key));
         if (dictFind(db->expires,key)) {
+            if (allvolatile && server.raft_id && --maxtries == 0) {
+                /* In raft mode expired keys are only deleted by the raft
+                 * log, so when every key has an expire they could all be
+                 * logically expired and still there: instead of looping
+                 * forever, give up returning a key that may be expired. */
+                return keyobj;
+            }
             if (expireIfNeeded(db,keyobj)) {
                 decrRefCount(keyobj);
                 continue; /* search for another key. This expired. */
@@ -251,6 +261,7 @@ int dbSyncDelete(redisDb *db, robj *key) {
     if (dictSize(db->expires) > 0) dictDelete(db->expires,key->ptr);
     if (dictDelete(db->dict,key->ptr) == DICT_OK) {
         if (server.cluster_enabled) slotToKeyDel(key);
+        if (db->keys_index) keysIndexDel(db,key);
         return 1;
     } else {
         return 0;
@@ -295,8 +306,13 @@ robj *dbUnshareStringValue(redisDb *db, robj *key, robj *o) {
     serverAssert(o->type == OBJ_STRING);
     if (o->refcount != 1 || o->encoding != OBJ_ENCODING_RAW) {
         robj *decoded = getDecodedObject(o);
-        o = createRawStringObject(decoded->ptr, sdslen(decoded->ptr));
-        decrRefCount(decoded);
+        if (o->encoding == OBJ_ENCODING_ROARING) {
+            /* Decoding a sparse bitmap already creates a private copy. */
+            o = decoded;
+        } else {
+            o = createRawStringObject(decoded->ptr, sdslen(decoded->ptr));
+            decrRefCount(decoded);
+        }
         dbOverwrite(db,key,o);
     }
     return o;
@@ -330,9 +346,11 @@ long long emptyDb(int dbnum, int flags, void(callback)(void*)) {
         removed += dictSize(server.db[j].dict);
         if (async) {
             emptyDbAsync(&server.db[j]);
+            if (server.db[j].keys_index) keysIndexFlushAsync(&server.db[j]);
         } else {
             dictEmpty(server.db[j].dict,callback);
             dictEmpty(server.db[j].expires,callback);
+            if (server.db[j].keys_index) keysIndexFlush(&server.db[j]);
         }
     }
     if (server.cluster_enabled) {
@@ -508,9 +526,43 @@ void keysCommand(client *c) {
     dictIterator *di;
     dictEntry *de;
     sds pattern = c->argv[1]->ptr;
-    int plen = sdslen(pattern), allkeys;
+    int plen = sdslen(pattern), allkeys, prefixlen;
     unsigned long numkeys = 0;
     void *replylen = addDeferredMultiBulkLength(c);
+    stringmatchPattern *compiled = stringmatchCompile(pattern,plen,0);
+
+    /* When the pattern starts with a literal prefix and the keys are
+     * indexed, only visit the keys starting with such prefix. */
+    prefixlen = c->db->keys_index ? stringmatchprefixlen(pattern,plen) : 0;
+    if (prefixlen) {
+        raxIterator ri;
+
+        raxStart(&ri,c->db->keys_index);
+        raxSeek(&ri,">=",(unsigned char*)pattern,prefixlen);
+        while(raxNext(&ri)) {
+            robj *keyobj;
+
+            if (ri.key_len < (size_t)prefixlen ||
+                memcmp(ri.key,pattern,prefixlen) != 0) break;
+            if (!stringmatchCompiled(compiled,(char*)ri.key,ri.key_len))
+                continue;
+            keyobj = createStringObject((char*)ri.key,ri.key_len);
+            if (expireIfNeeded(c->db,keyobj) == 0) {
+                addReplyBulk(c,keyobj);
+                numkeys++;
+            } else {
+                /* The key may have been removed from the index: seek
+                 * again since the iterator is no longer valid. */
+                raxSeek(&ri,">",(unsigned char*)keyobj->ptr,
+                        sdslen(keyobj->ptr));
+            }
+            decrRefCount(keyobj);
+        }
+        raxStop(&ri);
+        stringmatchFree(compiled);
+        setDeferredMultiBulkLength(c,replylen,numkeys);
+        return;
+    }
 
     di = dictGetSafeIterator(c->db->dict);
     allkeys = (pattern[0] == '*' && pattern[1] == '\0');
@@ -518,7 +570,7 @@ void keysCommand(client *c) {
         sds key = dictGetKey(de);
         robj *keyobj;
 
-        if (allkeys || stringmatchlen(pattern,plen,key,sdslen(key),0)) {
+        if (allkeys || stringmatchCompiled(compiled,key,sdslen(key))) {
             keyobj = createStringObject(key,sdslen(key));
             if (expireIfNeeded(c->db,keyobj) == 0) {
                 addReplyBulk(c,keyobj);
@@ -528,6 +580,7 @@ void keysCommand(client *c) {
         }
     }
     dictReleaseIterator(di);
+    stringmatchFree(compiled);
     setDeferredMultiBulkLength(c,replylen,numkeys);
 }
 
@@ -581,6 +634,95 @@ int parseScanCursorOrReply(client *c, robj *o, unsigned long *cursor) {
     return C_OK;
 }
 
+/* SCAN using the keys index visits the keys in lexicographic order, so the
+ * position of the iteration is the last key returned, that can't fit into a
+ * cursor. It is kept in the client instead, in a ring of SCAN_INDEX_CURSORS
+ * slots, and the cursor returned is the id of its slot entry, with the
+ * SCAN_INDEX_CURSOR_FLAG bit set. Cursors of the dictionary scan never have
+ * this bit set, since they are always smaller than the hash table size.
+ *
+ * A client can only resume its own cursors, and only its most recent
+ * SCAN_INDEX_CURSORS ones. Any other cursor restarts the iteration from
+ * scratch using the dictionary scan, so that SCAN can always be completed:
+ * the keys already returned may just be returned again. */
+#define SCAN_INDEX_CURSOR_FLAG (1UL << (sizeof(unsigned long)*8-1))
+
+static unsigned long scanIndexCursorCreate(client *c, sds key) {
+    scanIndexCursors *sc = c->scan_cursors;
+    unsigned long id, slot;
+
+    if (sc == NULL) sc = c->scan_cursors = zcalloc(sizeof(*sc));
+    id = ++sc->next_id & ~SCAN_INDEX_CURSOR_FLAG;
+    slot = id % SCAN_INDEX_CURSORS;
+    sdsfree(sc->key[slot]);
+    sc->id[slot] = id;
+    sc->key[slot] = sdsdup(key);
+    return id | SCAN_INDEX_CURSOR_FLAG;
+}
+
+static sds scanIndexCursorLookup(client *c, unsigned long cursor) {
+    scanIndexCursors *sc = c->scan_cursors;
+    unsigned long id = cursor & ~SCAN_INDEX_CURSOR_FLAG;
+    unsigned long slot = id % SCAN_INDEX_CURSORS;
+
+    if (sc == NULL || sc->key[slot] == NULL || sc->id[slot] != id)
+        return NULL;
+    return sc->key[slot];
+}
+
+void freeScanIndexCursors(client *c) {
+    scanIndexCursors *sc = c->scan_cursors;
+    int j;
+
+    if (sc == NULL) return;
+    for (j = 0; j < SCAN_INDEX_CURSORS; j++) sdsfree(sc->key[j]);
+    zfree(sc);
+    c->scan_cursors = NULL;
+}
+
+/* Add to the 'keys' list up to 'count' keys of the current DB starting with
+ * 'prefix', resuming the iteration from '*cursor', that is then set to the
+ * cursor of the next call, or to 0 if there are no more keys to return.
+ * If the cursor is not one of the client indexed SCAN cursors C_ERR is
+ * returned, and nothing is added to the list. */
+int scanKeysIndex(client *c, sds prefix, int prefixlen, long count,
+                  unsigned long *cursor, list *keys)
+{
+    raxIterator ri;
+    int more = 0;
+    sds last = NULL;
+
+    if (*cursor != 0) {
+        if (!(*cursor & SCAN_INDEX_CURSOR_FLAG)) return C_ERR;
+        if ((last = scanIndexCursorLookup(c,*cursor)) == NULL) return C_ERR;
+    }
+
+    raxStart(&ri,c->db->keys_index);
+    if (last == NULL)
+        raxSeek(&ri,">=",(unsigned char*)prefix,prefixlen);
+    else
+        raxSeek(&ri,">",(unsigned char*)last,sdslen(last));
+
+    while(raxNext(&ri)) {
+        if (ri.key_len < (size_t)prefixlen ||
+            memcmp(ri.key,prefix,prefixlen) != 0) break;
+        if (listLength(keys) == (unsigned long)count) {
+            more = 1;
+            break;
+        }
+        listAddNodeTail(keys,createStringObject((char*)ri.key,ri.key_len));
+    }
+    raxStop(&ri);
+
+    if (more) {
+        robj *last = listNodeValue(listLast(keys));
+        *cursor = scanIndexCursorCreate(c,last->ptr);
+    } else {
+        *cursor = 0;
+    }
+    return C_OK;
+}
+
 /* This command implements SCAN, HSCAN and SSCAN commands.
  * If object 'o' is passed, then it must be a Hash or Set object, otherwise
  * if 'o' is NULL the command will operate on the dictionary associated with
@@ -598,7 +740,8 @@ void scanGenericCommand(client *c, robj *o, unsigned long cursor) {
     listNode *node, *nextnode;
     long count = 10;
     sds pat = NULL;
-    int patlen = 0, use_pattern = 0;
+    int patlen = 0, use_pattern = 0, prefixlen;
+    stringmatchPattern *compiled = NULL;
     dict *ht;
 
     /* Object must be NULL (to iterate keys names), or the type of the object
@@ -663,8 +806,20 @@ void scanGenericCommand(client *c, robj *o, unsigned long cursor) {
         count *= 2; /* We return key / value for this type. */
     }
 
-    if (ht) {
+    if (o == NULL && use_pattern && c->db->keys_index &&
+        (prefixlen = stringmatchprefixlen(pat,patlen)) > 0 &&
+        scanKeysIndex(c,pat,prefixlen,count,&cursor,keys) == C_OK)
+    {
+        /* Handled the case of a pattern with a literal prefix on an indexed
+         * keyspace: the keys matching it are all together in the index. */
+    } else if (ht) {
         void *privdata[2];
+
+        /* A cursor of the keys index we can't resume: restart with the
+         * dictionary scan, see scanKeysIndex(). */
+        if (o == NULL && c->db->keys_index &&
+            (cursor & SCAN_INDEX_CURSOR_FLAG)) cursor = 0;
+
         /* We set the max number of iterations to ten times the specified
          * COUNT, so if the hash table is in a pathological state (very
          * sparsely populated) we avoid to block too much time at the cost
@@ -707,6 +862,7 @@ void scanGenericCommand(client *c, robj *o, unsigned long cursor) {
     }
 
     /* Step 3: Filter elements. */
+    if (use_pattern) compiled = stringmatchCompile(pat,patlen,0);
     node = listFirst(keys);
     while (node) {
         robj *kobj = listNodeValue(node);
@@ -716,7 +872,7 @@ void scanGenericCommand(client *c, robj *o, unsigned long cursor) {
         /* Filter element if it does not match the pattern. */
         if (!filter && use_pattern) {
             if (sdsEncodedObject(kobj)) {
-                if (!stringmatchlen(pat, patlen, kobj->ptr, sdslen(kobj->ptr), 0))
+                if (!stringmatchCompiled(compiled, kobj->ptr, sdslen(kobj->ptr)))
                     filter = 1;
             } else {
                 char buf[LONG_STR_SIZE];
@@ -724,7 +880,7 @@ void scanGenericCommand(client *c, robj *o, unsigned long cursor) {
 
                 serverAssert(kobj->encoding == OBJ_ENCODING_INT);
                 len = ll2string(buf,sizeof(buf),(long)kobj->ptr);
-                if (!stringmatchlen(pat, patlen, buf, len, 0)) filter = 1;
+                if (!stringmatchCompiled(compiled, buf, len)) filter = 1;
             }
         }
 
@@ -765,6 +921,7 @@ void scanGenericCommand(client *c, robj *o, unsigned long cursor) {
     }
 
 cleanup:
+    stringmatchFree(compiled);
     listSetFreeMethod(keys,decrRefCountVoid);
     listRelease(keys);
 }
@@ -978,10 +1135,12 @@ int dbSwapDatabases(int id1, int id2) {
     db1->dict = db2->dict;
     db1->expires = db2->expires;
     db1->avg_ttl = db2->avg_ttl;
+    db1->keys_index = db2->keys_index;
 
     db2->dict = aux.dict;
     db2->expires = aux.expires;
     db2->avg_ttl = aux.avg_ttl;
+    db2->keys_index = aux.keys_index;
 
     /* Now we need to handle clients blocked on lists: as an effect
      * of swapping the two DBs, a client that was waiting for list
@@ -1138,6 +1297,14 @@ int expireIfNeeded(redisDb *db, robj *key) {
      * we think the key is expired at this time. */
     if (server.masterhost != NULL) return now > when;
 
+    /* In raft mode keys are deleted only while a raft entry is applied, as
+     * of the time of the entry, so that every node deletes the same keys.
+     * See raftApplyEntry(). */
+    if (server.raft_id) {
+        if (server.raft_apply_time == 0) return now > when;
+        now = server.raft_apply_time;
+    }
+
     /* Return when this key has not expired */
     if (now <= when) return 0;
 
@@ -1467,3 +1634,21 @@ unsigned int delKeysInSlot(unsigned int hashslot) {
 unsigned int countKeysInSlot(unsigned int hashslot) {
     return server.cluster->slots_keys_count[hashslot];
 }
+
+/* Keys index API. When keyspace-prefix-index is enabled every DB also keeps
+ * the names of its keys in a radix tree, so that KEYS and SCAN can find the
+ * keys matching a pattern with a literal prefix without visiting the whole
+ * keyspace. */
+void keysIndexAdd(redisDb *db, robj *key) {
+    raxInsert(db->keys_index,(unsigned char*)key->ptr,sdslen(key->ptr),
+              NULL,NULL);
+}
+
+void keysIndexDel(redisDb *db, robj *key) {
+    raxRemove(db->keys_index,(unsigned char*)key->ptr,sdslen(key->ptr),NULL);
+}
+
+void keysIndexFlush(redisDb *db) {
+    raxFree(db->keys_index);
+    db->keys_index = raxNew();
+}
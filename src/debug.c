@@ -432,7 +432,8 @@ void debugCommand(client *c) {
                 "val_sds_len:%lld, val_sds_avail:%lld, val_zmalloc: %lld",
                 (long long) sdslen(key),
                 (long long) sdsavail(key),
-                (long long) sdsZmallocSize(key),
+                /* Keys are stored inside the dict entry, see dbDictType. */
+                (long long) sdsplacedlen(sdslen(key)),
                 (long long) sdslen(val->ptr),
                 (long long) sdsavail(val->ptr),
                 (long long) getStringObjectSdsUsedMemory(val));
@@ -125,7 +125,10 @@ robj *activeDefragStringOb(robj* ob, int *defragged) {
                 ret->ptr = (void*)((intptr_t)ret + ofs);
                 (*defragged)++;
             }
-        } else if (ob->encoding!=OBJ_ENCODING_INT) {
+        } else if (ob->encoding!=OBJ_ENCODING_INT &&
+                   ob->encoding!=OBJ_ENCODING_ROARING) {
+            /* Roaring bitmaps are made of many small allocations that
+             * are not moved for now. */
             serverPanic("Unknown string encoding");
         }
     }
@@ -169,20 +172,21 @@ int dictIterDefragEntry(dictIterator *iter) {
 int dictDefragTables(dict** dictRef) {
     dict *d = *dictRef;
     dictEntry **newtable;
-    int defragged = 0;
+    unsigned char *newmeta;
+    int defragged = 0, j;
     /* handle the dict struct */
     dict *newd = activeDefragAlloc(d);
     if (newd)
         defragged++, *dictRef = d = newd;
-    /* handle the first hash table */
-    newtable = activeDefragAlloc(d->ht[0].table);
-    if (newtable)
-        defragged++, d->ht[0].table = newtable;
-    /* handle the second hash table */
-    if (d->ht[1].table) {
-        newtable = activeDefragAlloc(d->ht[1].table);
+    /* handle the hash tables and their bucket metadata */
+    for (j = 0; j < 2; j++) {
+        if (d->ht[j].table == NULL) continue;
+        newtable = activeDefragAlloc(d->ht[j].table);
         if (newtable)
-            defragged++, d->ht[1].table = newtable;
+            defragged++, d->ht[j].table = newtable;
+        newmeta = activeDefragAlloc(d->ht[j].meta);
+        if (newmeta)
+            defragged++, d->ht[j].meta = newmeta;
     }
     return defragged;
 }
@@ -273,7 +277,6 @@ dictEntry* replaceSateliteDictKeyPtrAndOrDefragDictEntry(dict *d, sds oldkey, sd
  * all the various pointers it has. Returns a stat of how many pointers were
  * moved. */
 int defragKey(redisDb *db, dictEntry *de) {
-    sds keysds = dictGetKey(de);
     robj *newob, *ob;
     unsigned char *newzl;
     dict *d;
@@ -281,17 +284,9 @@ int defragKey(redisDb *db, dictEntry *de) {
     int defragged = 0;
     sds newsds;
 
-    /* Try to defrag the key name. */
-    newsds = activeDefragSds(keysds);
-    if (newsds)
-        defragged++, de->key = newsds;
-    if (dictSize(db->expires)) {
-         /* Dirty code:
-          * I can't search in db->expires for that key after i already released
-          * the pointer it holds it won't be able to do the string compare */
-        uint64_t hash = dictGetHash(db->dict, de->key);
-        replaceSateliteDictKeyPtrAndOrDefragDictEntry(db->expires, keysds, newsds, hash, &defragged);
-    }
+    /* The key name is stored inside the dictEntry, so it was already moved
+     * by defragDictBucketCallback() if needed. */
+    UNUSED(db);
 
     /* Try to defrag robj and / or string value. */
     ob = dictGetVal(de);
@@ -425,17 +420,36 @@ void defragScanCallback(void *privdata, const dictEntry *de) {
         server.stat_active_defrag_key_misses++;
 }
 
-/* Defrag scan callback for for each hash table bicket,
- * used in order to defrag the dictEntry allocations. */
+/* Defrag scan callback for for each hash table bicket of the main db
+ * dictionary, used in order to defrag the dictEntry allocations.
+ * The entries embed the key name (see dbDictType), so when an entry is
+ * moved its key pointer, and the one shared by the expires dict, must be
+ * updated as well. */
 void defragDictBucketCallback(void *privdata, dictEntry **bucketref) {
-    UNUSED(privdata);
+    redisDb *db = privdata;
+    int defragged = 0;
     while(*bucketref) {
         dictEntry *de = *bucketref, *newde;
+        sds oldkey = dictGetKey(de);
+        size_t keyoffset = (char*)oldkey - (char*)de;
         if ((newde = activeDefragAlloc(de))) {
+            sds newkey = (char*)newde + keyoffset;
+            defragged++;
+            newde->key = newkey;
             *bucketref = newde;
+            if (dictSize(db->expires)) {
+                /* Dirty code:
+                 * I can't search in db->expires for that key after i
+                 * already released the pointer it holds it won't be able
+                 * to do the string compare */
+                uint64_t hash = dictGetHash(db->dict, newkey);
+                replaceSateliteDictKeyPtrAndOrDefragDictEntry(db->expires,
+                    oldkey, newkey, hash, &defragged);
+            }
         }
         bucketref = &(*bucketref)->next;
     }
+    server.stat_active_defrag_hits += defragged;
 }
 
 /* Utility function to get the fragmentation ratio from jemalloc.
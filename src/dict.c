@@ -34,6 +34,7 @@
  */
 
 #include "fmacros.h"
+#include "config.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -95,6 +96,75 @@ uint64_t dictGenCaseHashFunction(const unsigned char *buf, int len) {
     return siphash_nocase(buf,len,dict_hash_function_seed);
 }
 
+/* The fast hashing function uses the wyhash implementation in wyhash.c.
+ * It is seeded like the default one, but is not designed to resist hash
+ * flooding, so it should only be used by dict types whose keys are not
+ * under the control of the clients. */
+
+uint64_t wyhash(const uint8_t *in, const size_t inlen, const uint8_t *k);
+uint64_t wyhash_nocase(const uint8_t *in, const size_t inlen, const uint8_t *k);
+
+uint64_t dictGenFastHashFunction(const void *key, int len) {
+    return wyhash(key,len,dict_hash_function_seed);
+}
+
+uint64_t dictGenFastCaseHashFunction(const unsigned char *buf, int len) {
+    return wyhash_nocase(buf,len,dict_hash_function_seed);
+}
+
+/* -------------------------- bucket metadata ------------------------------- */
+
+/* Every bucket has a metadata byte, kept in a separate array parallel to the
+ * table so that it can be loaded together with the bucket pointer, and that
+ * can tell most lookups of missing keys apart without touching any entry:
+ *
+ * 0: the bucket is empty.
+ * DICT_META_CHAIN clear: the bucket has a single entry, and the other bits
+ *     are a tag made of the 7 most significant bits of its hash (never 0).
+ * DICT_META_CHAIN set: the bucket may have more entries and must be walked.
+ *     The other bits are the tag of the first entry, or 0 if unknown.
+ *
+ * The tag of a new head is always known since entries are added on top,
+ * while after the head is deleted we don't rehash the next key to learn its
+ * tag, so such a bucket is just walked like a plain chain from now on. */
+#define DICT_META_CHAIN 0x80
+#define DICT_META_TAG_MASK 0x7f
+
+static inline unsigned char dictHashTag(uint64_t hash) {
+    unsigned char tag = hash >> 57;
+    return tag ? tag : 1;
+}
+
+/* Update the metadata of bucket 'idx' after 'he', with the specified hash,
+ * was added on top of it. */
+static inline void _dictMetaAddHead(dictht *ht, unsigned long idx,
+                                    dictEntry *he, uint64_t hash) {
+    ht->meta[idx] = dictHashTag(hash) | (he->next ? DICT_META_CHAIN : 0);
+}
+
+/* Update the metadata of bucket 'idx' after an entry was unlinked from it. */
+static inline void _dictMetaDelete(dictht *ht, unsigned long idx, int washead) {
+    if (ht->table[idx] == NULL)
+        ht->meta[idx] = 0;
+    else if (washead)
+        ht->meta[idx] = DICT_META_CHAIN; /* Unknown tag. */
+}
+
+/* Return the first entry of bucket 'idx' that may match a key with the
+ * specified hash tag, or NULL if the bucket can't contain such a key. */
+static inline dictEntry *_dictBucketLookupStart(dictht *ht, unsigned long idx,
+                                                unsigned char tag) {
+    dictEntry *he = ht->table[idx];
+    unsigned char meta = ht->meta[idx];
+
+    if (meta & DICT_META_CHAIN) {
+        unsigned char headtag = meta & DICT_META_TAG_MASK;
+        /* Skip the head without comparing its key if its tag is known. */
+        return (headtag && headtag != tag) ? he->next : he;
+    }
+    return (meta == tag) ? he : NULL;
+}
+
 /* ----------------------------- API implementation ------------------------- */
 
 /* Reset a hash table already initialized with ht_init().
@@ -102,6 +172,7 @@ uint64_t dictGenCaseHashFunction(const unsigned char *buf, int len) {
 static void _dictReset(dictht *ht)
 {
     ht->table = NULL;
+    ht->meta = NULL;
     ht->size = 0;
     ht->sizemask = 0;
     ht->used = 0;
@@ -161,6 +232,7 @@ int dictExpand(dict *d, unsigned long size)
     n.size = realsize;
     n.sizemask = realsize-1;
     n.table = zcalloc(realsize*sizeof(dictEntry*));
+    n.meta = zcalloc(realsize);
     n.used = 0;
 
     /* Is this the first initialization? If so it's not really a rehashing
@@ -176,6 +248,46 @@ int dictExpand(dict *d, unsigned long size)
     return DICT_OK;
 }
 
+/* Allocate the arrays of a hash table of 'size' buckets, that must be a
+ * power of two. Unlike dictExpand() the memory is explicitly zeroed, so that
+ * all its pages are faulted in at this point. The function does not access
+ * any dict, so it is safe to call it from other threads in order to prepare
+ * a big table for dictExpandWithTable(). */
+void dictTableAlloc(dictht *ht, unsigned long size) {
+    ht->size = size;
+    ht->sizemask = size-1;
+    ht->used = 0;
+    ht->table = zmalloc(size*sizeof(dictEntry*));
+    memset(ht->table,0,size*sizeof(dictEntry*));
+    ht->meta = zmalloc(size);
+    memset(ht->meta,0,size);
+}
+
+/* Release a table obtained with dictTableAlloc() that was not used. */
+void dictTableRelease(dictht *ht) {
+    zfree(ht->table);
+    zfree(ht->meta);
+    _dictReset(ht);
+}
+
+/* Like dictExpand() but use the empty table 'ht', obtained with
+ * dictTableAlloc(), as the new table. On success the dict takes ownership
+ * of the table, otherwise DICT_ERR is returned and the caller should
+ * release it. */
+int dictExpandWithTable(dict *d, dictht *ht) {
+    if (dictIsRehashing(d) || d->ht[0].used > ht->size ||
+        ht->size == d->ht[0].size) return DICT_ERR;
+
+    if (d->ht[0].table == NULL) {
+        d->ht[0] = *ht;
+    } else {
+        d->ht[1] = *ht;
+        d->rehashidx = 0;
+    }
+    _dictReset(ht);
+    return DICT_OK;
+}
+
 /* Performs N steps of incremental rehashing. Returns 1 if there are still
  * keys to move from the old to the new hash table, otherwise 0 is returned.
  *
@@ -202,24 +314,28 @@ int dictRehash(dict *d, int n) {
         de = d->ht[0].table[d->rehashidx];
         /* Move all the keys in this bucket from the old to the new hash HT */
         while(de) {
-            uint64_t h;
+            uint64_t h, idx;
 
             nextde = de->next;
             /* Get the index in the new hash table */
-            h = dictHashKey(d, de->key) & d->ht[1].sizemask;
-            de->next = d->ht[1].table[h];
-            d->ht[1].table[h] = de;
+            h = dictHashKey(d, de->key);
+            idx = h & d->ht[1].sizemask;
+            de->next = d->ht[1].table[idx];
+            d->ht[1].table[idx] = de;
+            _dictMetaAddHead(&d->ht[1],idx,de,h);
             d->ht[0].used--;
             d->ht[1].used++;
             de = nextde;
         }
         d->ht[0].table[d->rehashidx] = NULL;
+        d->ht[0].meta[d->rehashidx] = 0;
         d->rehashidx++;
     }
 
     /* Check if we already rehashed the whole table... */
     if (d->ht[0].used == 0) {
         zfree(d->ht[0].table);
+        zfree(d->ht[0].meta);
         d->ht[0] = d->ht[1];
         _dictReset(&d->ht[1]);
         d->rehashidx = -1;
@@ -237,6 +353,25 @@ long long timeInMilliseconds(void) {
     return (((long long)tv.tv_sec)*1000)+(tv.tv_usec/1000);
 }
 
+long long timeInMicroseconds(void) {
+    struct timeval tv;
+
+    gettimeofday(&tv,NULL);
+    return (((long long)tv.tv_sec)*1000000)+tv.tv_usec;
+}
+
+/* Rehash for an amount of time of about us microseconds. */
+int dictRehashMicroseconds(dict *d, long long us) {
+    long long start = timeInMicroseconds();
+    int rehashes = 0;
+
+    while(dictRehash(d,100)) {
+        rehashes += 100;
+        if (timeInMicroseconds()-start >= us) break;
+    }
+    return rehashes;
+}
+
 /* Rehash for an amount of time between ms milliseconds and ms+1 milliseconds */
 int dictRehashMilliseconds(dict *d, int ms) {
     long long start = timeInMilliseconds();
@@ -292,6 +427,7 @@ int dictAdd(dict *d, void *key, void *val)
 dictEntry *dictAddRaw(dict *d, void *key, dictEntry **existing)
 {
     long index;
+    uint64_t hash;
     dictEntry *entry;
     dictht *ht;
 
@@ -299,7 +435,8 @@ dictEntry *dictAddRaw(dict *d, void *key, dictEntry **existing)
 
     /* Get the index of the new element, or -1 if
      * the element already exists. */
-    if ((index = _dictKeyIndex(d, key, dictHashKey(d,key), existing)) == -1)
+    hash = dictHashKey(d,key);
+    if ((index = _dictKeyIndex(d, key, hash, existing)) == -1)
         return NULL;
 
     /* Allocate the memory and store the new entry.
@@ -307,13 +444,17 @@ dictEntry *dictAddRaw(dict *d, void *key, dictEntry **existing)
      * system it is more likely that recently added entries are accessed
      * more frequently. */
     ht = dictIsRehashing(d) ? &d->ht[1] : &d->ht[0];
-    entry = zmalloc(sizeof(*entry));
+    if (d->type->keyEmbed) {
+        entry = zmalloc(sizeof(*entry)+d->type->keyEmbedLen(key));
+        entry->key = d->type->keyEmbed(entry+1,key);
+    } else {
+        entry = zmalloc(sizeof(*entry));
+        dictSetKey(d, entry, key);
+    }
     entry->next = ht->table[index];
     ht->table[index] = entry;
+    _dictMetaAddHead(ht,index,entry,hash);
     ht->used++;
-
-    /* Set the hash entry fields. */
-    dictSetKey(d, entry, key);
     return entry;
 }
 
@@ -382,6 +523,7 @@ static dictEntry *dictGenericDelete(dict *d, const void *key, int nofree) {
                     prevHe->next = he->next;
                 else
                     d->ht[table].table[idx] = he->next;
+                _dictMetaDelete(&d->ht[table],idx,prevHe == NULL);
                 if (!nofree) {
                     dictFreeKey(d, he);
                     dictFreeVal(d, he);
@@ -460,6 +602,7 @@ int _dictClear(dict *d, dictht *ht, void(callback)(void *)) {
     }
     /* Free the table and the allocated cache structure */
     zfree(ht->table);
+    zfree(ht->meta);
     /* Re-initialize the table */
     _dictReset(ht);
     return DICT_OK; /* never fails */
@@ -477,13 +620,15 @@ dictEntry *dictFind(dict *d, const void *key)
 {
     dictEntry *he;
     uint64_t h, idx, table;
+    unsigned char tag;
 
     if (d->ht[0].used + d->ht[1].used == 0) return NULL; /* dict is empty */
     if (dictIsRehashing(d)) _dictRehashStep(d);
     h = dictHashKey(d, key);
+    tag = dictHashTag(h);
     for (table = 0; table <= 1; table++) {
         idx = h & d->ht[table].sizemask;
-        he = d->ht[table].table[idx];
+        he = _dictBucketLookupStart(&d->ht[table],idx,tag);
         while(he) {
             if (key==he->key || dictCompareKeys(d, key, he->key))
                 return he;
@@ -494,6 +639,61 @@ dictEntry *dictFind(dict *d, const void *key)
     return NULL;
 }
 
+/* Look up 'count' keys at once (at most DICT_PREFETCH_MAX_KEYS), setting
+ * des[j] to the entry of keys[j], or NULL if it is not found. Unlike
+ * calling dictFind() for every key, the lookups proceed in stages: first
+ * the buckets of all the keys are prefetched, then their first entries,
+ * and only then the chains are compared. This way the cache misses of
+ * the different keys are served in parallel, and a following dictFind()
+ * of the same keys will find everything in the CPU caches.
+ *
+ * The function does not perform a rehashing step, so it never modifies
+ * the dictionary. */
+void dictPrefetch(dict *d, void **keys, int count, dictEntry **des) {
+    uint64_t hashes[DICT_PREFETCH_MAX_KEYS];
+    int j, table, tables;
+    dictEntry *he;
+
+    if (count > DICT_PREFETCH_MAX_KEYS) count = DICT_PREFETCH_MAX_KEYS;
+    for (j = 0; j < count; j++) des[j] = NULL;
+    if (d->ht[0].used + d->ht[1].used == 0) return;
+    tables = dictIsRehashing(d) ? 2 : 1;
+
+    /* Stage 1: hash the keys and prefetch their buckets. */
+    for (j = 0; j < count; j++) {
+        hashes[j] = dictHashKey(d,keys[j]);
+        for (table = 0; table < tables; table++) {
+            uint64_t idx = hashes[j] & d->ht[table].sizemask;
+            redis_prefetch(&d->ht[table].table[idx]);
+            redis_prefetch(&d->ht[table].meta[idx]);
+        }
+    }
+
+    /* Stage 2: prefetch the first entry of every bucket. */
+    for (j = 0; j < count; j++) {
+        for (table = 0; table < tables; table++) {
+            uint64_t idx = hashes[j] & d->ht[table].sizemask;
+            if ((he = d->ht[table].table[idx]) != NULL) redis_prefetch(he);
+        }
+    }
+
+    /* Stage 3: find the entries. */
+    for (j = 0; j < count; j++) {
+        unsigned char tag = dictHashTag(hashes[j]);
+        for (table = 0; table < tables && des[j] == NULL; table++) {
+            uint64_t idx = hashes[j] & d->ht[table].sizemask;
+            he = _dictBucketLookupStart(&d->ht[table],idx,tag);
+            while(he) {
+                if (keys[j]==he->key || dictCompareKeys(d, keys[j], he->key)) {
+                    des[j] = he;
+                    break;
+                }
+                he = he->next;
+            }
+        }
+    }
+}
+
 void *dictFetchValue(dict *d, const void *key) {
     dictEntry *he;
 
@@ -930,6 +1130,13 @@ static int _dictExpandIfNeeded(dict *d)
         (dict_can_resize ||
          d->ht[0].used/d->ht[0].size > dict_force_resize_ratio))
     {
+        /* The dict type may want to provide the new table later, see
+         * dictExpandWithTable(), as long as the ratio stays within the
+         * "safe" threshold. */
+        if (d->type->expandLater &&
+            d->ht[0].used/d->ht[0].size <= dict_force_resize_ratio &&
+            d->type->expandLater(d,_dictNextPower(d->ht[0].used*2)))
+            return DICT_OK;
         return dictExpand(d, d->ht[0].used*2);
     }
     return DICT_OK;
@@ -958,6 +1165,7 @@ static unsigned long _dictNextPower(unsigned long size)
 static long _dictKeyIndex(dict *d, const void *key, uint64_t hash, dictEntry **existing)
 {
     unsigned long idx, table;
+    unsigned char tag = dictHashTag(hash);
     dictEntry *he;
     if (existing) *existing = NULL;
 
@@ -967,7 +1175,7 @@ static long _dictKeyIndex(dict *d, const void *key, uint64_t hash, dictEntry **e
     for (table = 0; table <= 1; table++) {
         idx = hash & d->ht[table].sizemask;
         /* Search if this slot does not already contain the given key */
-        he = d->ht[table].table[idx];
+        he = _dictBucketLookupStart(&d->ht[table],idx,tag);
         while(he) {
             if (key==he->key || dictCompareKeys(d, key, he->key)) {
                 if (existing) *existing = he;
@@ -1109,8 +1317,11 @@ void dictGetStats(char *buf, size_t bufsize, dict *d) {
 
 #include "sds.h"
 
+static uint64_t (*benchmarkHashFunction)(const void *key, int len) =
+    dictGenHashFunction;
+
 uint64_t hashCallback(const void *key) {
-    return dictGenHashFunction((unsigned char*)key, sdslen((char*)key));
+    return benchmarkHashFunction((unsigned char*)key, sdslen((char*)key));
 }
 
 int compareCallback(void *privdata, const void *key1, const void *key2) {
@@ -1144,18 +1355,20 @@ dictType BenchmarkDictType = {
     printf(msg ": %ld items in %lld ms\n", count, elapsed); \
 } while(0);
 
-/* dict-benchmark [count] */
+/* dict-benchmark [count] [fast] */
 int main(int argc, char **argv) {
     long j;
     long long start, elapsed;
     dict *dict = dictCreate(&BenchmarkDictType,NULL);
     long count = 0;
 
-    if (argc == 2) {
+    if (argc >= 2) {
         count = strtol(argv[1],NULL,10);
     } else {
         count = 5000000;
     }
+    if (argc >= 3 && !strcmp(argv[2],"fast"))
+        benchmarkHashFunction = dictGenFastHashFunction;
 
     start_benchmark();
     for (j = 0; j < count; j++) {
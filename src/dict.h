@@ -34,6 +34,7 @@
  */
 
 #include <stdint.h>
+#include <stddef.h>
 
 #ifndef __DICT_H
 #define __DICT_H
@@ -55,6 +56,8 @@ typedef struct dictEntry {
     struct dictEntry *next;
 } dictEntry;
 
+struct dict;
+
 typedef struct dictType {
     uint64_t (*hashFunction)(const void *key);
     void *(*keyDup)(void *privdata, const void *key);
@@ -62,12 +65,24 @@ typedef struct dictType {
     int (*keyCompare)(void *privdata, const void *key1, const void *key2);
     void (*keyDestructor)(void *privdata, void *key);
     void (*valDestructor)(void *privdata, void *obj);
+    /* When set, dictAddRaw() stores a copy of the key in the same allocation
+     * of the entry: keyEmbedLen() returns the bytes the copy needs, and
+     * keyEmbed() writes it at 'buf' returning the pointer to use as key.
+     * Such keys are released with the entry, so keyDup and keyDestructor
+     * should be NULL. */
+    size_t (*keyEmbedLen)(const void *key);
+    void *(*keyEmbed)(void *buf, const void *key);
+    /* When set, it is called before the table is grown to 'size' buckets.
+     * If it returns non zero the expansion is skipped, and the caller is
+     * expected to provide the table later with dictExpandWithTable(). */
+    int (*expandLater)(struct dict *d, unsigned long size);
 } dictType;
 
 /* This is our hash table structure. Every dictionary has two of this as we
  * implement incremental rehashing, for the old to the new table. */
 typedef struct dictht {
     dictEntry **table;
+    unsigned char *meta; /* A metadata byte for every bucket, see dict.c. */
     unsigned long size;
     unsigned long sizemask;
     unsigned long used;
@@ -100,6 +115,9 @@ typedef void (dictScanBucketFunction)(void *privdata, dictEntry **bucketref);
 /* This is the initial size of every hash table */
 #define DICT_HT_INITIAL_SIZE     4
 
+/* Max number of keys dictPrefetch() can look up at once. */
+#define DICT_PREFETCH_MAX_KEYS   64
+
 /* ------------------------------- Macros ------------------------------------*/
 #define dictFreeVal(d, entry) \
     if ((d)->type->valDestructor) \
@@ -144,12 +162,16 @@ typedef void (dictScanBucketFunction)(void *privdata, dictEntry **bucketref);
 #define dictGetUnsignedIntegerVal(he) ((he)->v.u64)
 #define dictGetDoubleVal(he) ((he)->v.d)
 #define dictSlots(d) ((d)->ht[0].size+(d)->ht[1].size)
+#define dictBucketSize() (sizeof(dictEntry*)+1) /* Pointer + metadata byte. */
 #define dictSize(d) ((d)->ht[0].used+(d)->ht[1].used)
 #define dictIsRehashing(d) ((d)->rehashidx != -1)
 
 /* API */
 dict *dictCreate(dictType *type, void *privDataPtr);
 int dictExpand(dict *d, unsigned long size);
+void dictTableAlloc(dictht *ht, unsigned long size);
+void dictTableRelease(dictht *ht);
+int dictExpandWithTable(dict *d, dictht *ht);
 int dictAdd(dict *d, void *key, void *val);
 dictEntry *dictAddRaw(dict *d, void *key, dictEntry **existing);
 dictEntry *dictAddOrFind(dict *d, void *key);
@@ -160,6 +182,7 @@ void dictFreeUnlinkedEntry(dict *d, dictEntry *he);
 void dictRelease(dict *d);
 dictEntry * dictFind(dict *d, const void *key);
 void *dictFetchValue(dict *d, const void *key);
+void dictPrefetch(dict *d, void **keys, int count, dictEntry **des);
 int dictResize(dict *d);
 dictIterator *dictGetIterator(dict *d);
 dictIterator *dictGetSafeIterator(dict *d);
@@ -170,11 +193,14 @@ unsigned int dictGetSomeKeys(dict *d, dictEntry **des, unsigned int count);
 void dictGetStats(char *buf, size_t bufsize, dict *d);
 uint64_t dictGenHashFunction(const void *key, int len);
 uint64_t dictGenCaseHashFunction(const unsigned char *buf, int len);
+uint64_t dictGenFastHashFunction(const void *key, int len);
+uint64_t dictGenFastCaseHashFunction(const unsigned char *buf, int len);
 void dictEmpty(dict *d, void(callback)(void*));
 void dictEnableResize(void);
 void dictDisableResize(void);
 int dictRehash(dict *d, int n);
 int dictRehashMilliseconds(dict *d, int ms);
+int dictRehashMicroseconds(dict *d, long long us);
 void dictSetHashFunctionSeed(uint8_t *seed);
 uint8_t *dictGetHashFunctionSeed(void);
 unsigned long dictScan(dict *d, unsigned long v, dictScanFunction *fn, dictScanBucketFunction *bucketfn, void *privdata);
@@ -401,6 +401,10 @@ int freeMemoryIfNeeded(void) {
     if (server.maxmemory_policy == MAXMEMORY_NO_EVICTION)
         goto cant_free; /* We need to free memory, but policy forbids. */
 
+    /* In raft mode every node must hold the same keys: evicting them on
+     * our own is not possible, writes are refused instead. */
+    if (server.raft_id) goto cant_free;
+
     latencyStartMonitor(latency);
     while (mem_freed < mem_tofree) {
         int j, k, i, keys_freed = 0;
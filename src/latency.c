@@ -42,7 +42,7 @@ int dictStringKeyCompare(void *privdata, const void *key1, const void *key2) {
 }
 
 uint64_t dictStringHash(const void *key) {
-    return dictGenHashFunction(key, strlen(key));
+    return dictGenFastHashFunction(key, strlen(key));
 }
 
 void dictVanillaFree(void *privdata, void *val);
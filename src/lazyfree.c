@@ -6,6 +6,15 @@
 static size_t lazyfree_objects = 0;
 pthread_mutex_t lazyfree_objects_mutex = PTHREAD_MUTEX_INITIALIZER;
 
+/* Values of a database released in background that are still referenced
+ * somewhere else, like the reply list of a client that is being served a
+ * big value, see _addReplyObjectRefToList(). The lazyfree thread can't
+ * release them since the main thread may be releasing the other references
+ * at the same time, so it moves them here, and the main thread releases
+ * them in lazyfreeReleaseSharedObjects(). */
+static list *lazyfree_shared_objects = NULL;
+static pthread_mutex_t lazyfree_shared_objects_mutex = PTHREAD_MUTEX_INITIALIZER;
+
 /* Return the number of currently pending objects to free. */
 size_t lazyfreeGetPendingObjectsCount(void) {
     size_t aux;
@@ -84,6 +93,7 @@ int dbAsyncDelete(redisDb *db, robj *key) {
     if (de) {
         dictFreeUnlinkedEntry(db->dict,de);
         if (server.cluster_enabled) slotToKeyDel(key);
+        if (db->keys_index) keysIndexDel(db,key);
         return 1;
     } else {
         return 0;
@@ -113,6 +123,16 @@ void slotToKeyFlushAsync(void) {
     bioCreateBackgroundJob(BIO_LAZY_FREE,NULL,NULL,old);
 }
 
+/* Empty the keys index of a DB by creating a new empty one and scheduling
+ * the old for lazy freeing. */
+void keysIndexFlushAsync(redisDb *db) {
+    rax *old = db->keys_index;
+
+    db->keys_index = raxNew();
+    atomicIncr(lazyfree_objects,old->numele);
+    bioCreateBackgroundJob(BIO_LAZY_FREE,NULL,NULL,old);
+}
+
 /* Release objects from the lazyfree thread. It's just decrRefCount()
  * updating the count of objects to release. */
 void lazyfreeFreeObjectFromBioThread(robj *o) {
@@ -127,13 +147,63 @@ void lazyfreeFreeObjectFromBioThread(robj *o) {
  * may be NULL if Redis Cluster is disabled. */
 void lazyfreeFreeDatabaseFromBioThread(dict *ht1, dict *ht2) {
     size_t numkeys = dictSize(ht1);
+    list *shared = NULL;
+    dictIterator *di;
+    dictEntry *de;
+
+    /* The dictionary is no longer reachable from the keyspace, so nobody can
+     * take new references to its values: the ones with a single reference
+     * are ours, while the others are handed to the main thread. */
+    di = dictGetIterator(ht1);
+    while((de = dictNext(di)) != NULL) {
+        robj *val = dictGetVal(de);
+
+        if (val->refcount == 1 || val->refcount == OBJ_SHARED_REFCOUNT)
+            continue;
+        if (shared == NULL) shared = listCreate();
+        listAddNodeTail(shared,val);
+        dictSetVal(ht1,de,NULL);
+    }
+    dictReleaseIterator(di);
+
     dictRelease(ht1);
     dictRelease(ht2);
+    if (shared) {
+        numkeys -= listLength(shared);
+        pthread_mutex_lock(&lazyfree_shared_objects_mutex);
+        if (lazyfree_shared_objects == NULL) {
+            lazyfree_shared_objects = shared;
+        } else {
+            listJoin(lazyfree_shared_objects,shared);
+            listRelease(shared);
+        }
+        pthread_mutex_unlock(&lazyfree_shared_objects_mutex);
+    }
     atomicDecr(lazyfree_objects,numkeys);
 }
 
-/* Release the skiplist mapping Redis Cluster keys to slots in the
- * lazyfree thread. */
+/* Called by the main thread in serverCron() to release the values the
+ * lazyfree thread could not release, see lazyfreeFreeDatabaseFromBioThread(). */
+void lazyfreeReleaseSharedObjects(void) {
+    list *shared;
+    listNode *ln;
+
+    pthread_mutex_lock(&lazyfree_shared_objects_mutex);
+    shared = lazyfree_shared_objects;
+    lazyfree_shared_objects = NULL;
+    pthread_mutex_unlock(&lazyfree_shared_objects_mutex);
+    if (shared == NULL) return;
+
+    while ((ln = listFirst(shared)) != NULL) {
+        decrRefCount(listNodeValue(ln));
+        listDelNode(shared,ln);
+        atomicDecr(lazyfree_objects,1);
+    }
+    listRelease(shared);
+}
+
+/* Release the radix tree mapping Redis Cluster keys to slots, or the keys
+ * index of a DB, in the lazyfree thread. */
 void lazyfreeFreeSlotsMapFromBioThread(rax *rt) {
     size_t len = rt->numele;
     raxFree(rt);
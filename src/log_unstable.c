@@ -1,12 +1,13 @@
 #include "log_unstable.h"
+#include "zmalloc.h"
 #include <stdio.h>
 #include <assert.h>
 unstable* createUnstable()
 {
     unstable* uns = zmalloc(sizeof(unstable));
-    uns->ssmd = createSnapshotMetaData();
-    uns->entries = listCreate();
-    listSetFreeMethod(uns->entries, decRaftEntryRefCnt);
+    uns->ssmd = NULL;   /* Only set while a snapshot waits to be persisted. */
+    uns->ssdata = NULL;
+    uns->entries = createRaftEntryList();
     uns->offset = 0;
     return uns;
 }
@@ -73,8 +74,9 @@ void unstableStableTo(unstable* u, uint64_t index, uint64_t term)
         while(lower > 0)
         {
             listDelNode(u->entries, listFirst(u->entries));
-            u->offset = index + 1;
+            lower--;
         }
+        u->offset = index + 1;
     }
 }
 
@@ -83,41 +85,53 @@ void unstableStableSnapTo(unstable* u, uint64_t index)
     if(u->ssmd != NULL && u->ssmd->lastLogIndex == index)
     {
         freeSnapshotMetaData(u->ssmd);
+        sdsfree(u->ssdata);
         u->ssmd = NULL;
+        u->ssdata = NULL;
     }
 }
 
-void unstableRestore(unstable* u, snapshotMetaData* ssmd)
+/* Start over from the snapshot 'ss', that is copied. */
+void unstableRestore(unstable* u, snapshot* ss)
 {
-    u->offset = ssmd->lastLogIndex + 1;
+    u->offset = ss->metaData->lastLogIndex + 1;
     listEmpty(u->entries);
     if(u->ssmd != NULL)
     {
         freeSnapshotMetaData(u->ssmd);
+        sdsfree(u->ssdata);
     }
-    u->ssmd = ssmd;
+    u->ssmd = dupSnapshotMetaData(ss->metaData);
+    u->ssdata = sdsdup(ss->data);
 }
 
 
+/* Append 'entries' taking a new reference to each of them. The caller
+ * keeps its own list. Entries from the first index of 'entries' on are
+ * replaced. */
 void unstableTruncateAndAppend(unstable* u, list* entries)
 {
-    raftEntry* entry = listFirst(u->entries)->value;
+    raftEntry* entry = listFirst(entries)->value;
     uint64_t after = entry->index;
-    if(after == u->offset + listLength(u->entries))
-    {
-        listApplyFunc(entries, incRaftEntryRefCnt);
-        listJoin(u->entries, entries);
-    }else if(after <= u->offset)
+    if(after <= u->offset)
     {
+        /* Replace all the unstable entries: the ones before 'after' are
+         * in the storage, that is truncated when these are persisted. */
         u->offset = after;
         listEmpty(u->entries);
-        listApplyFunc(entries, incRaftEntryRefCnt);
-        u->entries = entries;
     }else
     {
-        list* slice = unstableSlice(u, u->offset, after);
-        listEmpty(u->entries);
-        listJoin(u->entries, entries);
+        mustCheckOutOfBounds(u, u->offset, after);
+        while(u->offset + listLength(u->entries) > after)
+        {
+            listDelNode(u->entries, listLast(u->entries));
+        }
+    }
+    listNode* n = listFirst(entries);
+    while(n != NULL)
+    {
+        listAddNodeTail(u->entries, copyRaftEntry(n->value));
+        n = listNextNode(n);
     }
 }
 
@@ -125,7 +139,7 @@ void unstableTruncateAndAppend(unstable* u, list* entries)
 list* unstableSlice(unstable* u, uint64_t lo, uint64_t hi)
 {
     mustCheckOutOfBounds(u, lo, hi);
-    list* new_list = listCreate();
+    list* new_list = createRaftEntryList();
     uint64_t lower = lo - u->offset;
     uint64_t upper = hi - u->offset;
     listNode* node = listIndex(u->entries, lower);
@@ -4,6 +4,7 @@
 typedef struct unstable 
 {
     snapshotMetaData* ssmd;
+    sds ssdata;             /* Data of the snapshot, if ssmd is set. */
     list* entries;
     uint64_t offset;
 }unstable;
@@ -20,7 +21,7 @@ void unstableStableTo(unstable* u, uint64_t index, uint64_t term);
 
 void unstableStableSnapTo(unstable* u, uint64_t index);
 
-void unstableRestore(unstable* u, snapshotMetaData* ssmd);
+void unstableRestore(unstable* u, snapshot* ss);
 
 
 void unstableTruncateAndAppend(unstable* u, list* entries);
@@ -666,6 +666,7 @@ int RM_CreateCommand(RedisModuleCtx *ctx, const char *name, RedisModuleCmdFunc c
     cp->rediscmd->calls = 0;
     dictAdd(server.commands,sdsdup(cmdname),cp->rediscmd);
     dictAdd(server.orig_commands,sdsdup(cmdname),cp->rediscmd);
+    invalidateCommandLookupTable();
     return REDISMODULE_OK;
 }
 
@@ -2685,9 +2686,9 @@ RedisModuleCallReply *RM_Call(RedisModuleCtx *ctx, const char *cmdname, const ch
     sds proto = sdsnewlen(c->buf,c->bufpos);
     c->bufpos = 0;
     while(listLength(c->reply)) {
-        sds o = listNodeValue(listFirst(c->reply));
+        robj *o = listNodeValue(listFirst(c->reply));
 
-        proto = sdscatsds(proto,o);
+        proto = sdscatsds(proto,o->ptr);
         listDelNode(c->reply,listFirst(c->reply));
     }
     reply = moduleCreateCallReplyFromProto(ctx,proto);
@@ -3816,7 +3817,7 @@ void moduleUnsubscribeNotifications(RedisModule *module) {
  * this gets queries from modules. */
 
 uint64_t dictCStringKeyHash(const void *key) {
-    return dictGenHashFunction((unsigned char*)key, strlen((char*)key));
+    return dictGenFastHashFunction((unsigned char*)key, strlen((char*)key));
 }
 
 int dictCStringKeyCompare(void *privdata, const void *key1, const void *key2) {
@@ -3923,6 +3924,7 @@ void moduleUnregisterCommands(struct RedisModule *module) {
         }
     }
     dictReleaseIterator(di);
+    invalidateCommandLookupTable();
 }
 
 /* Load a module and initialize it. On success C_OK is returned, otherwise
@@ -29,11 +29,33 @@
 
 #include "server.h"
 #include "atomicvar.h"
+#include "bio.h"
 #include <sys/uio.h>
+#include <sched.h>
 #include <math.h>
 #include <ctype.h>
 
+/* Upper bound of the iovec array used by writeToClient(). */
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
 static void setProtocolError(const char *errstr, client *c, long pos);
+static void freeClientFromIOContext(client *c);
+int postponeClientRead(client *c);
+int processCommandAndResetClient(client *c);
+int ProcessingEventsWhileBlocked = 0; /* See processEventsWhileBlocked(). */
+
+#define IO_THREADS_OP_IDLE 0
+#define IO_THREADS_OP_READ 1
+#define IO_THREADS_OP_WRITE 2
+static int io_threads_op = IO_THREADS_OP_IDLE; /* What the threads are doing. */
+
+/* Reply objects the I/O threads could not release, see
+ * freeClientReplyValue(). */
+static list *io_threads_deferred_release;
+static pthread_mutex_t io_threads_deferred_release_mutex =
+    PTHREAD_MUTEX_INITIALIZER;
 
 /* Return the size consumed from the allocator, for the specified SDS string,
  * including internal fragmentation. This function is used in order to compute
@@ -54,20 +76,38 @@ size_t getStringObjectSdsUsedMemory(robj *o) {
     }
 }
 
-/* Client.reply list dup and free methods. */
+/* Client.reply list dup and free methods. The list is made of string
+ * objects: either chunks of protocol we own and append to, or big values
+ * referenced directly, see _addReplyObjectToList(). */
 void *dupClientReplyValue(void *o) {
-    return sdsdup(o);
+    incrRefCount((robj*)o);
+    return o;
 }
 
 void freeClientReplyValue(void *o) {
-    sdsfree(o);
+    robj *obj = o;
+
+    /* An I/O thread may only release objects it is the sole owner of:
+     * other threads could be releasing another reference to the same
+     * value concurrently. Shared ones are released by the main thread
+     * once the threads are done. */
+    if (io_threads_op != IO_THREADS_OP_IDLE && obj->refcount != 1) {
+        pthread_mutex_lock(&io_threads_deferred_release_mutex);
+        listAddNodeTail(io_threads_deferred_release,obj);
+        pthread_mutex_unlock(&io_threads_deferred_release_mutex);
+        return;
+    }
+    decrRefCount(obj);
 }
 
 int listMatchObjects(void *a, void *b) {
     return equalStringObjects(a,b);
 }
 
-client *createClient(int fd) {
+/* Create a client for the socket 'fd'. If 'sockopts' is true the socket is
+ * set non blocking, and TCP_NODELAY and keep alive are configured,
+ * otherwise the caller already took care of it. */
+static client *createClientGeneric(int fd, int sockopts) {
     client *c = zmalloc(sizeof(client));
 
     /* passing -1 as fd it is possible to create a non connected client.
@@ -75,10 +115,12 @@ client *createClient(int fd) {
      * in the context of a client. When commands are executed in other
      * contexts (for instance a Lua script) we need a non connected client. */
     if (fd != -1) {
-        anetNonBlock(NULL,fd);
-        anetEnableTcpNoDelay(NULL,fd);
-        if (server.tcpkeepalive)
-            anetKeepAlive(NULL,fd,server.tcpkeepalive);
+        if (sockopts) {
+            anetNonBlock(NULL,fd);
+            anetEnableTcpNoDelay(NULL,fd);
+            if (server.tcpkeepalive)
+                anetKeepAlive(NULL,fd,server.tcpkeepalive);
+        }
         if (aeCreateFileEvent(server.el,fd,AE_READABLE,
             readQueryFromClient, c) == AE_ERR)
         {
@@ -95,6 +137,9 @@ client *createClient(int fd) {
     c->fd = fd;
     c->name = NULL;
     c->bufpos = 0;
+    c->buf_usable_size = 0;
+    c->buf_peak = 0;
+    c->buf = NULL;
     c->querybuf = sdsempty();
     c->pending_querybuf = sdsempty();
     c->querybuf_peak = 0;
@@ -128,11 +173,15 @@ client *createClient(int fd) {
     c->bpop.target = NULL;
     c->bpop.numreplicas = 0;
     c->bpop.reploffset = 0;
+    c->bpop.raft_reqid = 0;
+    c->bpop.raft_read_index = 0;
     c->woff = 0;
+    c->raft_consistency = 0;
     c->watched_keys = listCreate();
     c->pubsub_channels = dictCreate(&objectKeyPointerValueDictType,NULL);
     c->pubsub_patterns = listCreate();
     c->peerid = NULL;
+    c->scan_cursors = NULL;
     listSetFreeMethod(c->pubsub_patterns,decrRefCountVoid);
     listSetMatchMethod(c->pubsub_patterns,listMatchObjects);
     if (fd != -1) listAddNodeTail(server.clients,c);
@@ -140,6 +189,10 @@ client *createClient(int fd) {
     return c;
 }
 
+client *createClient(int fd) {
+    return createClientGeneric(fd,1);
+}
+
 /* This function is called every time we are going to transmit new data
  * to the client. The behavior is the following:
  *
@@ -177,12 +230,31 @@ int prepareClientToWrite(client *c) {
 
     if (c->fd <= 0) return C_ERR; /* Fake client for AOF loading. */
 
+    /* Schedule the client to write the output buffers to the socket, unless
+     * it should already be setup to do so (it has already pending data).
+     *
+     * If CLIENT_PENDING_READ is set, we're in an I/O thread and should
+     * not install a write handler. Instead, it will be done by
+     * handleClientsWithPendingReadsUsingThreads() upon return. */
+    if (!clientHasPendingReplies(c) && !(c->flags & CLIENT_PENDING_READ))
+        clientInstallWriteHandler(c);
+
+    /* Authorize the caller to queue in the output buffer of this client. */
+    return C_OK;
+}
+
+/* This function puts the client in the queue of clients that should write
+ * their output buffers to the socket. Note that it does not *yet* install
+ * the write handler, to start clients are put in a queue of clients that need
+ * to write, so we try to do that before returning in the event loop (see the
+ * handleClientsWithPendingWrites() function).
+ * If we fail and there is more data to write, compared to what the socket
+ * buffers can hold, then we'll really install the handler. */
+void clientInstallWriteHandler(client *c) {
     /* Schedule the client to write the output buffers to the socket only
-     * if not already done (there were no pending writes already and the client
-     * was yet not flagged), and, for slaves, if the slave can actually
-     * receive writes at this stage. */
-    if (!clientHasPendingReplies(c) &&
-        !(c->flags & CLIENT_PENDING_WRITE) &&
+     * if not already done and, for slaves, if the slave can actually receive
+     * writes at this stage. */
+    if (!(c->flags & CLIENT_PENDING_WRITE) &&
         (c->replstate == REPL_STATE_NONE ||
          (c->replstate == SLAVE_STATE_ONLINE && !c->repl_put_online_on_ack)))
     {
@@ -195,18 +267,36 @@ int prepareClientToWrite(client *c) {
         c->flags |= CLIENT_PENDING_WRITE;
         listAddNodeHead(server.clients_pending_write,c);
     }
-
-    /* Authorize the caller to queue in the output buffer of this client. */
-    return C_OK;
 }
 
 /* -----------------------------------------------------------------------------
  * Low level functions to add more data to output buffers.
  * -------------------------------------------------------------------------- */
 
-int _addReplyToBuffer(client *c, const char *s, size_t len) {
-    size_t available = sizeof(c->buf)-c->bufpos;
+/* Make sure the static buffer of the client can hold 'size' bytes, growing
+ * it if needed. The buffer is allocated only when the first reply is
+ * emitted, starting from PROTO_REPLY_MIN_BYTES and doubling up to
+ * PROTO_REPLY_CHUNK_BYTES, so that idle clients, or clients that only get
+ * small replies, don't pay for a full chunk. clientsCron() shrinks or
+ * releases it later.
+ *
+ * Returns 1 if the buffer is large enough, 0 if 'size' is over the limit. */
+static int _reserveReplyBuffer(client *c, size_t size) {
+    size_t newsize;
 
+    if (size <= c->buf_usable_size) return 1;
+    if (size > PROTO_REPLY_CHUNK_BYTES) return 0;
+
+    newsize = c->buf_usable_size ? c->buf_usable_size*2 :
+                                   PROTO_REPLY_MIN_BYTES;
+    while(newsize < size) newsize *= 2;
+    if (newsize > PROTO_REPLY_CHUNK_BYTES) newsize = PROTO_REPLY_CHUNK_BYTES;
+    c->buf = zrealloc(c->buf,newsize);
+    c->buf_usable_size = newsize;
+    return 1;
+}
+
+int _addReplyToBuffer(client *c, const char *s, size_t len) {
     if (c->flags & CLIENT_CLOSE_AFTER_REPLY) return C_OK;
 
     /* If there already are entries in the reply list, we cannot
@@ -214,95 +304,92 @@ int _addReplyToBuffer(client *c, const char *s, size_t len) {
     if (listLength(c->reply) > 0) return C_ERR;
 
     /* Check that the buffer has enough space available for this string. */
-    if (len > available) return C_ERR;
+    if (!_reserveReplyBuffer(c,c->bufpos+len)) return C_ERR;
 
     memcpy(c->buf+c->bufpos,s,len);
     c->bufpos+=len;
+    if ((size_t)c->bufpos > c->buf_peak) c->buf_peak = c->bufpos;
     return C_OK;
 }
 
-void _addReplyObjectToList(client *c, robj *o) {
-    if (c->flags & CLIENT_CLOSE_AFTER_REPLY) return;
+/* Return the tail of the reply list if 'len' more bytes of protocol can
+ * be appended to it, otherwise NULL. We can only grow chunks we are the
+ * sole owner of: the tail may also be the placeholder set by
+ * addDeferredMultiBulkLength() (NULL), a value referenced by
+ * _addReplyObjectToList() or a chunk shared with another client by
+ * copyClientOutputBuffer(). */
+static robj *_replyListAppendableTail(client *c, size_t len) {
+    robj *tail;
 
-    if (listLength(c->reply) == 0) {
-        sds s = sdsdup(o->ptr);
-        listAddNodeTail(c->reply,s);
-        c->reply_bytes += sdslen(s);
-    } else {
-        listNode *ln = listLast(c->reply);
-        sds tail = listNodeValue(ln);
-
-        /* Append to this object when possible. If tail == NULL it was
-         * set via addDeferredMultiBulkLength(). */
-        if (tail && sdslen(tail)+sdslen(o->ptr) <= PROTO_REPLY_CHUNK_BYTES) {
-            tail = sdscatsds(tail,o->ptr);
-            listNodeValue(ln) = tail;
-            c->reply_bytes += sdslen(o->ptr);
-        } else {
-            sds s = sdsdup(o->ptr);
-            listAddNodeTail(c->reply,s);
-            c->reply_bytes += sdslen(s);
-        }
-    }
-    asyncCloseClientOnOutputBufferLimitReached(c);
+    if (listLength(c->reply) == 0) return NULL;
+    tail = listNodeValue(listLast(c->reply));
+    if (tail && tail->refcount == 1 &&
+        sdslen(tail->ptr)+len <= PROTO_REPLY_CHUNK_BYTES) return tail;
+    return NULL;
 }
 
 /* This method takes responsibility over the sds. When it is no longer
  * needed it will be free'd, otherwise it ends up in a robj. */
 void _addReplySdsToList(client *c, sds s) {
+    robj *tail;
+
     if (c->flags & CLIENT_CLOSE_AFTER_REPLY) {
         sdsfree(s);
         return;
     }
 
-    if (listLength(c->reply) == 0) {
-        listAddNodeTail(c->reply,s);
+    /* Append to the tail object when possible. */
+    if ((tail = _replyListAppendableTail(c,sdslen(s))) != NULL) {
+        tail->ptr = sdscatsds(tail->ptr,s);
         c->reply_bytes += sdslen(s);
+        sdsfree(s);
     } else {
-        listNode *ln = listLast(c->reply);
-        sds tail = listNodeValue(ln);
-
-        /* Append to this object when possible. If tail == NULL it was
-         * set via addDeferredMultiBulkLength(). */
-        if (tail && sdslen(tail)+sdslen(s) <= PROTO_REPLY_CHUNK_BYTES) {
-            tail = sdscatsds(tail,s);
-            listNodeValue(ln) = tail;
-            c->reply_bytes += sdslen(s);
-            sdsfree(s);
-        } else {
-            listAddNodeTail(c->reply,s);
-            c->reply_bytes += sdslen(s);
-        }
+        listAddNodeTail(c->reply,createObject(OBJ_STRING,s));
+        c->reply_bytes += sdslen(s);
     }
     asyncCloseClientOnOutputBufferLimitReached(c);
 }
 
 void _addReplyStringToList(client *c, const char *s, size_t len) {
+    robj *tail;
+
     if (c->flags & CLIENT_CLOSE_AFTER_REPLY) return;
 
-    if (listLength(c->reply) == 0) {
-        sds node = sdsnewlen(s,len);
-        listAddNodeTail(c->reply,node);
+    /* Append to the tail object when possible. */
+    if ((tail = _replyListAppendableTail(c,len)) != NULL) {
+        tail->ptr = sdscatlen(tail->ptr,s,len);
         c->reply_bytes += len;
     } else {
-        listNode *ln = listLast(c->reply);
-        sds tail = listNodeValue(ln);
-
-        /* Append to this object when possible. If tail == NULL it was
-         * set via addDeferredMultiBulkLength(). */
-        if (tail && sdslen(tail)+len <= PROTO_REPLY_CHUNK_BYTES) {
-            tail = sdscatlen(tail,s,len);
-            listNodeValue(ln) = tail;
-            c->reply_bytes += len;
-        } else {
-            sds node = sdsnewlen(s,len);
-            listAddNodeTail(c->reply,node);
-            c->reply_bytes += len;
-        }
+        sds node = sdsnewlen(s,len);
+        listAddNodeTail(c->reply,createObject(OBJ_STRING,node));
+        c->reply_bytes += len;
     }
     asyncCloseClientOnOutputBufferLimitReached(c);
 }
 
+/* Queue a reference to the string object 'o' without copying it. */
+static void _addReplyObjectRefToList(client *c, robj *o) {
+    if (c->flags & CLIENT_CLOSE_AFTER_REPLY) return;
+
+    incrRefCount(o);
+    listAddNodeTail(c->reply,o);
+    c->reply_bytes += sdslen(o->ptr);
+    asyncCloseClientOnOutputBufferLimitReached(c);
+}
+
+void _addReplyObjectToList(client *c, robj *o) {
+    size_t len = sdslen(o->ptr);
+
+    /* Big values are not copied: we just take a reference, and write them
+     * straight from the object. The value can't change under us since
+     * commands modifying strings in place unshare them first, see
+     * dbUnshareStringValue(). */
+    if (o->encoding == OBJ_ENCODING_RAW && len >= PROTO_REPLY_NOCOPY_BYTES)
+        _addReplyObjectRefToList(c,o);
+    else
+        _addReplyStringToList(c,o->ptr,len);
+}
+
 /* -----------------------------------------------------------------------------
  * Higher level functions to queue data on the client output buffer.
  * The following functions are the ones that commands implementations will call.
@@ -325,7 +412,7 @@ void addReply(client *c, robj *obj) {
         /* Optimization: if there is room in the static buffer for 32 bytes
          * (more than the max chars a 64 bit integer can take as string) we
          * avoid decoding the object and go for the lower level approach. */
-        if (listLength(c->reply) == 0 && (sizeof(c->buf) - c->bufpos) >= 32) {
+        if (listLength(c->reply) == 0 && _reserveReplyBuffer(c,c->bufpos+32)) {
             char buf[32];
             int len;
 
@@ -339,11 +426,34 @@ void addReply(client *c, robj *obj) {
         if (_addReplyToBuffer(c,obj->ptr,sdslen(obj->ptr)) != C_OK)
             _addReplyObjectToList(c,obj);
         decrRefCount(obj);
+    } else if (obj->encoding == OBJ_ENCODING_ROARING) {
+        /* Sparse bitmaps are materialized into a temporary string, that
+         * is referenced by the reply list if big enough. */
+        obj = getDecodedObject(obj);
+        if (_addReplyToBuffer(c,obj->ptr,sdslen(obj->ptr)) != C_OK)
+            _addReplyObjectToList(c,obj);
+        decrRefCount(obj);
     } else {
         serverPanic("Wrong obj->encoding in addReply()");
     }
 }
 
+/* Add a chunk of protocol formatted once and queued to many clients, like
+ * a PUBLISH payload. Unless it is small it is referenced instead of copied,
+ * so a single copy exists however many clients are going to receive it.
+ * The object must be a RAW string that nobody modifies later. */
+void addReplyProtoShared(client *c, robj *proto) {
+    size_t len = sdslen(proto->ptr);
+
+    if (prepareClientToWrite(c) != C_OK) return;
+    if (len < PROTO_REPLY_SHARED_MIN_BYTES) {
+        if (_addReplyToBuffer(c,proto->ptr,len) != C_OK)
+            _addReplyStringToList(c,proto->ptr,len);
+    } else {
+        _addReplyObjectRefToList(c,proto);
+    }
+}
+
 void addReplySds(client *c, sds s) {
     if (prepareClientToWrite(c) != C_OK) {
         /* The caller expects the sds to be free'd. */
@@ -437,27 +547,30 @@ void *addDeferredMultiBulkLength(client *c) {
 /* Populate the length object and try gluing it to the next chunk. */
 void setDeferredMultiBulkLength(client *c, void *node, long length) {
     listNode *ln = (listNode*)node;
-    sds len, next;
+    robj *next;
+    sds len;
 
     /* Abort when *node is NULL: when the client should not accept writes
      * we return NULL in addDeferredMultiBulkLength() */
     if (node == NULL) return;
 
     len = sdscatprintf(sdsnewlen("*",1),"%ld\r\n",length);
-    listNodeValue(ln) = len;
     c->reply_bytes += sdslen(len);
     if (ln->next != NULL) {
         next = listNodeValue(ln->next);
 
-        /* Only glue when the next node is non-NULL (an sds in this case) */
-        if (next != NULL) {
-            len = sdscatsds(len,next);
+        /* Only glue when the next node is a chunk of protocol: not another
+         * placeholder (NULL) nor a referenced value. */
+        if (next != NULL && next->refcount == 1 &&
+            sdslen(next->ptr) <= PROTO_REPLY_CHUNK_BYTES)
+        {
+            len = sdscatsds(len,next->ptr);
             listDelNode(c->reply,ln->next);
-            listNodeValue(ln) = len;
             /* No need to update c->reply_bytes: we are just moving the same
              * amount of bytes from one node to another. */
         }
     }
+    listNodeValue(ln) = createObject(OBJ_STRING,len);
     asyncCloseClientOnOutputBufferLimitReached(c);
 }
 
@@ -531,6 +644,8 @@ void addReplyBulkLen(client *c, robj *obj) {
 
     if (sdsEncodedObject(obj)) {
         len = sdslen(obj->ptr);
+    } else if (obj->encoding == OBJ_ENCODING_ROARING) {
+        len = ((roaring*)obj->ptr)->len;
     } else {
         long n = (long)obj->ptr;
 
@@ -596,7 +711,10 @@ void addReplyBulkLongLong(client *c, long long ll) {
 void copyClientOutputBuffer(client *dst, client *src) {
     listRelease(dst->reply);
     dst->reply = listDup(src->reply);
-    memcpy(dst->buf,src->buf,src->bufpos);
+    if (src->bufpos) {
+        _reserveReplyBuffer(dst,src->bufpos);
+        memcpy(dst->buf,src->buf,src->bufpos);
+    }
     dst->bufpos = src->bufpos;
     dst->reply_bytes = src->reply_bytes;
 }
@@ -608,9 +726,20 @@ int clientHasPendingReplies(client *c) {
 }
 
 #define MAX_ACCEPTS_PER_CALL 1000
+
+/* With accept4() accepted sockets are already non blocking, and on Linux
+ * they inherit TCP_NODELAY and the keep alive settings from the listening
+ * socket (see setClientListenersOptions()), so that a storm of connections
+ * does not cost four more system calls per client. */
+#ifdef HAVE_ACCEPT4
+#define ACCEPTED_SOCKET_NEEDS_OPTIONS 0
+#else
+#define ACCEPTED_SOCKET_NEEDS_OPTIONS 1
+#endif
+
 static void acceptCommonHandler(int fd, int flags, char *ip) {
     client *c;
-    if ((c = createClient(fd)) == NULL) {
+    if ((c = createClientGeneric(fd,ACCEPTED_SOCKET_NEEDS_OPTIONS)) == NULL) {
         serverLog(LL_WARNING,
             "Error registering fd event for the new client: %s (fd=%d)",
             strerror(errno),fd);
@@ -768,6 +897,14 @@ void unlinkClient(client *c) {
         c->flags &= ~CLIENT_PENDING_WRITE;
     }
 
+    /* Remove from the list of pending reads if needed. */
+    if (c->flags & CLIENT_PENDING_READ) {
+        ln = listSearchKey(server.clients_pending_read,c);
+        serverAssert(ln != NULL);
+        listDelNode(server.clients_pending_read,ln);
+        c->flags &= ~CLIENT_PENDING_READ;
+    }
+
     /* When client was just unblocked because of a blocking operation,
      * remove it from the list of unblocked clients. */
     if (c->flags & CLIENT_UNBLOCKED) {
@@ -825,6 +962,7 @@ void freeClient(client *c) {
 
     /* Free data structures. */
     listRelease(c->reply);
+    zfree(c->buf);
     freeClientArgv(c);
 
     /* Unlink the client: this will close the socket, remove the I/O
@@ -869,6 +1007,7 @@ void freeClient(client *c) {
     zfree(c->argv);
     freeClientMultiState(c);
     sdsfree(c->peerid);
+    freeScanIndexCursors(c);
     zfree(c);
 }
 
@@ -877,9 +1016,23 @@ void freeClient(client *c) {
  * a context where calling freeClient() is not possible, because the client
  * should be valid for the continuation of the flow of the program. */
 void freeClientAsync(client *c) {
+    /* We need to handle concurrent access to the server.clients_to_close list
+     * only in the freeClientAsync() function, since it's the only function that
+     * may access the list while Redis uses I/O threads. All the other accesses
+     * are in the context of the main thread while the other threads are
+     * idle. */
+    static pthread_mutex_t async_free_queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+
     if (c->flags & CLIENT_CLOSE_ASAP || c->flags & CLIENT_LUA) return;
     c->flags |= CLIENT_CLOSE_ASAP;
+    if (server.io_threads_num == 1) {
+        /* no need to bother with locking if there's just one thread (the main thread) */
+        listAddNodeTail(server.clients_to_close,c);
+        return;
+    }
+    pthread_mutex_lock(&async_free_queue_mutex);
     listAddNodeTail(server.clients_to_close,c);
+    pthread_mutex_unlock(&async_free_queue_mutex);
 }
 
 void freeClientsInAsyncFreeQueue(void) {
@@ -893,51 +1046,102 @@ void freeClientsInAsyncFreeQueue(void) {
     }
 }
 
+/* Gather the static reply buffer and as many nodes of the reply list as
+ * possible (up to IOV_MAX entries and NET_MAX_WRITES_PER_EVENT bytes) and
+ * send them with a single writev(2) call. Then consume what was written,
+ * advancing c->sentlen or releasing fully sent nodes.
+ *
+ * The number of bytes written (or -1 on error) is stored in *nwritten.
+ * C_ERR is returned if nothing was written or if the write was short, that
+ * is, the socket buffer is full and there is no point in trying again
+ * right now. Otherwise C_OK is returned. */
+static int _writevToClient(int fd, client *c, ssize_t *nwritten) {
+    struct iovec iov[IOV_MAX];
+    int iovcnt = 0;
+    size_t iov_bytes_len = 0;
+    listIter li;
+    listNode *ln;
+
+    /* Empty nodes at the head would make us gather nothing. */
+    while (listLength(c->reply) &&
+           sdslen(((robj*)listNodeValue(listFirst(c->reply)))->ptr) == 0)
+    {
+        listDelNode(c->reply,listFirst(c->reply));
+    }
+
+    if (c->bufpos > 0) {
+        iov[iovcnt].iov_base = c->buf+c->sentlen;
+        iov[iovcnt].iov_len = c->bufpos-c->sentlen;
+        iov_bytes_len += iov[iovcnt++].iov_len;
+    }
+
+    /* c->sentlen refers to the first reply node only when the static
+     * buffer is empty. */
+    size_t offset = c->bufpos > 0 ? 0 : c->sentlen;
+    listRewind(c->reply,&li);
+    while((ln = listNext(&li)) && iovcnt < IOV_MAX &&
+          iov_bytes_len < NET_MAX_WRITES_PER_EVENT)
+    {
+        sds o = ((robj*)listNodeValue(ln))->ptr;
+        size_t objlen = sdslen(o);
+
+        if (objlen == 0) continue;
+        iov[iovcnt].iov_base = o+offset;
+        iov[iovcnt].iov_len = objlen-offset;
+        iov_bytes_len += iov[iovcnt++].iov_len;
+        offset = 0;
+    }
+    if (iovcnt == 0) {
+        *nwritten = 0;
+        return C_ERR;
+    }
+
+    *nwritten = writev(fd,iov,iovcnt);
+    if (*nwritten <= 0) return C_ERR;
+
+    /* Consume the static buffer first, then the reply list nodes. */
+    size_t remaining = *nwritten;
+    if (c->bufpos > 0) {
+        size_t buflen = c->bufpos-c->sentlen;
+        if (remaining < buflen) {
+            c->sentlen += remaining;
+            return C_ERR;
+        }
+        c->bufpos = 0;
+        c->sentlen = 0;
+        remaining -= buflen;
+    }
+    while(remaining) {
+        ln = listFirst(c->reply);
+        sds o = ((robj*)listNodeValue(ln))->ptr;
+        size_t objlen = sdslen(o);
+
+        if (remaining < objlen-c->sentlen) {
+            c->sentlen += remaining;
+            break;
+        }
+        remaining -= objlen-c->sentlen;
+        listDelNode(c->reply,ln);
+        c->sentlen = 0;
+        c->reply_bytes -= objlen;
+        /* If there are no longer objects in the list, we expect
+         * the count of reply bytes to be exactly zero. */
+        if (listLength(c->reply) == 0)
+            serverAssert(c->reply_bytes == 0);
+    }
+    return ((size_t)*nwritten == iov_bytes_len) ? C_OK : C_ERR;
+}
+
 /* Write data in output buffers to client. Return C_OK if the client
  * is still valid after the call, C_ERR if it was freed. */
 int writeToClient(int fd, client *c, int handler_installed) {
     ssize_t nwritten = 0, totwritten = 0;
-    size_t objlen;
-    sds o;
 
     while(clientHasPendingReplies(c)) {
-        if (c->bufpos > 0) {
-            nwritten = write(fd,c->buf+c->sentlen,c->bufpos-c->sentlen);
-            if (nwritten <= 0) break;
-            c->sentlen += nwritten;
-            totwritten += nwritten;
-
-            /* If the buffer was sent, set bufpos to zero to continue with
-             * the remainder of the reply. */
-            if ((int)c->sentlen == c->bufpos) {
-                c->bufpos = 0;
-                c->sentlen = 0;
-            }
-        } else {
-            o = listNodeValue(listFirst(c->reply));
-            objlen = sdslen(o);
-
-            if (objlen == 0) {
-                listDelNode(c->reply,listFirst(c->reply));
-                continue;
-            }
+        int done = _writevToClient(fd,c,&nwritten) == C_ERR;
+        if (nwritten > 0) totwritten += nwritten;
+        if (done) break;
 
-            nwritten = write(fd, o + c->sentlen, objlen - c->sentlen);
-            if (nwritten <= 0) break;
-            c->sentlen += nwritten;
-            totwritten += nwritten;
-
-            /* If we fully sent the object on head go to the next one */
-            if (c->sentlen == objlen) {
-                listDelNode(c->reply,listFirst(c->reply));
-                c->sentlen = 0;
-                c->reply_bytes -= objlen;
-                /* If there are no longer objects in the list, we expect
-                 * the count of reply bytes to be exactly zero. */
-                if (listLength(c->reply) == 0)
-                    serverAssert(c->reply_bytes == 0);
-            }
-        }
         /* Note that we avoid to send more than NET_MAX_WRITES_PER_EVENT
          * bytes, in a single threaded server it's a good idea to serve
          * other clients as well, even if a very large request comes from
@@ -955,14 +1159,14 @@ int writeToClient(int fd, client *c, int handler_installed) {
              zmalloc_used_memory() < server.maxmemory) &&
             !(c->flags & CLIENT_SLAVE)) break;
     }
-    server.stat_net_output_bytes += totwritten;
+    atomicIncr(server.stat_net_output_bytes, totwritten);
     if (nwritten == -1) {
         if (errno == EAGAIN) {
             nwritten = 0;
         } else {
             serverLog(LL_VERBOSE,
                 "Error writing to client: %s", strerror(errno));
-            freeClient(c);
+            freeClientFromIOContext(c);
             return C_ERR;
         }
     }
@@ -979,7 +1183,7 @@ int writeToClient(int fd, client *c, int handler_installed) {
 
         /* Close connection after entire reply has been sent. */
         if (c->flags & CLIENT_CLOSE_AFTER_REPLY) {
-            freeClient(c);
+            freeClientFromIOContext(c);
             return C_ERR;
         }
     }
@@ -1308,16 +1512,108 @@ int processMultibulkBuffer(client *c) {
     return C_ERR;
 }
 
+/* Parse a "<prefix><number>\r\n" line starting at 'p', without going past
+ * 'end'. On success the number is stored in *ll and a pointer to the
+ * next line is returned, otherwise NULL is returned. */
+static char *scanProtocolLine(char *p, char *end, char prefix, long long *ll) {
+    char *newline;
+
+    if (p >= end || *p != prefix) return NULL;
+    newline = memchr(p,'\r',end-p);
+    if (newline == NULL || newline+1 >= end) return NULL;
+    if (!string2ll(p+1,newline-(p+1),ll)) return NULL;
+    return newline+2;
+}
+
+/* Scan the complete multi bulk command starting at 'p', without going past
+ * 'end', and return a pointer to what follows it, or NULL if the command is
+ * not complete. If 'keys' is not NULL, the keys of the command, as found
+ * using the first/last key and step of the command table, are appended to
+ * it as sds strings stored in 'keybuf', up to DICT_PREFETCH_MAX_KEYS keys
+ * in total. Commands that need a getkeys_proc are not handled. */
+static char *scanCommandKeys(char *p, char *end, void **keys,
+    char (*keybuf)[PROTO_PREFETCH_KEYLEN+16], int *numkeys)
+{
+    long long argc, len, i, first = 0, last = -1, step = 1;
+
+    if ((p = scanProtocolLine(p,end,'*',&argc)) == NULL || argc <= 0)
+        return NULL;
+    for (i = 0; i < argc; i++) {
+        if ((p = scanProtocolLine(p,end,'$',&len)) == NULL ||
+            len < 0 || end-p < len+2) return NULL;
+        if (keys == NULL) {
+            /* Just skip the argument. */
+        } else if (i == 0) {
+            struct redisCommand *cmd = lookupCommandByNameLen(p,len);
+
+            if (cmd && cmd->firstkey) {
+                first = cmd->firstkey;
+                last = cmd->lastkey < 0 ? argc+cmd->lastkey : cmd->lastkey;
+                step = cmd->keystep > 0 ? cmd->keystep : 1;
+            }
+        } else if (i >= first && i <= last && (i-first) % step == 0 &&
+                   len <= PROTO_PREFETCH_KEYLEN &&
+                   *numkeys < DICT_PREFETCH_MAX_KEYS)
+        {
+            keys[*numkeys] = sdsnewplaced(keybuf[*numkeys],p,len);
+            (*numkeys)++;
+        }
+        p += len+2;
+    }
+    return p;
+}
+
+/* Scan the complete multi bulk commands at the start of the query buffer
+ * of the client, up to PROTO_PREFETCH_CMDS, and prefetch the keyspace
+ * entries and values of their keys, so that when the commands are later
+ * executed one after the other, their lookups find everything in the CPU
+ * caches instead of stalling on a cache miss each. Only the query buffer
+ * is read: no argument objects are created.
+ *
+ * Returns the number of complete commands scanned, so that the caller
+ * can avoid scanning them again. */
+static int prefetchCommandsKeys(client *c) {
+    char keybuf[DICT_PREFETCH_MAX_KEYS][PROTO_PREFETCH_KEYLEN+16];
+    void *keys[DICT_PREFETCH_MAX_KEYS];
+    dictEntry *des[DICT_PREFETCH_MAX_KEYS];
+    char *p = c->querybuf, *end = c->querybuf+sdslen(c->querybuf);
+    int numcmds = 0, numkeys = 0, j;
+
+    /* Prefetching only pays off when there are more commands to overlap,
+     * so don't look up anything for a single command. */
+    if ((p = scanCommandKeys(p,end,NULL,NULL,NULL)) == NULL) return 0;
+    if (p == end) return 1;
+
+    p = c->querybuf;
+    while (numcmds < PROTO_PREFETCH_CMDS &&
+           (p = scanCommandKeys(p,end,keys,keybuf,&numkeys)) != NULL)
+    {
+        numcmds++;
+    }
+
+    if (numcmds > 1 && numkeys) {
+        dictPrefetch(c->db->dict,keys,numkeys,des);
+        for (j = 0; j < numkeys; j++)
+            if (des[j]) redis_prefetch(dictGetVal(des[j]));
+    }
+    return numcmds;
+}
+
 /* This function is called every time, in the client structure 'c', there is
  * more query buffer to process, because we read more data from the socket
  * or because a client was blocked and later reactivated, so there could be
- * pending query buffer, already representing a full command, to process. */
-void processInputBuffer(client *c) {
-    server.current_client = c;
+ * pending query buffer, already representing a full command, to process.
+ * Return C_ERR in case the client was freed while executing a command, and
+ * C_OK for all the other cases: the caller must not touch it after an error. */
+int processInputBuffer(client *c) {
+    int prefetched = 0; /* Commands already scanned by prefetchCommandsKeys() */
+
     /* Keep processing while there is something in the input buffer */
     while(sdslen(c->querybuf)) {
-        /* Return if clients are paused. */
-        if (!(c->flags & CLIENT_SLAVE) && clientsArePaused()) break;
+        /* Return if clients are paused. I/O threads never get clients while
+         * paused, and can't call clientsArePaused() that may unpause them. */
+        if (!(c->flags & (CLIENT_SLAVE|CLIENT_PENDING_READ)) &&
+            clientsArePaused()) break;
 
         /* Immediately abort if the client is in the middle of something. */
         if (c->flags & CLIENT_BLOCKED) break;
@@ -1338,9 +1634,19 @@ void processInputBuffer(client *c) {
             }
         }
 
+        /* Before parsing a new command from a pipeline, prefetch the keys
+         * of the next few ones. This reads the keyspace, so it is done only
+         * in the main thread. */
+        if (prefetched == 0 && c->reqtype == PROTO_REQ_MULTIBULK &&
+            c->multibulklen == 0 && !(c->flags & CLIENT_PENDING_READ))
+        {
+            prefetched = prefetchCommandsKeys(c);
+        }
+
         if (c->reqtype == PROTO_REQ_INLINE) {
             if (processInlineBuffer(c) != C_OK) break;
         } else if (c->reqtype == PROTO_REQ_MULTIBULK) {
+            if (prefetched) prefetched--;
             if (processMultibulkBuffer(c) != C_OK) break;
         } else {
             serverPanic("Unknown request type");
@@ -1350,27 +1656,79 @@ void processInputBuffer(client *c) {
         if (c->argc == 0) {
             resetClient(c);
         } else {
-            /* Only reset the client when the command was executed. */
-            if (processCommand(c) == C_OK) {
-                if (c->flags & CLIENT_MASTER && !(c->flags & CLIENT_MULTI)) {
-                    /* Update the applied replication offset of our master. */
-                    c->reploff = c->read_reploff - sdslen(c->querybuf);
-                }
+            /* If we are in the context of an I/O thread, we can't really
+             * execute the command here. All we can do is to flag the client
+             * as one that needs to process the command. */
+            if (c->flags & CLIENT_PENDING_READ) {
+                c->flags |= CLIENT_PENDING_COMMAND;
+                break;
+            }
 
-                /* Don't reset the client structure for clients blocked in a
-                 * module blocking command, so that the reply callback will
-                 * still be able to access the client argv and argc field.
-                 * The client will be reset in unblockClientFromModule(). */
-                if (!(c->flags & CLIENT_BLOCKED) || c->btype != BLOCKED_MODULE)
-                    resetClient(c);
+            /* We are finally ready to execute the command. */
+            if (processCommandAndResetClient(c) == C_ERR) {
+                /* If the client is no longer valid, we avoid exiting this
+                 * loop and trimming the client buffer later. So we return
+                 * ASAP in that case. */
+                return C_ERR;
             }
-            /* freeMemoryIfNeeded may flush slave output buffers. This may
-             * result into a slave, that may be the active client, to be
-             * freed. */
-            if (server.current_client == NULL) break;
         }
     }
+    return C_OK;
+}
+
+/* Perform processing of the client before moving on to processing the next
+ * client. This is useful for performing operations that affect the global
+ * state but can't wait until we're done with all clients. In other words
+ * can't wait until beforeSleep().
+ * Return C_ERR in case the client is no longer valid after executing the
+ * command, and C_OK for all the other cases. */
+int processCommandAndResetClient(client *c) {
+    int deadclient = 0;
+    server.current_client = c;
+    /* Only reset the client when the command was executed. */
+    if (processCommand(c) == C_OK) {
+        if (c->flags & CLIENT_MASTER && !(c->flags & CLIENT_MULTI)) {
+            /* Update the applied replication offset of our master. */
+            c->reploff = c->read_reploff - sdslen(c->querybuf);
+        }
+
+        /* Don't reset the client structure for clients blocked in a
+         * module blocking command, so that the reply callback will
+         * still be able to access the client argv and argc field.
+         * The client will be reset in unblockClientFromModule(). The
+         * same goes for clients waiting for a raft entry, that execute
+         * their command once it is committed, see raftUnblockClient(). */
+        if (!(c->flags & CLIENT_BLOCKED) ||
+            (c->btype != BLOCKED_MODULE && c->btype != BLOCKED_RAFT))
+            resetClient(c);
+    }
+    /* freeMemoryIfNeeded may flush slave output buffers. This may
+     * result into a slave, that may be the active client, to be
+     * freed. */
+    if (server.current_client == NULL) deadclient = 1;
     server.current_client = NULL;
+    return deadclient ? C_ERR : C_OK;
+}
+
+/* Most clients send commands that are read and processed entirely in a
+ * single readQueryFromClient() call, so instead of keeping a query buffer of
+ * PROTO_IOBUF_LEN bytes per client, the read is performed into the shared
+ * server.shared_querybuf, swapping it with the (empty) client buffer. Once
+ * the commands are processed, an empty query buffer bigger than the shared
+ * one is swapped back: this gives back the shared buffer, or replaces it with
+ * the buffer of a client that had to keep it for a partial command. A client
+ * left with a partial command simply keeps the buffer it read into.
+ *
+ * The shared buffer is only ever exchanged by the main thread: I/O threads
+ * read concurrently, so they never borrow it nor give a buffer back. */
+static void returnSharedQueryBuffer(client *c) {
+    sds qb = c->querybuf;
+
+    if (io_threads_op != IO_THREADS_OP_IDLE) return;
+    if (sdslen(qb) != 0 || sdsalloc(qb) <= sdsalloc(server.shared_querybuf))
+        return;
+    c->querybuf = server.shared_querybuf;
+    server.shared_querybuf = qb;
 }
 
 void readQueryFromClient(aeEventLoop *el, int fd, void *privdata, int mask) {
@@ -1380,6 +1738,10 @@ void readQueryFromClient(aeEventLoop *el, int fd, void *privdata, int mask) {
     UNUSED(el);
     UNUSED(mask);
 
+    /* Check if we want to read from the client later when exiting from
+     * the event loop. This is the case if threaded I/O is enabled. */
+    if (postponeClientRead(c)) return;
+
     readlen = PROTO_IOBUF_LEN;
     /* If this is a multi bulk request, and we are processing a bulk reply
      * that is large enough, try to maximize the probability that the query
@@ -1397,19 +1759,31 @@ void readQueryFromClient(aeEventLoop *el, int fd, void *privdata, int mask) {
 
     qblen = sdslen(c->querybuf);
     if (c->querybuf_peak < qblen) c->querybuf_peak = qblen;
+    /* Clients without pending input don't need a query buffer of their own:
+     * read into the shared one, see returnSharedQueryBuffer(). Reads done
+     * by the I/O threads always use the client buffer. */
+    if (qblen == 0 && io_threads_op == IO_THREADS_OP_IDLE &&
+        !(c->flags & CLIENT_MASTER) &&
+        sdsalloc(c->querybuf) < sdsalloc(server.shared_querybuf))
+    {
+        sds qb = c->querybuf;
+        c->querybuf = server.shared_querybuf;
+        server.shared_querybuf = qb;
+    }
     c->querybuf = sdsMakeRoomFor(c->querybuf, readlen);
     nread = read(fd, c->querybuf+qblen, readlen);
     if (nread == -1) {
         if (errno == EAGAIN) {
+            returnSharedQueryBuffer(c);
             return;
         } else {
             serverLog(LL_VERBOSE, "Reading from client: %s",strerror(errno));
-            freeClient(c);
+            freeClientFromIOContext(c);
             return;
         }
     } else if (nread == 0) {
         serverLog(LL_VERBOSE, "Client closed connection");
-        freeClient(c);
+        freeClientFromIOContext(c);
         return;
     } else if (c->flags & CLIENT_MASTER) {
         /* Append the query buffer to the pending (not applied) buffer
@@ -1422,7 +1796,7 @@ void readQueryFromClient(aeEventLoop *el, int fd, void *privdata, int mask) {
     sdsIncrLen(c->querybuf,nread);
     c->lastinteraction = server.unixtime;
     if (c->flags & CLIENT_MASTER) c->read_reploff += nread;
-    server.stat_net_input_bytes += nread;
+    atomicIncr(server.stat_net_input_bytes, nread);
     if (sdslen(c->querybuf) > server.client_max_querybuf_len) {
         sds ci = catClientInfoString(sdsempty(),c), bytes = sdsempty();
 
@@ -1430,7 +1804,7 @@ void readQueryFromClient(aeEventLoop *el, int fd, void *privdata, int mask) {
         serverLog(LL_WARNING,"Closing client that reached max query buffer length: %s (qbuf initial bytes: %s)", ci, bytes);
         sdsfree(ci);
         sdsfree(bytes);
-        freeClient(c);
+        freeClientFromIOContext(c);
         return;
     }
 
@@ -1441,10 +1815,10 @@ void readQueryFromClient(aeEventLoop *el, int fd, void *privdata, int mask) {
      * corresponding part of the replication stream, will be propagated to
      * the sub-slaves and to the replication backlog. */
     if (!(c->flags & CLIENT_MASTER)) {
-        processInputBuffer(c);
+        if (processInputBuffer(c) == C_OK) returnSharedQueryBuffer(c);
     } else {
         size_t prev_offset = c->reploff;
-        processInputBuffer(c);
+        if (processInputBuffer(c) == C_ERR) return;
         size_t applied = c->reploff - prev_offset;
         if (applied) {
             replicationFeedSlavesFromMasterStream(server.slaves,
@@ -2035,6 +2409,12 @@ int clientsArePaused(void) {
 int processEventsWhileBlocked(void) {
     int iterations = 4; /* See the function top-comment. */
     int count = 0;
+
+    /* Note: when we are processing events while blocked (for instance during
+     * busy Lua scripts or while loading), we set a global flag. When such
+     * flag is set, we avoid handling the read part of clients using threaded
+     * I/O, since beforeSleep() is not going to run. */
+    ProcessingEventsWhileBlocked = 1;
     while (iterations--) {
         int events = 0;
         events += aeProcessEvents(server.el, AE_FILE_EVENTS|AE_DONT_WAIT);
@@ -2042,5 +2422,351 @@ int processEventsWhileBlocked(void) {
         if (!events) break;
         count += events;
     }
+    ProcessingEventsWhileBlocked = 0;
+    return count;
+}
+
+/* ==========================================================================
+ * Threaded I/O
+ * ========================================================================== */
+
+/* State of every I/O thread. Slot 0 is the main thread, that takes its
+ * share of the clients while the other threads run. The 'mutex' is locked
+ * by the main thread to park a thread when threaded I/O is not active. */
+static struct ioThread {
+    pthread_t tid;
+    pthread_mutex_t mutex;
+    list *clients;              /* Clients to serve in the current phase. */
+    unsigned long pending;      /* Clients left, zero when the thread is done. */
+    pthread_mutex_t pending_mutex; /* Only used by the atomicvar.h fallback. */
+} io_threads[CONFIG_MAX_IO_THREADS];
+
+static inline unsigned long getIOPendingCount(int i) {
+    unsigned long count = 0;
+    atomicGetWithSync(io_threads[i].pending,count);
     return count;
 }
+
+static inline void setIOPendingCount(int i, unsigned long count) {
+    atomicSetWithSync(io_threads[i].pending,count);
+}
+
+/* While the I/O threads are running, clients may only be freed
+ * asynchronously: the main thread will take care of them later. */
+static void freeClientFromIOContext(client *c) {
+    if (io_threads_op != IO_THREADS_OP_IDLE)
+        freeClientAsync(c);
+    else
+        freeClient(c);
+}
+
+void *IOThreadMain(void *myid) {
+    /* The ID is the thread number (from 0 to server.io_threads_num-1), and is
+     * used by the thread to just manipulate a single sub-array of clients. */
+    long id = (unsigned long)myid;
+    sigset_t sigset;
+
+    /* Block SIGALRM so we are sure that only the main thread will
+     * receive the watchdog signal. */
+    sigemptyset(&sigset);
+    sigaddset(&sigset, SIGALRM);
+    if (pthread_sigmask(SIG_BLOCK, &sigset, NULL))
+        serverLog(LL_WARNING,
+            "Warning: can't mask SIGALRM in I/O thread: %s", strerror(errno));
+
+    while(1) {
+        /* Wait for start */
+        for (int j = 0; j < 1000000; j++) {
+            if (getIOPendingCount(id) != 0) break;
+        }
+
+        /* Give the main thread a chance to stop this thread. */
+        if (getIOPendingCount(id) == 0) {
+            pthread_mutex_lock(&io_threads[id].mutex);
+            pthread_mutex_unlock(&io_threads[id].mutex);
+            sched_yield(); /* Don't starve the main thread on few cores. */
+            continue;
+        }
+
+        /* Process: note that the main thread will never touch our list
+         * before we drop the pending count to 0. */
+        listIter li;
+        listNode *ln;
+        listRewind(io_threads[id].clients,&li);
+        while((ln = listNext(&li))) {
+            client *c = listNodeValue(ln);
+            if (io_threads_op == IO_THREADS_OP_WRITE) {
+                writeToClient(c->fd,c,0);
+            } else if (io_threads_op == IO_THREADS_OP_READ) {
+                readQueryFromClient(NULL,c->fd,c,AE_READABLE);
+            } else {
+                serverPanic("io_threads_op value is unknown");
+            }
+        }
+        listEmpty(io_threads[id].clients);
+        setIOPendingCount(id, 0);
+    }
+}
+
+/* Initialize the data structures needed for threaded I/O. */
+void initThreadedIO(void) {
+    pthread_attr_t attr;
+    size_t stacksize;
+
+    server.io_threads_active = 0; /* We start with threads not active. */
+
+    /* Don't spawn any thread if the user selected a single thread:
+     * we'll handle I/O directly from the main thread. */
+    if (server.io_threads_num == 1) return;
+
+    if (server.io_threads_num > CONFIG_MAX_IO_THREADS) {
+        serverLog(LL_WARNING,"Fatal: too many I/O threads configured. "
+                             "The maximum number is %d.", CONFIG_MAX_IO_THREADS);
+        exit(1);
+    }
+
+    /* Set the stack size as by default it may be small in some system */
+    pthread_attr_init(&attr);
+    pthread_attr_getstacksize(&attr,&stacksize);
+    if (!stacksize) stacksize = 1; /* The world is full of Solaris Fixes */
+    while (stacksize < REDIS_THREAD_STACK_SIZE) stacksize *= 2;
+    pthread_attr_setstacksize(&attr, stacksize);
+
+    io_threads_deferred_release = listCreate();
+    listSetFreeMethod(io_threads_deferred_release,decrRefCountVoid);
+
+    /* Spawn and initialize the I/O threads. */
+    for (int i = 0; i < server.io_threads_num; i++) {
+        /* Things we do for all the threads including the main thread. */
+        io_threads[i].clients = listCreate();
+        if (i == 0) continue; /* Thread 0 is the main thread. */
+
+        /* Things we do only for the additional threads. */
+        pthread_mutex_init(&io_threads[i].mutex,NULL);
+        pthread_mutex_init(&io_threads[i].pending_mutex,NULL);
+        setIOPendingCount(i, 0);
+        pthread_mutex_lock(&io_threads[i].mutex); /* Thread will be stopped. */
+        if (pthread_create(&io_threads[i].tid,&attr,IOThreadMain,
+                           (void*)(long)i) != 0)
+        {
+            serverLog(LL_WARNING,"Fatal: Can't initialize IO thread.");
+            exit(1);
+        }
+    }
+}
+
+void startThreadedIO(void) {
+    serverAssert(server.io_threads_active == 0);
+    for (int j = 1; j < server.io_threads_num; j++)
+        pthread_mutex_unlock(&io_threads[j].mutex);
+    server.io_threads_active = 1;
+}
+
+void stopThreadedIO(void) {
+    /* We may have still clients with pending reads when this function
+     * is called: handle them before stopping the threads. */
+    handleClientsWithPendingReadsUsingThreads();
+    serverAssert(server.io_threads_active == 1);
+    for (int j = 1; j < server.io_threads_num; j++)
+        pthread_mutex_lock(&io_threads[j].mutex);
+    server.io_threads_active = 0;
+}
+
+/* This function checks if there are not enough pending clients to justify
+ * taking the I/O threads active: in that case I/O threads are stopped if
+ * currently active. We track the pending writes as a measure of clients
+ * we need to handle in parallel, however the I/O threading is disabled
+ * globally for reads as well if we have too little pending clients.
+ *
+ * The function returns 0 if the I/O threading should be used because there
+ * are enough active threads, otherwise 1 is returned and the I/O threads
+ * could be possibly stopped (if already active) as a side effect. */
+int stopThreadedIOIfNeeded(void) {
+    int pending = listLength(server.clients_pending_write);
+
+    /* Return ASAP if I/O threads are disabled (single threaded mode). */
+    if (server.io_threads_num == 1) return 1;
+
+    if (pending < (server.io_threads_num*2)) {
+        if (server.io_threads_active) stopThreadedIO();
+        return 1;
+    } else {
+        return 0;
+    }
+}
+
+/* Run one I/O phase: the clients already distributed among the threads are
+ * served in parallel, the main thread handling its own share, and we return
+ * once every thread is done. */
+static void runIOThreadsPhase(int op) {
+    listIter li;
+    listNode *ln;
+
+    io_threads_op = op;
+    for (int j = 1; j < server.io_threads_num; j++) {
+        int count = listLength(io_threads[j].clients);
+        setIOPendingCount(j, count);
+    }
+
+    /* Also use the main thread to process a slice of clients. */
+    listRewind(io_threads[0].clients,&li);
+    while((ln = listNext(&li))) {
+        client *c = listNodeValue(ln);
+        if (op == IO_THREADS_OP_WRITE)
+            writeToClient(c->fd,c,0);
+        else
+            readQueryFromClient(NULL,c->fd,c,AE_READABLE);
+    }
+    listEmpty(io_threads[0].clients);
+
+    /* Wait for all the other threads to end their work. */
+    while(1) {
+        unsigned long pending = 0;
+        for (int j = 1; j < server.io_threads_num; j++)
+            pending += getIOPendingCount(j);
+        if (pending == 0) break;
+        sched_yield();
+    }
+    io_threads_op = IO_THREADS_OP_IDLE;
+    listEmpty(io_threads_deferred_release);
+}
+
+int handleClientsWithPendingWritesUsingThreads(void) {
+    int processed = listLength(server.clients_pending_write);
+    if (processed == 0) return 0; /* Return ASAP if there are no clients. */
+
+    /* If I/O threads are disabled or we have few clients to serve, don't
+     * use I/O threads, but the boring synchronous code. */
+    if (stopThreadedIOIfNeeded()) {
+        return handleClientsWithPendingWrites();
+    }
+
+    /* Start threads if needed. */
+    if (!server.io_threads_active) startThreadedIO();
+
+    /* Distribute the clients across N different lists. */
+    listIter li;
+    listNode *ln;
+    listRewind(server.clients_pending_write,&li);
+    int item_id = 0;
+    while((ln = listNext(&li))) {
+        client *c = listNodeValue(ln);
+        c->flags &= ~CLIENT_PENDING_WRITE;
+
+        /* Remove clients from the list of pending writes since
+         * they are going to be closed ASAP. */
+        if (c->flags & CLIENT_CLOSE_ASAP) {
+            listDelNode(server.clients_pending_write, ln);
+            continue;
+        }
+
+        int target_id = item_id % server.io_threads_num;
+        listAddNodeTail(io_threads[target_id].clients,c);
+        item_id++;
+    }
+
+    runIOThreadsPhase(IO_THREADS_OP_WRITE);
+
+    /* Run the list of clients again to install the write handler where
+     * needed. */
+    listRewind(server.clients_pending_write,&li);
+    while((ln = listNext(&li))) {
+        client *c = listNodeValue(ln);
+
+        /* Install the write handler if there are pending writes in some
+         * of the clients. */
+        if (clientHasPendingReplies(c) && !(c->flags & CLIENT_CLOSE_ASAP)) {
+            int ae_flags = AE_WRITABLE;
+            /* See handleClientsWithPendingWrites() about AE_BARRIER. */
+            if (server.aof_state == AOF_ON &&
+                server.aof_fsync == AOF_FSYNC_ALWAYS)
+            {
+                ae_flags |= AE_BARRIER;
+            }
+            if (aeCreateFileEvent(server.el, c->fd, ae_flags,
+                sendReplyToClient, c) == AE_ERR)
+            {
+                    freeClientAsync(c);
+            }
+        }
+    }
+    listEmpty(server.clients_pending_write);
+    return processed;
+}
+
+/* Return 1 if we want to handle the client read later using threaded I/O.
+ * This is called by the readable handler of the event loop.
+ * As a side effect of calling this function the client is put in the
+ * pending read clients and flagged as such. */
+int postponeClientRead(client *c) {
+    if (server.io_threads_active &&
+        server.io_threads_do_reads &&
+        !ProcessingEventsWhileBlocked &&
+        !clientsArePaused() &&
+        !(c->flags & (CLIENT_MASTER|CLIENT_SLAVE|CLIENT_PENDING_READ|
+                      CLIENT_BLOCKED)))
+    {
+        c->flags |= CLIENT_PENDING_READ;
+        listAddNodeHead(server.clients_pending_read,c);
+        return 1;
+    } else {
+        return 0;
+    }
+}
+
+/* When threaded I/O is also enabled for the reading + parsing side, the
+ * readable handler will just put normal clients into a queue of clients to
+ * process (instead of serving them synchronously). This function runs
+ * the queue using the I/O threads, and process them in order to accumulate
+ * the reads in the buffers, and also parse the first command available
+ * rendering it in the client structures. */
+int handleClientsWithPendingReadsUsingThreads(void) {
+    if (!server.io_threads_active || !server.io_threads_do_reads) return 0;
+    int processed = listLength(server.clients_pending_read);
+    if (processed == 0) return 0;
+
+    /* Distribute the clients across N different lists. */
+    listIter li;
+    listNode *ln;
+    listRewind(server.clients_pending_read,&li);
+    int item_id = 0;
+    while((ln = listNext(&li))) {
+        client *c = listNodeValue(ln);
+        int target_id = item_id % server.io_threads_num;
+        listAddNodeTail(io_threads[target_id].clients,c);
+        item_id++;
+    }
+
+    runIOThreadsPhase(IO_THREADS_OP_READ);
+
+    /* Run the list of clients again to process the new buffers. */
+    while(listLength(server.clients_pending_read)) {
+        ln = listFirst(server.clients_pending_read);
+        client *c = listNodeValue(ln);
+        c->flags &= ~CLIENT_PENDING_READ;
+        listDelNode(server.clients_pending_read,ln);
+
+        /* The client was closed by its I/O thread. */
+        if (c->flags & CLIENT_CLOSE_ASAP) continue;
+
+        if (c->flags & CLIENT_PENDING_COMMAND) {
+            c->flags &= ~CLIENT_PENDING_COMMAND;
+            if (processCommandAndResetClient(c) == C_ERR) {
+                /* If the client is no longer valid, we avoid
+                 * processing the client later. So we just go
+                 * to the next. */
+                continue;
+            }
+        }
+        if (processInputBuffer(c) == C_ERR) continue;
+
+        /* We may have pending replies if a thread readQueryFromClient()
+         * produced replies and did not install a write handler (it can't). */
+        if (!(c->flags & CLIENT_PENDING_WRITE) && clientHasPendingReplies(c))
+            clientInstallWriteHandler(c);
+    }
+
+    /* Clients the I/O threads had to close. */
+    freeClientsInAsyncFreeQueue();
+    return processed;
+}
@@ -77,6 +77,7 @@ raftNodeProgress* newRaftNodeProgress(uint8_t id, uint64_t inflights_size)
     node->ins = newInflights(inflights_size);
     node->pendingSnapshotIndex = 0;
     node->active = false;
+    node->isWitness = false;
     return node;
 }
 
@@ -172,16 +173,18 @@ bool maybeDecrTo(raftNodeProgress* node, uint64_t reject_index, uint64_t last_in
     return true;
 }
 
+/* A probed node gets one append at a time, a replicating one as many as
+ * the inflights window allows, and nothing while a snapshot is pending. */
 bool canSend(raftNodeProgress* node)
 {
     if(node->state == NodeStateProb)
     {
-        return node->paused;
+        return !node->paused;
     }else if (node->state == NodeStateReplicate)
     {
-        return isInflightsFull(node->ins);
+        return !isInflightsFull(node->ins);
     }
-    return true;
+    return false;
 }
 
 
@@ -40,6 +40,7 @@ typedef struct raftNodeProgress
     inflights* ins;
     uint64_t pendingSnapshotIndex;
     bool active;
+    bool isWitness;
 }raftNodeProgress;
 
 raftNodeProgress* newRaftNodeProgress(uint8_t id, uint64_t inflights_size);
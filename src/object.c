@@ -173,6 +173,8 @@ robj *dupStringObject(const robj *o) {
         d->encoding = OBJ_ENCODING_INT;
         d->ptr = o->ptr;
         return d;
+    case OBJ_ENCODING_ROARING:
+        return createRoaringObject(roaringDup(o->ptr));
     default:
         serverPanic("Wrong encoding.");
         break;
@@ -207,6 +209,12 @@ robj *createIntsetObject(void) {
     return o;
 }
 
+robj *createRoaringObject(roaring *r) {
+    robj *o = createObject(OBJ_STRING,r);
+    o->encoding = OBJ_ENCODING_ROARING;
+    return o;
+}
+
 robj *createHashObject(void) {
     unsigned char *zl = ziplistNew();
     robj *o = createObject(OBJ_HASH, zl);
@@ -242,6 +250,8 @@ robj *createModuleObject(moduleType *mt, void *value) {
 void freeStringObject(robj *o) {
     if (o->encoding == OBJ_ENCODING_RAW) {
         sdsfree(o->ptr);
+    } else if (o->encoding == OBJ_ENCODING_ROARING) {
+        roaringFree(o->ptr);
     }
 }
 
@@ -366,6 +376,8 @@ int isObjectRepresentableAsLongLong(robj *o, long long *llval) {
     if (o->encoding == OBJ_ENCODING_INT) {
         if (llval) *llval = (long) o->ptr;
         return C_OK;
+    } else if (o->encoding == OBJ_ENCODING_ROARING) {
+        return C_ERR;
     } else {
         return isSdsRepresentableAsLongLong(o->ptr,llval);
     }
@@ -465,6 +477,12 @@ robj *getDecodedObject(robj *o) {
         ll2string(buf,32,(long)o->ptr);
         dec = createStringObject(buf,strlen(buf));
         return dec;
+    } else if (o->type == OBJ_STRING && o->encoding == OBJ_ENCODING_ROARING) {
+        roaring *r = o->ptr;
+        sds s = sdsnewlen(NULL,r->len);
+
+        roaringGetBytes(r,0,(unsigned char*)s,r->len);
+        return createObject(OBJ_STRING,s);
     } else {
         serverPanic("Unknown encoding type");
     }
@@ -487,6 +505,18 @@ int compareStringObjectsWithFlags(robj *a, robj *b, int flags) {
     size_t alen, blen, minlen;
 
     if (a == b) return 0;
+    if (a->encoding == OBJ_ENCODING_ROARING ||
+        b->encoding == OBJ_ENCODING_ROARING)
+    {
+        int cmp;
+
+        a = getDecodedObject(a);
+        b = getDecodedObject(b);
+        cmp = compareStringObjectsWithFlags(a,b,flags);
+        decrRefCount(a);
+        decrRefCount(b);
+        return cmp;
+    }
     if (sdsEncodedObject(a)) {
         astr = a->ptr;
         alen = sdslen(astr);
@@ -542,6 +572,8 @@ size_t stringObjectLen(robj *o) {
     serverAssertWithInfo(NULL,o,o->type == OBJ_STRING);
     if (sdsEncodedObject(o)) {
         return sdslen(o->ptr);
+    } else if (o->encoding == OBJ_ENCODING_ROARING) {
+        return ((roaring*)o->ptr)->len;
     } else {
         return sdigits10((long)o->ptr);
     }
@@ -567,6 +599,9 @@ int getDoubleFromObject(const robj *o, double *target) {
                 return C_ERR;
         } else if (o->encoding == OBJ_ENCODING_INT) {
             value = (long)o->ptr;
+        } else if (o->encoding == OBJ_ENCODING_ROARING) {
+            /* Sparse bitmaps contain zero bytes: never a valid number. */
+            return C_ERR;
         } else {
             serverPanic("Unknown string encoding");
         }
@@ -609,6 +644,9 @@ int getLongDoubleFromObject(robj *o, long double *target) {
                 return C_ERR;
         } else if (o->encoding == OBJ_ENCODING_INT) {
             value = (long)o->ptr;
+        } else if (o->encoding == OBJ_ENCODING_ROARING) {
+            /* Sparse bitmaps contain zero bytes: never a valid number. */
+            return C_ERR;
         } else {
             serverPanic("Unknown string encoding");
         }
@@ -642,6 +680,9 @@ int getLongLongFromObject(robj *o, long long *target) {
             if (string2ll(o->ptr,sdslen(o->ptr),&value) == 0) return C_ERR;
         } else if (o->encoding == OBJ_ENCODING_INT) {
             value = (long)o->ptr;
+        } else if (o->encoding == OBJ_ENCODING_ROARING) {
+            /* Sparse bitmaps contain zero bytes: never a valid number. */
+            return C_ERR;
         } else {
             serverPanic("Unknown string encoding");
         }
@@ -690,6 +731,7 @@ char *strEncoding(int encoding) {
     case OBJ_ENCODING_INTSET: return "intset";
     case OBJ_ENCODING_SKIPLIST: return "skiplist";
     case OBJ_ENCODING_EMBSTR: return "embstr";
+    case OBJ_ENCODING_ROARING: return "roaring";
     default: return "unknown";
     }
 }
@@ -715,6 +757,8 @@ size_t objectComputeSize(robj *o, size_t sample_size) {
             asize = sdsAllocSize(o->ptr)+sizeof(*o);
         } else if(o->encoding == OBJ_ENCODING_EMBSTR) {
             asize = sdslen(o->ptr)+2+sizeof(*o);
+        } else if(o->encoding == OBJ_ENCODING_ROARING) {
+            asize = roaringBytes(o->ptr)+sizeof(*o);
         } else {
             serverPanic("Unknown string encoding");
         }
@@ -737,7 +781,7 @@ size_t objectComputeSize(robj *o, size_t sample_size) {
         if (o->encoding == OBJ_ENCODING_HT) {
             d = o->ptr;
             di = dictGetIterator(d);
-            asize = sizeof(*o)+sizeof(dict)+(sizeof(struct dictEntry*)*dictSlots(d));
+            asize = sizeof(*o)+sizeof(dict)+(dictBucketSize()*dictSlots(d));
             while((de = dictNext(di)) != NULL && samples < sample_size) {
                 ele = dictGetKey(de);
                 elesize += sizeof(struct dictEntry) + sdsAllocSize(ele);
@@ -758,7 +802,7 @@ size_t objectComputeSize(robj *o, size_t sample_size) {
             d = ((zset*)o->ptr)->dict;
             zskiplist *zsl = ((zset*)o->ptr)->zsl;
             zskiplistNode *znode = zsl->header->level[0].forward;
-            asize = sizeof(*o)+sizeof(zset)+(sizeof(struct dictEntry*)*dictSlots(d));
+            asize = sizeof(*o)+sizeof(zset)+(dictBucketSize()*dictSlots(d));
             while(znode != NULL && samples < sample_size) {
                 elesize += sdsAllocSize(znode->ele);
                 elesize += sizeof(struct dictEntry) + zmalloc_size(znode);
@@ -775,7 +819,7 @@ size_t objectComputeSize(robj *o, size_t sample_size) {
         } else if (o->encoding == OBJ_ENCODING_HT) {
             d = o->ptr;
             di = dictGetIterator(d);
-            asize = sizeof(*o)+sizeof(dict)+(sizeof(struct dictEntry*)*dictSlots(d));
+            asize = sizeof(*o)+sizeof(dict)+(dictBucketSize()*dictSlots(d));
             while((de = dictNext(di)) != NULL && samples < sample_size) {
                 ele = dictGetKey(de);
                 ele2 = dictGetVal(de);
@@ -841,6 +885,7 @@ struct redisMemOverhead *getMemoryOverheadData(void) {
             client *c = listNodeValue(ln);
             mem += getClientOutputBufferMemoryUsage(c);
             mem += sdsAllocSize(c->querybuf);
+            mem += c->buf_usable_size;
             mem += sizeof(client);
         }
     }
@@ -859,6 +904,7 @@ struct redisMemOverhead *getMemoryOverheadData(void) {
                 continue;
             mem += getClientOutputBufferMemoryUsage(c);
             mem += sdsAllocSize(c->querybuf);
+            mem += c->buf_usable_size;
             mem += sizeof(client);
         }
     }
@@ -883,13 +929,13 @@ struct redisMemOverhead *getMemoryOverheadData(void) {
         mh->db[mh->num_dbs].dbid = j;
 
         mem = dictSize(db->dict) * sizeof(dictEntry) +
-              dictSlots(db->dict) * sizeof(dictEntry*) +
+              dictSlots(db->dict) * dictBucketSize() +
               dictSize(db->dict) * sizeof(robj);
         mh->db[mh->num_dbs].overhead_ht_main = mem;
         mem_total+=mem;
 
         mem = dictSize(db->expires) * sizeof(dictEntry) +
-              dictSlots(db->expires) * sizeof(dictEntry*);
+              dictSlots(db->expires) * dictBucketSize();
         mh->db[mh->num_dbs].overhead_ht_expires = mem;
         mem_total+=mem;
 
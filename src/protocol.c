@@ -56,13 +56,24 @@ raftEntry* dupRaftEntry(const raftEntry* entry)
     }
     raftEntry* new_entry = createRaftEntry();
     sdsfree(new_entry->data);
-    new_entry->data = sdsdup(new_entry->data);
-    new_entry->term = new_entry->term;
-    new_entry->index = new_entry->index;
-    new_entry->entryType = new_entry->entryType;
+    new_entry->data = sdsdup(entry->data);
+    new_entry->term = entry->term;
+    new_entry->index = entry->index;
+    new_entry->entryType = entry->entryType;
     return new_entry;
 }
 
+/* Entries are shared by the messages, the unstable log and the storage: a
+ * list of entries holds one reference to each of them, listDup() takes new
+ * references and releasing the list drops them. */
+list* createRaftEntryList()
+{
+    list* entries = listCreate();
+    listSetDupMethod(entries, (void* (*)(void*))copyRaftEntry);
+    listSetFreeMethod(entries, (void (*)(void*))decRaftEntryRefCnt);
+    return entries;
+}
+
 snapshotMetaData* createSnapshotMetaData()
 {
     snapshotMetaData* ssmd = zmalloc(sizeof(snapshotMetaData));
@@ -137,13 +148,11 @@ raftMessage* createRaftMessage()
     msg->index = 0;
     msg->logTerm = 0;
     msg->commited = 0;
-    msg->entries = listCreate();
+    msg->entries = createRaftEntryList();
     msg->ss = createSnapShot();
     msg->reject = false;
     msg->lastMatchIndex = 0;
     msg->context = sdsempty();
-    listSetDupMethod(msg->entries, (void* (*)(void*))dupRaftEntry);
-    listSetFreeMethod(msg->entries, (void (*)(void*))freeRaftEntry);
     return msg;
 }
 
@@ -178,8 +187,6 @@ raftMessage* dupRaftMessage(const raftMessage* msg)
     new_msg->reject = msg->reject;
     new_msg->lastMatchIndex = msg->lastMatchIndex;
     new_msg->context = sdsdup(msg->context);
-    listSetDupMethod(new_msg->entries, (void* (*)(void*))dupRaftEntry);
-    listSetFreeMethod(new_msg->entries, (void (*)(void*))freeRaftEntry);
     return new_msg;
 }
 
@@ -189,6 +196,7 @@ confState* createConfState()
     confState* cs = zmalloc(sizeof(confState));
     cs->peers = listCreate();
     cs->learners = listCreate();
+    cs->witnesses = listCreate();
     return cs;
 }
 
@@ -197,6 +205,7 @@ confState* dupConfState(const confState* cs)
     confState* new_cs = zmalloc(sizeof(confState));
     new_cs->peers = listDup(cs->peers);
     new_cs->learners = listDup(cs->learners);
+    new_cs->witnesses = listDup(cs->witnesses);
     return new_cs;
 }
 
@@ -204,5 +213,6 @@ void freeConfState(confState* cs)
 {
     listRelease(cs->peers);
     listRelease(cs->learners);
+    listRelease(cs->witnesses);
     zfree(cs);
 }
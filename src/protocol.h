@@ -42,6 +42,7 @@ typedef struct confState
 {
     list* peers;
     list* learners;    
+    list* witnesses;
 }confState;
 
 typedef struct snapshotMetaData
@@ -111,6 +112,8 @@ raftEntry* copyRaftEntry(raftEntry* entry);
 
 raftEntry* dupRaftEntry(const raftEntry* entry);
 
+list* createRaftEntryList();
+
 snapshotMetaData* createSnapshotMetaData();
 
 void freeSnapshotMetaData(snapshotMetaData* ssmd);
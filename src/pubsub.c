@@ -37,6 +37,7 @@ void freePubsubPattern(void *p) {
     pubsubPattern *pat = p;
 
     decrRefCount(pat->pattern);
+    stringmatchFree(pat->compiled);
     zfree(pat);
 }
 
@@ -47,6 +48,53 @@ int listMatchPubsubPattern(void *a, void *b) {
            (equalStringObjects(pa->pattern,pb->pattern));
 }
 
+/* Patterns are indexed in server.pubsub_patterns by their literal prefix,
+ * that is, the part before the first glob special char: every key of the
+ * radix tree maps to the list of pubsubPattern sharing that prefix. This
+ * way PUBLISH only needs to match the patterns whose literal prefix is a
+ * prefix of the channel name. */
+size_t pubsubPatternPrefixLen(sds pattern) {
+    return stringmatchprefixlen(pattern,sdslen(pattern));
+}
+
+/* Add the pattern to the index. */
+void pubsubIndexPattern(pubsubPattern *pat) {
+    unsigned char *prefix = (unsigned char*)pat->pattern->ptr;
+    size_t len = pubsubPatternPrefixLen(pat->pattern->ptr);
+    list *l = raxFind(server.pubsub_patterns,prefix,len);
+
+    if (l == raxNotFound) {
+        l = listCreate();
+        listSetFreeMethod(l,freePubsubPattern);
+        listSetMatchMethod(l,listMatchPubsubPattern);
+        raxInsert(server.pubsub_patterns,prefix,len,l,NULL);
+    }
+    listAddNodeTail(l,pat);
+    server.pubsub_patterns_count++;
+}
+
+/* Remove from the index, and free, the pubsubPattern of the client 'c' for
+ * the given pattern, that must be an sds encoded object. */
+void pubsubUnindexPattern(client *c, robj *pattern) {
+    unsigned char *prefix = (unsigned char*)pattern->ptr;
+    size_t len = pubsubPatternPrefixLen(pattern->ptr);
+    list *l = raxFind(server.pubsub_patterns,prefix,len);
+    pubsubPattern pat;
+    listNode *ln;
+
+    serverAssert(l != raxNotFound);
+    pat.client = c;
+    pat.pattern = pattern;
+    ln = listSearchKey(l,&pat);
+    serverAssert(ln != NULL);
+    listDelNode(l,ln);
+    server.pubsub_patterns_count--;
+    if (listLength(l) == 0) {
+        raxRemove(server.pubsub_patterns,prefix,len,NULL);
+        listRelease(l);
+    }
+}
+
 /* Return the number of channels + patterns a client is subscribed to. */
 int clientSubscriptionsCount(client *c) {
     return dictSize(c->pubsub_channels)+
@@ -134,8 +182,10 @@ int pubsubSubscribePattern(client *c, robj *pattern) {
         incrRefCount(pattern);
         pat = zmalloc(sizeof(*pat));
         pat->pattern = getDecodedObject(pattern);
+        pat->compiled = stringmatchCompile(pat->pattern->ptr,
+                                           sdslen(pat->pattern->ptr),0);
         pat->client = c;
-        listAddNodeTail(server.pubsub_patterns,pat);
+        pubsubIndexPattern(pat);
     }
     /* Notify the client */
     addReply(c,shared.mbulkhdr[3]);
@@ -149,17 +199,16 @@ int pubsubSubscribePattern(client *c, robj *pattern) {
  * 0 if the client was not subscribed to the specified channel. */
 int pubsubUnsubscribePattern(client *c, robj *pattern, int notify) {
     listNode *ln;
-    pubsubPattern pat;
     int retval = 0;
 
     incrRefCount(pattern); /* Protect the object. May be the same we remove */
     if ((ln = listSearchKey(c->pubsub_patterns,pattern)) != NULL) {
+        robj *decoded = getDecodedObject(pattern);
+
         retval = 1;
         listDelNode(c->pubsub_patterns,ln);
-        pat.client = c;
-        pat.pattern = pattern;
-        ln = listSearchKey(server.pubsub_patterns,&pat);
-        listDelNode(server.pubsub_patterns,ln);
+        pubsubUnindexPattern(c,decoded);
+        decrRefCount(decoded);
     }
     /* Notify the client */
     if (notify) {
@@ -221,12 +270,61 @@ int pubsubUnsubscribeAllPatterns(client *c, int notify) {
     return count;
 }
 
+/* Return the channel and the message encoded as two bulk strings: this is
+ * the tail of both the "message" and "pmessage" replies, so it is formatted
+ * just once and shared by all the receivers, see addReplyProtoShared(). */
+robj *pubsubEncodeMessage(robj *channel, robj *message) {
+    robj *ch = getDecodedObject(channel), *msg = getDecodedObject(message);
+    size_t chlen = sdslen(ch->ptr), msglen = sdslen(msg->ptr);
+    sds s = sdsMakeRoomFor(sdsempty(),chlen+msglen+48);
+
+    s = sdscatfmt(s,"$%U\r\n",(unsigned long long)chlen);
+    s = sdscatlen(s,ch->ptr,chlen);
+    s = sdscatfmt(s,"\r\n$%U\r\n",(unsigned long long)msglen);
+    s = sdscatlen(s,msg->ptr,msglen);
+    s = sdscatlen(s,"\r\n",2);
+    decrRefCount(ch);
+    decrRefCount(msg);
+    return createObject(OBJ_STRING,s);
+}
+
+/* State of the pattern matching of pubsubPublishMessage(). */
+typedef struct pubsubPatternMatch {
+    robj *channel;      /* Channel name, sds encoded. */
+    robj *message;
+    robj *proto;        /* Shared reply tail, encoded on first use. */
+    int receivers;
+} pubsubPatternMatch;
+
+/* raxFindPrefixes() callback: send the message to the clients of the
+ * patterns in the list 'l' that match the channel. */
+static void pubsubPublishToPatterns(void *l, void *privdata) {
+    pubsubPatternMatch *pm = privdata;
+    sds channel = pm->channel->ptr;
+    listNode *ln;
+    listIter li;
+
+    listRewind(l,&li);
+    while ((ln = listNext(&li)) != NULL) {
+        pubsubPattern *pat = ln->value;
+
+        if (stringmatchCompiled(pat->compiled,channel,sdslen(channel))) {
+            if (pm->proto == NULL)
+                pm->proto = pubsubEncodeMessage(pm->channel,pm->message);
+            addReply(pat->client,shared.mbulkhdr[4]);
+            addReply(pat->client,shared.pmessagebulk);
+            addReplyBulk(pat->client,pat->pattern);
+            addReplyProtoShared(pat->client,pm->proto);
+            pm->receivers++;
+        }
+    }
+}
+
 /* Publish a message */
 int pubsubPublishMessage(robj *channel, robj *message) {
     int receivers = 0;
+    robj *proto = NULL;
     dictEntry *de;
-    listNode *ln;
-    listIter li;
 
     /* Send to clients listening for that channel */
     de = dictFind(server.pubsub_channels,channel);
@@ -235,38 +333,34 @@ int pubsubPublishMessage(robj *channel, robj *message) {
         listNode *ln;
         listIter li;
 
+        proto = pubsubEncodeMessage(channel,message);
         listRewind(list,&li);
         while ((ln = listNext(&li)) != NULL) {
             client *c = ln->value;
 
             addReply(c,shared.mbulkhdr[3]);
             addReply(c,shared.messagebulk);
-            addReplyBulk(c,channel);
-            addReplyBulk(c,message);
+            addReplyProtoShared(c,proto);
             receivers++;
         }
     }
-    /* Send to clients listening to matching channels */
-    if (listLength(server.pubsub_patterns)) {
-        listRewind(server.pubsub_patterns,&li);
-        channel = getDecodedObject(channel);
-        while ((ln = listNext(&li)) != NULL) {
-            pubsubPattern *pat = ln->value;
-
-            if (stringmatchlen((char*)pat->pattern->ptr,
-                                sdslen(pat->pattern->ptr),
-                                (char*)channel->ptr,
-                                sdslen(channel->ptr),0)) {
-                addReply(pat->client,shared.mbulkhdr[4]);
-                addReply(pat->client,shared.pmessagebulk);
-                addReplyBulk(pat->client,pat->pattern);
-                addReplyBulk(pat->client,channel);
-                addReplyBulk(pat->client,message);
-                receivers++;
-            }
-        }
-        decrRefCount(channel);
+    /* Send to clients listening to matching channels: only the patterns
+     * indexed by a prefix of the channel name can match, and they are
+     * all found descending the index once along the channel name. */
+    if (server.pubsub_patterns_count) {
+        pubsubPatternMatch pm;
+
+        pm.channel = getDecodedObject(channel);
+        pm.message = message;
+        pm.proto = proto;
+        pm.receivers = 0;
+        raxFindPrefixes(server.pubsub_patterns,(unsigned char*)pm.channel->ptr,
+                        sdslen(pm.channel->ptr),pubsubPublishToPatterns,&pm);
+        decrRefCount(pm.channel);
+        proto = pm.proto;
+        receivers += pm.receivers;
     }
+    if (proto) decrRefCount(proto);
     return receivers;
 }
 
@@ -330,6 +424,8 @@ void pubsubCommand(client *c) {
     {
         /* PUBSUB CHANNELS [<pattern>] */
         sds pat = (c->argc == 2) ? NULL : c->argv[2]->ptr;
+        stringmatchPattern *compiled =
+            pat ? stringmatchCompile(pat,sdslen(pat),0) : NULL;
         dictIterator *di = dictGetIterator(server.pubsub_channels);
         dictEntry *de;
         long mblen = 0;
@@ -340,14 +436,14 @@ void pubsubCommand(client *c) {
             robj *cobj = dictGetKey(de);
             sds channel = cobj->ptr;
 
-            if (!pat || stringmatchlen(pat, sdslen(pat),
-                                       channel, sdslen(channel),0))
+            if (!pat || stringmatchCompiled(compiled,channel,sdslen(channel)))
             {
                 addReplyBulk(c,cobj);
                 mblen++;
             }
         }
         dictReleaseIterator(di);
+        stringmatchFree(compiled);
         setDeferredMultiBulkLength(c,replylen,mblen);
     } else if (!strcasecmp(c->argv[1]->ptr,"numsub") && c->argc >= 2) {
         /* PUBSUB NUMSUB [Channel_1 ... Channel_N] */
@@ -362,7 +458,7 @@ void pubsubCommand(client *c) {
         }
     } else if (!strcasecmp(c->argv[1]->ptr,"numpat") && c->argc == 2) {
         /* PUBSUB NUMPAT */
-        addReplyLongLong(c,listLength(server.pubsub_patterns));
+        addReplyLongLong(c,server.pubsub_patterns_count);
     } else {
         addReplyErrorFormat(c,
             "Unknown PUBSUB subcommand or wrong number of arguments for '%s'",
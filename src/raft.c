@@ -9,54 +9,29 @@ bool matchVoteInfo(voteInfo* a, voteInfo* b)
     return a->id == b->id;
 }
 
-unsigned int dictKeyHash(const void *keyp) {
-    unsigned long key = (unsigned long)keyp;
-    key = dictGenHashFunction(&key,sizeof(key));
-    key += ~(key << 15);
-    key ^=  (key >> 10);
-    key +=  (key << 3);
-    key ^=  (key >> 6);
-    key += ~(key << 11);
-    key ^=  (key >> 16);
-    return key;
-}
-
-int dictKeyCompare(void *privdata, const void *key1, const void *key2) {
-    unsigned long k1 = (unsigned long)key1;
-    unsigned long k2 = (unsigned long)key2;
-    return k1 == k2;
-}
-
-dictType intKeydictType = {
-    dictKeyHash,                   /* hash function */
-    NULL,                          /* key dup */
-    NULL,                          /* val dup */
-    dictKeyCompare,                /* key compare */
-    NULL,                          /* key destructor */
-    NULL                           /* val destructor */
-};
-
 raft* newRaft(raftConfig* cfg)
 {
     raftLog* log = newRaftLog(cfg->storage);
     hardState hs = getHardState(cfg->storage);
     confState *cs = getConfState(cfg->storage);
     list* peers = cfg->peers;
+    list* witnesses = cfg->witnesses;
+    if(listLength(cs->witnesses) > 0)
+    {
+        witnesses = cs->witnesses;
+    }
+    /* After a snapshot the storage knows the configuration better than
+     * the caller. */
     if(listLength(cs->peers) > 0)
     {
-        if(listLength(peers) > 0)
-        {
-            assert(false);
-        }
         peers = cs->peers;
     }
-    raft* r = zmalloc(sizeof(raft));
+    raft* r = zcalloc(sizeof(raft));
     r->id = cfg->id;
+    r->raftlog = log;
     r->leader = 0;
     r->maxSizePerMsg = cfg->maxSizePerMsg;
     r->maxInflightMsgs = cfg->maxInflightMsgs;
-    r->peers = dictCreate(&intKeydictType, NULL);
-    r->votes = dictCreate(&intKeydictType, NULL);
     //listSetFreeMethod(free); todo
     r->electionTimeout = cfg->electionTick;
     r->heartbeatTimeout = cfg->heartbeatTick;
@@ -67,15 +42,31 @@ raft* newRaft(raftConfig* cfg)
     r->readStates = listCreate();
     listSetFreeMethod(r->readStates, freeReadState);
     listSetDupMethod(r->readStates, dupReadState);
-    listIter li;  
-    listRewind(cfg->peers,&li);
+    r->pendingProps = createRaftEntryList();
+    listIter li;
+    listRewind(peers,&li);
     uint8_t peer;
     listNode* ln;
     while ((ln = listNext(&li)) != NULL) {
-        peer = (uint8_t)ln->value;
+        peer = (uint8_t)(unsigned long)ln->value;
         raftNodeProgress* pr = newRaftNodeProgress(peer, r->maxInflightMsgs);
         pr->next = 1;
-        dictAdd(r->peers, peer, pr);
+        addProgress(r, pr);
+    }
+    r->isWitness = false;
+    if(witnesses != NULL)
+    {
+        restoreWitnesses(r, witnesses);
+    }
+    freeConfState(cs);
+
+    /* Pick up the state persisted before a restart. */
+    r->term = hs.term;
+    r->voteFor = hs.voteFor;
+    commitTo(log, hs.commited);
+    if(cfg->applied > 0)
+    {
+        log->applied = cfg->applied;
     }
 
     becomeFollower(r, r->term, 0);
@@ -83,6 +74,17 @@ raft* newRaft(raftConfig* cfg)
 
 }
 
+/* Release a raft created by newRaft(). The storage is not owned by it. */
+void freeRaft(raft* r)
+{
+    freeRaftLog(r->raftlog);
+    clearProgress(r);
+    listRelease(r->msgs);
+    listRelease(r->readStates);
+    listRelease(r->pendingProps);
+    zfree(r);
+}
+
 void resetRaftTerm(raft* r, uint64_t term)
 {
     if(r->term != term)
@@ -94,18 +96,20 @@ void resetRaftTerm(raft* r, uint64_t term)
     r->electionElapsed = 0;
     r->heartbeatElapsed = 0;
     r->electionRandomTimeout = r->electionTimeout+ redisLrand48() % r->electionTimeout;
-    dictEmpty(r->votes, NULL);
-    dictIterator* it = dictGetIterator(r->peers);
-    raftNodeProgress* progress;
-    dictEntry* e = dictNext(it);
-    while (e != NULL) {
-        progress = dictGetVal(e);
+    memset(r->votes, VoteNone, sizeof(r->votes));
+    r->numVotes = 0;
+    r->numGranted = 0;
+    for(int i = 0; i < r->numPeers; i++)
+    {
+        raftNodeProgress* progress = r->prs[r->peerIds[i]];
         resetRaftNodeProgress(progress, NodeStateProb);
         progress->next = lastIndex(r->raftlog) + 1;
-        if (dictGetKey(e) == r->id) {
-            return progress->match = lastIndex(r->raftlog);
+        progress->match = 0;
+        progress->active = false;
+        if(progress->id == r->id)
+        {
+            progress->match = lastIndex(r->raftlog);
         }
-        e = dictNext(it);
     }    
 }
 
@@ -122,7 +126,7 @@ void becomeFollower(raft* r, uint64_t term, uint64_t leader)
 void becomeCandidate(raft* r)
 {
     assert(r->state != NodeStateLeader);
-    r->step = stepLeader;
+    r->step = stepCandidate;
     resetRaftTerm(r, r->term + 1);
     r->tick = tickElection;
     r->voteFor = r->id;
@@ -134,25 +138,42 @@ void becomeLeader(raft* r)
     assert(r->state != NodeStateFollower);
     r->step = stepLeader;
     resetRaftTerm(r, r->term);
-    r->tick = r->heartbeatTimeout;
+    r->tick = tickHeartbeat;
     r->leader = r->id;
     r->state = NodeStateLeader;
+    /* Entries of the previous terms only count as committed once an entry
+     * of our term is: append an empty one right away. */
     raftEntry* entry = createRaftEntry();
     appendEntry(r, entry);
+    decRaftEntryRefCnt(entry);
 }
 
 
 raftNodeProgress* getProgress(raft* r, uint8_t id)
 {
-    dictIterator* it = dictGetIterator(r->peers);
-    dictEntry* e = dictNext(it);
-    while (e != NULL) {
-        if (dictGetKey(e) == id) {
-            return dictGetVal(e);
-        }
-        e = dictNext(it);
+    return r->prs[id];
+}
+
+void addProgress(raft* r, raftNodeProgress* pr)
+{
+    if(r->prs[pr->id] != NULL)
+    {
+        freeRaftNodeProgress(r->prs[pr->id]);
+    }else
+    {
+        r->peerIds[r->numPeers++] = pr->id;
     }   
-    return NULL;
+    r->prs[pr->id] = pr;
+}
+
+void clearProgress(raft* r)
+{
+    for(int i = 0; i < r->numPeers; i++)
+    {
+        freeRaftNodeProgress(r->prs[r->peerIds[i]]);
+        r->prs[r->peerIds[i]] = NULL;
+    }
+    r->numPeers = 0;
 }
 
 
@@ -188,6 +209,7 @@ void stepLeader(struct raft* r, raftMessage* msg)
                     }
                     r->pendingConf = true;
                 }               
+                n = listNextNode(n);
             }
             appendEntries(r, msg->entries);
             broadCastAppend(r);
@@ -195,7 +217,7 @@ void stepLeader(struct raft* r, raftMessage* msg)
         case MessageReadIndex:
             if(quorum(r) > 1)
             {
-                TermResult res = termOf(r, r->raftlog->commited);
+                TermResult res = termOf(r->raftlog, r->raftlog->commited);
                 uint64_t t = zeroTermOnErrCompacted(res.term, res.err);
                 if(t != r->term)
                 {
@@ -206,6 +228,7 @@ void stepLeader(struct raft* r, raftMessage* msg)
                     ReadState *rs = createReadState();
                     rs->index = r->raftlog->commited;
                     raftEntry* ent = listFirst(msg->entries)->value;
+                    sdsfree(rs->requestCtx);
                     rs->requestCtx = sdsdup(ent->data);
                     listAddNodeTail(r->readStates, rs);
                 }else 
@@ -223,6 +246,7 @@ void stepLeader(struct raft* r, raftMessage* msg)
                 ReadState *rs = createReadState();
                 rs->index = r->raftlog->commited;
                 raftEntry* ent = listFirst(msg->entries)->value;
+                sdsfree(rs->requestCtx);
                 rs->requestCtx = sdsdup(ent->data);
                 listAddNodeTail(r->readStates, rs);
             }
@@ -248,7 +272,7 @@ void stepLeader(struct raft* r, raftMessage* msg)
                         becomeProbe(pr);
                     }
                 }
-                sendAppend(msg->from);
+                sendAppend(r, msg->from);
             }else
             {
                 bool can_send = canSend(pr);
@@ -280,12 +304,12 @@ void stepLeader(struct raft* r, raftMessage* msg)
                         broadCastAppend(r);
                     }else if(!can_send)
                     {
-                        sendAppend(msg->from);
+                        sendAppend(r, msg->from);
                     }
                 }
             }
             break;
-        case MessageHeartBeat:
+        case MessageHeartBeatResp:
             pr->active = true;
             resumeProgress(pr);
             if(pr->state == NodeStateReplicate && isInflightsFull(pr->ins))
@@ -320,23 +344,16 @@ void stepLeader(struct raft* r, raftMessage* msg)
 
 int pollRaft(raft* r, uint64_t id, bool v)
 {
-    dictEntry* e = dictFind(r->votes, id);
-    if(e == NULL)
-    {
-        dictAdd(r->votes, id, 1);
-    }
-    int peers = dictSize(r->votes);
-    int granted = 0;
-    dictIterator* it = dictGetIterator(r->votes);
-    e = dictNext(it);
-    while(e != NULL)
+    if(r->votes[(uint8_t)id] == VoteNone)
     {
-        if(e->v.val == 1)
+        r->votes[(uint8_t)id] = v ? VoteGranted : VoteRejected;
+        r->numVotes++;
+        if(v)
         {
-            granted++;
+            r->numGranted++;
         } 
     }
-    return granted;
+    return r->numGranted;
 }
 
 
@@ -346,7 +363,8 @@ void stepCandidate(struct raft* r, raftMessage* msg)
     {
         case MessageProp:
         {
-            serverLog(LL_NOTICE, "%d no leader at term %d; dropping proposal", r->id, r->term);
+            serverLog(LL_NOTICE, "%d no leader at term %llu; dropping proposal",
+                r->id, (unsigned long long)r->term);
             break;
         }           
         case MessageApp:
@@ -355,12 +373,18 @@ void stepCandidate(struct raft* r, raftMessage* msg)
             handleAppendEntries(r, msg);
             break;
         }      
-        case MessageSnap:
+        case MessageHeartBeat:
         {
             becomeFollower(r, r->term, msg->from);
             handleHeartBeat(r, msg);
             break;
         }
+        case MessageSnap:
+        {
+            becomeFollower(r, r->term, msg->from);
+            handleSnapshot(r, msg);
+            break;
+        }
         case MessageVoteResp:
         {
             int granted = pollRaft(r, msg->from, !msg->reject);
@@ -369,9 +393,9 @@ void stepCandidate(struct raft* r, raftMessage* msg)
             {
                 becomeLeader(r);
                 broadCastAppend(r);
-            }else if(quo == dictSize(r->votes) - granted)
+            }else if(quo == r->numVotes - granted)
             {
-                becomeFollower(r, msg->from, 0);
+                becomeFollower(r, r->term, 0);
             }
             break;
         }         
@@ -388,10 +412,14 @@ void stepFollower(struct raft* r, raftMessage* msg)
         {
             if(r->leader == 0)
             {
+                serverLog(LL_NOTICE, "%d no leader at term %llu; dropping proposal",
+                    r->id, (unsigned long long)r->term);
                 return;
             }
-            msg->to = r->leader;
-            sendMsg(r, msg);
+            /* Don't forward every proposal on its own: park the entries and
+             * let flushProposals() ship the whole batch to the leader once
+             * per event loop iteration. */
+            listJoin(r->pendingProps, msg->entries);
             break;
         }           
         case MessageApp:
@@ -417,8 +445,15 @@ void stepFollower(struct raft* r, raftMessage* msg)
         }
         case MessageReadIndex:
         {
-            msg->to = r->leader;
-            sendMsg(r, msg);
+            /* The message belongs to the caller of Step(): forward a copy.
+             * Without a leader the read is dropped, like a proposal. */
+            if(r->leader == 0)
+            {
+                break;
+            }
+            raftMessage* m = dupRaftMessage(msg);
+            m->to = r->leader;
+            sendMsg(r, m);
             break;
         }
         case MessageReadIndexResp:
@@ -426,6 +461,7 @@ void stepFollower(struct raft* r, raftMessage* msg)
             ReadState *rs = createReadState();
             rs->index = msg->index;
             raftEntry* ent = listFirst(msg->entries)->value;
+            sdsfree(rs->requestCtx);
             rs->requestCtx = sdsdup(ent->data);
             listAddNodeTail(r->readStates, rs);
             break;
@@ -437,8 +473,12 @@ void stepFollower(struct raft* r, raftMessage* msg)
 
 bool promotable(raft* r)
 {
-    dictEntry* e = dictFind(r->peers, r->id);
-    return e != NULL;
+    /* A witness has no dataset to serve, it votes but never campaigns. */
+    if(r->isWitness)
+    {
+        return false;
+    }
+    return r->prs[r->id] != NULL;
 }
 
 bool pastElectionTimeout(raft* r)
@@ -467,11 +507,14 @@ void tickHeartbeat(raft* r)
     if(r->electionElapsed >= r->electionTimeout)
     {
         r->electionElapsed = 0;
-        raftMessage* m = createRaftMessage();
-        m->from = r->id;
-        m->type = MessageCheckQuorum;
-        Step(r, m);
-        freeRaftMessage(m);
+        if(r->checkQuorum)
+        {
+            raftMessage* m = createRaftMessage();
+            m->from = r->id;
+            m->type = MessageCheckQuorum;
+            Step(r, m);
+            freeRaftMessage(m);
+        }
     }
     if(r->state != NodeStateLeader)
     {
@@ -488,9 +531,45 @@ void tickHeartbeat(raft* r)
     }
 }
 
-void appendEntry(raft* r, raftEntry* entry)
+/* Forward the proposals a follower collected since the last call to the
+ * leader as a single MessageProp. Meant to be called by the driver once per
+ * event loop iteration (beforeSleep), after all the client writes of this
+ * iteration went through Step(). If the leader is unknown or changed to us
+ * in the meantime, the batch is dropped or appended locally. */
+void flushProposals(raft* r)
 {
+    if(listLength(r->pendingProps) == 0)
+    {
+        return;
+    }
+    if(r->leader == 0 || r->state == NodeStateCandidate)
+    {
+        serverLog(LL_NOTICE, "%d no leader at term %llu; dropping %lu batched proposals",
+            r->id, (unsigned long long)r->term, listLength(r->pendingProps));
+        listEmpty(r->pendingProps);
+        return;
+    }
+    raftMessage* m = createRaftMessage();
+    m->type = MessageProp;
+    listJoin(m->entries, r->pendingProps);
+    if(r->leader == r->id)
+    {
+        m->from = r->id;
+        Step(r, m);
+        freeRaftMessage(m);
+        return;
+    }
+    m->to = r->leader;
+    sendMsg(r, m);
+}
 
+/* Append a single entry to the leader log, see appendEntries(). */
+void appendEntry(raft* r, raftEntry* entry)
+{
+    list* entries = createRaftEntryList();
+    listAddNodeTail(entries, copyRaftEntry(entry));
+    appendEntries(r, entries);
+    listRelease(entries);
 }
 
 void appendEntries(raft* r, list* entries)
@@ -504,6 +583,7 @@ void appendEntries(raft* r, list* entries)
         ent->term = r->term;
         ent->index = last_index + off;
         off++;
+        n = listNextNode(n);
     }
     append(r->raftlog, entries);
     raftNodeProgress* pr = getProgress(r, r->id);
@@ -514,7 +594,7 @@ void appendEntries(raft* r, list* entries)
 
 int quorum(raft* r)
 {
-    return dictSize(r->peers)/2 + 1;
+    return r->numPeers/2 + 1;
 }
 
 void sendMsg(raft* r, raftMessage* msg)
@@ -528,7 +608,7 @@ void sendMsg(raft* r, raftMessage* msg)
         }
     }else 
     {
-        if(msg->type != 0)
+        if(msg->term != 0)
         {
             assert(false);
         }
@@ -553,18 +633,55 @@ void sendAppend(raft* r, uint64_t to)
     EntriesResult entries_res = entriesOfLog(r->raftlog, pr->next, UINT64_MAX);
     if(term_res.err != StorageOk || entries_res.err != StorageOk)
     {
+        if(entries_res.entries != NULL)
+        {
+            listRelease(entries_res.entries);
+        }
         if(!pr->active)
         {
+            freeRaftMessage(msg);
             return;
         }
+        /* The entries the node needs are compacted: send the snapshot
+         * they were compacted into. Witnesses have no dataset to restore,
+         * the metadata is enough for them to skip to the snapshot index. */
+        snapshot* ss = getStorageSnapshot(r->raftlog->ms);
+        if(ss->metaData->lastLogIndex == 0)
+        {
+            freeSnapShot(ss);
+            freeRaftMessage(msg);
+            return;
+        }
+        if(pr->isWitness)
+        {
+            sdsclear(ss->data);
+        }
+        freeSnapShot(msg->ss);
+        msg->ss = ss;
         msg->type = MessageSnap;
-        //TODO
+        /* Like a probe, wait for the answer before sending anything else.
+         * If the snapshot gets lost, the next heartbeat response resumes
+         * the progress and the snapshot is sent again. */
+        if(pr->state != NodeStateProb)
+        {
+            becomeProbe(pr);
+        }
+        pauseProgress(pr);
     }else
     {
         msg->type = MessageApp;
         msg->index = pr->next - 1;
         msg->logTerm = term_res.term;
-        msg->entries = entries_res.entries;
+        if(entries_res.entries != NULL)
+        {
+            listRelease(msg->entries);
+            msg->entries = entries_res.entries;
+        }
+        if(pr->isWitness && listLength(msg->entries) != 0)
+        {
+            msg->entries = witnessEntries(entries_res.entries);
+            listRelease(entries_res.entries);
+        }
         msg->commited = r->raftlog->commited;
         int len = listLength(msg->entries);
         if(len != 0)
@@ -577,7 +694,8 @@ void sendAppend(raft* r, uint64_t to)
                 addInflight(pr->ins, last_index);
             }else if(pr->state == NodeStateProb)
             {
-                //todo
+                /* Wait for the answer before probing again. */
+                pauseProgress(pr);
             }else
             {
                 assert(false);
@@ -592,6 +710,10 @@ void sendAppend(raft* r, uint64_t to)
 int numOfPendingConf(list* ents)
 {
     int num = 0;
+    if(ents == NULL)
+    {
+        return 0;
+    }
     listNode* n = listFirst(ents);
     while(n != NULL)
     {
@@ -600,6 +722,7 @@ int numOfPendingConf(list* ents)
         {
             num++;
         }
+        n = listNextNode(n);
     }    
     return num;
 }
@@ -627,12 +750,17 @@ bool Step(raft* r, raftMessage* msg)
         {
             becomeFollower(r, msg->term, 0);
         }
-    }else if(msg->type < r->term)
+    }else if(msg->term < r->term)
     {
-        raftMessage* m = createRaftMessage();
-        m->to = msg->from;
-        m->type = MessageAppResp;
-        sendMsg(r, m);
+        /* A stale leader learns the new term from the answer and steps
+         * down, any other stale message is just dropped. */
+        if(msg->type == MessageApp || msg->type == MessageHeartBeat)
+        {
+            raftMessage* m = createRaftMessage();
+            m->to = msg->from;
+            m->type = MessageAppResp;
+            sendMsg(r, m);
+        }
         return true;
     }
 
@@ -649,13 +777,18 @@ bool Step(raft* r, raftMessage* msg)
                     assert(false);
                 }
                 int num = numOfPendingConf(res.entries);
-                listRelease(res.entries);
+                if (res.entries != NULL)
+                {
+                    listRelease(res.entries);
+                }
                 if (num > 0)
                 {
-                    serverLog(LL_WARNING, "%d cannot campaign at term %d since there are still %d pending configuration changes to apply", r->id, r->term, num);
+                    serverLog(LL_WARNING, "%d cannot campaign at term %llu since there are still %d pending configuration changes to apply",
+                        r->id, (unsigned long long)r->term, num);
                     return true;
                 }
-                serverLog(LL_NOTICE, "%d is starting a new election at term %d", r->id, r->term);
+                serverLog(LL_NOTICE, "%d is starting a new election at term %llu",
+                    r->id, (unsigned long long)r->term);
                 campaign(r);
             }
             else
@@ -677,7 +810,7 @@ bool Step(raft* r, raftMessage* msg)
                 r->voteFor = msg->from;
             }else
             {
-                m->reject = true;;
+                m->reject = true;
                 sendMsg(r, m);
             }
             break;
@@ -699,7 +832,14 @@ void handleAppendEntries(raft* r, raftMessage* msg)
         sendMsg(r, m);
         return;
     }
+    if(r->isWitness && msg->entries != NULL)
+    {
+        list* ents = witnessEntries(msg->entries);
+        listRelease(msg->entries);
+        msg->entries = ents;
+    }
     uint64_t last_index = maybeAppendEntries(r->raftlog, msg->logTerm, msg->index, msg->commited, msg->entries);
+    witnessCompact(r);
     if(last_index != UINT64_MAX)
     {
         raftMessage* m = createRaftMessage();
@@ -722,8 +862,10 @@ void handleAppendEntries(raft* r, raftMessage* msg)
 void handleHeartBeat(raft* r, raftMessage* msg)
 {
     commitTo(r->raftlog, msg->commited);
+    witnessCompact(r);
     raftMessage* m = createRaftMessage();
     m->to = msg->from;
+    sdsfree(m->context);
     m->context = sdsdup(msg->context);
     m->type = MessageHeartBeatResp;
     sendMsg(r, m);
@@ -731,12 +873,18 @@ void handleHeartBeat(raft* r, raftMessage* msg)
 
 void handleSnapshot(raft* r, raftMessage* msg)
 {
-    uint64_t index = msg->ss->metaData->lastLogIndex;
-    uint64_t term = msg->ss->metaData->lastLogTerm;
+    raftMessage* m = createRaftMessage();
+    m->to = msg->from;
+    m->type = MessageAppResp;
     if(restoreSnapshot(r, msg->ss))
     {
-        //todo
+        m->index = lastIndex(r->raftlog);
+    }else
+    {
+        m->index = r->raftlog->commited;
     }
+    witnessCompact(r);
+    sendMsg(r, m);
 }
 
 bool restoreSnapshot(raft* r, snapshot* ss)
@@ -745,14 +893,15 @@ bool restoreSnapshot(raft* r, snapshot* ss)
     {
         return false;
     }
-    if(matchTerm(r->raftlog, ss->metaData->lastLogIndex, ss->metaData->lastLogTerm))
+    if(matchTerm(r->raftlog, ss->metaData->lastLogTerm, ss->metaData->lastLogIndex))
     {
         commitTo(r->raftlog, ss->metaData->lastLogIndex);
         return false;
     }
-    restoreSnapshotMD(r->raftlog, ss->metaData);
-    dictEmpty(r->peers, NULL);
+    restoreLogSnapshot(r->raftlog, ss);
+    clearProgress(r);
     restoreNode(r, ss->metaData->cs->peers);
+    restoreWitnesses(r, ss->metaData->cs->witnesses);
     return true;
 }
 
@@ -763,64 +912,61 @@ void restoreNode(raft* r, list* nodes)
     uint8_t peer;
     listNode* ln;
     while ((ln = listNext(&li)) != NULL) {
-        peer = (uint8_t)ln->value;
+        peer = (uint8_t)(unsigned long)ln->value;
         raftNodeProgress* pr = newRaftNodeProgress(peer, r->maxInflightMsgs);
         pr->match = 0;
         pr->next = lastIndex(r->raftlog) + 1;
-        dictAdd(r->peers, peer, pr);
+        addProgress(r, pr);
     }    
 }
 
-bool maybeCommitRaft(raft* r)
+/* Return the highest index replicated on at least 'quo' of the 'count'
+ * match indexes. The array is sorted in place (descending): groups are
+ * small so an insertion sort beats anything fancier. */
+uint64_t quorumMatchIndex(uint64_t* matches, int count, int quo)
 {
-    int quo = quorum(r);
-    uint64_t* l = zmalloc(quo*sizeof(uint64_t));
-    memset(l, 0, quo*sizeof(uint64_t));
-    dictIterator* it = dictGetIterator(r->peers);
-    raftNodeProgress* progress;
-    dictEntry* e = dictNext(it);
-    while (e != NULL) {
-        raftNodeProgress* pr = dictGetVal(e);
-        uint64_t match = pr->match;
-        int smallest = 0;
-        for(int i = 1; i < quo; i++)
-        {
-            if(l[smallest] > l[i])
-            {
-                smallest = i; 
-            }
-        }
-        if(match > l[smallest])
+    for(int i = 1; i < count; i++)
+    {
+        uint64_t m = matches[i];
+        int j = i - 1;
+        while(j >= 0 && matches[j] < m)
         {
-            l[smallest] = match;
+            matches[j + 1] = matches[j];
+            j--;
         }
-        e = dictNext(it);
+        matches[j + 1] = m;
     }
-    int smallest = 0;
-    for(int i = 1; i < quo; i++)
+    return matches[quo - 1];
+}
+
+bool maybeCommitRaft(raft* r)
+{
+    uint64_t matches[RAFT_MAX_PEERS];
+    if(r->numPeers == 0)
     {
-        if(l[smallest] > l[i])
-        {
-            smallest = i; 
-        }
+        return false;
+    }
+    for(int i = 0; i < r->numPeers; i++)
+    {
+        matches[i] = r->prs[r->peerIds[i]]->match;
     }
-    maybeCommit(r->raftlog, l[smallest], r->term);    
-    zfree(l);
+    uint64_t index = quorumMatchIndex(matches, r->numPeers, quorum(r));
+    return maybeCommit(r->raftlog, index, r->term);
 }
 
+/* Tell if a quorum (us included) talked to the leader since the last
+ * check, and start a new check period. */
 bool checkQuorumActive(raft* r)
 {
     int active_num = 0;
-    dictIterator* it = dictGetIterator(r->peers);
-    raftNodeProgress* progress;
-    dictEntry* e = dictNext(it);
-    while (e != NULL) {
-        raftNodeProgress* pr = dictGetVal(e);
-        if(pr->active)
+    for(int i = 0; i < r->numPeers; i++)
+    {
+        raftNodeProgress* pr = r->prs[r->peerIds[i]];
+        if(pr->id == r->id || pr->active)
         {
             active_num++;
         }
-        e = dictNext(it);
+        pr->active = false;
     }   
     return active_num >= quorum(r);
 }
@@ -834,11 +980,9 @@ void campaign(raft* r)
         becomeLeader(r);
         return;
     }
-    dictIterator* it = dictGetIterator(r->peers);
-    raftNodeProgress* progress;
-    dictEntry* e = dictNext(it);
-    while (e != NULL) {
-        raftNodeProgress* pr = dictGetVal(e);
+    for(int i = 0; i < r->numPeers; i++)
+    {
+        raftNodeProgress* pr = r->prs[r->peerIds[i]];
         if(pr->id == r->id)
         {
             continue;
@@ -847,23 +991,21 @@ void campaign(raft* r)
         msg->term = r->term;
         msg->to = pr->id;
         msg->type = MessageVote;
-        msg->index = lastIndex(r);
-        msg->logTerm = lastTerm(r);
+        msg->index = lastIndex(r->raftlog);
+        msg->logTerm = lastTerm(r->raftlog);
         sendMsg(r, msg);
-        e = dictNext(it);
     }   
 
 }
 
 void broadCastAppend(raft* r)
 {
-    dictIterator* it = dictGetIterator(r->peers);
-    raftNodeProgress* progress;
-    dictEntry* e = dictNext(it);
-    while (e != NULL) {
-        raftNodeProgress* pr = dictGetVal(e);
-        sendAppend(r, pr->id);
-        e = dictNext(it);
+    for(int i = 0; i < r->numPeers; i++)
+    {
+        if(r->peerIds[i] != r->id)
+        {
+            sendAppend(r, r->peerIds[i]);
+        }
     }   
 }
 
@@ -885,12 +1027,559 @@ void sendHeartBeat(raft* r, uint64_t to)
 
 void broadcastHeartbeat(raft *r)
 {
-    dictIterator* it = dictGetIterator(r->peers);
-    raftNodeProgress* progress;
-    dictEntry* e = dictNext(it);
-    while (e != NULL) {
-        raftNodeProgress* pr = dictGetVal(e);
-        sendHeartBeat(r, pr->id);
-        e = dictNext(it);
+    for(int i = 0; i < r->numPeers; i++)
+    {
+        if(r->peerIds[i] != r->id)
+        {
+            sendHeartBeat(r, r->peerIds[i]);
+        }
     }     
-}
\ No newline at end of file
+}
+
+void restoreWitnesses(raft* r, list* witnesses)
+{
+    listIter li;
+    listRewind(witnesses, &li);
+    listNode* ln;
+    while ((ln = listNext(&li)) != NULL) {
+        uint8_t id = (uint8_t)(unsigned long)ln->value;
+        raftNodeProgress* pr = getProgress(r, id);
+        if(pr != NULL)
+        {
+            pr->isWitness = true;
+        }
+        if(id == r->id)
+        {
+            r->isWitness = true;
+        }
+    }
+}
+
+/* Witnesses only keep the log metadata: return a copy of 'entries' where the
+ * payload of normal entries is dropped. Configuration changes keep their
+ * data since the witness still has to track the membership. */
+list* witnessEntries(list* entries)
+{
+    list* ents = createRaftEntryList();
+    listNode* n = listFirst(entries);
+    while(n != NULL)
+    {
+        raftEntry* ent = n->value;
+        raftEntry* w = createRaftEntry();
+        w->term = ent->term;
+        w->index = ent->index;
+        w->entryType = ent->entryType;
+        if(ent->entryType == EntryConfChange)
+        {
+            sdsfree(w->data);
+            w->data = sdsdup(ent->data);
+        }
+        listAddNodeTail(ents, w);
+        n = listNextNode(n);
+    }
+    return ents;
+}
+
+/* A witness applies no commands: as soon as entries are committed they
+ * count as applied, and everything already persisted up to that point is
+ * compacted away so that only the log tail needed to vote and to match
+ * AppendEntries stays around. */
+void witnessCompact(raft* r)
+{
+    if(!r->isWitness)
+    {
+        return;
+    }
+    raftLog* l = r->raftlog;
+    l->applied = l->commited;
+    uint64_t stable = storageLastIndex(l->ms);
+    uint64_t compact_index = l->applied < stable ? l->applied : stable;
+    if(compact_index >= storageFirstIndex(l->ms))
+    {
+        Compact(l->ms, compact_index);
+    }
+}
+
+/* Return the ConsistencyLevel named by 's' (as in CONSISTENCY
+ * local|leader|quorum|linearizable), or -1 if unknown. */
+int consistencyLevelFromString(const char* s)
+{
+    if(!strcasecmp(s, "local")) return ConsistencyLocal;
+    if(!strcasecmp(s, "leader")) return ConsistencyLeader;
+    if(!strcasecmp(s, "quorum")) return ConsistencyQuorum;
+    if(!strcasecmp(s, "linearizable")) return ConsistencyLinearizable;
+    return -1;
+}
+
+/* Start a linearizable read: the ReadState tagged with 'ctx' shows up in
+ * r->readStates once the leader confirmed its commit index, the read can be
+ * served as soon as the entries up to rs->index are applied. The request is
+ * dropped when there is no leader, or when the leader did not commit an
+ * entry in its term yet. */
+void requestReadIndex(raft* r, sds ctx)
+{
+    raftMessage* m = createRaftMessage();
+    m->type = MessageReadIndex;
+    m->from = r->id;
+    raftEntry* ent = createRaftEntry();
+    sdsfree(ent->data);
+    ent->data = sdsdup(ctx);
+    listAddNodeTail(m->entries, ent);
+    Step(r, m);
+    freeRaftMessage(m);
+}
+
+/* ---------------------------------------------------------------------------
+ * Driver helpers. After every Step() or tick the node that hosts a raft has
+ * to, in this order:
+ *
+ * 1. Persist raftHardState(), the snapshot raftStableSnapshot() moved to
+ *    the storage and the entries raftStableEntries() moved there: the
+ *    other nodes count on what we voted and acknowledged. If there was a
+ *    snapshot, restore the state of the application from its data.
+ * 2. Send the messages returned by raftTakeMessages().
+ * 3. Apply the entries returned by raftCommittedEntries().
+ *
+ * Once in a while raftCompact() bounds the size of the log.
+ * ------------------------------------------------------------------------- */
+
+hardState raftHardState(raft* r)
+{
+    hardState hs;
+    hs.term = r->term;
+    hs.voteFor = r->voteFor;
+    hs.commited = r->raftlog->commited;
+    return hs;
+}
+
+/* Move the entries appended since the last call from the unstable log to
+ * the storage, and return true if there was any. */
+bool raftStableEntries(raft* r)
+{
+    unstable* u = r->raftlog->uns;
+    if(listLength(u->entries) == 0)
+    {
+        return false;
+    }
+    raftEntry* last = listLast(u->entries)->value;
+    uint64_t index = last->index;
+    uint64_t term = last->term;
+    AppendEntriesToStorage(r->raftlog->ms, u->entries);
+    stableTo(r->raftlog, index, term);
+    return true;
+}
+
+/* Move the snapshot received from the leader since the last call, if any,
+ * to the storage, and return true if there was one. The entries up to the
+ * snapshot count as applied: the caller has to replace the state of the
+ * application with getStorageSnapshot(r->raftlog->ms)->data. */
+bool raftStableSnapshot(raft* r)
+{
+    unstable* u = r->raftlog->uns;
+    if(u->ssmd == NULL)
+    {
+        return false;
+    }
+    uint64_t index = u->ssmd->lastLogIndex;
+    ApplySnapshot(r->raftlog->ms, u->ssmd, u->ssdata);
+    stableSnapTo(r->raftlog, index);
+    if(r->raftlog->applied < index)
+    {
+        r->raftlog->applied = index;
+    }
+    return true;
+}
+
+/* Return the current configuration, to be freed with freeConfState(). */
+confState* raftConfState(raft* r)
+{
+    confState* cs = createConfState();
+    for(int i = 0; i < r->numPeers; i++)
+    {
+        raftNodeProgress* pr = r->prs[r->peerIds[i]];
+        listAddNodeTail(cs->peers, (void*)(unsigned long)pr->id);
+        if(pr->isWitness)
+        {
+            listAddNodeTail(cs->witnesses, (void*)(unsigned long)pr->id);
+        }
+    }
+    return cs;
+}
+
+/* Take 'data', the state of the application with every entry returned so
+ * far by raftCommittedEntries() applied, as the snapshot of the storage,
+ * and drop the entries it covers from the log. Nodes that still need them
+ * are sent the snapshot instead. 'data' is owned by the storage from now
+ * on. Returns the index of the snapshot, or 0 if there was nothing new to
+ * compact. */
+uint64_t raftCompact(raft* r, sds data)
+{
+    memoryStorage* ms = r->raftlog->ms;
+    uint64_t index = r->raftlog->applied;
+    if(index > storageLastIndex(ms))
+    {
+        index = storageLastIndex(ms);
+    }
+    confState* cs = raftConfState(r);
+    StorageError err = CreateSnapshot(ms, index, cs, data);
+    freeConfState(cs);
+    if(err != StorageOk)
+    {
+        return 0;
+    }
+    Compact(ms, index);
+    return index;
+}
+
+/* Return the entries committed since the last call, NULL if there are none.
+ * They count as applied as soon as they are returned. */
+list* raftCommittedEntries(raft* r)
+{
+    list* ents = nextEnts(r->raftlog);
+    if(ents != NULL)
+    {
+        r->raftlog->applied = r->raftlog->commited;
+    }
+    return ents;
+}
+
+/* Return the messages to send, the caller releases them. */
+list* raftTakeMessages(raft* r)
+{
+    list* msgs = r->msgs;
+    r->msgs = listCreate();
+    listSetFreeMethod(r->msgs, freeRaftMessage);
+    listSetDupMethod(r->msgs, dupRaftMessage);
+    return msgs;
+}
+
+#ifdef REDIS_TEST
+#define RAFT_TEST_NODES 3
+
+typedef struct raftTestNode
+{
+    raft* r;
+    memoryStorage* ms;
+    sds applied;        /* The state machine: the applied entries joined. */
+    bool isolated;      /* Messages from and to this node are dropped. */
+    bool witness;
+}raftTestNode;
+
+static raftTestNode raftTestCluster[RAFT_TEST_NODES + 1];
+
+static void raftTestStart(uint8_t id)
+{
+    raftTestNode* n = &raftTestCluster[id];
+    raftConfig cfg;
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.id = id;
+    cfg.electionTick = 10;
+    cfg.heartbeatTick = 1;
+    cfg.checkQuorum = true;
+    cfg.maxInflightMsgs = 256;
+    cfg.maxSizePerMsg = UINT64_MAX;
+    cfg.peers = listCreate();
+    cfg.witnesses = listCreate();
+    for(unsigned long j = 1; j <= RAFT_TEST_NODES; j++)
+    {
+        listAddNodeTail(cfg.peers, (void*)j);
+        if(raftTestCluster[j].witness)
+        {
+            listAddNodeTail(cfg.witnesses, (void*)j);
+        }
+    }
+    if(n->ms == NULL)
+    {
+        n->ms = newMemoryStorage();
+        n->applied = sdsempty();
+    }
+    cfg.storage = n->ms;
+    cfg.applied = n->ms->pState->commited;
+    n->r = newRaft(&cfg);
+    listRelease(cfg.peers);
+    listRelease(cfg.witnesses);
+}
+
+/* Run the driver loop of every node until no message is left in flight. */
+static void raftTestDeliver(void)
+{
+    bool sent = true;
+    while(sent)
+    {
+        sent = false;
+        for(int id = 1; id <= RAFT_TEST_NODES; id++)
+        {
+            raftTestNode* n = &raftTestCluster[id];
+            if(raftStableSnapshot(n->r))
+            {
+                sdsfree(n->applied);
+                n->applied = sdsdup(n->ms->ssdata);
+            }
+            raftStableEntries(n->r);
+            hardState hs = raftHardState(n->r);
+            setHardState(n->ms, &hs);
+            list* msgs = raftTakeMessages(n->r);
+            listIter li;
+            listNode* ln;
+            listRewind(msgs, &li);
+            while((ln = listNext(&li)) != NULL)
+            {
+                raftMessage* m = ln->value;
+                if(n->isolated || raftTestCluster[m->to].isolated)
+                {
+                    continue;
+                }
+                Step(raftTestCluster[m->to].r, m);
+                sent = true;
+            }
+            listRelease(msgs);
+            list* ents = raftCommittedEntries(n->r);
+            if(ents != NULL)
+            {
+                listRewind(ents, &li);
+                while((ln = listNext(&li)) != NULL)
+                {
+                    raftEntry* e = ln->value;
+                    n->applied = sdscatsds(n->applied, e->data);
+                }
+                listRelease(ents);
+            }
+        }
+    }
+}
+
+static void raftTestTick(int rounds)
+{
+    while(rounds--)
+    {
+        for(int id = 1; id <= RAFT_TEST_NODES; id++)
+        {
+            raftTestCluster[id].r->tick(raftTestCluster[id].r);
+        }
+        raftTestDeliver();
+    }
+}
+
+/* Return the id of the only leader among the nodes that are not isolated,
+ * or 0 if there is none or more than one. */
+static uint8_t raftTestLeader(void)
+{
+    uint8_t leader = 0;
+    for(int id = 1; id <= RAFT_TEST_NODES; id++)
+    {
+        raftTestNode* n = &raftTestCluster[id];
+        if(n->isolated || n->r->state != NodeStateLeader)
+        {
+            continue;
+        }
+        if(leader != 0)
+        {
+            return 0;
+        }
+        leader = id;
+    }
+    return leader;
+}
+
+static uint8_t raftTestElect(void)
+{
+    for(int j = 0; j < 100 && raftTestLeader() == 0; j++)
+    {
+        raftTestTick(1);
+    }
+    return raftTestLeader();
+}
+
+static void raftTestPropose(uint8_t id, const char* data)
+{
+    raftMessage* m = createRaftMessage();
+    raftEntry* e = createRaftEntry();
+    sdsfree(e->data);
+    e->data = sdsnew(data);
+    listAddNodeTail(m->entries, e);
+    m->type = MessageProp;
+    m->from = id;
+    Step(raftTestCluster[id].r, m);
+    freeRaftMessage(m);
+    flushProposals(raftTestCluster[id].r);
+    raftTestDeliver();
+}
+
+/* Check the state machine of every node but 'skip'. Witnesses apply no
+ * data, so their state machine stays empty. */
+static void raftTestCheckApplied(const char* expected, uint8_t skip)
+{
+    for(int id = 1; id <= RAFT_TEST_NODES; id++)
+    {
+        if(id != skip)
+        {
+            raftTestNode* n = &raftTestCluster[id];
+            assert(!strcmp(n->applied, n->witness ? "" : expected));
+        }
+    }
+}
+
+int raftTest(int argc, char **argv)
+{
+    UNUSED(argc);
+    UNUSED(argv);
+    /* serverLog() needs a log file: keep the election chatter out. */
+    server.logfile = "";
+    server.verbosity = LL_WARNING;
+    redisSrand48((int32_t)ustime());
+    memset(raftTestCluster, 0, sizeof(raftTestCluster));
+    for(int id = 1; id <= RAFT_TEST_NODES; id++)
+    {
+        raftTestStart(id);
+    }
+
+    printf("Elect a leader: ");
+    uint8_t leader = raftTestElect();
+    assert(leader != 0);
+    for(int id = 1; id <= RAFT_TEST_NODES; id++)
+    {
+        assert(raftTestCluster[id].r->leader == leader);
+        assert(raftTestCluster[id].r->term == raftTestCluster[leader].r->term);
+    }
+    printf("OK\n");
+
+    printf("Replicate a proposal of the leader: ");
+    raftTestPropose(leader, "a");
+    raftTestCheckApplied("a", 0);
+    printf("OK\n");
+
+    printf("Forward a proposal of a follower: ");
+    uint8_t follower = leader % RAFT_TEST_NODES + 1;
+    raftTestPropose(follower, "b");
+    raftTestCheckApplied("ab", 0);
+    printf("OK\n");
+
+    printf("Elect a new leader without the old one: ");
+    uint8_t old_leader = leader;
+    uint64_t old_term = raftTestCluster[leader].r->term;
+    raftTestCluster[old_leader].isolated = true;
+    leader = raftTestElect();
+    assert(leader != 0 && leader != old_leader);
+    assert(raftTestCluster[leader].r->term > old_term);
+    raftTestPropose(leader, "c");
+    raftTestCheckApplied("abc", old_leader);
+    assert(!strcmp(raftTestCluster[old_leader].applied, "ab"));
+    printf("OK\n");
+
+    /* While isolated the old leader stepped down and kept campaigning with
+     * higher terms, so it may force a new election once back. Its log is
+     * behind, so it can't win it. */
+    printf("The old leader rejoins and catches up: ");
+    raftTestCluster[old_leader].isolated = false;
+    raftTestTick(20);
+    leader = raftTestElect();
+    assert(leader != 0 && leader != old_leader);
+    raftTestCheckApplied("abc", 0);
+    printf("OK\n");
+
+    printf("A node restarts from its storage: ");
+    uint8_t restarted = leader % RAFT_TEST_NODES + 1;
+    uint64_t term = raftTestCluster[restarted].r->term;
+    freeRaft(raftTestCluster[restarted].r);
+    raftTestStart(restarted);
+    assert(raftTestCluster[restarted].r->term == term);
+    assert(raftTestCluster[restarted].r->raftlog->commited ==
+           raftTestCluster[leader].r->raftlog->commited);
+    raftTestTick(5);
+    raftTestPropose(leader, "d");
+    raftTestCheckApplied("abcd", 0);
+    printf("OK\n");
+
+    printf("A follower gets the read index from the leader: ");
+    uint8_t reader = leader % RAFT_TEST_NODES + 1;
+    sds ctx = sdsnew("read");
+    requestReadIndex(raftTestCluster[reader].r, ctx);
+    sdsfree(ctx);
+    raftTestDeliver();
+    list* rss = raftTestCluster[reader].r->readStates;
+    assert(listLength(rss) == 1);
+    ReadState* rs = listFirst(rss)->value;
+    assert(!strcmp(rs->requestCtx, "read"));
+    assert(rs->index == raftTestCluster[leader].r->raftlog->commited);
+    listDelNode(rss, listFirst(rss));
+    printf("OK\n");
+
+    printf("A lagging node catches up from a snapshot: ");
+    uint8_t lagging = leader % RAFT_TEST_NODES + 1;
+    raftTestCluster[lagging].isolated = true;
+    raftTestPropose(leader, "e");
+    uint64_t ss_index = raftCompact(raftTestCluster[leader].r,
+        sdsdup(raftTestCluster[leader].applied));
+    assert(ss_index == raftTestCluster[leader].r->raftlog->applied);
+    assert(storageFirstIndex(raftTestCluster[leader].ms) == ss_index + 1);
+    raftTestCluster[lagging].isolated = false;
+    raftTestTick(5);
+    assert(raftTestCluster[lagging].ms->ssmd->lastLogIndex == ss_index);
+    raftTestPropose(leader, "f");
+    raftTestCheckApplied("abcdef", 0);
+    printf("OK\n");
+
+    for(int id = 1; id <= RAFT_TEST_NODES; id++)
+    {
+        freeRaft(raftTestCluster[id].r);
+        sdsfree(raftTestCluster[id].applied);
+    }
+
+    /* Same cluster, but the last node is a witness. */
+    uint8_t witness = RAFT_TEST_NODES;
+    memset(raftTestCluster, 0, sizeof(raftTestCluster));
+    raftTestCluster[witness].witness = true;
+    for(int id = 1; id <= RAFT_TEST_NODES; id++)
+    {
+        raftTestStart(id);
+    }
+
+    printf("A witness never leads and applies no data: ");
+    leader = raftTestElect();
+    assert(leader != 0 && leader != witness);
+    assert(raftTestCluster[witness].r->isWitness);
+    raftTestPropose(leader, "a");
+    raftTestPropose(witness, "b");
+    raftTestCheckApplied("ab", 0);
+    /* Committed entries are compacted away right away. */
+    raftLog* wlog = raftTestCluster[witness].r->raftlog;
+    assert(storageFirstIndex(wlog->ms) == wlog->commited + 1);
+    printf("OK\n");
+
+    printf("The vote of a witness elects a new leader: ");
+    old_leader = leader;
+    raftTestCluster[old_leader].isolated = true;
+    leader = raftTestElect();
+    assert(leader != 0 && leader != old_leader && leader != witness);
+    raftTestPropose(leader, "c");
+    raftTestCheckApplied("abc", old_leader);
+    raftTestCluster[old_leader].isolated = false;
+    raftTestTick(20);
+    leader = raftTestElect();
+    assert(leader != 0 && leader != witness);
+    printf("OK\n");
+
+    printf("A witness catches up from the snapshot metadata: ");
+    raftTestCluster[witness].isolated = true;
+    raftTestPropose(leader, "d");
+    ss_index = raftCompact(raftTestCluster[leader].r,
+        sdsdup(raftTestCluster[leader].applied));
+    assert(ss_index != 0);
+    raftTestCluster[witness].isolated = false;
+    raftTestTick(5);
+    memoryStorage* wms = raftTestCluster[witness].ms;
+    assert(wms->ssmd->lastLogIndex == ss_index);
+    assert(sdslen(wms->ssdata) == 0);
+    raftTestPropose(leader, "e");
+    assert(wlog->commited == raftTestCluster[leader].r->raftlog->commited);
+    raftTestCheckApplied("abcde", 0);
+    printf("OK\n");
+
+    for(int id = 1; id <= RAFT_TEST_NODES; id++)
+    {
+        freeRaft(raftTestCluster[id].r);
+        sdsfree(raftTestCluster[id].applied);
+    }
+    return 0;
+}
+#endif
\ No newline at end of file
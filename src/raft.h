@@ -4,10 +4,12 @@
 #include <stdbool.h>
 #include <stdlib.h>
 #include "adlist.h"
-#include "dict.h"
 #include "raftlog.h"
 #include "node_progress.h"
 
+/* Node ids are uint8_t, so the peer tables are plain arrays indexed by id. */
+#define RAFT_MAX_PEERS 256
+
 struct raft;
 typedef void (*stepFunc)(struct raft* r, raftMessage* msg);
 typedef void (*tickFunc)(struct raft* r);
@@ -18,6 +20,7 @@ typedef struct raftConfig
     uint32_t heartbeatTick;
     bool checkQuorum;
     list* peers;
+    list* witnesses;    /* Subset of peers that are witnesses, may be NULL. */
     uint64_t maxSizePerMsg;
     uint64_t maxInflightMsgs;
     uint64_t applied;
@@ -31,6 +34,18 @@ typedef enum NodeStateType
     NodeStateLeader
 }NodeStateType;
 
+/* When a write is acknowledged, from the cheapest to the safest. See the
+ * CONSISTENCY command in raftmode.c. */
+typedef enum ConsistencyLevel
+{
+    ConsistencyLocal = 1,       /* Once proposed, no raft round trip. */
+    ConsistencyLeader,          /* Once the leader appended it to its log. */
+    ConsistencyQuorum,          /* With its reply, once committed and applied. */
+    ConsistencyLinearizable     /* Like quorum, reads served through ReadIndex. */
+}ConsistencyLevel;
+
+int consistencyLevelFromString(const char* s);
+
 typedef struct voteInfo 
 {
     uint8_t id;
@@ -39,12 +54,20 @@ typedef struct voteInfo
 
 bool matchVoteInfo(voteInfo* a, voteInfo* b);
 
+typedef enum VoteState
+{
+    VoteNone = 0,
+    VoteGranted,
+    VoteRejected
+}VoteState;
+
 typedef struct raft
 {
     uint8_t id;
     uint8_t leader;
     uint64_t term;
     uint8_t voteFor;
+    bool isWitness;
     NodeStateType state;
     uint32_t electionTimeout;
     uint32_t electionElapsed;
@@ -54,18 +77,25 @@ typedef struct raft
     bool checkQuorum;
     uint64_t maxSizePerMsg;
     uint64_t maxInflightMsgs;   
-    dict* peers;
-    dict* votes;
+    raftNodeProgress* prs[RAFT_MAX_PEERS];  /* Progress by node id, NULL if not a peer. */
+    uint8_t peerIds[RAFT_MAX_PEERS];        /* Ids set in prs, for dense iteration. */
+    int numPeers;
+    uint8_t votes[RAFT_MAX_PEERS];          /* VoteState by node id. */
+    int numVotes;
+    int numGranted;
     list* msgs;
     raftLog* raftlog;
     bool pendingConf;
     stepFunc step;
     tickFunc tick;
     list* readStates;
+    list* pendingProps;     /* Follower proposals waiting for flushProposals(). */
 }raft;
 
 raft* newRaft(raftConfig* cfg);
 
+void freeRaft(raft* r);
+
 void resetRaftTerm(raft* r, uint64_t term);
 
 void becomeFollower(raft* r, uint64_t term, uint64_t leader);
@@ -76,6 +106,12 @@ void becomeLeader(raft* r);
 
 raftNodeProgress* getProgress(raft* r, uint8_t id);
 
+void addProgress(raft* r, raftNodeProgress* pr);
+
+void clearProgress(raft* r);
+
+uint64_t quorumMatchIndex(uint64_t* matches, int count, int quo);
+
 void stepFollower(struct raft* r, raftMessage* msg);
 void stepCandidate(struct raft* r, raftMessage* msg);
 void stepLeader(struct raft* r, raftMessage* msg);
@@ -84,6 +120,20 @@ void tickHeartbeat(struct raft* r);
 
 void appendEntry(raft* r, raftEntry* entry);
 
+void appendEntries(raft* r, list* entries);
+
+void sendMsg(raft* r, raftMessage* msg);
+
+void sendAppend(raft* r, uint64_t to);
+
+void handleAppendEntries(raft* r, raftMessage* msg);
+
+void handleHeartBeat(raft* r, raftMessage* msg);
+
+void handleSnapshot(raft* r, raftMessage* msg);
+
+void flushProposals(raft* r);
+
 int numOfPendingConf(list* ents);
 
 int pollRaft(raft* r, uint64_t id, bool v);
@@ -96,6 +146,12 @@ bool restoreSnapshot(raft* r, snapshot* ss);
 
 void restoreNode(raft* r, list* nodes);
 
+void restoreWitnesses(raft* r, list* witnesses);
+
+list* witnessEntries(list* entries);
+
+void witnessCompact(raft* r);
+
 bool maybeCommitRaft(raft* r);
 
 bool checkQuorumActive(raft* r);
@@ -107,4 +163,20 @@ void broadCastAppend(raft* r);
 void sendHeartBeat(raft* r, uint64_t to);
 
 void broadcastHeartbeat(raft *r);
+
+void requestReadIndex(raft* r, sds ctx);
+
+hardState raftHardState(raft* r);
+
+bool raftStableEntries(raft* r);
+
+bool raftStableSnapshot(raft* r);
+
+confState* raftConfState(raft* r);
+
+uint64_t raftCompact(raft* r, sds data);
+
+list* raftCommittedEntries(raft* r);
+
+list* raftTakeMessages(raft* r);
 #endif // !__RAFT__
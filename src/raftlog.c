@@ -15,6 +15,16 @@ raftLog* newRaftLog(memoryStorage* ms)
     return raft_log;
 }
 
+/* The storage belongs to the caller of newRaftLog() and is not released. */
+void freeRaftLog(raftLog* raftlog)
+{
+    listRelease(raftlog->uns->entries);
+    freeSnapshotMetaData(raftlog->uns->ssmd);
+    sdsfree(raftlog->uns->ssdata);
+    zfree(raftlog->uns);
+    zfree(raftlog);
+}
+
 TermResult termOf(raftLog* raftlog, uint64_t index)
 {
     TermResult result;
@@ -94,10 +104,14 @@ uint64_t findConflict(raftLog* raftlog, list* entries)
     return 0;    
 }
 
+/* Move the commit index forward, it never goes back. */
 void commitTo(raftLog* raftlog, uint64_t commited)
 {
-    assert(commited > raftlog->commited);
-    raftlog->commited = commited;
+    if(commited > raftlog->commited)
+    {
+        assert(commited <= lastIndex(raftlog));
+        raftlog->commited = commited;
+    }
 }
 
 uint64_t maybeAppendEntries(raftLog* raftlog, uint64_t pre_term, uint64_t pre_index, uint64_t commited, list* entries)
@@ -108,14 +122,18 @@ uint64_t maybeAppendEntries(raftLog* raftlog, uint64_t pre_term, uint64_t pre_in
     }
     uint64_t new_last_index = pre_index + listLength(entries);
     uint64_t conflict_index = findConflict(raftlog, entries);
-    assert(conflict_index > raftlog->commited);
-    uint64_t offset = conflict_index - pre_index - 1;
-    while(offset > 0)
+    if(conflict_index != 0)
     {
-        listDelNode(entries, listFirst(entries));
-        offset--;
+        /* Entries before the first conflict are already in the log. */
+        assert(conflict_index > raftlog->commited);
+        uint64_t offset = conflict_index - pre_index - 1;
+        while(offset > 0)
+        {
+            listDelNode(entries, listFirst(entries));
+            offset--;
+        }
+        append(raftlog, entries);
     }
-    append(raftlog, entries);
     commitTo(raftlog, new_last_index < commited ? new_last_index : commited);
     return new_last_index;
 } 
@@ -128,7 +146,7 @@ uint64_t append(raftLog* raftlog, list* entries)
     }
     raftEntry* raft_entry = listFirst(entries)->value;
     uint64_t after = raft_entry->index - 1;
-    assert(after < raftlog->commited);
+    assert(after >= raftlog->commited);
     unstableTruncateAndAppend(raftlog->uns, entries);
     return lastIndex(raftlog);
 }
@@ -163,10 +181,10 @@ bool maybeCommit(raftLog* raftlog, uint64_t max_index, uint64_t term)
     return false;
 }
 
-void restoreSnapshotMD(raftLog* raftlog, snapshotMetaData* ssmd)
+void restoreLogSnapshot(raftLog* raftlog, snapshot* ss)
 {
-    raftlog->commited = ssmd->lastLogIndex;
-    unstableRestore(raftlog->uns, ssmd);
+    raftlog->commited = ss->metaData->lastLogIndex;
+    unstableRestore(raftlog->uns, ss);
 }
 
 list* unstableEntries(raftLog* raftlog)
@@ -251,6 +269,7 @@ EntriesResult slice(raftLog* raftlog, uint64_t lo, uint64_t hi, uint64_t max_siz
             result.entries = unstable_ents;
         }else{
             listJoin(result.entries, unstable_ents);
+            listRelease(unstable_ents);
         }
     }
     return result;
@@ -13,6 +13,8 @@ typedef struct raftLog
 
 raftLog* newRaftLog(memoryStorage* ms);
 
+void freeRaftLog(raftLog* raftlog);
+
 TermResult termOf(raftLog* raftlog, uint64_t index);
 
 bool matchTerm(raftLog* raftlog, uint64_t term, uint64_t index);
@@ -38,7 +40,7 @@ bool isUpToDate(raftLog* raftlog, uint64_t last_index, uint64_t term);
 
 bool maybeCommit(raftLog* raftlog, uint64_t max_index, uint64_t term);
 
-void restoreSnapshotMD(raftLog* raftlog, snapshotMetaData* ssmd);
+void restoreLogSnapshot(raftLog* raftlog, snapshot* ss);
 
 list* unstableEntries(raftLog* raftlog);
 
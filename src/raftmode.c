@@ -0,0 +1,1115 @@
+/* Raft mode: replicate the dataset among a group of servers with the raft
+ * library, see raft.c.
+ *
+ * When "raft-id" is configured the servers listed with "raft-peer" form a
+ * raft group. Write commands are not executed when received: they are
+ * proposed to the raft log, and every node of the group executes them once
+ * committed, in the order of the log. Every node accepts writes, followers
+ * included: the writes received during an event loop iteration are proposed
+ * together in beforeSleep(), so that a follower forwards them to the leader
+ * as a single MessageProp (see flushProposals()). The client that sent the
+ * write is blocked until its node applies the entry, and gets the reply of
+ * that execution.
+ *
+ * With the CONSISTENCY command a client can trade this for a faster
+ * acknowledgement, or ask for linearizable reads:
+ *
+ * local         Writes reply +OK once proposed. Reads are served locally.
+ * leader        Writes reply +OK once the leader appended them to its log.
+ * quorum        Writes reply once applied, as described above. The default.
+ * linearizable  Like quorum, and reads wait for the commit index of the
+ *               leader (see requestReadIndex()) to be applied locally, so
+ *               that they see every write acknowledged before they started.
+ *
+ * Every entry is a sequence of commands in the Redis protocol, preceded by
+ * a header that is itself encoded as a command:
+ *
+ * C <runid> <reqid> <dbid> <ms>  Commands of the request <reqid> of the
+ *                                node whose run id is <runid>, executed in
+ *                                the database <dbid> as of the time <ms>.
+ * E <dbid> <ms> <key> ...        Keys of <dbid> to delete if expired at <ms>.
+ *
+ * Since expires are computed and checked with the time of the entry, see
+ * commandTime() and expireIfNeeded(), every node holds the same keys. Only
+ * the raft leader looks for expired keys, proposing "E" entries.
+ *
+ * The raft log and hard state are appended to the raft log file as they
+ * change, and replayed at startup to rebuild the dataset. The log is never
+ * compacted, so like an AOF that is never rewritten it grows with every
+ * write.
+ *
+ * Copyright (c) 2009-2012, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "server.h"
+#include "hiredis.h"
+#include "async.h"
+#include "raft.h"
+#include "read_only.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+
+/* Ticks are raftCron() calls, every 100 milliseconds. */
+#define RAFT_ELECTION_TICK 10
+#define RAFT_HEARTBEAT_TICK 1
+#define RAFT_MAX_INFLIGHT 256
+#define RAFT_MAX_MSG_SIZE (1024*1024) /* Entries bytes per append message. */
+#define RAFT_RECONNECT_PERIOD 1000
+#define RAFT_MAX_PENDING_COMMANDS 100
+#define RAFT_REQUEST_TIMEOUT 5000   /* Milliseconds a client waits for the
+                                       entry of its request. */
+#define RAFT_EXPIRE_LOOKUPS 20      /* Keys with an expire sampled by the
+                                       leader per database and tick. */
+#define RAFT_NOLEADER_ERR \
+    "-NOLEADER No raft leader at the moment, try again later\r\n"
+
+int redisAeAttach(aeEventLoop *loop, redisAsyncContext *ac);
+
+static struct raftModeState {
+    raft *r;                    /* Our raft node. */
+    memoryStorage *ms;          /* Raft log and hard state. */
+    hardState persisted;        /* Hard state saved in the log file. */
+    int fd;                     /* Raft log file, open for appending. */
+    raftPeer *peers[RAFT_MAX_PEERS]; /* Peers by raft id. */
+    list *proposals;            /* Entries proposed in this iteration. */
+    uint64_t next_reqid;        /* Id of the next client request. */
+    rax *waiting;               /* Clients waiting for their entry, or
+                                   for their read index, by request id. */
+    list *reads;                /* Clients whose read index is known,
+                                   waiting for it to be applied. */
+    client *client;             /* Executes the entries of the other
+                                   nodes, and the expired ones of ours. */
+} raftmode;
+
+/* ============================ Raft transport ==============================
+ * Shared with the Sentinel raft mode: the messages are sent as commands
+ * ("RAFT ..." or "SENTINEL RAFT ...") over a hiredis link to every peer.
+ * -------------------------------------------------------------------------- */
+
+raftPeer *createRaftPeer(uint8_t id, char *ip, int port) {
+    raftPeer *peer = zmalloc(sizeof(*peer));
+
+    peer->id = id;
+    peer->ip = sdsnew(ip);
+    peer->port = port;
+    peer->cc = NULL;
+    peer->pending_commands = 0;
+    peer->last_reconn_time = 0;
+    return peer;
+}
+
+static void raftLinkError(const redisAsyncContext *c) {
+    raftPeer *peer = c->data;
+
+    if (peer) peer->cc = NULL;
+}
+
+static void raftLinkEstablishedCallback(const redisAsyncContext *c, int status) {
+    if (status != C_OK) raftLinkError(c);
+}
+
+static void raftDisconnectCallback(const redisAsyncContext *c, int status) {
+    UNUSED(status);
+    raftLinkError(c);
+}
+
+static void raftReplyCallback(redisAsyncContext *c, void *reply, void *privdata) {
+    raftPeer *peer = c->data;
+    UNUSED(privdata);
+
+    if (!reply || !peer) return;
+    peer->pending_commands--;
+}
+
+/* Connect to the peer if it is disconnected, trying at most once every
+ * RAFT_RECONNECT_PERIOD milliseconds. */
+static void raftReconnectPeer(raftPeer *peer) {
+    mstime_t now = mstime();
+
+    if (peer->cc) return;
+    if (now - peer->last_reconn_time < RAFT_RECONNECT_PERIOD) return;
+    peer->last_reconn_time = now;
+
+    peer->cc = redisAsyncConnectBind(peer->ip,peer->port,NET_FIRST_BIND_ADDR);
+    if (peer->cc->err) {
+        serverLog(LL_DEBUG,"Can't connect to raft peer %d: %s",
+            peer->id, peer->cc->errstr);
+        redisAsyncFree(peer->cc);
+        peer->cc = NULL;
+        return;
+    }
+    peer->pending_commands = 0;
+    peer->cc->data = peer;
+    redisAeAttach(server.el,peer->cc);
+    redisAsyncSetConnectCallback(peer->cc,raftLinkEstablishedCallback);
+    redisAsyncSetDisconnectCallback(peer->cc,raftDisconnectCallback);
+
+    /* The peers of a raft group share the password, like a master and
+     * its slaves. */
+    if (server.masterauth &&
+        redisAsyncCommand(peer->cc,raftReplyCallback,NULL,"AUTH %s",
+            server.masterauth) == C_OK)
+    {
+        peer->pending_commands++;
+    }
+}
+
+/* Return the comma separated list of the raft ids in 'ids'. */
+static sds raftJoinIds(list *ids) {
+    sds s = sdsempty();
+    listIter li;
+    listNode *ln;
+
+    listRewind(ids,&li);
+    while((ln = listNext(&li)) != NULL) {
+        if (sdslen(s)) s = sdscatlen(s,",",1);
+        s = sdscatfmt(s,"%u",(unsigned int)(unsigned long)ln->value);
+    }
+    return s;
+}
+
+/* Add the raft ids listed in 's' by raftJoinIds() to 'ids'. */
+static void raftSplitIds(list *ids, sds s) {
+    int count, j;
+    sds *parts = sdssplitlen(s,sdslen(s),",",1,&count);
+
+    for (j = 0; j < count; j++) {
+        int id = atoi(parts[j]);
+
+        if (id > 0 && id < RAFT_MAX_PEERS)
+            listAddNodeTail(ids,(void*)(unsigned long)id);
+    }
+    sdsfreesplitres(parts,count);
+}
+
+/* Send a raft message to its peer as the command made of the 'prefixc'
+ * arguments in 'prefixv' followed by:
+ *
+ * <type> <from> <to> <term> <index> <log-term> <commit> <reject>
+ * <last-match-index> <context> [<term> <index> <type> <data> ...]
+ *
+ * Snapshot messages have no entries, but the snapshot instead:
+ *
+ * <index> <term> <peers> <witnesses> <data>
+ *
+ * Messages to disconnected or too slow peers are dropped: raft retries. */
+void raftSendMessage(raftPeer *peer, raftMessage *msg, int prefixc, char **prefixv) {
+    int snap = msg->type == MessageSnap;
+    int argc = prefixc + 10 + (snap ? 5 : listLength(msg->entries)*4), j = 0;
+    sds *argv;
+    size_t *argvlen;
+    listIter li;
+    listNode *ln;
+
+    if (peer == NULL) return;
+    raftReconnectPeer(peer);
+    if (peer->cc == NULL ||
+        peer->pending_commands >= RAFT_MAX_PENDING_COMMANDS) return;
+
+    argv = zmalloc(sizeof(sds)*argc);
+    argvlen = zmalloc(sizeof(size_t)*argc);
+    for (j = 0; j < prefixc; j++) argv[j] = sdsnew(prefixv[j]);
+    argv[j++] = sdsfromlonglong(msg->type);
+    argv[j++] = sdsfromlonglong(msg->from);
+    argv[j++] = sdsfromlonglong(msg->to);
+    argv[j++] = sdsfromlonglong(msg->term);
+    argv[j++] = sdsfromlonglong(msg->index);
+    argv[j++] = sdsfromlonglong(msg->logTerm);
+    argv[j++] = sdsfromlonglong(msg->commited);
+    argv[j++] = sdsfromlonglong(msg->reject);
+    argv[j++] = sdsfromlonglong(msg->lastMatchIndex);
+    argv[j++] = msg->context ? sdsdup(msg->context) : sdsempty();
+    if (snap) {
+        snapshotMetaData *ssmd = msg->ss->metaData;
+
+        argv[j++] = sdsfromlonglong(ssmd->lastLogIndex);
+        argv[j++] = sdsfromlonglong(ssmd->lastLogTerm);
+        argv[j++] = raftJoinIds(ssmd->cs->peers);
+        argv[j++] = raftJoinIds(ssmd->cs->witnesses);
+        argv[j++] = sdsdup(msg->ss->data);
+    } else {
+        listRewind(msg->entries,&li);
+        while((ln = listNext(&li)) != NULL) {
+            raftEntry *entry = ln->value;
+
+            argv[j++] = sdsfromlonglong(entry->term);
+            argv[j++] = sdsfromlonglong(entry->index);
+            argv[j++] = sdsfromlonglong(entry->entryType);
+            argv[j++] = sdsdup(entry->data);
+        }
+    }
+    for (j = 0; j < argc; j++) argvlen[j] = sdslen(argv[j]);
+
+    if (redisAsyncCommandArgv(peer->cc,raftReplyCallback,NULL,
+        argc,(const char**)argv,argvlen) == C_OK)
+    {
+        peer->pending_commands++;
+    }
+    for (j = 0; j < argc; j++) sdsfree(argv[j]);
+    zfree(argv);
+    zfree(argvlen);
+}
+
+/* Parse the raft message sent by raftSendMessage() starting at the argument
+ * 'first' of the client, for the raft node 'r'. Returns NULL, after replying
+ * with an error, if the message is not valid. */
+raftMessage *raftMessageFromArgv(client *c, int first, raft *r) {
+    long long field[9];
+    raftMessage *msg;
+    int j, snap;
+
+    if (c->argc < first+10) goto numargserr;
+    for (j = 0; j < 9; j++) {
+        if (getLongLongFromObjectOrReply(c,c->argv[first+j],&field[j],NULL)
+            != C_OK) return NULL;
+    }
+    switch(field[0]) {
+    case MessageProp: case MessageHeartBeat: case MessageHeartBeatResp:
+    case MessageApp: case MessageAppResp: case MessageVote:
+    case MessageVoteResp: case MessageReadIndex: case MessageReadIndexResp:
+    case MessageSnap:
+        break;
+    default:
+        addReplyError(c,"Invalid raft message type");
+        return NULL;
+    }
+    snap = field[0] == MessageSnap;
+    if (snap ? c->argc != first+15 : (c->argc-first-10) % 4) goto numargserr;
+    if (field[2] != r->id || field[1] <= 0 || field[1] >= RAFT_MAX_PEERS ||
+        r->prs[field[1]] == NULL)
+    {
+        addReplyError(c,"Unknown raft peer");
+        return NULL;
+    }
+
+    msg = createRaftMessage();
+    msg->type = field[0];
+    msg->from = field[1];
+    msg->to = field[2];
+    msg->term = field[3];
+    msg->index = field[4];
+    msg->logTerm = field[5];
+    msg->commited = field[6];
+    msg->reject = field[7] != 0;
+    msg->lastMatchIndex = field[8];
+    msg->context = sdscpy(msg->context,c->argv[first+9]->ptr);
+    first += 10;
+    if (snap) {
+        snapshotMetaData *ssmd = msg->ss->metaData;
+
+        ssmd->lastLogIndex = strtoull(c->argv[first]->ptr,NULL,10);
+        ssmd->lastLogTerm = strtoull(c->argv[first+1]->ptr,NULL,10);
+        raftSplitIds(ssmd->cs->peers,c->argv[first+2]->ptr);
+        raftSplitIds(ssmd->cs->witnesses,c->argv[first+3]->ptr);
+        msg->ss->data = sdscpylen(msg->ss->data,c->argv[first+4]->ptr,
+                                  sdslen(c->argv[first+4]->ptr));
+    }
+    for (j = first; !snap && j < c->argc; j += 4) {
+        raftEntry *entry = createRaftEntry();
+
+        entry->term = strtoull(c->argv[j]->ptr,NULL,10);
+        entry->index = strtoull(c->argv[j+1]->ptr,NULL,10);
+        entry->entryType = atoi(c->argv[j+2]->ptr);
+        entry->data = sdscpylen(entry->data,c->argv[j+3]->ptr,
+                                sdslen(c->argv[j+3]->ptr));
+        listAddNodeTail(msg->entries,entry);
+    }
+    return msg;
+
+numargserr:
+    addReplyError(c,"Wrong number of arguments for the raft message");
+    return NULL;
+}
+
+/* ============================== Raft log file ============================
+ * The records are appended to the file as the log and the hard state
+ * change:
+ *
+ * entry <index> <term> <type> <len>\r\n<data>\r\n
+ * state <term> <vote> <commit>\r\n
+ *
+ * An entry replaces the entries of the log with the same or a greater
+ * index, like when the leader overwrites a conflicting tail.
+ * -------------------------------------------------------------------------- */
+
+/* Load the raft log file into the raft storage. A record truncated by a
+ * crash at the end of the file is discarded, like with aof-load-truncated. */
+static void raftLoadLog(void) {
+    FILE *fp = fopen(server.raft_log_filename,"r");
+    char buf[128];
+    off_t valid = 0;
+    long long records = 0;
+
+    if (fp == NULL) {
+        if (errno == ENOENT) return;
+        serverLog(LL_WARNING,"Fatal error: can't open the raft log %s: %s",
+            server.raft_log_filename, strerror(errno));
+        exit(1);
+    }
+
+    while(fgets(buf,sizeof(buf),fp) != NULL) {
+        int argc;
+        sds *argv;
+
+        if (strchr(buf,'\n') == NULL) goto truncated;
+        argv = sdssplitargs(buf,&argc);
+        if (argv && argc == 5 && !strcmp(argv[0],"entry")) {
+            raftEntry *entry = createRaftEntry();
+            size_t len = strtoull(argv[4],NULL,10);
+            list *entries;
+
+            entry->index = strtoull(argv[1],NULL,10);
+            entry->term = strtoull(argv[2],NULL,10);
+            entry->entryType = atoi(argv[3]);
+            entry->data = sdsMakeRoomFor(entry->data,len+2);
+            if (fread(entry->data,len+2,1,fp) != 1) {
+                freeRaftEntry(entry);
+                sdsfreesplitres(argv,argc);
+                goto truncated;
+            }
+            sdssetlen(entry->data,len);
+            entry->data[len] = '\0';
+            if (entry->index == 0 ||
+                entry->index > storageLastIndex(raftmode.ms)+1)
+            {
+                freeRaftEntry(entry);
+                sdsfreesplitres(argv,argc);
+                goto fmterr;
+            }
+            entries = createRaftEntryList();
+            listAddNodeTail(entries,entry);
+            AppendEntriesToStorage(raftmode.ms,entries);
+            listRelease(entries);
+        } else if (argv && argc == 4 && !strcmp(argv[0],"state")) {
+            hardState hs;
+
+            hs.term = strtoull(argv[1],NULL,10);
+            hs.voteFor = atoi(argv[2]);
+            hs.commited = strtoull(argv[3],NULL,10);
+            setHardState(raftmode.ms,&hs);
+            raftmode.persisted = hs;
+        } else {
+            sdsfreesplitres(argv,argc);
+            goto fmterr;
+        }
+        sdsfreesplitres(argv,argc);
+        valid = ftello(fp);
+        records++;
+    }
+    fclose(fp);
+    serverLog(LL_NOTICE,"Raft log loaded: %lld records, last index %llu",
+        records, (unsigned long long) storageLastIndex(raftmode.ms));
+    return;
+
+truncated:
+    serverLog(LL_WARNING,"!!! Warning: short read while loading the raft log "
+        "%s, the last record is discarded !!!", server.raft_log_filename);
+    if (ftruncate(fileno(fp),valid) == -1) {
+        serverLog(LL_WARNING,"Error truncating the raft log: %s",
+            strerror(errno));
+        exit(1);
+    }
+    fclose(fp);
+    return;
+
+fmterr:
+    serverLog(LL_WARNING,"Bad record in the raft log %s at offset %lld",
+        server.raft_log_filename, (long long) valid);
+    exit(1);
+}
+
+/* Append the records in 'buf' to the raft log file, and flush them to disk
+ * before we acknowledge them to the other nodes. Like with the AOF and
+ * "appendfsync always", we can't go on if the write fails. */
+static void raftWriteLog(sds buf) {
+    size_t written = 0;
+
+    while(written < sdslen(buf)) {
+        ssize_t nwritten = write(raftmode.fd,buf+written,sdslen(buf)-written);
+
+        if (nwritten <= 0) {
+            if (nwritten == -1 && errno == EINTR) continue;
+            serverLog(LL_WARNING,"Can't write the raft log: %s. Exiting...",
+                nwritten == -1 ? strerror(errno) : "short write");
+            exit(1);
+        }
+        written += nwritten;
+    }
+    if (aof_fsync(raftmode.fd) == -1) {
+        serverLog(LL_WARNING,"Can't fsync the raft log: %s. Exiting...",
+            strerror(errno));
+        exit(1);
+    }
+}
+
+/* =============================== Raft node ================================ */
+
+/* Add the peer "raft-peer <id> <ip> <port>". Returns an error, or NULL. */
+char *raftAddPeer(int id, char *ip, int port) {
+    if (id < 1 || id >= RAFT_MAX_PEERS) return "Raft id must be between 1 and 255";
+    if (port <= 0 || port > 65535) return "Invalid port";
+    if (raftmode.peers[id]) return "Duplicated raft peer id";
+    raftmode.peers[id] = createRaftPeer(id,ip,port);
+    return NULL;
+}
+
+/* Create the raft node, loading its log from the raft log file. */
+void raftInit(void) {
+    raftConfig cfg;
+    list *peers = listCreate();
+    int j;
+
+    raftmode.ms = newMemoryStorage();
+    memset(&raftmode.persisted,0,sizeof(raftmode.persisted));
+    raftLoadLog();
+    raftmode.fd = open(server.raft_log_filename,O_WRONLY|O_APPEND|O_CREAT,0644);
+    if (raftmode.fd == -1) {
+        serverLog(LL_WARNING,"Can't open the raft log %s: %s",
+            server.raft_log_filename, strerror(errno));
+        exit(1);
+    }
+
+    /* Our own id is part of the group even if it is not listed among the
+     * peers, so that every node can use the same list. */
+    listAddNodeTail(peers,(void*)(unsigned long)server.raft_id);
+    for (j = 1; j < RAFT_MAX_PEERS; j++) {
+        if (raftmode.peers[j] && j != server.raft_id)
+            listAddNodeTail(peers,(void*)(unsigned long)j);
+    }
+
+    memset(&cfg,0,sizeof(cfg));
+    cfg.id = server.raft_id;
+    cfg.electionTick = RAFT_ELECTION_TICK;
+    cfg.heartbeatTick = RAFT_HEARTBEAT_TICK;
+    cfg.checkQuorum = true;
+    cfg.maxSizePerMsg = RAFT_MAX_MSG_SIZE;
+    cfg.maxInflightMsgs = RAFT_MAX_INFLIGHT;
+    cfg.applied = 0; /* The dataset is rebuilt from the start of the log. */
+    cfg.storage = raftmode.ms;
+    cfg.peers = peers;
+    raftmode.r = newRaft(&cfg);
+    listRelease(peers);
+
+    raftmode.proposals = listCreate();
+    raftmode.next_reqid = 1;
+    raftmode.waiting = raxNew();
+    raftmode.reads = listCreate();
+    raftmode.client = createClient(-1);
+    serverLog(LL_NOTICE,"Raft id is %d, %d nodes in the group",
+        server.raft_id, raftmode.r->numPeers);
+}
+
+/* Called every 100 milliseconds by serverCron(). The raft leader also
+ * samples the keys with an expire, and proposes to delete the expired ones:
+ * the other nodes never delete them on their own. */
+void raftCron(void) {
+    raft *r = raftmode.r;
+    mstime_t now = mstime();
+    int j, k;
+
+    r->tick(r);
+    if (r->state != NodeStateLeader) return;
+
+    for (j = 0; j < server.dbnum; j++) {
+        redisDb *db = server.db+j;
+        sds argv[3+RAFT_EXPIRE_LOOKUPS];
+        int argc = 3;
+        raftEntry *entry;
+
+        if (dictSize(db->expires) == 0) continue;
+        for (k = 0; k < RAFT_EXPIRE_LOOKUPS; k++) {
+            dictEntry *de = dictGetRandomKey(db->expires);
+
+            if (dictGetSignedIntegerVal(de) < now)
+                argv[argc++] = sdsdup(dictGetKey(de));
+        }
+        if (argc == 3) continue;
+
+        argv[0] = sdsnew("E");
+        argv[1] = sdsfromlonglong(j);
+        argv[2] = sdsfromlonglong(now);
+        entry = createRaftEntry();
+        entry->data = sdscatfmt(entry->data,"*%i\r\n",argc);
+        for (k = 0; k < argc; k++) {
+            entry->data = sdscatfmt(entry->data,"$%U\r\n%S\r\n",
+                (unsigned long long) sdslen(argv[k]), argv[k]);
+            sdsfree(argv[k]);
+        }
+        listAddNodeTail(raftmode.proposals,entry);
+    }
+}
+
+/* Parse the command at the offset *pos of the entry 'data', advancing *pos
+ * past it. Returns NULL at the end of the entry, or if it is malformed. */
+static robj **raftParseCommand(sds data, size_t *pos, int *argc) {
+    char *p = data+*pos, *end = data+sdslen(data), *nl;
+    long long count, len;
+    robj **argv;
+    int j;
+
+    if (p >= end || *p != '*') return NULL;
+    nl = memchr(p,'\r',end-p);
+    if (nl == NULL || !string2ll(p+1,nl-p-1,&count) ||
+        count <= 0 || count > INT_MAX) return NULL;
+    p = nl+2;
+
+    argv = zmalloc(sizeof(robj*)*count);
+    for (j = 0; j < count; j++) {
+        if (p >= end || *p != '$' || (nl = memchr(p,'\r',end-p)) == NULL ||
+            !string2ll(p+1,nl-p-1,&len) || len < 0 || len+4 > end-nl)
+        {
+            while(j--) decrRefCount(argv[j]);
+            zfree(argv);
+            return NULL;
+        }
+        argv[j] = createStringObject(nl+2,len);
+        p = nl+2+len+2;
+    }
+    *pos = p-data;
+    *argc = count;
+    return argv;
+}
+
+static void raftFreeArgv(robj **argv, int argc) {
+    int j;
+
+    for (j = 0; j < argc; j++) decrRefCount(argv[j]);
+    zfree(argv);
+}
+
+/* Execute the commands of an entry, starting at the offset 'pos', with our
+ * client that has no connection: the request was sent to another node, or
+ * was already replied to because of the timeout. Transactions are executed
+ * like when the AOF is loaded. */
+static void raftExecuteCommands(sds data, size_t pos, int dbid) {
+    client *c = raftmode.client;
+    robj **argv;
+    int argc;
+
+    if (selectDb(c,dbid) == C_ERR) {
+        serverLog(LL_WARNING,"Raft entry for the missing database %d", dbid);
+        return;
+    }
+    while((argv = raftParseCommand(data,&pos,&argc)) != NULL) {
+        struct redisCommand *cmd = lookupCommand(argv[0]->ptr);
+
+        if (cmd == NULL) {
+            serverLog(LL_WARNING,"Unknown command '%s' in the raft log",
+                (char*)argv[0]->ptr);
+            raftFreeArgv(argv,argc);
+            continue;
+        }
+        c->argc = argc;
+        c->argv = argv;
+        c->cmd = c->lastcmd = cmd;
+        if (c->flags & CLIENT_MULTI && cmd->proc != execCommand)
+            queueMultiCommand(c);
+        else
+            call(c,CMD_CALL_FULL);
+        /* The command may have rewritten its arguments. */
+        raftFreeArgv(c->argv,c->argc);
+        c->argv = NULL;
+        c->argc = 0;
+        c->cmd = NULL;
+    }
+    if (c->flags & CLIENT_MULTI) discardTransaction(c);
+}
+
+/* Encode the request id as a key of raftmode.waiting. */
+static void raftEncodeReqid(unsigned char *buf, uint64_t reqid) {
+    reqid = htonu64(reqid);
+    memcpy(buf,&reqid,sizeof(reqid));
+}
+
+/* Return the client waiting for the request 'reqid', or NULL. */
+static client *raftWaitingClient(uint64_t reqid) {
+    unsigned char buf[8];
+    void *c;
+
+    raftEncodeReqid(buf,reqid);
+    c = raxFind(raftmode.waiting,buf,sizeof(buf));
+    return c == raxNotFound ? NULL : c;
+}
+
+/* Return the client waiting for the entry whose header is 'argv', or NULL
+ * if the entry was proposed by another node or nobody waits for it. */
+static client *raftEntryClient(robj **argv, int argc) {
+    if (argc != 5 || strcmp(argv[0]->ptr,"C") ||
+        strcmp(argv[1]->ptr,server.runid)) return NULL;
+    return raftWaitingClient(strtoull(argv[2]->ptr,NULL,10));
+}
+
+/* Apply a committed entry. */
+static void raftApplyEntry(sds data) {
+    size_t pos = 0;
+    int argc, j;
+    robj **argv = raftParseCommand(data,&pos,&argc);
+    long long dbid, ms;
+
+    if (argv == NULL) goto badentry;
+    if (!strcmp(argv[0]->ptr,"C") && argc == 5 &&
+        string2ll(argv[3]->ptr,sdslen(argv[3]->ptr),&dbid) &&
+        string2ll(argv[4]->ptr,sdslen(argv[4]->ptr),&ms) && ms > 0)
+    {
+        client *c = raftEntryClient(argv,argc);
+
+        server.raft_apply_time = ms;
+        if (c != NULL) {
+            /* The client waiting for this entry executes it, getting the
+             * reply. Its arguments and transaction are the ones encoded
+             * in the entry. */
+            serverAssert(c->db->id == dbid);
+            server.current_client = c;
+            call(c,CMD_CALL_FULL);
+            c->woff = server.master_repl_offset;
+            server.current_client = NULL;
+            unblockClient(c);
+        } else {
+            raftExecuteCommands(data,pos,dbid);
+        }
+        server.raft_apply_time = 0;
+    } else if (!strcmp(argv[0]->ptr,"E") && argc >= 3 &&
+               string2ll(argv[1]->ptr,sdslen(argv[1]->ptr),&dbid) &&
+               string2ll(argv[2]->ptr,sdslen(argv[2]->ptr),&ms) && ms > 0 &&
+               dbid >= 0 && dbid < server.dbnum)
+    {
+        server.raft_apply_time = ms;
+        for (j = 3; j < argc; j++) expireIfNeeded(server.db+dbid,argv[j]);
+        server.raft_apply_time = 0;
+    } else {
+        goto badentry;
+    }
+    raftFreeArgv(argv,argc);
+    return;
+
+badentry:
+    serverLog(LL_WARNING,"Skipping a malformed raft entry");
+    if (argv) raftFreeArgv(argv,argc);
+}
+
+/* Called for the entries appended to our log: reply to the client waiting
+ * for the entry with the "leader" consistency. On the leader the entry is
+ * appended as soon as proposed, on a follower when the leader sends it back
+ * appended to its own log. */
+static void raftAckAppendedEntry(sds data) {
+    size_t pos = 0;
+    int argc;
+    robj **argv = raftParseCommand(data,&pos,&argc);
+    client *c;
+
+    if (argv == NULL) return;
+    c = raftEntryClient(argv,argc);
+    if (c && c->raft_consistency == ConsistencyLeader) {
+        addReply(c,shared.ok);
+        unblockClient(c);
+    }
+    raftFreeArgv(argv,argc);
+}
+
+/* Serve the linearizable reads: a read can be executed once the leader
+ * confirmed the commit index it has to wait for, in a ReadState, and this
+ * index is applied. */
+static void raftServeReads(void) {
+    raft *r = raftmode.r;
+    listIter li;
+    listNode *ln;
+
+    while((ln = listFirst(r->readStates)) != NULL) {
+        ReadState *rs = ln->value;
+        client *c = raftWaitingClient(strtoull(rs->requestCtx,NULL,10));
+
+        if (c && c->bpop.raft_read_index == 0) {
+            c->bpop.raft_read_index = rs->index;
+            listAddNodeTail(raftmode.reads,c);
+        }
+        listDelNode(r->readStates,ln);
+    }
+
+    listRewind(raftmode.reads,&li);
+    while((ln = listNext(&li)) != NULL) {
+        client *c = ln->value;
+
+        if (c->bpop.raft_read_index > r->raftlog->applied) continue;
+        server.current_client = c;
+        call(c,CMD_CALL_FULL);
+        server.current_client = NULL;
+        unblockClient(c);
+    }
+}
+
+/* Run the raft node: propose the writes of this event loop iteration as a
+ * single message, save the new log entries and hard state, apply what was
+ * committed, and only then send the messages, so that nothing we
+ * acknowledge can be lost by a restart. */
+static void raftReady(void) {
+    raft *r = raftmode.r;
+    sds buf = sdsempty();
+    hardState hs;
+    list *entries, *msgs;
+    listIter li;
+    listNode *ln;
+    char *prefix = "RAFT";
+
+    if (listLength(raftmode.proposals)) {
+        raftMessage *msg = createRaftMessage();
+
+        msg->type = MessageProp;
+        msg->from = server.raft_id;
+        while((ln = listFirst(raftmode.proposals)) != NULL) {
+            listAddNodeTail(msg->entries,ln->value);
+            listDelNode(raftmode.proposals,ln);
+        }
+        Step(r,msg);
+        freeRaftMessage(msg);
+    }
+    flushProposals(r);
+
+    listRewind(r->raftlog->uns->entries,&li);
+    while((ln = listNext(&li)) != NULL) {
+        raftEntry *entry = ln->value;
+
+        if (raxSize(raftmode.waiting)) raftAckAppendedEntry(entry->data);
+        buf = sdscatprintf(buf,"entry %llu %llu %d %zu\r\n",
+            (unsigned long long) entry->index,
+            (unsigned long long) entry->term,
+            (int) entry->entryType, sdslen(entry->data));
+        buf = sdscatsds(buf,entry->data);
+        buf = sdscatlen(buf,"\r\n",2);
+    }
+    raftStableEntries(r);
+    hs = raftHardState(r);
+    if (hs.term != raftmode.persisted.term ||
+        hs.voteFor != raftmode.persisted.voteFor ||
+        hs.commited != raftmode.persisted.commited)
+    {
+        buf = sdscatprintf(buf,"state %llu %d %llu\r\n",
+            (unsigned long long) hs.term, (int) hs.voteFor,
+            (unsigned long long) hs.commited);
+        setHardState(raftmode.ms,&hs);
+        raftmode.persisted = hs;
+    }
+    if (sdslen(buf)) raftWriteLog(buf);
+    sdsfree(buf);
+
+    if ((entries = raftCommittedEntries(r)) != NULL) {
+        listRewind(entries,&li);
+        while((ln = listNext(&li)) != NULL) {
+            raftEntry *entry = ln->value;
+
+            /* Leaders commit an empty entry when elected. */
+            if (sdslen(entry->data)) raftApplyEntry(entry->data);
+        }
+        listRelease(entries);
+        if (listLength(server.ready_keys)) handleClientsBlockedOnLists();
+    }
+    raftServeReads();
+
+    msgs = raftTakeMessages(r);
+    listRewind(msgs,&li);
+    while((ln = listNext(&li)) != NULL) {
+        raftMessage *msg = ln->value;
+
+        if (msg->to != server.raft_id)
+            raftSendMessage(raftmode.peers[msg->to],msg,1,&prefix);
+    }
+    listRelease(msgs);
+}
+
+/* Called by beforeSleep(). */
+void raftBeforeSleep(void) {
+    raftReady();
+
+    /* The clients we just replied to may have more commands in their query
+     * buffer: propose their writes now rather than at the next iteration,
+     * that may be up to 100 milliseconds away. */
+    if (listLength(server.unblocked_clients)) {
+        processUnblockedClients();
+        if (listLength(raftmode.proposals)) raftReady();
+    }
+}
+
+/* ============================ Client requests ============================= */
+
+/* Return an error if the command can't be executed by every node with the
+ * same result, or NULL. */
+static char *raftCheckCommand(struct redisCommand *cmd) {
+    if (cmd->flags & CMD_WRITE && cmd->flags & CMD_RANDOM)
+        return "Non deterministic write commands are not supported in raft mode";
+    if (cmd->proc == migrateCommand)
+        return "MIGRATE is not supported in raft mode";
+    return NULL;
+}
+
+/* Replace EVALSHA with EVAL and the script body in the arguments: the other
+ * nodes may not have the script. Returns C_ERR if we don't have it either. */
+static int raftRewriteEvalSha(robj **argv, struct redisCommand **cmdp) {
+    robj *body;
+    sds sha;
+
+    if (sdslen(argv[1]->ptr) != 40) return C_ERR;
+    sha = sdsdup(argv[1]->ptr);
+    sdstolower(sha);
+    body = dictFetchValue(server.lua_scripts,sha);
+    sdsfree(sha);
+    if (body == NULL) return C_ERR;
+
+    decrRefCount(argv[0]);
+    argv[0] = createStringObject("EVAL",4);
+    decrRefCount(argv[1]);
+    argv[1] = body;
+    incrRefCount(body);
+    *cmdp = lookupCommandByCString("eval");
+    return C_OK;
+}
+
+static int raftClientConsistency(client *c) {
+    return c->raft_consistency ? c->raft_consistency : ConsistencyQuorum;
+}
+
+/* Block the client until the request raftmode.next_reqid completes. */
+static void raftBlockClient(client *c) {
+    unsigned char buf[8];
+
+    c->bpop.raft_reqid = raftmode.next_reqid++;
+    c->bpop.raft_read_index = 0;
+    c->bpop.timeout = mstime()+RAFT_REQUEST_TIMEOUT;
+    raftEncodeReqid(buf,c->bpop.raft_reqid);
+    raxInsert(raftmode.waiting,buf,sizeof(buf),c,NULL);
+    blockClient(c,BLOCKED_RAFT);
+}
+
+/* Start a linearizable read, or transaction without writes: the client is
+ * blocked until raftServeReads() executes it. */
+static int raftProcessRead(client *c) {
+    sds ctx;
+
+    if (raftmode.r->leader == 0) {
+        if (c->flags & CLIENT_MULTI) discardTransaction(c);
+        addReplySds(c,sdsnew(RAFT_NOLEADER_ERR));
+        return 1;
+    }
+    ctx = sdsfromlonglong(raftmode.next_reqid);
+    requestReadIndex(raftmode.r,ctx);
+    sdsfree(ctx);
+    raftBlockClient(c);
+    return 1;
+}
+
+/* Called by processCommand() for every command in raft mode. Returns 1 if
+ * the command was proposed to the raft log, blocking the client until the
+ * entry is applied or appended (see CONSISTENCY), if it is a linearizable
+ * read waiting for its read index, or if it was refused with an error. Returns 0 if the command has
+ * to be executed, or queued in a transaction, right away. */
+int raftProcessCommand(client *c) {
+    int j, writes = 0, level = raftClientConsistency(c);
+    sds data;
+    raftEntry *entry;
+    char *err = NULL;
+    sds header[5];
+
+    if (c->flags & CLIENT_MULTI) {
+        if (c->cmd->proc != execCommand || c->flags & CLIENT_DIRTY_EXEC)
+            return 0;
+        for (j = 0; j < c->mstate.count; j++) {
+            multiCmd *mc = c->mstate.commands+j;
+
+            if (mc->cmd->flags & CMD_WRITE ||
+                mc->cmd->proc == evalCommand || mc->cmd->proc == evalShaCommand)
+                writes = 1;
+            if (!err) err = raftCheckCommand(mc->cmd);
+            if (!err && mc->cmd->proc == evalShaCommand &&
+                raftRewriteEvalSha(mc->argv,&mc->cmd) == C_ERR)
+                err = "-NOSCRIPT No matching script in the transaction";
+        }
+        if (!writes) return level == ConsistencyLinearizable ?
+                            raftProcessRead(c) : 0;
+    } else {
+        /* WATCH can't work since the transaction is executed later. */
+        if (c->cmd->proc == watchCommand)
+            err = "WATCH is not supported in raft mode";
+        else if (c->cmd->proc == blpopCommand ||
+                 c->cmd->proc == brpopCommand ||
+                 c->cmd->proc == brpoplpushCommand)
+            err = "Blocking commands are not supported in raft mode";
+        else if (!(c->cmd->flags & CMD_WRITE) &&
+                 c->cmd->proc != evalCommand && c->cmd->proc != evalShaCommand)
+            return level == ConsistencyLinearizable &&
+                   c->cmd->flags & CMD_READONLY ? raftProcessRead(c) : 0;
+        if (!err) err = raftCheckCommand(c->cmd);
+        if (!err && c->cmd->proc == evalShaCommand &&
+            raftRewriteEvalSha(c->argv,&c->cmd) == C_ERR)
+        {
+            addReply(c,shared.noscripterr);
+            return 1;
+        }
+    }
+
+    if (err == NULL && raftmode.r->leader == 0) {
+        if (c->flags & CLIENT_MULTI) discardTransaction(c);
+        addReplySds(c,sdsnew(RAFT_NOLEADER_ERR));
+        return 1;
+    }
+    if (err) {
+        if (c->flags & CLIENT_MULTI) discardTransaction(c);
+        if (err[0] == '-')
+            addReplySds(c,sdscatfmt(sdsnew(err),"\r\n"));
+        else
+            addReplyError(c,err);
+        return 1;
+    }
+
+    /* The entry: the header, then the command or the whole transaction. */
+    header[0] = sdsnew("C");
+    header[1] = sdsnew(server.runid);
+    header[2] = sdsfromlonglong(raftmode.next_reqid);
+    header[3] = sdsfromlonglong(c->db->id);
+    header[4] = sdsfromlonglong(mstime());
+    data = sdscatfmt(sdsempty(),"*%i\r\n",5);
+    for (j = 0; j < 5; j++) {
+        data = sdscatfmt(data,"$%U\r\n%S\r\n",
+            (unsigned long long) sdslen(header[j]), header[j]);
+        sdsfree(header[j]);
+    }
+    if (c->flags & CLIENT_MULTI) {
+        robj *multi = createStringObject("MULTI",5);
+
+        data = catAppendOnlyGenericCommand(data,1,&multi);
+        decrRefCount(multi);
+        for (j = 0; j < c->mstate.count; j++) {
+            multiCmd *mc = c->mstate.commands+j;
+
+            data = catAppendOnlyGenericCommand(data,mc->argc,mc->argv);
+        }
+    }
+    data = catAppendOnlyGenericCommand(data,c->argc,c->argv);
+
+    entry = createRaftEntry();
+    sdsfree(entry->data);
+    entry->data = data;
+    listAddNodeTail(raftmode.proposals,entry);
+
+    /* Wait for the entry, unless the client does not care. The entry
+     * is then executed like the ones proposed by the other nodes. */
+    if (level == ConsistencyLocal) {
+        raftmode.next_reqid++;
+        if (c->flags & CLIENT_MULTI) discardTransaction(c);
+        addReply(c,shared.ok);
+        return 1;
+    }
+    raftBlockClient(c);
+    return 1;
+}
+
+/* Called by unblockClient(): the client got the reply it was waiting for,
+ * timed out, or is being freed. */
+void raftUnblockClient(client *c) {
+    unsigned char buf[8];
+
+    raftEncodeReqid(buf,c->bpop.raft_reqid);
+    raxRemove(raftmode.waiting,buf,sizeof(buf),NULL);
+    c->bpop.raft_reqid = 0;
+    if (c->bpop.raft_read_index) {
+        listDelNode(raftmode.reads,listSearchKey(raftmode.reads,c));
+        c->bpop.raft_read_index = 0;
+    }
+    if (c->flags & CLIENT_MULTI) discardTransaction(c);
+    resetClient(c);
+}
+
+void raftBlockedClientTimedOut(client *c) {
+    addReplySds(c,sdsnew("-TIMEOUT The raft request did not complete in time, "
+                         "a write may still be applied later\r\n"));
+}
+
+/* RAFT <type> <from> <to> ... as sent by raftSendMessage(). The messages
+ * of the iteration are processed together in raftBeforeSleep(). */
+void raftCommand(client *c) {
+    raftMessage *msg;
+
+    if (!server.raft_id) {
+        addReplyError(c,"This instance has raft mode disabled");
+        return;
+    }
+    if ((msg = raftMessageFromArgv(c,1,raftmode.r)) == NULL) return;
+    Step(raftmode.r,msg);
+    freeRaftMessage(msg);
+    addReply(c,shared.ok);
+}
+
+/* CONSISTENCY [local|leader|quorum|linearizable]
+ *
+ * Set when the writes of the client are acknowledged, and whether its reads
+ * are linearizable, see the top comment. Without argument the current level
+ * is returned. */
+void consistencyCommand(client *c) {
+    static char *names[] = {NULL,"local","leader","quorum","linearizable"};
+    int level;
+
+    if (!server.raft_id) {
+        addReplyError(c,"This instance has raft mode disabled");
+        return;
+    }
+    if (c->argc == 1) {
+        addReplyBulkCString(c,names[raftClientConsistency(c)]);
+        return;
+    }
+    if (c->argc != 2) {
+        addReply(c,shared.syntaxerr);
+        return;
+    }
+    if ((level = consistencyLevelFromString(c->argv[1]->ptr)) == -1) {
+        addReplyError(c,"Consistency must be one of local, leader, quorum "
+                        "or linearizable");
+        return;
+    }
+    c->raft_consistency = level;
+    addReply(c,shared.ok);
+}
+
+sds raftCatInfoString(sds info) {
+    raft *r = raftmode.r;
+    char *state = r->state == NodeStateLeader ? "leader" :
+                  r->state == NodeStateCandidate ? "candidate" : "follower";
+
+    return sdscatprintf(info,
+        "raft_id:%d\r\n"
+        "raft_state:%s\r\n"
+        "raft_leader:%d\r\n"
+        "raft_term:%llu\r\n"
+        "raft_last_index:%llu\r\n"
+        "raft_commit:%llu\r\n"
+        "raft_applied:%llu\r\n"
+        "raft_waiting_clients:%llu\r\n",
+        server.raft_id, state, r->leader,
+        (unsigned long long) r->term,
+        (unsigned long long) lastIndex(r->raftlog),
+        (unsigned long long) r->raftlog->commited,
+        (unsigned long long) r->raftlog->applied,
+        (unsigned long long) raxSize(raftmode.waiting));
+}
@@ -807,6 +807,41 @@ void *raxFind(rax *rax, unsigned char *s, size_t len) {
     return raxGetData(h);
 }
 
+/* Call 'fn' with the value of every key of the rax that is a prefix of the
+ * string 's' of 'len' bytes (the empty key and 's' itself included), from
+ * the shortest to the longest, together with the 'privdata' pointer.
+ * A single descent along 's' is performed: this is the same walk of
+ * raxLowWalk(), just stopping at every key node met on the way. */
+void raxFindPrefixes(rax *rax, unsigned char *s, size_t len,
+                     void (*fn)(void *data, void *privdata), void *privdata)
+{
+    raxNode *h = rax->head;
+    size_t i = 0; /* Position in the string. */
+    size_t j; /* Child to follow. */
+
+    while(1) {
+        if (h->iskey) fn(raxGetData(h),privdata);
+        if (h->size == 0 || i == len) break;
+        unsigned char *v = h->data;
+
+        if (h->iscompr) {
+            /* The key nodes are the ones ending the compressed sequence,
+             * so the whole sequence must match. */
+            if (h->size > len-i || memcmp(v,s+i,h->size) != 0) break;
+            i += h->size;
+            j = 0;
+        } else {
+            for (j = 0; j < h->size; j++) {
+                if (v[j] == s[i]) break;
+            }
+            if (j == h->size) break;
+            i++;
+        }
+        raxNode **children = raxNodeFirstChildPtr(h);
+        memcpy(&h,children+j,sizeof(h));
+    }
+}
+
 /* Return the memory address where the 'parent' node stores the specified
  * 'child' pointer, so that the caller can update the pointer with another
  * one if needed. The function assumes it will find a match, otherwise the
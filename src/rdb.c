@@ -595,7 +595,10 @@ int rdbLoadBinaryFloatValue(rio *rdb, float *val) {
 int rdbSaveObjectType(rio *rdb, robj *o) {
     switch (o->type) {
     case OBJ_STRING:
-        return rdbSaveType(rdb,RDB_TYPE_STRING);
+        if (o->encoding == OBJ_ENCODING_ROARING)
+            return rdbSaveType(rdb,RDB_TYPE_STRING_ROARING);
+        else
+            return rdbSaveType(rdb,RDB_TYPE_STRING);
     case OBJ_LIST:
         if (o->encoding == OBJ_ENCODING_QUICKLIST)
             return rdbSaveType(rdb,RDB_TYPE_LIST_QUICKLIST);
@@ -643,7 +646,17 @@ int rdbLoadObjectType(rio *rdb) {
 ssize_t rdbSaveObject(rio *rdb, robj *o) {
     ssize_t n = 0, nwritten = 0;
 
-    if (o->type == OBJ_STRING) {
+    if (o->type == OBJ_STRING && o->encoding == OBJ_ENCODING_ROARING) {
+        /* Save a sparse bitmap as a serialized blob. */
+        size_t l = roaringBlobLen(o->ptr);
+        unsigned char *blob = zmalloc(l);
+
+        roaringSerialize(o->ptr,blob);
+        n = rdbSaveRawString(rdb,blob,l);
+        zfree(blob);
+        if (n == -1) return -1;
+        nwritten += n;
+    } else if (o->type == OBJ_STRING) {
         /* Save a string value */
         if ((n = rdbSaveStringObject(rdb,o)) == -1) return -1;
         nwritten += n;
@@ -1173,6 +1186,23 @@ robj *rdbLoadObject(int rdbtype, rio *rdb) {
         /* Read string value */
         if ((o = rdbLoadEncodedStringObject(rdb)) == NULL) return NULL;
         o = tryObjectEncoding(o);
+    } else if (rdbtype == RDB_TYPE_STRING_ROARING) {
+        /* Read a sparse bitmap */
+        size_t bloblen;
+        unsigned char *blob =
+            rdbGenericLoadStringObject(rdb,RDB_LOAD_PLAIN,&bloblen);
+        roaring *r;
+
+        if (blob == NULL) return NULL;
+        r = roaringDeserialize(blob,bloblen);
+        zfree(blob);
+        if (r == NULL)
+            rdbExitReportCorruptRDB("Roaring bitmap integrity check failed.");
+        o = createRoaringObject(r);
+
+        /* Convert to a plain string if sparse bitmaps are disabled. */
+        if (server.bitmap_roaring_min_bytes == 0)
+            bitmapTypeConvert(o,OBJ_ENCODING_RAW);
     } else if (rdbtype == RDB_TYPE_LIST) {
         /* Read list value */
         if ((len = rdbLoadLen(rdb,NULL)) == RDB_LENERR) return NULL;
@@ -91,8 +91,16 @@
 #define RDB_TYPE_LIST_QUICKLIST 14
 /* NOTE: WHEN ADDING NEW RDB TYPE, UPDATE rdbIsObjectType() BELOW */
 
+/* Types only this server knows about. They are numbered far away from the
+ * range above, that upstream keeps extending (15 and up are already taken
+ * by newer upstream RDB versions), so that any other loader stops with an
+ * unknown type error instead of misparsing the value. For the same reason
+ * they don't bump RDB_VERSION, whose next values have an upstream meaning. */
+#define RDB_TYPE_STRING_ROARING 200
+
 /* Test if a type is an object type. */
-#define rdbIsObjectType(t) ((t >= 0 && t <= 7) || (t >= 9 && t <= 14))
+#define rdbIsObjectType(t) ((t >= 0 && t <= 7) || (t >= 9 && t <= 14) || \
+                            t == RDB_TYPE_STRING_ROARING)
 
 /* Special RDB opcodes (saved/loaded with rdbSaveType/rdbLoadType). */
 #define RDB_OPCODE_AUX        250
@@ -1,10 +1,12 @@
 #include "read_only.h"
+#include "zmalloc.h"
 
 ReadState* createReadState()
 {
     ReadState* rs = zmalloc(sizeof(ReadState));
     rs->index = 0;
     rs->requestCtx = sdsempty();
+    return rs;
 }
 
 ReadState* dupReadState(const ReadState* rs)
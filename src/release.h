@@ -0,0 +1,3 @@
+#define REDIS_GIT_SHA1 "63fce78f"
+#define REDIS_GIT_DIRTY "7247"
+#define REDIS_BUILD_ID "vm-1792378874"
@@ -1997,6 +1997,12 @@ void slaveofCommand(client *c) {
         return;
     }
 
+    /* In raft mode the nodes replicate through the raft log. */
+    if (server.raft_id) {
+        addReplyError(c,"SLAVEOF not allowed in raft mode.");
+        return;
+    }
+
     /* The special host/port combination "NO" "ONE" turns the instance
      * into a master. Otherwise the new master address is set. */
     if (!strcasecmp(c->argv[1]->ptr,"no") &&
@@ -0,0 +1,1244 @@
+/* Roaring bitmaps implementation.
+ *
+ * A roaring bitmap stores the string value of a sparse bitmap, as created
+ * by SETBIT, without allocating memory for the zero bytes. A bit offset is
+ * split into a 16 bit "key", selecting a chunk of 65536 bits (8192 bytes of
+ * the string), and 16 low bits addressing the bit inside the chunk. Chunks
+ * without set bits are not stored at all, the other ones are stored by a
+ * container using one of the following representations:
+ *
+ * ARRAY:  the sorted offsets of the set bits, 2 bytes per set bit. Never
+ *         used for more than ROARING_ARRAY_MAX bits, where it would take
+ *         more memory than a bitmap.
+ * BITMAP: the 8192 bytes of the chunk, verbatim. Since the bit order is the
+ *         same as the one of strings, BITCOUNT and BITPOS on these chunks
+ *         use the same code (and SIMD kernels) used for plain strings.
+ * RUN:    sorted [first,last] ranges of set bits, 4 bytes per range, for
+ *         chunks with long sequences of ones.
+ *
+ * As in Redis strings, bit 0 is the most significant bit of the first byte.
+ * The length of the string is tracked separately, so that STRLEN, or BITCOUNT
+ * with negative indexes, behave exactly as they do with the raw encoding.
+ *
+ * The design follows "Better bitmap performance with Roaring bitmaps" by
+ * Chambi, Lemire, Kaser and Godin.
+ */
+
+#include "server.h"
+#include <assert.h>
+
+#define ROARING_CHUNK_BITS 65536
+#define ROARING_BITMAP_BYTES 8192
+#define ROARING_ARRAY_MAX 4096 /* Past that an array is bigger than a bitmap */
+
+#define bitmapGet(p,l) ((p)[(l)>>3] & (1<<(7-((l)&7))))
+#define bitmapSet(p,l) ((p)[(l)>>3] |= (1<<(7-((l)&7))))
+#define bitmapClear(p,l) ((p)[(l)>>3] &= ~(1<<(7-((l)&7))))
+
+/* ----------------------------- Bitmap helpers ----------------------------- */
+
+/* Set the bits from 'first' to 'last' (both inclusive) in 'p'. */
+static void bitmapSetRange(unsigned char *p, uint64_t first, uint64_t last) {
+    uint64_t fb = first>>3, lb = last>>3;
+    unsigned char fmask = 0xff >> (first&7);
+    unsigned char lmask = 0xff << (7-(last&7));
+
+    if (fb == lb) {
+        p[fb] |= fmask & lmask;
+        return;
+    }
+    p[fb] |= fmask;
+    if (lb > fb+1) memset(p+fb+1,0xff,lb-fb-1);
+    p[lb] |= lmask;
+}
+
+/* Return the position of the leftmost set bit of the non zero byte 'b'. */
+static int byteFirstSet(unsigned char b) {
+    int pos = 0;
+    while (!(b & 0x80)) {
+        b <<= 1;
+        pos++;
+    }
+    return pos;
+}
+
+/* Return the number of sequences of ones in a bitmap chunk. */
+static uint32_t bitmapCountRuns(const unsigned char *p) {
+    uint32_t runs = 0;
+    int j, prev = 0;
+
+    for (j = 0; j < ROARING_BITMAP_BYTES; j++) {
+        unsigned char b = p[j];
+
+        if (b == 0) {
+            prev = 0;
+            continue;
+        }
+        /* A run starts at every set bit with a clear bit at its left. */
+        unsigned char starts = b & ~((b >> 1) | (prev << 7));
+        while (starts) {
+            starts &= starts-1;
+            runs++;
+        }
+        prev = b & 1;
+    }
+    return runs;
+}
+
+/* ---------------------------- Container helpers --------------------------- */
+
+static size_t containerDataBytes(const roaringContainer *c) {
+    switch(c->type) {
+    case ROARING_ARRAY: return c->size*sizeof(uint16_t);
+    case ROARING_RUN: return c->size*sizeof(uint16_t)*2;
+    default: return ROARING_BITMAP_BYTES;
+    }
+}
+
+/* Return the index of the first entry of the array that is >= v. */
+static uint32_t arrayLowerBound(const uint16_t *a, uint32_t size, uint32_t v) {
+    uint32_t lo = 0, hi = size;
+
+    while (lo < hi) {
+        uint32_t mid = lo+(hi-lo)/2;
+        if (a[mid] < v) lo = mid+1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+/* Return the index of the first run ending at or after v. */
+static uint32_t runLowerBound(const uint16_t *runs, uint32_t size, uint32_t v) {
+    uint32_t lo = 0, hi = size;
+
+    while (lo < hi) {
+        uint32_t mid = lo+(hi-lo)/2;
+        if (runs[mid*2+1] < v) lo = mid+1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+/* Set in the zeroed chunk 'p' the bits of the container. */
+static void containerFill(const roaringContainer *c, unsigned char *p) {
+    uint16_t *v = c->data;
+    uint32_t j;
+
+    switch(c->type) {
+    case ROARING_ARRAY:
+        for (j = 0; j < c->size; j++) bitmapSet(p,v[j]);
+        break;
+    case ROARING_RUN:
+        for (j = 0; j < c->size; j++) bitmapSetRange(p,v[j*2],v[j*2+1]);
+        break;
+    default:
+        memcpy(p,c->data,ROARING_BITMAP_BYTES);
+        break;
+    }
+}
+
+/* Turn the chunk 'p' (allocated with zmalloc, the function takes ownership
+ * of it) having 'card' bits set, into the container 'c', using the smallest
+ * representation. The 'key' field of the container is not touched. */
+static void containerFromBitmap(roaringContainer *c, unsigned char *p,
+                                uint32_t card)
+{
+    size_t runbytes = bitmapCountRuns(p)*sizeof(uint16_t)*2;
+    size_t arraybytes = (card <= ROARING_ARRAY_MAX) ?
+                        card*sizeof(uint16_t) : SIZE_MAX;
+    uint32_t j, n = 0;
+
+    c->card = card;
+    if (arraybytes <= runbytes && arraybytes < ROARING_BITMAP_BYTES) {
+        uint16_t *a = zmalloc(arraybytes);
+        for (j = 0; j < ROARING_BITMAP_BYTES; j++) {
+            unsigned char b = p[j];
+            int bit;
+
+            if (b == 0) continue;
+            for (bit = 0; bit < 8; bit++)
+                if (b & (0x80 >> bit)) a[n++] = j*8+bit;
+        }
+        zfree(p);
+        c->type = ROARING_ARRAY;
+        c->size = n;
+        c->data = a;
+    } else if (runbytes < ROARING_BITMAP_BYTES) {
+        uint16_t *runs = zmalloc(runbytes);
+        int inrun = 0;
+        for (j = 0; j < ROARING_CHUNK_BITS; j++) {
+            /* Skip whole bytes when they don't change the state. */
+            if ((j&7) == 0 && p[j>>3] == (inrun ? 0xff : 0)) {
+                j += 7;
+                continue;
+            }
+            if (!inrun && bitmapGet(p,j)) {
+                runs[n*2] = j;
+                inrun = 1;
+            } else if (inrun && !bitmapGet(p,j)) {
+                runs[n*2+1] = j-1;
+                n++;
+                inrun = 0;
+            }
+        }
+        if (inrun) {
+            runs[n*2+1] = ROARING_CHUNK_BITS-1;
+            n++;
+        }
+        zfree(p);
+        c->type = ROARING_RUN;
+        c->size = n;
+        c->data = runs;
+    } else {
+        c->type = ROARING_BITMAP;
+        c->size = 0;
+        c->data = p;
+    }
+}
+
+/* Re-encode the container with its smallest representation. */
+static void containerOptimize(roaringContainer *c) {
+    unsigned char *p = zcalloc(ROARING_BITMAP_BYTES);
+
+    containerFill(c,p);
+    zfree(c->data);
+    containerFromBitmap(c,p,c->card);
+}
+
+static void containerDup(roaringContainer *dst, const roaringContainer *src) {
+    size_t bytes = containerDataBytes(src);
+
+    *dst = *src;
+    dst->data = zmalloc(bytes);
+    memcpy(dst->data,src->data,bytes);
+}
+
+static int containerGet(const roaringContainer *c, uint32_t l) {
+    uint16_t *v = c->data;
+    uint32_t j;
+
+    switch(c->type) {
+    case ROARING_ARRAY:
+        j = arrayLowerBound(v,c->size,l);
+        return j < c->size && v[j] == l;
+    case ROARING_RUN:
+        j = runLowerBound(v,c->size,l);
+        return j < c->size && v[j*2] <= l;
+    default:
+        return bitmapGet((unsigned char*)c->data,l) != 0;
+    }
+}
+
+/* Return true if the run container takes more memory than the alternatives,
+ * with the same preference order of containerFromBitmap(). */
+static int containerRunsTooBig(const roaringContainer *c) {
+    size_t runbytes = c->size*sizeof(uint16_t)*2;
+
+    if (runbytes >= ROARING_BITMAP_BYTES) return 1;
+    return c->card <= ROARING_ARRAY_MAX && c->card*sizeof(uint16_t) <= runbytes;
+}
+
+/* Set the bit 'l' of the container. Return 1 if the bit was clear. */
+static int containerSet(roaringContainer *c, uint32_t l) {
+    uint16_t *v = c->data;
+    uint32_t j;
+
+    switch(c->type) {
+    case ROARING_ARRAY:
+        j = arrayLowerBound(v,c->size,l);
+        if (j < c->size && v[j] == l) return 0;
+        if (c->size == ROARING_ARRAY_MAX) {
+            unsigned char *p = zcalloc(ROARING_BITMAP_BYTES);
+            containerFill(c,p);
+            zfree(c->data);
+            bitmapSet(p,l);
+            c->type = ROARING_BITMAP;
+            c->size = 0;
+            c->data = p;
+            break;
+        }
+        v = zrealloc(v,(c->size+1)*sizeof(uint16_t));
+        memmove(v+j+1,v+j,(c->size-j)*sizeof(uint16_t));
+        v[j] = l;
+        c->data = v;
+        c->size++;
+        break;
+    case ROARING_RUN: {
+        j = runLowerBound(v,c->size,l);
+        if (j < c->size && v[j*2] <= l) return 0;
+
+        int left = j > 0 && (uint32_t)v[(j-1)*2+1]+1 == l;
+        int right = j < c->size && (uint32_t)v[j*2] == l+1;
+        if (left && right) {
+            /* The bit joins the previous and the next runs. */
+            v[(j-1)*2+1] = v[j*2+1];
+            memmove(v+j*2,v+(j+1)*2,(c->size-j-1)*sizeof(uint16_t)*2);
+            c->size--;
+            c->data = zrealloc(v,c->size*sizeof(uint16_t)*2);
+        } else if (left) {
+            v[(j-1)*2+1] = l;
+        } else if (right) {
+            v[j*2] = l;
+        } else {
+            v = zrealloc(v,(c->size+1)*sizeof(uint16_t)*2);
+            memmove(v+(j+1)*2,v+j*2,(c->size-j)*sizeof(uint16_t)*2);
+            v[j*2] = v[j*2+1] = l;
+            c->data = v;
+            c->size++;
+        }
+        c->card++;
+        if (containerRunsTooBig(c)) containerOptimize(c);
+        return 1;
+    }
+    default:
+        if (bitmapGet((unsigned char*)c->data,l)) return 0;
+        bitmapSet((unsigned char*)c->data,l);
+        break;
+    }
+    c->card++;
+    return 1;
+}
+
+/* Clear the bit 'l' of the container. Return 1 if the bit was set. When the
+ * last bit is cleared the container is left empty, with no data allocated,
+ * and should be removed by the caller. */
+static int containerClear(roaringContainer *c, uint32_t l) {
+    uint16_t *v = c->data;
+    uint32_t j;
+
+    switch(c->type) {
+    case ROARING_ARRAY:
+        j = arrayLowerBound(v,c->size,l);
+        if (j == c->size || v[j] != l) return 0;
+        memmove(v+j,v+j+1,(c->size-j-1)*sizeof(uint16_t));
+        c->size--;
+        c->card--;
+        if (c->size == 0) {
+            zfree(v);
+            c->data = NULL;
+        } else {
+            c->data = zrealloc(v,c->size*sizeof(uint16_t));
+        }
+        return 1;
+    case ROARING_RUN: {
+        j = runLowerBound(v,c->size,l);
+        if (j == c->size || v[j*2] > l) return 0;
+
+        uint16_t first = v[j*2], last = v[j*2+1];
+        if (first == last) {
+            memmove(v+j*2,v+(j+1)*2,(c->size-j-1)*sizeof(uint16_t)*2);
+            c->size--;
+            if (c->size == 0) {
+                zfree(v);
+                c->data = NULL;
+            } else {
+                c->data = zrealloc(v,c->size*sizeof(uint16_t)*2);
+            }
+        } else if (l == first) {
+            v[j*2]++;
+        } else if (l == last) {
+            v[j*2+1]--;
+        } else {
+            /* Split the run in two. */
+            v = zrealloc(v,(c->size+1)*sizeof(uint16_t)*2);
+            memmove(v+(j+1)*2,v+j*2,(c->size-j)*sizeof(uint16_t)*2);
+            v[j*2+1] = l-1;
+            v[(j+1)*2] = l+1;
+            c->data = v;
+            c->size++;
+        }
+        c->card--;
+        if (c->card && containerRunsTooBig(c)) containerOptimize(c);
+        return 1;
+    }
+    default:
+        if (!bitmapGet((unsigned char*)c->data,l)) return 0;
+        bitmapClear((unsigned char*)c->data,l);
+        c->card--;
+        /* Go back to an array only well below the conversion threshold,
+         * so that flipping a bit around it does not convert every time. */
+        if (c->card <= ROARING_ARRAY_MAX/2) {
+            if (c->card == 0) {
+                zfree(c->data);
+                c->type = ROARING_ARRAY;
+                c->data = NULL;
+            } else {
+                containerOptimize(c);
+            }
+        }
+        return 1;
+    }
+}
+
+/* Return the first set bit at or after 'l', or -1 if there is none. */
+static long containerNextSet(const roaringContainer *c, uint32_t l) {
+    uint16_t *v = c->data;
+    uint32_t j;
+
+    switch(c->type) {
+    case ROARING_ARRAY:
+        j = arrayLowerBound(v,c->size,l);
+        return j < c->size ? v[j] : -1;
+    case ROARING_RUN:
+        j = runLowerBound(v,c->size,l);
+        if (j == c->size) return -1;
+        return v[j*2] > l ? v[j*2] : l;
+    default: {
+        unsigned char *p = c->data;
+        uint32_t byte = l>>3;
+        unsigned char b = p[byte] & (0xff >> (l&7));
+        long pos;
+
+        if (b) return byte*8+byteFirstSet(b);
+        if (++byte == ROARING_BITMAP_BYTES) return -1;
+        pos = redisBitpos(p+byte,ROARING_BITMAP_BYTES-byte,1);
+        return pos == -1 ? -1 : (long)byte*8+pos;
+    }
+    }
+}
+
+/* Return the first clear bit at or after 'l', or ROARING_CHUNK_BITS if all
+ * the bits from 'l' to the end of the chunk are set. */
+static uint32_t containerNextClear(const roaringContainer *c, uint32_t l) {
+    uint16_t *v = c->data;
+    uint32_t j;
+
+    switch(c->type) {
+    case ROARING_ARRAY:
+        j = arrayLowerBound(v,c->size,l);
+        while (j < c->size && v[j] == l) {
+            j++;
+            l++;
+        }
+        return l;
+    case ROARING_RUN:
+        j = runLowerBound(v,c->size,l);
+        if (j < c->size && v[j*2] <= l) return (uint32_t)v[j*2+1]+1;
+        return l;
+    default: {
+        unsigned char *p = c->data;
+        uint32_t byte = l>>3;
+        unsigned char b = ~p[byte] & (0xff >> (l&7));
+
+        if (b) return byte*8+byteFirstSet(b);
+        if (++byte == ROARING_BITMAP_BYTES) return ROARING_CHUNK_BITS;
+        return byte*8+redisBitpos(p+byte,ROARING_BITMAP_BYTES-byte,0);
+    }
+    }
+}
+
+/* Count the set bits of the container from 'lo' to 'hi', inclusive. Both
+ * are byte aligned: 'lo' is a multiple of 8, 'hi' a multiple of 8 minus 1. */
+static uint32_t containerCount(const roaringContainer *c, uint32_t lo,
+                               uint32_t hi)
+{
+    uint16_t *v = c->data;
+    uint32_t j, count = 0;
+
+    if (lo == 0 && hi == ROARING_CHUNK_BITS-1) return c->card;
+    switch(c->type) {
+    case ROARING_ARRAY:
+        return arrayLowerBound(v,c->size,hi+1)-arrayLowerBound(v,c->size,lo);
+    case ROARING_RUN:
+        for (j = runLowerBound(v,c->size,lo); j < c->size; j++) {
+            uint32_t first = v[j*2], last = v[j*2+1];
+
+            if (first > hi) break;
+            if (first < lo) first = lo;
+            if (last > hi) last = hi;
+            count += last-first+1;
+        }
+        return count;
+    default:
+        return redisPopcount((unsigned char*)c->data+(lo>>3),(hi-lo+1)>>3);
+    }
+}
+
+/* Compute the AND, OR or XOR of the containers 'x' and 'y', that have the
+ * same key, into 'out'. If the result is empty 'out->card' is set to zero
+ * and nothing is allocated. */
+static void containerBitop(int op, const roaringContainer *x,
+                           const roaringContainer *y, roaringContainer *out)
+{
+    uint32_t j;
+
+    out->key = x->key;
+    if (x->type == ROARING_ARRAY && y->type == ROARING_ARRAY) {
+        /* Merge the two sorted arrays. */
+        uint16_t *a = x->data, *b = y->data, *res;
+        uint32_t i = 0, n = 0;
+
+        res = zmalloc((x->size+y->size)*sizeof(uint16_t));
+        j = 0;
+        while (i < x->size || j < y->size) {
+            if (j == y->size || (i < x->size && a[i] < b[j])) {
+                if (op != ROARING_OP_AND) res[n++] = a[i];
+                i++;
+            } else if (i == x->size || b[j] < a[i]) {
+                if (op != ROARING_OP_AND) res[n++] = b[j];
+                j++;
+            } else {
+                if (op != ROARING_OP_XOR) res[n++] = a[i];
+                i++;
+                j++;
+            }
+        }
+        if (n == 0) {
+            zfree(res);
+            out->card = 0;
+        } else if (n > ROARING_ARRAY_MAX) {
+            unsigned char *p = zcalloc(ROARING_BITMAP_BYTES);
+            for (j = 0; j < n; j++) bitmapSet(p,res[j]);
+            zfree(res);
+            containerFromBitmap(out,p,n);
+        } else {
+            out->type = ROARING_ARRAY;
+            out->card = out->size = n;
+            out->data = zrealloc(res,n*sizeof(uint16_t));
+        }
+        return;
+    }
+
+    if (op == ROARING_OP_AND &&
+        (x->type == ROARING_ARRAY || y->type == ROARING_ARRAY))
+    {
+        /* Sparse AND anything: just probe the other container. */
+        const roaringContainer *arr = x->type == ROARING_ARRAY ? x : y;
+        const roaringContainer *other = arr == x ? y : x;
+        uint16_t *a = arr->data, *res = zmalloc(arr->size*sizeof(uint16_t));
+        uint32_t n = 0;
+
+        for (j = 0; j < arr->size; j++)
+            if (containerGet(other,a[j])) res[n++] = a[j];
+        if (n == 0) {
+            zfree(res);
+            out->card = 0;
+        } else {
+            out->type = ROARING_ARRAY;
+            out->card = out->size = n;
+            out->data = zrealloc(res,n*sizeof(uint16_t));
+        }
+        return;
+    }
+
+    /* General case: operate on the two chunks expanded as bitmaps. */
+    unsigned char *p = zcalloc(ROARING_BITMAP_BYTES);
+    unsigned char *q = zcalloc(ROARING_BITMAP_BYTES);
+    unsigned long *lp = (unsigned long*)p, *lq = (unsigned long*)q;
+    uint32_t card;
+
+    containerFill(x,p);
+    containerFill(y,q);
+    for (j = 0; j < ROARING_BITMAP_BYTES/sizeof(unsigned long); j++) {
+        switch(op) {
+        case ROARING_OP_AND: lp[j] &= lq[j]; break;
+        case ROARING_OP_OR: lp[j] |= lq[j]; break;
+        case ROARING_OP_XOR: lp[j] ^= lq[j]; break;
+        }
+    }
+    zfree(q);
+    card = redisPopcount(p,ROARING_BITMAP_BYTES);
+    if (card == 0) {
+        zfree(p);
+        out->card = 0;
+    } else {
+        containerFromBitmap(out,p,card);
+    }
+}
+
+/* ---------------------------- Roaring bitmaps ----------------------------- */
+
+/* Return the index of the first container with a key >= 'key'. */
+static uint32_t roaringFind(const roaring *r, uint32_t key) {
+    uint32_t lo = 0, hi = r->count;
+
+    while (lo < hi) {
+        uint32_t mid = lo+(hi-lo)/2;
+        if (r->c[mid].key < key) lo = mid+1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+/* Append the container 'c' to 'r', that must have room for it. Used when
+ * building a bitmap container after container, in key order. */
+static void roaringAppend(roaring *r, roaringContainer *c) {
+    r->c[r->count++] = *c;
+    r->card += c->card;
+    r->bytes += sizeof(roaringContainer)+containerDataBytes(c);
+}
+
+/* Reallocate the containers array to the exact number of containers. */
+static void roaringShrink(roaring *r) {
+    if (r->count == 0) {
+        zfree(r->c);
+        r->c = NULL;
+    } else {
+        r->c = zrealloc(r->c,sizeof(roaringContainer)*r->count);
+    }
+}
+
+/* Create an empty bitmap, representing the empty string. */
+roaring *roaringNew(void) {
+    roaring *r = zmalloc(sizeof(*r));
+
+    r->len = 0;
+    r->card = 0;
+    r->bytes = sizeof(*r);
+    r->count = 0;
+    r->c = NULL;
+    return r;
+}
+
+void roaringFree(roaring *r) {
+    uint32_t j;
+
+    for (j = 0; j < r->count; j++) zfree(r->c[j].data);
+    zfree(r->c);
+    zfree(r);
+}
+
+roaring *roaringDup(const roaring *r) {
+    roaring *d = zmalloc(sizeof(*d));
+    uint32_t j;
+
+    *d = *r;
+    d->c = r->count ? zmalloc(sizeof(roaringContainer)*r->count) : NULL;
+    for (j = 0; j < r->count; j++) containerDup(d->c+j,r->c+j);
+    return d;
+}
+
+/* Create a bitmap representing the 'len' bytes string at 'p'. */
+roaring *roaringFromBytes(const unsigned char *p, size_t len) {
+    roaring *r = roaringNew();
+    size_t off;
+
+    r->len = len;
+    if (len) r->c = zmalloc(sizeof(roaringContainer)*
+                            ((len+ROARING_BITMAP_BYTES-1)/ROARING_BITMAP_BYTES));
+    for (off = 0; off < len; off += ROARING_BITMAP_BYTES) {
+        size_t n = len-off;
+        roaringContainer c;
+        size_t card;
+
+        if (n > ROARING_BITMAP_BYTES) n = ROARING_BITMAP_BYTES;
+        if ((card = redisPopcount((void*)(p+off),n)) == 0) continue;
+
+        unsigned char *chunk = zcalloc(ROARING_BITMAP_BYTES);
+        memcpy(chunk,p+off,n);
+        c.key = off/ROARING_BITMAP_BYTES;
+        containerFromBitmap(&c,chunk,card);
+        roaringAppend(r,&c);
+    }
+    roaringShrink(r);
+    return r;
+}
+
+/* Copy 'count' bytes of the string, starting at byte 'offset', into 'buf'.
+ * Bytes past the end of the string are set to zero. */
+void roaringGetBytes(const roaring *r, uint64_t offset, unsigned char *buf,
+                     size_t count)
+{
+    uint64_t firstbit = offset*8, endbit = (offset+count)*8;
+    uint32_t i, j;
+
+    memset(buf,0,count);
+    if (count == 0) return;
+    for (i = roaringFind(r,firstbit>>16); i < r->count; i++) {
+        roaringContainer *c = r->c+i;
+        uint64_t base = (uint64_t)c->key << 16;
+        uint16_t *v = c->data;
+
+        if (base >= endbit) break;
+        switch(c->type) {
+        case ROARING_ARRAY:
+            j = base < firstbit ? arrayLowerBound(v,c->size,firstbit-base) : 0;
+            for (; j < c->size && base+v[j] < endbit; j++)
+                bitmapSet(buf,base+v[j]-firstbit);
+            break;
+        case ROARING_RUN:
+            j = base < firstbit ? runLowerBound(v,c->size,firstbit-base) : 0;
+            for (; j < c->size; j++) {
+                uint64_t first = base+v[j*2], last = base+v[j*2+1];
+
+                if (first >= endbit) break;
+                if (first < firstbit) first = firstbit;
+                if (last >= endbit) last = endbit-1;
+                bitmapSetRange(buf,first-firstbit,last-firstbit);
+            }
+            break;
+        default: {
+            uint64_t from = base>>3, to = from+ROARING_BITMAP_BYTES;
+
+            if (from < offset) from = offset;
+            if (to > offset+count) to = offset+count;
+            memcpy(buf+(from-offset),
+                   (unsigned char*)c->data+(from-(base>>3)),to-from);
+            break;
+        }
+        }
+    }
+}
+
+int roaringGetBit(const roaring *r, uint64_t bitoffset) {
+    uint32_t key = bitoffset >> 16;
+    uint32_t i = roaringFind(r,key);
+
+    if (i == r->count || r->c[i].key != key) return 0;
+    return containerGet(r->c+i,bitoffset & 0xffff);
+}
+
+/* Set or clear the bit at 'bitoffset', growing the string if needed as
+ * SETBIT does. The old value of the bit is returned. */
+int roaringSetBit(roaring *r, uint64_t bitoffset, int on) {
+    uint32_t key = bitoffset >> 16, l = bitoffset & 0xffff;
+    uint32_t i = roaringFind(r,key);
+    roaringContainer *c;
+    size_t oldbytes;
+    int changed;
+
+    if ((bitoffset>>3) >= r->len) r->len = (bitoffset>>3)+1;
+
+    if (i == r->count || r->c[i].key != key) {
+        if (!on) return 0;
+        /* Create a new container holding just this bit. */
+        r->c = zrealloc(r->c,sizeof(roaringContainer)*(r->count+1));
+        memmove(r->c+i+1,r->c+i,sizeof(roaringContainer)*(r->count-i));
+        c = r->c+i;
+        c->key = key;
+        c->type = ROARING_ARRAY;
+        c->card = c->size = 1;
+        c->data = zmalloc(sizeof(uint16_t));
+        ((uint16_t*)c->data)[0] = l;
+        r->count++;
+        r->card++;
+        r->bytes += sizeof(roaringContainer)+sizeof(uint16_t);
+        return 0;
+    }
+
+    c = r->c+i;
+    oldbytes = containerDataBytes(c);
+    changed = on ? containerSet(c,l) : containerClear(c,l);
+    r->bytes = r->bytes-oldbytes+containerDataBytes(c);
+    if (!changed) return on;
+
+    if (on) {
+        r->card++;
+    } else {
+        r->card--;
+        if (c->card == 0) {
+            zfree(c->data);
+            memmove(r->c+i,r->c+i+1,sizeof(roaringContainer)*(r->count-i-1));
+            r->count--;
+            r->bytes -= sizeof(roaringContainer);
+            roaringShrink(r);
+        }
+    }
+    return !on;
+}
+
+/* Count the set bits from the byte 'start' to the byte 'end', inclusive, as
+ * BITCOUNT does. The range must be inside the string. */
+uint64_t roaringCount(const roaring *r, uint64_t start, uint64_t end) {
+    uint64_t firstbit = start*8, lastbit = end*8+7, count = 0;
+    uint32_t i;
+
+    if (start == 0 && end+1 >= r->len) return r->card;
+    for (i = roaringFind(r,firstbit>>16); i < r->count; i++) {
+        roaringContainer *c = r->c+i;
+        uint64_t base = (uint64_t)c->key << 16;
+        uint64_t lo = firstbit > base ? firstbit-base : 0;
+        uint64_t hi = lastbit-base;
+
+        if (base > lastbit) break;
+        if (hi >= ROARING_CHUNK_BITS) hi = ROARING_CHUNK_BITS-1;
+        count += containerCount(c,lo,hi);
+    }
+    return count;
+}
+
+/* Return the offset of the first set bit at or after 'bitoffset', or -1 if
+ * there are no more set bits. */
+long long roaringNextSetBit(const roaring *r, uint64_t bitoffset) {
+    uint32_t i;
+
+    for (i = roaringFind(r,bitoffset>>16); i < r->count; i++) {
+        roaringContainer *c = r->c+i;
+        uint64_t base = (uint64_t)c->key << 16;
+        long next = containerNextSet(c,bitoffset > base ? bitoffset-base : 0);
+
+        if (next != -1) return base+next;
+    }
+    return -1;
+}
+
+/* Return the position of the first bit set to 'bit' in the 'count' bytes
+ * starting at 'start', relative to the start of the range, with the same
+ * conventions of redisBitpos(): if there are no clear bits count*8 is
+ * returned, while if there are no set bits the result is -1. */
+long roaringBitpos(const roaring *r, uint64_t start, uint64_t count, int bit) {
+    uint64_t firstbit = start*8, endbit = firstbit+count*8, pos;
+    uint32_t i = roaringFind(r,firstbit>>16);
+
+    if (bit) {
+        long long next = roaringNextSetBit(r,firstbit);
+        return (next != -1 && (uint64_t)next < endbit) ?
+               (long)(next-firstbit) : -1;
+    }
+
+    /* Looking for a clear bit: every chunk without a container is made of
+     * zeroes, so we only need to skip full containers that are adjacent. */
+    pos = firstbit;
+    while (pos < endbit) {
+        roaringContainer *c = r->c+i;
+        uint64_t base;
+        uint32_t next;
+
+        if (i == r->count || c->key != (pos>>16)) break;
+        base = (uint64_t)c->key << 16;
+        next = containerNextClear(c,pos-base);
+        pos = base+next;
+        if (next < ROARING_CHUNK_BITS) break;
+        i++;
+    }
+    return pos < endbit ? (long)(pos-firstbit) : (long)count*8;
+}
+
+/* Compute AND, OR or XOR of the two bitmaps, returning a new bitmap as long
+ * as the longest of the two. */
+static roaring *roaringBitop2(int op, const roaring *a, const roaring *b) {
+    roaring *r = roaringNew();
+    uint32_t i = 0, j = 0;
+
+    r->len = a->len > b->len ? a->len : b->len;
+    if (op == ROARING_OP_AND) {
+        uint32_t max = a->count < b->count ? a->count : b->count;
+        r->c = max ? zmalloc(sizeof(roaringContainer)*max) : NULL;
+    } else if (a->count+b->count) {
+        r->c = zmalloc(sizeof(roaringContainer)*(a->count+b->count));
+    }
+
+    while (i < a->count || j < b->count) {
+        roaringContainer c;
+
+        if (j == b->count || (i < a->count && a->c[i].key < b->c[j].key)) {
+            if (op != ROARING_OP_AND) {
+                containerDup(&c,a->c+i);
+                roaringAppend(r,&c);
+            }
+            i++;
+        } else if (i == a->count || b->c[j].key < a->c[i].key) {
+            if (op != ROARING_OP_AND) {
+                containerDup(&c,b->c+j);
+                roaringAppend(r,&c);
+            }
+            j++;
+        } else {
+            containerBitop(op,a->c+i,b->c+j,&c);
+            if (c.card) roaringAppend(r,&c);
+            i++;
+            j++;
+        }
+    }
+    roaringShrink(r);
+    return r;
+}
+
+/* Compute the AND, OR or XOR of 'numsrc' bitmaps (at least one) with the
+ * semantics of BITOP: the result is as long as the longest source. */
+roaring *roaringBitop(int op, roaring **src, unsigned long numsrc) {
+    roaring *r = roaringDup(src[0]);
+    unsigned long j;
+
+    for (j = 1; j < numsrc; j++) {
+        roaring *next = roaringBitop2(op,r,src[j]);
+        roaringFree(r);
+        r = next;
+    }
+    return r;
+}
+
+/* Return the memory used by the bitmap, not counting allocator overhead. */
+size_t roaringBytes(const roaring *r) {
+    return r->bytes;
+}
+
+/* The serialized format, used by RDB files, is the following, with all the
+ * integers stored little endian:
+ *
+ * <len:8 bytes><count:4 bytes><container-1>...<container-N>
+ *
+ * Where every container is:
+ *
+ * <key:2 bytes><type:1 byte><size:4 bytes><data>
+ *
+ * The data is the array of 16 bit offsets, or of 16 bit first/last pairs of
+ * run containers, or the 8192 bytes of bitmap containers. */
+#define ROARING_HDR_LEN 12
+#define ROARING_CONTAINER_HDR_LEN 7
+
+size_t roaringBlobLen(const roaring *r) {
+    size_t len = ROARING_HDR_LEN;
+    uint32_t j;
+
+    for (j = 0; j < r->count; j++)
+        len += ROARING_CONTAINER_HDR_LEN+containerDataBytes(r->c+j);
+    return len;
+}
+
+/* Serialize the bitmap into 'buf', that must be roaringBlobLen() bytes. */
+void roaringSerialize(const roaring *r, unsigned char *buf) {
+    uint64_t len = r->len;
+    uint32_t count = r->count, i, j;
+
+    memcpy(buf,&len,8);
+    memrev64ifbe(buf);
+    memcpy(buf+8,&count,4);
+    memrev32ifbe(buf+8);
+    buf += ROARING_HDR_LEN;
+
+    for (i = 0; i < r->count; i++) {
+        roaringContainer *c = r->c+i;
+        uint32_t size = c->size;
+        size_t bytes = containerDataBytes(c);
+
+        memcpy(buf,&c->key,2);
+        memrev16ifbe(buf);
+        buf[2] = c->type;
+        memcpy(buf+3,&size,4);
+        memrev32ifbe(buf+3);
+        buf += ROARING_CONTAINER_HDR_LEN;
+        memcpy(buf,c->data,bytes);
+        if (c->type != ROARING_BITMAP) {
+            for (j = 0; j < bytes/2; j++) memrev16ifbe(buf+j*2);
+        }
+        buf += bytes;
+    }
+}
+
+/* Load a bitmap serialized by roaringSerialize(). Since the blob may come
+ * from a corrupted RDB file or a RESTORE payload, everything is validated,
+ * and NULL is returned if the blob is not well formed. */
+roaring *roaringDeserialize(const unsigned char *buf, size_t len) {
+    const unsigned char *end = buf+len;
+    roaring *r;
+    uint64_t slen;
+    uint32_t count, i, j;
+
+    if (len < ROARING_HDR_LEN) return NULL;
+    memcpy(&slen,buf,8);
+    memrev64ifbe(&slen);
+    memcpy(&count,buf+8,4);
+    memrev32ifbe(&count);
+    buf += ROARING_HDR_LEN;
+    /* Offsets are 32 bits, so strings are at most 512MB. */
+    if (slen > ((uint64_t)1<<29) || count > ROARING_CHUNK_BITS) return NULL;
+    if ((size_t)(end-buf) < (size_t)count*ROARING_CONTAINER_HDR_LEN)
+        return NULL;
+
+    r = roaringNew();
+    r->len = slen;
+    if (count) r->c = zmalloc(sizeof(roaringContainer)*count);
+    for (i = 0; i < count; i++) {
+        roaringContainer c;
+        uint16_t *v;
+        uint64_t maxbit;
+        size_t bytes;
+
+        if (end-buf < ROARING_CONTAINER_HDR_LEN) goto err;
+        memcpy(&c.key,buf,2);
+        memrev16ifbe(&c.key);
+        c.type = buf[2];
+        memcpy(&c.size,buf+3,4);
+        memrev32ifbe(&c.size);
+        buf += ROARING_CONTAINER_HDR_LEN;
+
+        if (i && c.key <= r->c[i-1].key) goto err;
+        if (c.type == ROARING_ARRAY) {
+            if (c.size == 0 || c.size > ROARING_ARRAY_MAX) goto err;
+        } else if (c.type == ROARING_RUN) {
+            if (c.size == 0 || c.size > ROARING_CHUNK_BITS/2) goto err;
+        } else if (c.type != ROARING_BITMAP || c.size != 0) {
+            goto err;
+        }
+        bytes = containerDataBytes(&c);
+        if ((size_t)(end-buf) < bytes) goto err;
+        c.data = zmalloc(bytes);
+        memcpy(c.data,buf,bytes);
+        buf += bytes;
+        v = c.data;
+
+        /* Check the content, computing the number of set bits. */
+        if (c.type == ROARING_ARRAY) {
+            for (j = 0; j < c.size; j++) {
+                memrev16ifbe(v+j);
+                if (j && v[j] <= v[j-1]) goto errdata;
+            }
+            c.card = c.size;
+            maxbit = v[c.size-1];
+        } else if (c.type == ROARING_RUN) {
+            c.card = 0;
+            for (j = 0; j < c.size; j++) {
+                memrev16ifbe(v+j*2);
+                memrev16ifbe(v+j*2+1);
+                if (v[j*2] > v[j*2+1]) goto errdata;
+                /* Runs must be sorted and not adjacent. */
+                if (j && (uint32_t)v[j*2] <= (uint32_t)v[(j-1)*2+1]+1)
+                    goto errdata;
+                c.card += v[j*2+1]-v[j*2]+1;
+            }
+            maxbit = v[c.size*2-1];
+        } else {
+            long last = -1, pos;
+            c.card = redisPopcount(c.data,ROARING_BITMAP_BYTES);
+            if (c.card == 0) goto errdata;
+            /* The last set bit must be inside the string, and it can
+             * only be in the last non zero byte. */
+            for (j = ROARING_BITMAP_BYTES; j > 0; j--) {
+                unsigned char b = ((unsigned char*)c.data)[j-1];
+                if (b == 0) continue;
+                for (pos = 7; pos >= 0; pos--) {
+                    if (b & (0x80 >> pos)) {
+                        last = (long)(j-1)*8+pos;
+                        break;
+                    }
+                }
+                break;
+            }
+            maxbit = last;
+        }
+        maxbit += (uint64_t)c.key << 16;
+        if ((maxbit>>3) >= slen) goto errdata;
+        roaringAppend(r,&c);
+        continue;
+
+errdata:
+        zfree(c.data);
+        goto err;
+    }
+    if (buf != end) goto err;
+    roaringShrink(r);
+    return r;
+
+err:
+    roaringFree(r);
+    return NULL;
+}
+
+#ifdef REDIS_TEST
+#include <sys/time.h>
+
+#define ROARING_TEST_MAXLEN (ROARING_BITMAP_BYTES*40)
+
+/* Check the invariants of the bitmap, and that it represents the 'len'
+ * bytes string at 'ref'. */
+static void roaringTestCheck(roaring *r, unsigned char *ref, size_t len) {
+    unsigned char *buf = zmalloc(len ? len : 1);
+    size_t bytes = sizeof(*r);
+    uint64_t card = 0;
+    uint32_t j;
+
+    assert(r->len == len);
+    for (j = 0; j < r->count; j++) {
+        roaringContainer *c = r->c+j;
+        unsigned char *p = zcalloc(ROARING_BITMAP_BYTES);
+
+        if (j) assert(c->key > r->c[j-1].key);
+        assert(c->card > 0);
+        if (c->type == ROARING_ARRAY) assert(c->size == c->card);
+        containerFill(c,p);
+        assert(redisPopcount(p,ROARING_BITMAP_BYTES) == c->card);
+        zfree(p);
+        card += c->card;
+        bytes += sizeof(roaringContainer)+containerDataBytes(c);
+    }
+    assert(card == r->card);
+    assert(bytes == r->bytes);
+    roaringGetBytes(r,0,buf,len);
+    assert(memcmp(buf,ref,len) == 0);
+    zfree(buf);
+}
+
+/* Fill 'p' with a random mix of empty, sparse, dense and full chunks, so
+ * that all the container types are exercised. */
+static void roaringTestRandomBytes(unsigned char *p, size_t len) {
+    size_t off;
+
+    memset(p,0,len);
+    for (off = 0; off < len; off += ROARING_BITMAP_BYTES) {
+        size_t n = len-off, j;
+        if (n > ROARING_BITMAP_BYTES) n = ROARING_BITMAP_BYTES;
+
+        switch(rand() % 5) {
+        case 0: break;
+        case 1: /* Sparse. */
+            for (j = rand() % 100; j > 0; j--) p[off+rand()%n] |= 1<<(rand()%8);
+            break;
+        case 2: /* Ranges of ones. */
+            for (j = rand() % 20; j > 0; j--) {
+                size_t start = rand()%n, count = rand()%(n-start)+1;
+                memset(p+off+start,rand()%2 ? 0xff : 0x7e,count);
+            }
+            break;
+        case 3: /* Dense. */
+            for (j = 0; j < n; j++) p[off+j] = rand();
+            break;
+        case 4: /* Full. */
+            memset(p+off,0xff,n);
+            break;
+        }
+    }
+}
+
+int roaringTest(int argc, char **argv) {
+    unsigned char *ref = zmalloc(ROARING_TEST_MAXLEN);
+    unsigned char *ref2 = zmalloc(ROARING_TEST_MAXLEN);
+    unsigned char *blob;
+    roaring *r, *r2, *res, *src[2];
+    int i, j;
+
+    UNUSED(argc);
+    UNUSED(argv);
+    srand(time(NULL));
+
+    printf("SETBIT and GETBIT against a plain string: "); {
+        for (i = 0; i < 100; i++) {
+            size_t len = 0, maxlen = rand() % ROARING_TEST_MAXLEN + 1;
+
+            memset(ref,0,ROARING_TEST_MAXLEN);
+            r = roaringNew();
+            for (j = 0; j < 5000; j++) {
+                uint64_t bit;
+                int on = rand() % 3 != 0, old;
+
+                /* Stay near a few spots to create runs and full chunks. */
+                if (rand() % 2 && len) {
+                    bit = (uint64_t)(rand() % (len*8));
+                } else {
+                    bit = (uint64_t)(rand() % (maxlen*8));
+                }
+                old = (ref[bit>>3] & (0x80>>(bit&7))) != 0;
+                assert(roaringGetBit(r,bit) == old);
+                assert(roaringSetBit(r,bit,on) == old);
+                if (on) ref[bit>>3] |= 0x80>>(bit&7);
+                else ref[bit>>3] &= ~(0x80>>(bit&7));
+                if ((bit>>3) >= len) len = (bit>>3)+1;
+            }
+            roaringTestCheck(r,ref,len);
+            roaringFree(r);
+        }
+        printf("ok\n");
+    }
+
+    printf("Full containers, runs and bitmaps: "); {
+        r = roaringNew();
+        memset(ref,0,ROARING_BITMAP_BYTES*2);
+        for (j = 0; j < ROARING_CHUNK_BITS; j++) {
+            roaringSetBit(r,ROARING_CHUNK_BITS+j,1);
+            ref[ROARING_BITMAP_BYTES+j/8] |= 0x80>>(j%8);
+        }
+        roaringTestCheck(r,ref,ROARING_BITMAP_BYTES*2);
+        for (j = ROARING_CHUNK_BITS-1; j >= 0; j -= 3) {
+            roaringSetBit(r,ROARING_CHUNK_BITS+j,0);
+            ref[ROARING_BITMAP_BYTES+j/8] &= ~(0x80>>(j%8));
+        }
+        roaringTestCheck(r,ref,ROARING_BITMAP_BYTES*2);
+        roaringFree(r);
+        printf("ok\n");
+    }
+
+    printf("Conversion, BITCOUNT, BITPOS and serialization: "); {
+        for (i = 0; i < 200; i++) {
+            size_t len = rand() % ROARING_TEST_MAXLEN + 1;
+
+            roaringTestRandomBytes(ref,len);
+            r = roaringFromBytes(ref,len);
+            roaringTestCheck(r,ref,len);
+
+            for (j = 0; j < 100; j++) {
+                uint64_t start = rand() % len, end = rand() % len;
+                unsigned char buf[64];
+                size_t count;
+
+                if (start > end) {
+                    uint64_t tmp = start;
+                    start = end;
+                    end = tmp;
+                }
+                count = end-start+1;
+                assert(roaringCount(r,start,end) ==
+                       redisPopcount(ref+start,count));
+                assert(roaringBitpos(r,start,count,1) ==
+                       redisBitpos(ref+start,count,1));
+                assert(roaringBitpos(r,start,count,0) ==
+                       redisBitpos(ref+start,count,0));
+
+                if (count > sizeof(buf)) count = sizeof(buf);
+                roaringGetBytes(r,start,buf,count);
+                assert(memcmp(buf,ref+start,
+                    start+count > len ? len-start : count) == 0);
+            }
+
+            blob = zmalloc(roaringBlobLen(r));
+            roaringSerialize(r,blob);
+            r2 = roaringDeserialize(blob,roaringBlobLen(r));
+            assert(r2 != NULL);
+            roaringTestCheck(r2,ref,len);
+            /* Truncated or altered blobs must be refused. */
+            assert(roaringDeserialize(blob,roaringBlobLen(r)-1) == NULL);
+            if (r->count) {
+                blob[ROARING_HDR_LEN+2] = 5;
+                assert(roaringDeserialize(blob,roaringBlobLen(r)) == NULL);
+            }
+            zfree(blob);
+            roaringFree(r2);
+            roaringFree(r);
+        }
+        printf("ok\n");
+    }
+
+    printf("BITOP AND, OR, XOR: "); {
+        for (i = 0; i < 200; i++) {
+            size_t len = rand() % ROARING_TEST_MAXLEN + 1;
+            size_t len2 = rand() % ROARING_TEST_MAXLEN + 1;
+            size_t maxlen = len > len2 ? len : len2;
+            int op = rand() % 3;
+
+            roaringTestRandomBytes(ref,len);
+            roaringTestRandomBytes(ref2,len2);
+            src[0] = r = roaringFromBytes(ref,len);
+            src[1] = r2 = roaringFromBytes(ref2,len2);
+            res = roaringBitop(op,src,2);
+
+            if (len < maxlen) memset(ref+len,0,maxlen-len);
+            if (len2 < maxlen) memset(ref2+len2,0,maxlen-len2);
+            for (j = 0; j < (int)maxlen; j++) {
+                switch(op) {
+                case ROARING_OP_AND: ref[j] &= ref2[j]; break;
+                case ROARING_OP_OR: ref[j] |= ref2[j]; break;
+                case ROARING_OP_XOR: ref[j] ^= ref2[j]; break;
+                }
+            }
+            roaringTestCheck(res,ref,maxlen);
+            roaringFree(res);
+            roaringFree(r);
+            roaringFree(r2);
+        }
+        printf("ok\n");
+    }
+
+    printf("Memory of a sparse bitmap: "); {
+        r = roaringNew();
+        for (j = 0; j < 1000; j++)
+            roaringSetBit(r,(uint64_t)j*4000000+7,1);
+        assert(r->len == (uint64_t)999*4000000/8+1);
+        assert(roaringBytes(r) < 1000*64);
+        roaringFree(r);
+        printf("ok\n");
+    }
+
+    zfree(ref);
+    zfree(ref2);
+    return 0;
+}
+#endif
@@ -0,0 +1,59 @@
+/* Roaring bitmaps, used to store sparse bitmaps set with SETBIT.
+ *
+ * The 32 bit space of bit offsets is split into chunks of 65536 bits, and
+ * only the chunks with at least a bit set are allocated, each as a
+ * "container" using the cheapest of three representations. See roaring.c
+ * for the details. */
+
+#ifndef __ROARING_H
+#define __ROARING_H
+#include <stdint.h>
+#include <stddef.h>
+
+/* Container types. */
+#define ROARING_ARRAY 0     /* Sorted array of 16 bit offsets. */
+#define ROARING_BITMAP 1    /* 8k bitmap, same bit order as Redis strings. */
+#define ROARING_RUN 2       /* Sorted array of [first,last] ranges. */
+
+/* Bit operations for roaringBitop(). */
+#define ROARING_OP_AND 0
+#define ROARING_OP_OR 1
+#define ROARING_OP_XOR 2
+
+typedef struct roaringContainer {
+    uint16_t key;       /* Bits 16-31 of all the offsets stored here. */
+    uint8_t type;       /* ROARING_ARRAY, ROARING_BITMAP or ROARING_RUN. */
+    uint32_t card;      /* Number of set bits, from 1 to 65536. */
+    uint32_t size;      /* Array entries or runs. Unused for bitmaps. */
+    void *data;
+} roaringContainer;
+
+typedef struct roaring {
+    uint64_t len;       /* Length in bytes of the string we represent. */
+    uint64_t card;      /* Total number of set bits. */
+    size_t bytes;       /* Memory used, as reported by roaringBytes(). */
+    uint32_t count;     /* Number of containers. */
+    roaringContainer *c; /* Containers, sorted by key. */
+} roaring;
+
+roaring *roaringNew(void);
+void roaringFree(roaring *r);
+roaring *roaringDup(const roaring *r);
+roaring *roaringFromBytes(const unsigned char *p, size_t len);
+void roaringGetBytes(const roaring *r, uint64_t offset, unsigned char *buf, size_t count);
+int roaringGetBit(const roaring *r, uint64_t bitoffset);
+int roaringSetBit(roaring *r, uint64_t bitoffset, int on);
+long long roaringNextSetBit(const roaring *r, uint64_t bitoffset);
+uint64_t roaringCount(const roaring *r, uint64_t start, uint64_t end);
+long roaringBitpos(const roaring *r, uint64_t start, uint64_t count, int bit);
+roaring *roaringBitop(int op, roaring **src, unsigned long numsrc);
+size_t roaringBytes(const roaring *r);
+size_t roaringBlobLen(const roaring *r);
+void roaringSerialize(const roaring *r, unsigned char *buf);
+roaring *roaringDeserialize(const unsigned char *buf, size_t len);
+
+#ifdef REDIS_TEST
+int roaringTest(int argc, char *argv[]);
+#endif
+
+#endif // __ROARING_H
@@ -481,12 +481,19 @@ int luaRedisGenericCommand(lua_State *lua, int raise_error) {
 
     /* Write commands are forbidden against read-only slaves, or if a
      * command marked as non-deterministic was already called in the context
-     * of this script. */
+     * of this script. In raft mode, where every node runs the script, the
+     * non-deterministic writes are forbidden as well, and while a raft entry
+     * is applied the checks depending on the state of this node are skipped
+     * since the other nodes execute the script anyway. */
     if (cmd->flags & CMD_WRITE) {
         if (server.lua_random_dirty && !server.lua_replicate_commands) {
             luaPushError(lua,
                 "Write commands not allowed after non deterministic commands. Call redis.replicate_commands() at the start of your script in order to switch to single commands replication mode.");
             goto cleanup;
+        } else if (server.raft_id && cmd->flags & CMD_RANDOM) {
+            luaPushError(lua,
+                "Non deterministic write commands are not allowed in raft mode");
+            goto cleanup;
         } else if (server.masterhost && server.repl_slave_ro &&
                    !server.loading &&
                    !(server.lua_caller->flags & CLIENT_MASTER))
@@ -494,6 +501,7 @@ int luaRedisGenericCommand(lua_State *lua, int raise_error) {
             luaPushError(lua, shared.roslaveerr->ptr);
             goto cleanup;
         } else if (server.stop_writes_on_bgsave_err &&
+                   !server.raft_apply_time &&
                    server.saveparamslen > 0 &&
                    server.lastbgsave_status == C_ERR)
         {
@@ -507,7 +515,7 @@ int luaRedisGenericCommand(lua_State *lua, int raise_error) {
      * first write in the context of this script, otherwise we can't stop
      * in the middle. */
     if (server.maxmemory && server.lua_write_dirty == 0 &&
-        (cmd->flags & CMD_DENYOOM))
+        !server.raft_apply_time && (cmd->flags & CMD_DENYOOM))
     {
         if (freeMemoryIfNeeded() == C_ERR) {
             luaPushError(lua, shared.oomerr->ptr);
@@ -564,7 +572,7 @@ int luaRedisGenericCommand(lua_State *lua, int raise_error) {
     /* Convert the result of the Redis command into a suitable Lua type.
      * The first thing we need is to create a single string from the client
      * output buffers. */
-    if (listLength(c->reply) == 0 && c->bufpos < PROTO_REPLY_CHUNK_BYTES) {
+    if (listLength(c->reply) == 0 && (size_t)c->bufpos < c->buf_usable_size) {
         /* This is a fast path for the common case of a reply inside the
          * client static buffer. Don't create an SDS string but just use
          * the client buffer directly. */
@@ -575,9 +583,9 @@ int luaRedisGenericCommand(lua_State *lua, int raise_error) {
         reply = sdsnewlen(c->buf,c->bufpos);
         c->bufpos = 0;
         while(listLength(c->reply)) {
-            sds o = listNodeValue(listFirst(c->reply));
+            robj *o = listNodeValue(listFirst(c->reply));
 
-            reply = sdscatsds(reply,o);
+            reply = sdscatsds(reply,o->ptr);
             listDelNode(c->reply,listFirst(c->reply));
         }
     }
@@ -705,7 +713,9 @@ int luaRedisStatusReplyCommand(lua_State *lua) {
  * already started to write, returns false and stick to whole scripts
  * replication, which is our default. */
 int luaRedisReplicateCommandsCommand(lua_State *lua) {
-    if (server.lua_write_dirty) {
+    /* In raft mode every node runs the script, so it must be deterministic
+     * like when the script itself is replicated. */
+    if (server.lua_write_dirty || server.raft_id) {
         lua_pushboolean(lua,0);
     } else {
         server.lua_replicate_commands = 1;
@@ -1256,7 +1266,8 @@ void evalGenericCommand(client *c, int evalsha) {
      * is called after a random command was used. */
     server.lua_random_dirty = 0;
     server.lua_write_dirty = 0;
-    server.lua_replicate_commands = server.lua_always_replicate_commands;
+    server.lua_replicate_commands = server.lua_always_replicate_commands &&
+                                    !server.raft_id;
     server.lua_multi_emitted = 0;
     server.lua_repl = PROPAGATE_AOF|PROPAGATE_REPL;
 
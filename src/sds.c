@@ -69,33 +69,14 @@ static inline char sdsReqType(size_t string_size) {
     return SDS_TYPE_64;
 }
 
-/* Create a new sds string with the content specified by the 'init' pointer
- * and 'initlen'.
- * If NULL is used for 'init' the string is initialized with zero bytes.
- *
- * The string is always null-termined (all the sds strings are, always) so
- * even if you create an sds string with:
- *
- * mystring = sdsnewlen("abc",3);
- *
- * You can print the string with printf() as there is an implicit \0 at the
- * end of the string. However the string is binary safe and can contain
- * \0 characters in the middle, as the length is stored in the sds header. */
-sds sdsnewlen(const void *init, size_t initlen) {
-    void *sh;
-    sds s;
-    char type = sdsReqType(initlen);
-    /* Empty strings are usually created in order to append. Use type 8
-     * since type 5 is not good at this. */
-    if (type == SDS_TYPE_5 && initlen == 0) type = SDS_TYPE_8;
-    int hdrlen = sdsHdrSize(type);
+/* Write the header of a string of type 'type' at 'sh', copy 'initlen'
+ * bytes of 'init' (if not NULL) after it, and return the string. */
+static sds sdsInitHeader(void *sh, char type, const void *init,
+                         size_t initlen)
+{
+    sds s = (char*)sh+sdsHdrSize(type);
     unsigned char *fp; /* flags pointer. */
 
-    sh = s_malloc(hdrlen+initlen+1);
-    if (!init)
-        memset(sh, 0, hdrlen+initlen+1);
-    if (sh == NULL) return NULL;
-    s = (char*)sh+hdrlen;
     fp = ((unsigned char*)s)-1;
     switch(type) {
         case SDS_TYPE_5: {
@@ -137,6 +118,50 @@ sds sdsnewlen(const void *init, size_t initlen) {
     return s;
 }
 
+/* Create a new sds string with the content specified by the 'init' pointer
+ * and 'initlen'.
+ * If NULL is used for 'init' the string is initialized with zero bytes.
+ *
+ * The string is always null-termined (all the sds strings are, always) so
+ * even if you create an sds string with:
+ *
+ * mystring = sdsnewlen("abc",3);
+ *
+ * You can print the string with printf() as there is an implicit \0 at the
+ * end of the string. However the string is binary safe and can contain
+ * \0 characters in the middle, as the length is stored in the sds header. */
+sds sdsnewlen(const void *init, size_t initlen) {
+    void *sh;
+    char type = sdsReqType(initlen);
+    /* Empty strings are usually created in order to append. Use type 8
+     * since type 5 is not good at this. */
+    if (type == SDS_TYPE_5 && initlen == 0) type = SDS_TYPE_8;
+    int hdrlen = sdsHdrSize(type);
+
+    sh = s_malloc(hdrlen+initlen+1);
+    if (!init)
+        memset(sh, 0, hdrlen+initlen+1);
+    if (sh == NULL) return NULL;
+    return sdsInitHeader(sh,type,init,initlen);
+}
+
+/* Return the number of bytes sdsnewplaced() needs in order to store a
+ * string of 'initlen' bytes: header, string, and null terminator. */
+size_t sdsplacedlen(size_t initlen) {
+    return sdsHdrSize(sdsReqType(initlen))+initlen+1;
+}
+
+/* Like sdsnewlen() but instead of allocating the string, it is created
+ * inside the memory pointed by 'buf', that must be at least
+ * sdsplacedlen(initlen) bytes. This is useful in order to store a string
+ * in the same allocation of some other structure.
+ *
+ * The returned string has no free space and can't be enlarged or released
+ * with sdsfree(): it lives as long as the memory holding it. */
+sds sdsnewplaced(void *buf, const void *init, size_t initlen) {
+    return sdsInitHeader(buf,sdsReqType(initlen),init,initlen);
+}
+
 /* Create an empty (zero length) sds string. Even in this case the string
  * always has an implicit null term. */
 sds sdsempty(void) {
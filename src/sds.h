@@ -215,6 +215,8 @@ static inline void sdssetalloc(sds s, size_t newlen) {
 }
 
 sds sdsnewlen(const void *init, size_t initlen);
+size_t sdsplacedlen(size_t initlen);
+sds sdsnewplaced(void *buf, const void *init, size_t initlen);
 sds sdsnew(const char *init);
 sds sdsempty(void);
 sds sdsdup(const sds s);
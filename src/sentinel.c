@@ -31,6 +31,7 @@
 #include "server.h"
 #include "hiredis.h"
 #include "async.h"
+#include "raft.h"
 
 #include <ctype.h>
 #include <arpa/inet.h>
@@ -119,6 +120,15 @@ typedef struct sentinelAddr {
 #define SENTINEL_SIMFAILURE_CRASH_AFTER_ELECTION (1<<0)
 #define SENTINEL_SIMFAILURE_CRASH_AFTER_PROMOTION (1<<1)
 
+/* Raft mode. Ticks are sentinelTimer() calls, so about 100 milliseconds. */
+#define SENTINEL_RAFT_ELECTION_TICK 10
+#define SENTINEL_RAFT_HEARTBEAT_TICK 1
+#define SENTINEL_RAFT_MAX_INFLIGHT 256
+#define SENTINEL_RAFT_COMPACT_ENTRIES 100 /* Applied entries between two
+                                             snapshots of the state. */
+#define SENTINEL_RAFT_NOLEADER_ERR \
+    "-NOLEADER No raft leader at the moment, try again later\r\n"
+
 /* The link to a sentinelRedisInstance. When we have the same set of Sentinels
  * monitoring many masters, we have different instances representing the
  * same Sentinels, one per master, and we need to share the hiredis connections
@@ -241,6 +251,14 @@ struct sentinelState {
     int announce_port;  /* Port that is gossiped to other sentinels if
                            non zero. */
     unsigned long simfailure_flags; /* Failures simulation. */
+    /* Raft mode: failover elections and master address switches are
+     * committed to a raft log shared by the Sentinels. */
+    uint8_t raft_id;    /* Our raft id, 0 if raft mode is not enabled. */
+    raft *raft;         /* Our raft node, NULL if raft mode is not enabled. */
+    memoryStorage *raft_storage; /* Raft log and hard state. */
+    hardState raft_persisted;    /* Hard state saved in the config file. */
+    uint64_t raft_applied;       /* Index of the last applied raft entry. */
+    raftPeer *raft_peers[RAFT_MAX_PEERS]; /* Peers by raft id. */
 } sentinel;
 
 /* A script execution job. */
@@ -325,7 +343,7 @@ static void redisAeCleanup(void *privdata) {
     zfree(e);
 }
 
-static int redisAeAttach(aeEventLoop *loop, redisAsyncContext *ac) {
+int redisAeAttach(aeEventLoop *loop, redisAsyncContext *ac) {
     redisContext *c = &(ac->c);
     redisAeEvents *e;
 
@@ -367,6 +385,7 @@ void sentinelEvent(int level, char *type, sentinelRedisInstance *ri, const char
 sentinelRedisInstance *sentinelSelectSlave(sentinelRedisInstance *master);
 void sentinelScheduleScriptExecution(char *path, ...);
 void sentinelStartFailover(sentinelRedisInstance *master);
+void sentinelFailoverWaitStart(sentinelRedisInstance *ri);
 void sentinelDiscardReplyCallback(redisAsyncContext *c, void *reply, void *privdata);
 int sentinelSendSlaveOf(sentinelRedisInstance *ri, char *host, int port);
 char *sentinelVoteLeader(sentinelRedisInstance *master, uint64_t req_epoch, char *req_runid, uint64_t *leader_epoch);
@@ -376,6 +395,14 @@ int sentinelSendPing(sentinelRedisInstance *ri);
 int sentinelForceHelloUpdateForMaster(sentinelRedisInstance *master);
 sentinelRedisInstance *getSentinelRedisInstanceByAddrAndRunID(dict *instances, char *ip, int port, char *runid);
 void sentinelSimFailureCrash(void);
+memoryStorage *sentinelRaftStorage(void);
+void sentinelRaftStart(void);
+void sentinelRaftReady(void);
+void sentinelRaftCommand(client *c);
+int sentinelRaftPropose(sds data);
+sds sentinelSetMasterOption(sentinelRedisInstance *ri, char *option, char *value, int apply);
+void sentinelRaftProposeFailover(sentinelRedisInstance *master);
+void sentinelRaftProposeSwitch(sentinelRedisInstance *master, sentinelAddr *addr);
 
 /* ========================= Dictionary types =============================== */
 
@@ -456,6 +483,7 @@ void initSentinel(void) {
         retval = dictAdd(server.commands, sdsnew(cmd->name), cmd);
         serverAssert(retval == DICT_OK);
     }
+    invalidateCommandLookupTable();
 
     /* Initialize various data structures. */
     sentinel.current_epoch = 0;
@@ -468,6 +496,12 @@ void initSentinel(void) {
     sentinel.announce_ip = NULL;
     sentinel.announce_port = 0;
     sentinel.simfailure_flags = SENTINEL_SIMFAILURE_NONE;
+    sentinel.raft_id = 0;
+    sentinel.raft = NULL;
+    sentinel.raft_storage = NULL;
+    memset(&sentinel.raft_persisted,0,sizeof(sentinel.raft_persisted));
+    sentinel.raft_applied = 0;
+    memset(sentinel.raft_peers,0,sizeof(sentinel.raft_peers));
     memset(sentinel.myid,0,sizeof(sentinel.myid));
 }
 
@@ -502,6 +536,9 @@ void sentinelIsRunning(void) {
     /* Log its ID to make debugging of issues simpler. */
     serverLog(LL_WARNING,"Sentinel ID is %s", sentinel.myid);
 
+    /* Join the raft group if raft mode is enabled. */
+    if (sentinel.raft_id) sentinelRaftStart();
+
     /* We want to generate a +monitor event for every configured master
      * at startup. */
     sentinelGenerateInitialMonitorEvents();
@@ -1684,6 +1721,66 @@ char *sentinelHandleConfiguration(char **argv, int argc) {
     } else if (!strcasecmp(argv[0],"announce-port") && argc == 2) {
         /* announce-port <port> */
         sentinel.announce_port = atoi(argv[1]);
+    } else if (!strcasecmp(argv[0],"raft-id") && argc == 2) {
+        /* raft-id <id> */
+        int id = atoi(argv[1]);
+
+        if (id <= 0 || id >= RAFT_MAX_PEERS)
+            return "Raft id must be between 1 and 255.";
+        sentinel.raft_id = id;
+    } else if (!strcasecmp(argv[0],"raft-peer") && argc == 4) {
+        /* raft-peer <id> <ip> <port> */
+        int id = atoi(argv[1]);
+        sentinelAddr *addr;
+
+        if (id <= 0 || id >= RAFT_MAX_PEERS)
+            return "Raft id must be between 1 and 255.";
+        if (sentinel.raft_peers[id]) return "Duplicated raft peer id.";
+        if ((addr = createSentinelAddr(argv[2],atoi(argv[3]))) == NULL)
+            return "Wrong hostname or port for raft peer.";
+        sentinel.raft_peers[id] = createRaftPeer(id,addr->ip,addr->port);
+        releaseSentinelAddr(addr);
+    } else if (!strcasecmp(argv[0],"raft-state") && argc == 5) {
+        /* raft-state <term> <vote> <commit> <applied> */
+        hardState hs;
+
+        hs.term = strtoull(argv[1],NULL,10);
+        hs.voteFor = atoi(argv[2]);
+        hs.commited = strtoull(argv[3],NULL,10);
+        setHardState(sentinelRaftStorage(),&hs);
+        sentinel.raft_persisted = hs;
+        sentinel.raft_applied = strtoull(argv[4],NULL,10);
+    } else if (!strcasecmp(argv[0],"raft-snapshot") && argc == 4) {
+        /* raft-snapshot <index> <term> <data> */
+        memoryStorage *ms = sentinelRaftStorage();
+        snapshotMetaData *ssmd;
+        StorageError err;
+
+        if (storageLastIndex(ms) != ms->ssmd->lastLogIndex)
+            return "The raft snapshot must precede the raft entries.";
+        /* The group is set by sentinelRaftStart(). */
+        ssmd = createSnapshotMetaData();
+        ssmd->lastLogIndex = strtoull(argv[1],NULL,10);
+        ssmd->lastLogTerm = strtoull(argv[2],NULL,10);
+        err = ApplySnapshot(ms,ssmd,argv[3]);
+        freeSnapshotMetaData(ssmd);
+        if (err != StorageOk) return "Duplicated raft snapshot.";
+    } else if (!strcasecmp(argv[0],"raft-entry") && argc == 4) {
+        /* raft-entry <index> <term> <data> */
+        memoryStorage *ms = sentinelRaftStorage();
+        raftEntry *entry;
+        list *entries;
+
+        if (strtoull(argv[1],NULL,10) != storageLastIndex(ms)+1)
+            return "Raft entries must be consecutive.";
+        entry = createRaftEntry();
+        entry->index = strtoull(argv[1],NULL,10);
+        entry->term = strtoull(argv[2],NULL,10);
+        entry->data = sdscpy(entry->data,argv[3]);
+        entries = createRaftEntryList();
+        listAddNodeTail(entries,entry);
+        AppendEntriesToStorage(ms,entries);
+        listRelease(entries);
     } else {
         return "Unrecognized sentinel configuration statement.";
     }
@@ -1699,6 +1796,7 @@ void rewriteConfigSentinelOption(struct rewriteConfigState *state) {
     dictIterator *di, *di2;
     dictEntry *de;
     sds line;
+    int j;
 
     /* sentinel unique ID. */
     line = sdscatprintf(sdsempty(), "sentinel myid %s", sentinel.myid);
@@ -1832,6 +1930,53 @@ void rewriteConfigSentinelOption(struct rewriteConfigState *state) {
         rewriteConfigRewriteLine(state,"sentinel",line,1);
     }
 
+    /* sentinel raft-peer. */
+    for (j = 1; j < RAFT_MAX_PEERS; j++) {
+        raftPeer *peer = sentinel.raft_peers[j];
+
+        if (peer == NULL) continue;
+        line = sdscatprintf(sdsempty(),"sentinel raft-peer %d %s %d",
+            j, peer->ip, peer->port);
+        rewriteConfigRewriteLine(state,"sentinel",line,1);
+    }
+
+    /* sentinel raft-id, raft-state, raft-snapshot and raft-entry: the
+     * config file is also the stable storage of the raft node. */
+    if (sentinel.raft_id) {
+        memoryStorage *ms = sentinelRaftStorage();
+        listIter li;
+        listNode *ln;
+
+        line = sdscatprintf(sdsempty(),"sentinel raft-id %d",
+                            sentinel.raft_id);
+        rewriteConfigRewriteLine(state,"sentinel",line,1);
+        line = sdscatprintf(sdsempty(),"sentinel raft-state %llu %d %llu %llu",
+            (unsigned long long) ms->pState->term, ms->pState->voteFor,
+            (unsigned long long) ms->pState->commited,
+            (unsigned long long) sentinel.raft_applied);
+        rewriteConfigRewriteLine(state,"sentinel",line,1);
+        if (ms->ssmd->lastLogIndex) {
+            line = sdscatprintf(sdsempty(),"sentinel raft-snapshot %llu %llu ",
+                (unsigned long long) ms->ssmd->lastLogIndex,
+                (unsigned long long) ms->ssmd->lastLogTerm);
+            line = sdscatrepr(line,ms->ssdata,sdslen(ms->ssdata));
+            rewriteConfigRewriteLine(state,"sentinel",line,1);
+        }
+
+        /* The first entry is a placeholder for the compacted log. */
+        listRewind(ms->entries,&li);
+        listNext(&li);
+        while((ln = listNext(&li)) != NULL) {
+            raftEntry *entry = ln->value;
+
+            line = sdscatprintf(sdsempty(),"sentinel raft-entry %llu %llu ",
+                (unsigned long long) entry->index,
+                (unsigned long long) entry->term);
+            line = sdscatrepr(line,entry->data,sdslen(entry->data));
+            rewriteConfigRewriteLine(state,"sentinel",line,1);
+        }
+    }
+
     dictReleaseIterator(di);
 }
 
@@ -2158,6 +2303,7 @@ void sentinelRefreshInstanceInfo(sentinelRedisInstance *ri, const char *info) {
             ri->master->failover_state = SENTINEL_FAILOVER_STATE_RECONF_SLAVES;
             ri->master->failover_state_change_time = mstime();
             sentinelFlushConfig();
+            if (sentinel.raft) sentinelRaftProposeSwitch(ri->master,ri->addr);
             sentinelEvent(LL_WARNING,"+promoted-slave",ri,"%@");
             if (sentinel.simfailure_flags &
                 SENTINEL_SIMFAILURE_CRASH_AFTER_PROMOTION)
@@ -2388,8 +2534,10 @@ void sentinelProcessHelloMessage(char *hello, int hello_len) {
                 (unsigned long long) sentinel.current_epoch);
         }
 
-        /* Update master info if received configuration is newer. */
-        if (si && master->config_epoch < master_config_epoch) {
+        /* Update master info if received configuration is newer. In raft
+         * mode the master address only changes with a committed switch
+         * entry, see sentinelRaftApply(). */
+        if (si && !sentinel.raft && master->config_epoch < master_config_epoch) {
             master->config_epoch = master_config_epoch;
             if (master_port != master->addr->port ||
                 strcmp(master->addr->ip, token[5]))
@@ -3031,6 +3179,30 @@ void sentinelCommand(client *c) {
             return;
         }
 
+        /* In raft mode the master is added by every Sentinel when the
+         * entry is applied, see sentinelRaftApply(). */
+        if (sentinel.raft) {
+            sds data;
+
+            if (sentinelGetMasterByName(c->argv[2]->ptr)) {
+                addReplyError(c,"Duplicated master name");
+                return;
+            }
+            if (port < 0 || port > 65535) {
+                addReplyError(c,"Invalid port number");
+                return;
+            }
+            data = sdsnew("monitor ");
+            data = sdscatrepr(data,c->argv[2]->ptr,sdslen(c->argv[2]->ptr));
+            data = sdscatprintf(data," %s %ld %ld",
+                (char*)c->argv[3]->ptr,port,quorum);
+            if (sentinelRaftPropose(data) == C_OK)
+                addReply(c,shared.ok);
+            else
+                addReplySds(c,sdsnew(SENTINEL_RAFT_NOLEADER_ERR));
+            return;
+        }
+
         /* Parameters are valid. Try to create the master instance. */
         ri = createSentinelRedisInstance(c->argv[2]->ptr,SRI_MASTER,
                 c->argv[3]->ptr,port,quorum,NULL);
@@ -3063,6 +3235,16 @@ void sentinelCommand(client *c) {
         if (c->argc != 3) goto numargserr;
         if ((ri = sentinelGetMasterByNameOrReplyError(c,c->argv[2]))
             == NULL) return;
+        if (sentinel.raft) {
+            sds data = sdsnew("remove ");
+
+            data = sdscatrepr(data,ri->name,strlen(ri->name));
+            if (sentinelRaftPropose(data) == C_OK)
+                addReply(c,shared.ok);
+            else
+                addReplySds(c,sdsnew(SENTINEL_RAFT_NOLEADER_ERR));
+            return;
+        }
         sentinelEvent(LL_WARNING,"-monitor",ri,"%@");
         dictDelete(sentinel.masters,c->argv[2]->ptr);
         sentinelFlushConfig();
@@ -3159,6 +3341,9 @@ void sentinelCommand(client *c) {
         }
         dictReleaseIterator(di);
         if (masters_local != sentinel.masters) dictRelease(masters_local);
+    } else if (!strcasecmp(c->argv[1]->ptr,"raft")) {
+        /* SENTINEL RAFT <type> <from> <to> ... */
+        sentinelRaftCommand(c);
     } else if (!strcasecmp(c->argv[1]->ptr,"simulate-failure")) {
         /* SENTINEL SIMULATE-FAILURE <flag> <flag> ... <flag> */
         int j;
@@ -3249,6 +3434,22 @@ void sentinelInfoCommand(client *c) {
             sentinel.running_scripts,
             listLength(sentinel.scripts_queue),
             sentinel.simfailure_flags);
+        if (sentinel.raft) {
+            info = sdscatprintf(info,
+                "sentinel_raft_id:%d\r\n"
+                "sentinel_raft_leader:%d\r\n"
+                "sentinel_raft_term:%llu\r\n"
+                "sentinel_raft_commit:%llu\r\n"
+                "sentinel_raft_applied:%llu\r\n"
+                "sentinel_raft_snapshot:%llu\r\n",
+                sentinel.raft_id,
+                sentinel.raft->leader,
+                (unsigned long long) sentinel.raft->term,
+                (unsigned long long) sentinel.raft->raftlog->commited,
+                (unsigned long long) sentinel.raft_applied,
+                (unsigned long long)
+                    sentinel.raft_storage->ssmd->lastLogIndex);
+        }
 
         di = dictGetIterator(sentinel.masters);
         while((de = dictNext(di)) != NULL) {
@@ -3290,92 +3491,120 @@ void sentinelRoleCommand(client *c) {
     dictReleaseIterator(di);
 }
 
+/* Set the 'option' of the master 'ri' to 'value', as in SENTINEL SET.
+ * When 'apply' is zero the option is only checked. Returns NULL on success,
+ * otherwise the error to reply to the client, and nothing is changed. */
+sds sentinelSetMasterOption(sentinelRedisInstance *ri, char *option, char *value, int apply) {
+    long long ll;
+
+    if (!strcasecmp(option,"down-after-milliseconds")) {
+        /* down-after-millisecodns <milliseconds> */
+        if (!string2ll(value,strlen(value),&ll) || ll <= 0) goto badfmt;
+        if (apply) {
+            ri->down_after_period = ll;
+            sentinelPropagateDownAfterPeriod(ri);
+        }
+    } else if (!strcasecmp(option,"failover-timeout")) {
+        /* failover-timeout <milliseconds> */
+        if (!string2ll(value,strlen(value),&ll) || ll <= 0) goto badfmt;
+        if (apply) ri->failover_timeout = ll;
+    } else if (!strcasecmp(option,"parallel-syncs")) {
+        /* parallel-syncs <milliseconds> */
+        if (!string2ll(value,strlen(value),&ll) || ll <= 0) goto badfmt;
+        if (apply) ri->parallel_syncs = ll;
+    } else if (!strcasecmp(option,"notification-script")) {
+        /* notification-script <path> */
+        if (!apply && strlen(value) && access(value,X_OK) == -1)
+            return sdsnew("Notification script seems non existing or "
+                          "non executable");
+        if (apply) {
+            sdsfree(ri->notification_script);
+            ri->notification_script = strlen(value) ? sdsnew(value) : NULL;
+        }
+    } else if (!strcasecmp(option,"client-reconfig-script")) {
+        /* client-reconfig-script <path> */
+        if (!apply && strlen(value) && access(value,X_OK) == -1)
+            return sdsnew("Client reconfiguration script seems non existing "
+                          "or non executable");
+        if (apply) {
+            sdsfree(ri->client_reconfig_script);
+            ri->client_reconfig_script = strlen(value) ? sdsnew(value) : NULL;
+        }
+    } else if (!strcasecmp(option,"auth-pass")) {
+        /* auth-pass <password> */
+        if (apply) {
+            sdsfree(ri->auth_pass);
+            ri->auth_pass = strlen(value) ? sdsnew(value) : NULL;
+        }
+    } else if (!strcasecmp(option,"quorum")) {
+        /* quorum <count> */
+        if (!string2ll(value,strlen(value),&ll) || ll <= 0) goto badfmt;
+        if (apply) ri->quorum = ll;
+    } else {
+        return sdscatprintf(sdsempty(),"Unknown option '%s' for SENTINEL SET",
+            option);
+    }
+    if (apply) sentinelEvent(LL_WARNING,"+set",ri,"%@ %s %s",option,value);
+    return NULL;
+
+badfmt: /* Bad format errors */
+    return sdscatprintf(sdsempty(),"Invalid argument '%s' for SENTINEL SET '%s'",
+        value, option);
+}
+
 /* SENTINEL SET <mastername> [<option> <value> ...] */
 void sentinelSetCommand(client *c) {
     sentinelRedisInstance *ri;
     int j, changes = 0;
-    char *option, *value;
+    sds err;
 
     if ((ri = sentinelGetMasterByNameOrReplyError(c,c->argv[2]))
         == NULL) return;
 
-    /* Process option - value pairs. */
-    for (j = 3; j < c->argc; j += 2) {
-        option = c->argv[j]->ptr;
-        value = c->argv[j+1]->ptr;
-        robj *o = c->argv[j+1];
-        long long ll;
-
-        if (!strcasecmp(option,"down-after-milliseconds")) {
-            /* down-after-millisecodns <milliseconds> */
-            if (getLongLongFromObject(o,&ll) == C_ERR || ll <= 0)
-                goto badfmt;
-            ri->down_after_period = ll;
-            sentinelPropagateDownAfterPeriod(ri);
-            changes++;
-        } else if (!strcasecmp(option,"failover-timeout")) {
-            /* failover-timeout <milliseconds> */
-            if (getLongLongFromObject(o,&ll) == C_ERR || ll <= 0)
-                goto badfmt;
-            ri->failover_timeout = ll;
-            changes++;
-       } else if (!strcasecmp(option,"parallel-syncs")) {
-            /* parallel-syncs <milliseconds> */
-            if (getLongLongFromObject(o,&ll) == C_ERR || ll <= 0)
-                goto badfmt;
-            ri->parallel_syncs = ll;
-            changes++;
-       } else if (!strcasecmp(option,"notification-script")) {
-            /* notification-script <path> */
-            if (strlen(value) && access(value,X_OK) == -1) {
-                addReplyError(c,
-                    "Notification script seems non existing or non executable");
-                if (changes) sentinelFlushConfig();
-                return;
-            }
-            sdsfree(ri->notification_script);
-            ri->notification_script = strlen(value) ? sdsnew(value) : NULL;
-            changes++;
-       } else if (!strcasecmp(option,"client-reconfig-script")) {
-            /* client-reconfig-script <path> */
-            if (strlen(value) && access(value,X_OK) == -1) {
-                addReplyError(c,
-                    "Client reconfiguration script seems non existing or "
-                    "non executable");
-                if (changes) sentinelFlushConfig();
+    /* In raft mode the options are checked here, and set by every Sentinel
+     * when the entry is applied, see sentinelRaftApply(). */
+    if (sentinel.raft) {
+        sds data = sdsnew("set ");
+
+        data = sdscatrepr(data,ri->name,strlen(ri->name));
+        for (j = 3; j < c->argc; j += 2) {
+            err = sentinelSetMasterOption(ri,c->argv[j]->ptr,
+                                          c->argv[j+1]->ptr,0);
+            if (err) {
+                addReplyError(c,err);
+                sdsfree(err);
+                sdsfree(data);
                 return;
             }
-            sdsfree(ri->client_reconfig_script);
-            ri->client_reconfig_script = strlen(value) ? sdsnew(value) : NULL;
-            changes++;
-       } else if (!strcasecmp(option,"auth-pass")) {
-            /* auth-pass <password> */
-            sdsfree(ri->auth_pass);
-            ri->auth_pass = strlen(value) ? sdsnew(value) : NULL;
-            changes++;
-       } else if (!strcasecmp(option,"quorum")) {
-            /* quorum <count> */
-            if (getLongLongFromObject(o,&ll) == C_ERR || ll <= 0)
-                goto badfmt;
-            ri->quorum = ll;
-            changes++;
-        } else {
-            addReplyErrorFormat(c,"Unknown option '%s' for SENTINEL SET",
-                option);
+            data = sdscatlen(data," ",1);
+            data = sdscatrepr(data,c->argv[j]->ptr,sdslen(c->argv[j]->ptr));
+            data = sdscatlen(data," ",1);
+            data = sdscatrepr(data,c->argv[j+1]->ptr,
+                              sdslen(c->argv[j+1]->ptr));
+        }
+        if (sentinelRaftPropose(data) == C_OK)
+            addReply(c,shared.ok);
+        else
+            addReplySds(c,sdsnew(SENTINEL_RAFT_NOLEADER_ERR));
+        return;
+    }
+
+    /* Process option - value pairs. */
+    for (j = 3; j < c->argc; j += 2) {
+        char *option = c->argv[j]->ptr, *value = c->argv[j+1]->ptr;
+
+        if ((err = sentinelSetMasterOption(ri,option,value,0)) != NULL) {
+            addReplyError(c,err);
+            sdsfree(err);
             if (changes) sentinelFlushConfig();
             return;
         }
-        sentinelEvent(LL_WARNING,"+set",ri,"%@ %s %s",option,value);
+        sentinelSetMasterOption(ri,option,value,1);
+        changes++;
     }
 
     if (changes) sentinelFlushConfig();
     addReply(c,shared.ok);
-    return;
-
-badfmt: /* Bad format errors */
-    if (changes) sentinelFlushConfig();
-    addReplyErrorFormat(c,"Invalid argument '%s' for SENTINEL SET '%s'",
-            value, option);
 }
 
 /* Our fake PUBLISH command: it is actually useful only to receive hello messages
@@ -3539,6 +3768,18 @@ void sentinelReceiveIsMasterDownReply(redisAsyncContext *c, void *reply, void *p
                     (unsigned long long) r->element[2]->integer);
             ri->leader = sdsnew(r->element[1]->str);
             ri->leader_epoch = r->element[2]->integer;
+
+            /* If we are waiting for the outcome of our own election, count
+             * the votes right now instead of waiting for the next timer
+             * tick: the last vote we need usually lands here. */
+            sentinelRedisInstance *master = ri->master;
+            if (!sentinel.tilt &&
+                master->flags & SRI_FAILOVER_IN_PROGRESS &&
+                master->failover_state == SENTINEL_FAILOVER_STATE_WAIT_START &&
+                ri->leader_epoch == master->failover_epoch)
+            {
+                sentinelFailoverWaitStart(master);
+            }
         }
     }
 }
@@ -3584,8 +3825,8 @@ void sentinelAskMasterStateToOtherSentinels(sentinelRedisInstance *master, int f
                     "SENTINEL is-master-down-by-addr %s %s %llu %s",
                     master->addr->ip, port,
                     sentinel.current_epoch,
-                    (master->failover_state > SENTINEL_FAILOVER_STATE_NONE) ?
-                    sentinel.myid : "*");
+                    (master->failover_state > SENTINEL_FAILOVER_STATE_NONE &&
+                     sentinel.raft == NULL) ? sentinel.myid : "*");
         if (retval == C_OK) ri->link->pending_commands++;
     }
     dictReleaseIterator(di);
@@ -3804,6 +4045,7 @@ void sentinelStartFailover(sentinelRedisInstance *master) {
     sentinelEvent(LL_WARNING,"+try-failover",master,"%@");
     master->failover_start_time = mstime()+rand()%SENTINEL_MAX_DESYNC;
     master->failover_state_change_time = mstime();
+    if (sentinel.raft) sentinelRaftProposeFailover(master);
 }
 
 /* This function checks if there are the conditions to start the failover,
@@ -3824,6 +4066,9 @@ int sentinelStartFailoverIfNeeded(sentinelRedisInstance *master) {
     /* Failover already in progress? */
     if (master->flags & SRI_FAILOVER_IN_PROGRESS) return 0;
 
+    /* In raft mode only the raft leader tries to failover. */
+    if (sentinel.raft && sentinel.raft->state != NodeStateLeader) return 0;
+
     /* Last failover attempt started too little time ago? */
     if (mstime() - master->failover_start_time <
         master->failover_timeout*2)
@@ -3956,8 +4201,13 @@ void sentinelFailoverWaitStart(sentinelRedisInstance *ri) {
     char *leader;
     int isleader;
 
-    /* Check if we are the leader for the failover epoch. */
-    leader = sentinelGetLeader(ri, ri->failover_epoch);
+    /* Check if we are the leader for the failover epoch. In raft mode the
+     * leader is the one named by the committed failover entry. */
+    if (sentinel.raft)
+        leader = (ri->leader && ri->leader_epoch == ri->failover_epoch) ?
+                 sdsnew(ri->leader) : NULL;
+    else
+        leader = sentinelGetLeader(ri, ri->failover_epoch);
     isleader = leader && strcasecmp(leader,sentinel.myid) == 0;
     sdsfree(leader);
 
@@ -4172,6 +4422,10 @@ void sentinelFailoverSwitchToPromotedSlave(sentinelRedisInstance *master) {
     sentinelRedisInstance *ref = master->promoted_slave ?
                                  master->promoted_slave : master;
 
+    /* Propose the switch again in case the first proposal was lost. */
+    if (sentinel.raft && master->promoted_slave)
+        sentinelRaftProposeSwitch(master,ref->addr);
+
     sentinelEvent(LL_WARNING,"+switch-master",master,"%s %s %d %s %d",
         master->name, master->addr->ip, master->addr->port,
         ref->addr->ip, ref->addr->port);
@@ -4221,6 +4475,397 @@ void sentinelAbortFailover(sentinelRedisInstance *ri) {
     }
 }
 
+/* =============================== RAFT MODE ================================
+ * When "sentinel raft-id" is configured the Sentinels listed with
+ * "sentinel raft-peer" form a raft group (see raft.c). The raft leader is the
+ * only Sentinel starting failovers, and two kinds of entries are committed
+ * to the log and applied by every Sentinel:
+ *
+ * failover <name> <epoch> <runid>    <runid> won the failover election.
+ * switch <name> <ip> <port> <epoch>  The failover promoted <ip>:<port>.
+ *
+ * This replaces both the is-master-down-by-addr votes and the Hello based
+ * propagation of the new master address. SENTINEL MONITOR, REMOVE and SET
+ * are committed to the log as well, so that every Sentinel monitors the same
+ * masters with the same options:
+ *
+ * monitor <name> <ip> <port> <quorum>
+ * remove <name>
+ * set <name> <option> <value> [<option> <value> ...]
+ *
+ * Every SENTINEL_RAFT_COMPACT_ENTRIES applied entries the state is saved as
+ * a raft snapshot, written with the same entries plus "epoch <epoch>", and
+ * the log is compacted. The raft log, snapshot and hard state are saved in
+ * the config file, like the rest of the Sentinel state.
+ * -------------------------------------------------------------------------- */
+
+/* Return the raft storage, creating it if needed: the config file is loaded
+ * before the raft node is created. */
+memoryStorage *sentinelRaftStorage(void) {
+    if (sentinel.raft_storage == NULL)
+        sentinel.raft_storage = newMemoryStorage();
+    return sentinel.raft_storage;
+}
+
+/* Return the raft group. Our own id is part of it even if it is not listed
+ * among the peers, so that every Sentinel can use the same list. */
+confState *sentinelRaftConfState(void) {
+    confState *cs = createConfState();
+    int j;
+
+    listAddNodeTail(cs->peers,(void*)(unsigned long)sentinel.raft_id);
+    for (j = 1; j < RAFT_MAX_PEERS; j++) {
+        if (sentinel.raft_peers[j] && j != sentinel.raft_id)
+            listAddNodeTail(cs->peers,(void*)(unsigned long)j);
+    }
+    return cs;
+}
+
+/* Create the raft node. */
+void sentinelRaftStart(void) {
+    memoryStorage *ms = sentinelRaftStorage();
+    confState *cs = sentinelRaftConfState();
+    raftConfig cfg;
+
+    /* The snapshot loaded from the config file does not record the group. */
+    if (ms->ssmd->lastLogIndex && listLength(ms->ssmd->cs->peers) == 0) {
+        freeConfState(ms->ssmd->cs);
+        ms->ssmd->cs = dupConfState(cs);
+    }
+
+    memset(&cfg,0,sizeof(cfg));
+    cfg.id = sentinel.raft_id;
+    cfg.electionTick = SENTINEL_RAFT_ELECTION_TICK;
+    cfg.heartbeatTick = SENTINEL_RAFT_HEARTBEAT_TICK;
+    cfg.checkQuorum = true;
+    cfg.maxSizePerMsg = UINT64_MAX;
+    cfg.maxInflightMsgs = SENTINEL_RAFT_MAX_INFLIGHT;
+    cfg.applied = sentinel.raft_applied;
+    cfg.storage = ms;
+    cfg.peers = cs->peers;
+    sentinel.raft = newRaft(&cfg);
+    serverLog(LL_WARNING,"Sentinel raft id is %d, %lu Sentinels in the group",
+        sentinel.raft_id, listLength(cfg.peers));
+    freeConfState(cs);
+}
+
+/* Apply a committed raft entry. Every Sentinel applies the same entries in
+ * the same order, so the checks against the epochs are enough to make the
+ * ones already applied before a restart harmless. */
+void sentinelRaftApply(sds data) {
+    sentinelRedisInstance *master;
+    int argc, j;
+    sds *argv = sdssplitargs(data,&argc);
+
+    if (argv == NULL) return;
+    if (argc == 2 && !strcasecmp(argv[0],"epoch")) {
+        uint64_t epoch = strtoull(argv[1],NULL,10);
+
+        if (epoch > sentinel.current_epoch) {
+            sentinel.current_epoch = epoch;
+            sentinelEvent(LL_WARNING,"+new-epoch",NULL,"%llu",
+                (unsigned long long) sentinel.current_epoch);
+        }
+        goto cleanup;
+    }
+    if (argc < 2) goto cleanup;
+    master = sentinelGetMasterByName(argv[1]);
+
+    if (!strcasecmp(argv[0],"monitor") && argc == 5) {
+        int port = atoi(argv[3]), quorum = atoi(argv[4]);
+
+        /* A snapshot also lists the masters we already monitor. */
+        if (master == NULL) {
+            master = createSentinelRedisInstance(argv[1],SRI_MASTER,argv[2],
+                                                 port,quorum,NULL);
+            if (master)
+                sentinelEvent(LL_WARNING,"+monitor",master,"%@ quorum %d",
+                    master->quorum);
+        } else {
+            master->quorum = quorum;
+            if (port != master->addr->port || strcmp(master->addr->ip,argv[2]))
+                sentinelResetMasterAndChangeAddress(master,argv[2],port);
+        }
+        goto cleanup;
+    }
+    if (master == NULL) goto cleanup;
+
+    if (!strcasecmp(argv[0],"remove") && argc == 2) {
+        sentinelEvent(LL_WARNING,"-monitor",master,"%@");
+        dictDelete(sentinel.masters,argv[1]);
+    } else if (!strcasecmp(argv[0],"set") && argc >= 4 && argc % 2 == 0) {
+        for (j = 2; j < argc; j += 2)
+            sentinelSetMasterOption(master,argv[j],argv[j+1],1);
+    } else if (!strcasecmp(argv[0],"failover") && argc == 4) {
+        uint64_t epoch = strtoull(argv[2],NULL,10);
+
+        if (epoch > sentinel.current_epoch) {
+            sentinel.current_epoch = epoch;
+            sentinelEvent(LL_WARNING,"+new-epoch",master,"%llu",
+                (unsigned long long) sentinel.current_epoch);
+        }
+        if (epoch > master->leader_epoch) {
+            sdsfree(master->leader);
+            master->leader = sdsnew(argv[3]);
+            master->leader_epoch = epoch;
+            sentinelEvent(LL_WARNING,"+vote-for-leader",master,"%s %llu",
+                master->leader, (unsigned long long) master->leader_epoch);
+            if (strcasecmp(master->leader,sentinel.myid)) {
+                /* Don't start a failover of our own while this one is
+                 * in progress. */
+                master->failover_start_time = mstime();
+            } else if (!sentinel.tilt &&
+                       master->flags & SRI_FAILOVER_IN_PROGRESS &&
+                       master->failover_state ==
+                           SENTINEL_FAILOVER_STATE_WAIT_START &&
+                       master->failover_epoch == epoch)
+            {
+                sentinelFailoverWaitStart(master);
+            }
+        }
+    } else if (!strcasecmp(argv[0],"switch") && argc == 5) {
+        uint64_t epoch = strtoull(argv[4],NULL,10);
+        int port = atoi(argv[3]);
+
+        /* The Sentinel performing the failover already updated its
+         * config_epoch, it switches at the end of the failover. */
+        if (epoch > master->config_epoch) {
+            master->config_epoch = epoch;
+            if (port != master->addr->port || strcmp(master->addr->ip,argv[2]))
+            {
+                sentinelAddr *old_addr;
+
+                sentinelEvent(LL_WARNING,"+switch-master",
+                    master,"%s %s %d %s %d",
+                    master->name,
+                    master->addr->ip, master->addr->port,
+                    argv[2], port);
+
+                old_addr = dupSentinelAddr(master->addr);
+                sentinelResetMasterAndChangeAddress(master,argv[2],port);
+                sentinelCallClientReconfScript(master,
+                    SENTINEL_OBSERVER,"start",
+                    old_addr,master->addr);
+                releaseSentinelAddr(old_addr);
+            }
+        }
+    }
+
+cleanup:
+    sdsfreesplitres(argv,argc);
+}
+
+/* Return our state as the entries that rebuild it, for the raft snapshot:
+ * the current epoch, then every master with its options and the last
+ * failover. */
+sds sentinelRaftSnapshot(void) {
+    sds data = sdscatprintf(sdsempty(),"epoch %llu\n",
+        (unsigned long long) sentinel.current_epoch);
+    dictIterator *di;
+    dictEntry *de;
+
+    di = dictGetIterator(sentinel.masters);
+    while((de = dictNext(di)) != NULL) {
+        sentinelRedisInstance *ri = dictGetVal(de);
+        /* While we fail over the master, the config epoch is already the
+         * one of the promoted slave, see sentinelRefreshInstanceInfo(). */
+        sentinelAddr *addr = sentinelGetCurrentMasterAddress(ri);
+        char *auth_pass = ri->auth_pass ? ri->auth_pass : "";
+        char *notification_script =
+            ri->notification_script ? ri->notification_script : "";
+        char *client_reconfig_script =
+            ri->client_reconfig_script ? ri->client_reconfig_script : "";
+
+        data = sdscat(data,"monitor ");
+        data = sdscatrepr(data,ri->name,strlen(ri->name));
+        data = sdscatprintf(data," %s %d %u\n",
+            addr->ip, addr->port, ri->quorum);
+
+        data = sdscat(data,"set ");
+        data = sdscatrepr(data,ri->name,strlen(ri->name));
+        data = sdscatprintf(data," down-after-milliseconds %lld"
+            " failover-timeout %lld parallel-syncs %d auth-pass ",
+            ri->down_after_period, ri->failover_timeout, ri->parallel_syncs);
+        data = sdscatrepr(data,auth_pass,strlen(auth_pass));
+        data = sdscat(data," notification-script ");
+        data = sdscatrepr(data,notification_script,
+                          strlen(notification_script));
+        data = sdscat(data," client-reconfig-script ");
+        data = sdscatrepr(data,client_reconfig_script,
+                          strlen(client_reconfig_script));
+        data = sdscat(data,"\n");
+
+        data = sdscat(data,"switch ");
+        data = sdscatrepr(data,ri->name,strlen(ri->name));
+        data = sdscatprintf(data," %s %d %llu\n",
+            addr->ip, addr->port, (unsigned long long) ri->config_epoch);
+
+        if (ri->leader) {
+            data = sdscat(data,"failover ");
+            data = sdscatrepr(data,ri->name,strlen(ri->name));
+            data = sdscatprintf(data," %llu %s\n",
+                (unsigned long long) ri->leader_epoch, ri->leader);
+        }
+    }
+    dictReleaseIterator(di);
+    return data;
+}
+
+/* Replace our state with the snapshot sent by the raft leader because we
+ * are too far behind to catch up from its log: forget the masters it does
+ * not list, then apply its entries. */
+void sentinelRaftRestore(sds data) {
+    int count, j;
+    sds *lines = sdssplitlen(data,sdslen(data),"\n",1,&count);
+    dictIterator *di;
+    dictEntry *de;
+
+    di = dictGetSafeIterator(sentinel.masters);
+    while((de = dictNext(di)) != NULL) {
+        sentinelRedisInstance *ri = dictGetVal(de);
+        int found = 0;
+
+        for (j = 0; j < count && !found; j++) {
+            int argc;
+            sds *argv = sdssplitargs(lines[j],&argc);
+
+            if (argv && argc == 5 && !strcasecmp(argv[0],"monitor") &&
+                !strcmp(argv[1],ri->name)) found = 1;
+            sdsfreesplitres(argv,argc);
+        }
+        if (!found) {
+            sentinelEvent(LL_WARNING,"-monitor",ri,"%@");
+            dictDelete(sentinel.masters,ri->name);
+        }
+    }
+    dictReleaseIterator(di);
+
+    for (j = 0; j < count; j++) {
+        if (sdslen(lines[j])) sentinelRaftApply(lines[j]);
+    }
+    sdsfreesplitres(lines,count);
+}
+
+/* Run the raft node after every step, tick or proposal: save the new log
+ * entries and hard state, apply what was committed, and only then send the
+ * messages, so that nothing we acknowledge can be lost by a restart. */
+void sentinelRaftReady(void) {
+    raft *r = sentinel.raft;
+    memoryStorage *ms = sentinel.raft_storage;
+    hardState hs;
+    list *entries, *msgs;
+    listIter li;
+    listNode *ln;
+    int changed = 0;
+    char *prefix[2] = {"SENTINEL","RAFT"};
+
+    flushProposals(r);
+    if (raftStableSnapshot(r)) {
+        sentinelRaftRestore(ms->ssdata);
+        changed = 1;
+    }
+    if (raftStableEntries(r)) changed = 1;
+    hs = raftHardState(r);
+    if (hs.term != sentinel.raft_persisted.term ||
+        hs.voteFor != sentinel.raft_persisted.voteFor ||
+        hs.commited != sentinel.raft_persisted.commited)
+    {
+        setHardState(sentinel.raft_storage,&hs);
+        sentinel.raft_persisted = hs;
+        changed = 1;
+    }
+
+    if ((entries = raftCommittedEntries(r)) != NULL) {
+        listRewind(entries,&li);
+        while((ln = listNext(&li)) != NULL) {
+            raftEntry *entry = ln->value;
+
+            /* Leaders commit an empty entry when elected. */
+            if (sdslen(entry->data)) sentinelRaftApply(entry->data);
+        }
+        listRelease(entries);
+        changed = 1;
+    }
+    sentinel.raft_applied = r->raftlog->applied;
+
+    /* Snapshot the state from time to time so that the log, and the config
+     * file that stores it, don't grow forever. */
+    if (sentinel.raft_applied - ms->ssmd->lastLogIndex >=
+        SENTINEL_RAFT_COMPACT_ENTRIES &&
+        raftCompact(r,sentinelRaftSnapshot()))
+    {
+        changed = 1;
+    }
+    if (changed) sentinelFlushConfig();
+
+    msgs = raftTakeMessages(r);
+    listRewind(msgs,&li);
+    while((ln = listNext(&li)) != NULL) {
+        raftMessage *msg = ln->value;
+
+        if (msg->to != sentinel.raft_id)
+            raftSendMessage(sentinel.raft_peers[msg->to],msg,2,prefix);
+    }
+    listRelease(msgs);
+}
+
+/* Propose an entry, taking ownership of 'data'. Followers forward it to the
+ * raft leader. Returns C_ERR, dropping the entry, if there is no leader to
+ * propose it to. */
+int sentinelRaftPropose(sds data) {
+    raftMessage *msg;
+    raftEntry *entry;
+
+    if (sentinel.raft->leader == 0) {
+        sdsfree(data);
+        return C_ERR;
+    }
+    msg = createRaftMessage();
+    entry = createRaftEntry();
+    sdsfree(entry->data);
+    entry->data = data;
+    listAddNodeTail(msg->entries,entry);
+    msg->type = MessageProp;
+    msg->from = sentinel.raft_id;
+    Step(sentinel.raft,msg);
+    freeRaftMessage(msg);
+    sentinelRaftReady();
+    return C_OK;
+}
+
+void sentinelRaftProposeFailover(sentinelRedisInstance *master) {
+    sds data = sdsnew("failover ");
+
+    data = sdscatrepr(data,master->name,strlen(master->name));
+    data = sdscatprintf(data," %llu %s",
+        (unsigned long long) master->failover_epoch, sentinel.myid);
+    sentinelRaftPropose(data);
+}
+
+void sentinelRaftProposeSwitch(sentinelRedisInstance *master, sentinelAddr *addr) {
+    sds data = sdsnew("switch ");
+
+    data = sdscatrepr(data,master->name,strlen(master->name));
+    data = sdscatprintf(data," %s %d %llu",addr->ip,addr->port,
+        (unsigned long long) master->failover_epoch);
+    sentinelRaftPropose(data);
+}
+
+/* SENTINEL RAFT <type> <from> <to> ... as sent by raftSendMessage(). */
+void sentinelRaftCommand(client *c) {
+    raftMessage *msg;
+
+    if (sentinel.raft == NULL) {
+        addReplyError(c,"This Sentinel is not in raft mode");
+        return;
+    }
+    if ((msg = raftMessageFromArgv(c,2,sentinel.raft)) == NULL) return;
+    Step(sentinel.raft,msg);
+    freeRaftMessage(msg);
+    sentinelRaftReady();
+    addReply(c,shared.ok);
+}
+
 /* ======================== SENTINEL timer handler ==========================
  * This is the "main" our Sentinel, being sentinel completely non blocking
  * in design. The function is called every second.
@@ -4320,6 +4965,10 @@ void sentinelCheckTiltCondition(void) {
 
 void sentinelTimer(void) {
     sentinelCheckTiltCondition();
+    if (sentinel.raft) {
+        sentinel.raft->tick(sentinel.raft);
+        sentinelRaftReady();
+    }
     sentinelHandleDictOfRedisInstances(sentinel.masters);
     sentinelRunPendingScripts();
     sentinelCollectTerminatedScripts();
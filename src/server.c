@@ -269,6 +269,8 @@ struct redisCommand redisCommandTable[] = {
     {"watch",watchCommand,-2,"sF",0,NULL,1,-1,1,0,0},
     {"unwatch",unwatchCommand,1,"sF",0,NULL,0,0,0,0,0},
     {"cluster",clusterCommand,-2,"a",0,NULL,0,0,0,0,0},
+    {"raft",raftCommand,-11,"aslt",0,NULL,0,0,0,0,0},
+    {"consistency",consistencyCommand,-1,"ltF",0,NULL,0,0,0,0,0},
     {"restore",restoreCommand,-4,"wm",0,NULL,1,1,1,0,0},
     {"restore-asking",restoreCommand,-4,"wmk",0,NULL,1,1,1,0,0},
     {"migrate",migrateCommand,-6,"w",0,migrateGetKeys,0,0,0,0,0},
@@ -412,6 +414,13 @@ mstime_t mstime(void) {
     return ustime()/1000;
 }
 
+/* Return the time in milliseconds the commands use to compute the expires
+ * they set. While a raft entry is applied this is the time of the entry, so
+ * that every node of the group sets the same expires. */
+mstime_t commandTime(void) {
+    return server.raft_apply_time ? server.raft_apply_time : mstime();
+}
+
 /* After an RDB dump or AOF rewrite we exit from children using _exit() instead of
  * exit(), because the latter may interact with the same file objects used by
  * the parent process. However if we are testing the coverage normal exit() is
@@ -479,6 +488,15 @@ void dictSdsDestructor(void *privdata, void *val)
     sdsfree(val);
 }
 
+/* Used by dicts that store sds keys inside the dictEntry allocation. */
+size_t dictSdsEmbedLen(const void *key) {
+    return sdsplacedlen(sdslen((sds)key));
+}
+
+void *dictSdsEmbed(void *buf, const void *key) {
+    return sdsnewplaced(buf,key,sdslen((sds)key));
+}
+
 int dictObjKeyCompare(void *privdata, const void *key1,
         const void *key2)
 {
@@ -499,6 +517,16 @@ uint64_t dictSdsCaseHash(const void *key) {
     return dictGenCaseHashFunction((unsigned char*)key, sdslen((char*)key));
 }
 
+/* Faster but not hash flooding resistant variants of the above, for the
+ * dictionaries where the keys are not controlled by the clients. */
+uint64_t dictSdsFastHash(const void *key) {
+    return dictGenFastHashFunction((unsigned char*)key, sdslen((char*)key));
+}
+
+uint64_t dictSdsFastCaseHash(const void *key) {
+    return dictGenFastCaseHashFunction((unsigned char*)key, sdslen((char*)key));
+}
+
 int dictEncObjKeyCompare(void *privdata, const void *key1,
         const void *key2)
 {
@@ -571,14 +599,19 @@ dictType zsetDictType = {
     NULL                       /* val destructor */
 };
 
-/* Db->dict, keys are sds strings, vals are Redis objects. */
+/* Db->dict, keys are sds strings, vals are Redis objects. The keys are
+ * copied inside the dictEntry itself, saving an allocation per key and
+ * a pointer dereference when comparing keys on lookups. */
 dictType dbDictType = {
     dictSdsHash,                /* hash function */
     NULL,                       /* key dup */
     NULL,                       /* val dup */
     dictSdsKeyCompare,          /* key compare */
-    dictSdsDestructor,          /* key destructor */
-    dictObjectDestructor   /* val destructor */
+    NULL,                       /* key destructor */
+    dictObjectDestructor,       /* val destructor */
+    dictSdsEmbedLen,            /* key embed len */
+    dictSdsEmbed,               /* key embed */
+    dictExpandInBackground      /* expand later */
 };
 
 /* server.lua_scripts sha (as sds string) -> scripts (as robj) cache. */
@@ -598,12 +631,15 @@ dictType keyptrDictType = {
     NULL,                       /* val dup */
     dictSdsKeyCompare,          /* key compare */
     NULL,                       /* key destructor */
-    NULL                        /* val destructor */
+    NULL,                       /* val destructor */
+    NULL,                       /* key embed len */
+    NULL,                       /* key embed */
+    dictExpandInBackground      /* expand later */
 };
 
 /* Command table. sds string -> command struct pointer. */
 dictType commandTableDictType = {
-    dictSdsCaseHash,            /* hash function */
+    dictSdsFastCaseHash,        /* hash function */
     NULL,                       /* key dup */
     NULL,                       /* val dup */
     dictSdsKeyCaseCompare,      /* key compare */
@@ -636,7 +672,7 @@ dictType keylistDictType = {
 /* Cluster nodes hash table, mapping nodes addresses 1.2.3.4:6379 to
  * clusterNode structures. */
 dictType clusterNodesDictType = {
-    dictSdsHash,                /* hash function */
+    dictSdsFastHash,            /* hash function */
     NULL,                       /* key dup */
     NULL,                       /* val dup */
     dictSdsKeyCompare,          /* key compare */
@@ -648,7 +684,7 @@ dictType clusterNodesDictType = {
  * we can re-add this node. The goal is to avoid readding a removed
  * node for some time. */
 dictType clusterNodesBlackListDictType = {
-    dictSdsCaseHash,            /* hash function */
+    dictSdsFastCaseHash,        /* hash function */
     NULL,                       /* key dup */
     NULL,                       /* val dup */
     dictSdsKeyCaseCompare,      /* key compare */
@@ -660,7 +696,7 @@ dictType clusterNodesBlackListDictType = {
  * we can re-add this node. The goal is to avoid readding a removed
  * node for some time. */
 dictType modulesDictType = {
-    dictSdsCaseHash,            /* hash function */
+    dictSdsFastCaseHash,        /* hash function */
     NULL,                       /* key dup */
     NULL,                       /* val dup */
     dictSdsKeyCaseCompare,      /* key compare */
@@ -670,7 +706,7 @@ dictType modulesDictType = {
 
 /* Migrate cache dict type. */
 dictType migrateCacheDictType = {
-    dictSdsHash,                /* hash function */
+    dictSdsFastHash,            /* hash function */
     NULL,                       /* key dup */
     NULL,                       /* val dup */
     dictSdsKeyCompare,          /* key compare */
@@ -682,7 +718,7 @@ dictType migrateCacheDictType = {
  * Keys are sds SHA1 strings, while values are not used at all in the current
  * implementation. */
 dictType replScriptCacheDictType = {
-    dictSdsCaseHash,            /* hash function */
+    dictSdsFastCaseHash,        /* hash function */
     NULL,                       /* key dup */
     NULL,                       /* val dup */
     dictSdsKeyCaseCompare,      /* key compare */
@@ -708,21 +744,148 @@ void tryResizeHashTables(int dbid) {
         dictResize(server.db[dbid].expires);
 }
 
+/* A table for a big keyspace dict, allocated by the BIO_DICT_TABLE thread
+ * while the dict keeps working with its current table. */
+typedef struct dictTableJob {
+    dict *d;                /* Dict that asked for the table. */
+    unsigned long oldsize;  /* Size of the dict table at that time. */
+    dictht ht;              /* The table, ready when the bio job is done. */
+} dictTableJob;
+
+/* The expandLater() method of the keyspace dict types. Allocating and
+ * zeroing a table of millions of buckets can block the server for a long
+ * time, so for big tables the work is left to a bio thread, and the dict
+ * keeps using its current table (at a load factor a bit over 1) until
+ * handleDictTableJobs() gives it the new one. Returns 1 if the table will
+ * be provided later, 0 if the dict should expand now. */
+int dictExpandInBackground(dict *d, unsigned long size) {
+    listIter li;
+    listNode *ln;
+    dictTableJob *job;
+
+    /* While loading the cron is not called, so there is nobody to install
+     * the table. */
+    if (size < HASHTABLE_BIG_SIZE || server.loading) return 0;
+    listRewind(server.dict_table_jobs,&li);
+    while((ln = listNext(&li)) != NULL) {
+        job = ln->value;
+        if (job->d == d) return 1; /* Already in progress. */
+    }
+    job = zmalloc(sizeof(*job));
+    job->d = d;
+    job->oldsize = d->ht[0].size;
+    listAddNodeTail(server.dict_table_jobs,job);
+    bioCreateBackgroundJob(BIO_DICT_TABLE,&job->ht,(void*)size,NULL);
+    return 1;
+}
+
+/* Give the tables allocated in the background to the dicts that asked for
+ * them. Bio jobs of a given type are processed in order, so the first
+ * jobs in the list, minus the ones still pending, are done. If a dict was
+ * released or resized in the meantime, the table is just discarded. */
+void handleDictTableJobs(void) {
+    unsigned long done = listLength(server.dict_table_jobs) -
+                         bioPendingJobsOfType(BIO_DICT_TABLE);
+
+    while(done--) {
+        listNode *ln = listFirst(server.dict_table_jobs);
+        dictTableJob *job = ln->value;
+        dict *d = NULL;
+        int j;
+
+        for (j = 0; j < server.dbnum; j++) {
+            if (server.db[j].dict == job->d || server.db[j].expires == job->d) {
+                d = job->d;
+                break;
+            }
+        }
+        if (d == NULL || d->ht[0].size != job->oldsize ||
+            dictExpandWithTable(d,&job->ht) == DICT_ERR)
+        {
+            dictTableRelease(&job->ht);
+        }
+        zfree(job);
+        listDelNode(server.dict_table_jobs,ln);
+    }
+}
+
+/* Return true if the dict is a big table (see HASHTABLE_BIG_SIZE) in the
+ * middle of a rehashing. */
+int dictIsBigRehashing(dict *d) {
+    return dictIsRehashing(d) && (d->ht[0].size >= HASHTABLE_BIG_SIZE ||
+                                  d->ht[1].size >= HASHTABLE_BIG_SIZE);
+}
+
+/* Return the keys or expires table of the specified DB if it is a big
+ * table in the middle of a rehashing, otherwise NULL is returned. */
+dict *bigRehashingDict(int dbid) {
+    if (dictIsBigRehashing(server.db[dbid].dict))
+        return server.db[dbid].dict; /* Keys dictionary */
+    if (dictIsBigRehashing(server.db[dbid].expires))
+        return server.db[dbid].expires; /* Expires */
+    return NULL;
+}
+
+/* Time event rehashing the big tables. A step of 1 millisecond every cron
+ * call would leave a db of tens of millions of keys in the two tables state
+ * (where every lookup probes both) for many minutes, while longer steps
+ * stall every command for as long. So while a big table is rehashing, this
+ * time event runs steps of HASHTABLE_BIG_REHASH_SLICE_US, spaced so that
+ * they take at most HASHTABLE_BIG_REHASH_PERC percent of the CPU time, both
+ * when the server is busy and when it is idle.
+ *
+ * The time event is created by incrementallyRehash() and deletes itself
+ * when there is nothing left to do. */
+int rehashBigTablesProc(struct aeEventLoop *eventLoop, long long id, void *clientData) {
+    int j;
+    UNUSED(eventLoop);
+    UNUSED(id);
+    UNUSED(clientData);
+
+    /* Same conditions of databasesCron(): if we stop here because of a
+     * saving child, the cron will start us again later. */
+    if (server.activerehashing &&
+        server.rdb_child_pid == -1 && server.aof_child_pid == -1)
+    {
+        for (j = 0; j < server.dbnum; j++) {
+            dict *d = bigRehashingDict(j);
+
+            if (d == NULL) continue;
+            dictRehashMicroseconds(d,HASHTABLE_BIG_REHASH_SLICE_US);
+            return HASHTABLE_BIG_REHASH_SLICE_US/1000*
+                   (100-HASHTABLE_BIG_REHASH_PERC)/HASHTABLE_BIG_REHASH_PERC;
+        }
+    }
+    server.big_rehash_timer = -1;
+    return AE_NOMORE;
+}
+
 /* Our hash table implementation performs rehashing incrementally while
  * we write/read from the hash table. Still if the server is idle, the hash
  * table will use two tables for a long time. So we try to use 1 millisecond
  * of CPU time at every call of this function to perform some rehahsing.
+ * Big tables are left to rehashBigTablesProc() instead, that is started
+ * here if not already running.
  *
  * The function returns 1 if some rehashing was performed, otherwise 0
  * is returned. */
 int incrementallyRehash(int dbid) {
+    if (server.big_rehash_timer == -1 && bigRehashingDict(dbid) != NULL) {
+        server.big_rehash_timer = aeCreateTimeEvent(server.el,0,
+            rehashBigTablesProc,NULL,NULL);
+    }
+
     /* Keys dictionary */
-    if (dictIsRehashing(server.db[dbid].dict)) {
+    if (dictIsRehashing(server.db[dbid].dict) &&
+        !dictIsBigRehashing(server.db[dbid].dict))
+    {
         dictRehashMilliseconds(server.db[dbid].dict,1);
         return 1; /* already used our millisecond for this loop... */
     }
     /* Expires */
-    if (dictIsRehashing(server.db[dbid].expires)) {
+    if (dictIsRehashing(server.db[dbid].expires) &&
+        !dictIsBigRehashing(server.db[dbid].expires))
+    {
         dictRehashMilliseconds(server.db[dbid].expires,1);
         return 1; /* already used our millisecond for this loop... */
     }
@@ -789,15 +952,9 @@ int clientsCronHandleTimeout(client *c, mstime_t now_ms) {
         freeClient(c);
         return 1;
     } else if (c->flags & CLIENT_BLOCKED) {
-        /* Blocked OPS timeout is handled with milliseconds resolution.
-         * However note that the actual resolution is limited by
-         * server.hz. */
-
-        if (c->bpop.timeout != 0 && c->bpop.timeout < now_ms) {
-            /* Handle blocking operation specific timeout. */
-            replyToBlockedClientTimedOut(c);
-            unblockClient(c);
-        } else if (server.cluster_enabled) {
+        /* Blocked OPS timeout is handled with milliseconds resolution by
+         * handleBlockedClientsTimeout(), called in beforeSleep(). */
+        if (server.cluster_enabled) {
             /* Cluster: handle unblock & redirect of clients blocked
              * into keys no longer served by this server. */
             if (clusterRedirectBlockedClientIfNeeded(c))
@@ -833,6 +990,32 @@ int clientsCronResizeQueryBuffer(client *c) {
     return 0;
 }
 
+/* The client output buffer is allocated on demand by _addReplyToBuffer().
+ * When the client is idle we release it, otherwise we halve it if the
+ * recent replies used only a small fraction of it. Like for the query buffer
+ * the peak is reset at every call.
+ *
+ * The function always returns 0 as it never terminates the client. */
+int clientsCronResizeOutputBuffer(client *c) {
+    time_t idletime = server.unixtime - c->lastinteraction;
+
+    /* Only resize empty buffers, so that no pending data is moved. */
+    if (c->buf_usable_size && c->bufpos == 0) {
+        if (idletime > 2) {
+            zfree(c->buf);
+            c->buf = NULL;
+            c->buf_usable_size = 0;
+        } else if (c->buf_usable_size > PROTO_REPLY_MIN_BYTES &&
+                   c->buf_peak < c->buf_usable_size/4)
+        {
+            c->buf_usable_size /= 2;
+            c->buf = zrealloc(c->buf,c->buf_usable_size);
+        }
+    }
+    c->buf_peak = c->bufpos;
+    return 0;
+}
+
 #define CLIENTS_CRON_MIN_ITERATIONS 5
 void clientsCron(void) {
     /* Make sure to process at least numclients/server.hz of clients
@@ -865,6 +1048,7 @@ void clientsCron(void) {
          * terminated. */
         if (clientsCronHandleTimeout(c,now)) continue;
         if (clientsCronResizeQueryBuffer(c)) continue;
+        if (clientsCronResizeOutputBuffer(c)) continue;
     }
 }
 
@@ -873,8 +1057,11 @@ void clientsCron(void) {
  * rehashing. */
 void databasesCron(void) {
     /* Expire keys by random sampling. Not required for slaves
-     * as master will synthesize DELs for us. */
-    if (server.active_expire_enabled && server.masterhost == NULL) {
+     * as master will synthesize DELs for us, nor in raft mode where
+     * the raft leader does it, see raftCron(). */
+    if (server.active_expire_enabled && server.masterhost == NULL &&
+        !server.raft_id)
+    {
         activeExpireCycle(ACTIVE_EXPIRE_CYCLE_SLOW);
     } else if (server.masterhost != NULL) {
         expireSlaveKeys();
@@ -905,6 +1092,9 @@ void databasesCron(void) {
             resize_db++;
         }
 
+        /* Install the tables allocated in background. */
+        handleDictTableJobs();
+
         /* Rehash */
         if (server.activerehashing) {
             for (j = 0; j < dbs_per_call; j++) {
@@ -1034,6 +1224,10 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
     /* Handle background operations on Redis databases. */
     databasesCron();
 
+    /* Release the values of databases flushed in background that the
+     * lazyfree thread found still in use. */
+    lazyfreeReleaseSharedObjects();
+
     /* Start a scheduled AOF rewrite if this was requested by the user while
      * a BGSAVE was in progress. */
     if (server.rdb_child_pid == -1 && server.aof_child_pid == -1 &&
@@ -1153,6 +1347,11 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
         if (server.sentinel_mode) sentinelTimer();
     }
 
+    /* Tick the raft node if we are in raft mode. */
+    run_with_period(100) {
+        if (server.raft_id) raftCron();
+    }
+
     /* Cleanup expired MIGRATE cached sockets. */
     run_with_period(1000) {
         migrateCloseTimedoutSockets();
@@ -1186,6 +1385,10 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
 void beforeSleep(struct aeEventLoop *eventLoop) {
     UNUSED(eventLoop);
 
+    /* Just call a subset of vital functions in case we are re-entering
+     * the event loop from processEventsWhileBlocked(). */
+    handleClientsWithPendingReadsUsingThreads();
+
     /* Call the Redis Cluster before sleep function. Note that this function
      * may change the state of Redis Cluster (from ok to fail or vice versa),
      * so it's a good idea to call it before serving the unblocked clients
@@ -1194,7 +1397,8 @@ void beforeSleep(struct aeEventLoop *eventLoop) {
 
     /* Run a fast expire cycle (the called function will return
      * ASAP if a fast cycle is not needed). */
-    if (server.active_expire_enabled && server.masterhost == NULL)
+    if (server.active_expire_enabled && server.masterhost == NULL &&
+        !server.raft_id)
         activeExpireCycle(ACTIVE_EXPIRE_CYCLE_FAST);
 
     /* Send all the slaves an ACK request if at least one client blocked
@@ -1221,15 +1425,23 @@ void beforeSleep(struct aeEventLoop *eventLoop) {
      * blocking commands. */
     moduleHandleBlockedClients();
 
+    /* Unblock the clients whose blocking operation timed out. */
+    handleBlockedClientsTimeout();
+
     /* Try to process pending commands for clients that were just unblocked. */
     if (listLength(server.unblocked_clients))
         processUnblockedClients();
 
+    /* Propose the writes received in this iteration to the raft log, and
+     * apply the committed entries, replying to the clients waiting for
+     * them. This must happen before the AOF and the replies are written. */
+    if (server.raft_id) raftBeforeSleep();
+
     /* Write the AOF buffer on disk */
     flushAppendOnlyFile(0);
 
     /* Handle writes with pending output buffers. */
-    handleClientsWithPendingWrites();
+    handleClientsWithPendingWritesUsingThreads();
 
     /* Before we are going to sleep, let the threads access the dataset by
      * releasing the GIL. Redis main thread will not touch anything at this
@@ -1345,6 +1557,8 @@ void initServerConfig(void) {
     pthread_mutex_init(&server.next_client_id_mutex,NULL);
     pthread_mutex_init(&server.lruclock_mutex,NULL);
     pthread_mutex_init(&server.unixtime_mutex,NULL);
+    pthread_mutex_init(&server.stat_net_input_bytes_mutex,NULL);
+    pthread_mutex_init(&server.stat_net_output_bytes_mutex,NULL);
 
     getRandomHexChars(server.runid,CONFIG_RUN_ID_SIZE);
     server.runid[CONFIG_RUN_ID_SIZE] = '\0';
@@ -1366,6 +1580,8 @@ void initServerConfig(void) {
     server.verbosity = CONFIG_DEFAULT_VERBOSITY;
     server.maxidletime = CONFIG_DEFAULT_CLIENT_TIMEOUT;
     server.tcpkeepalive = CONFIG_DEFAULT_TCP_KEEPALIVE;
+    server.io_threads_num = CONFIG_DEFAULT_IO_THREADS_NUM;
+    server.io_threads_do_reads = CONFIG_DEFAULT_IO_THREADS_DO_READS;
     server.active_expire_enabled = 1;
     server.active_defrag_enabled = CONFIG_DEFAULT_ACTIVE_DEFRAG;
     server.active_defrag_ignore_bytes = CONFIG_DEFAULT_DEFRAG_IGNORE_BYTES;
@@ -1410,6 +1626,8 @@ void initServerConfig(void) {
     server.rdb_checksum = CONFIG_DEFAULT_RDB_CHECKSUM;
     server.stop_writes_on_bgsave_err = CONFIG_DEFAULT_STOP_WRITES_ON_BGSAVE_ERROR;
     server.activerehashing = CONFIG_DEFAULT_ACTIVE_REHASHING;
+    server.keyspace_fast_hash = CONFIG_DEFAULT_KEYSPACE_FAST_HASH;
+    server.keyspace_prefix_index = CONFIG_DEFAULT_KEYSPACE_PREFIX_INDEX;
     server.active_defrag_running = 0;
     server.notify_keyspace_events = 0;
     server.maxclients = CONFIG_DEFAULT_MAX_CLIENTS;
@@ -1427,6 +1645,7 @@ void initServerConfig(void) {
     server.zset_max_ziplist_entries = OBJ_ZSET_MAX_ZIPLIST_ENTRIES;
     server.zset_max_ziplist_value = OBJ_ZSET_MAX_ZIPLIST_VALUE;
     server.hll_sparse_max_bytes = CONFIG_DEFAULT_HLL_SPARSE_MAX_BYTES;
+    server.bitmap_roaring_min_bytes = CONFIG_DEFAULT_BITMAP_ROARING_MIN_BYTES;
     server.shutdown_asap = 0;
     server.cluster_enabled = 0;
     server.cluster_node_timeout = CLUSTER_DEFAULT_NODE_TIMEOUT;
@@ -1438,6 +1657,9 @@ void initServerConfig(void) {
     server.cluster_announce_ip = CONFIG_DEFAULT_CLUSTER_ANNOUNCE_IP;
     server.cluster_announce_port = CONFIG_DEFAULT_CLUSTER_ANNOUNCE_PORT;
     server.cluster_announce_bus_port = CONFIG_DEFAULT_CLUSTER_ANNOUNCE_BUS_PORT;
+    server.raft_id = 0;
+    server.raft_log_filename = zstrdup(CONFIG_DEFAULT_RAFT_LOG_FILENAME);
+    server.raft_apply_time = 0;
     server.migrate_cached_sockets = dictCreate(&migrateCacheDictType,NULL);
     server.next_client_id = 1; /* Client IDs, start from 1 .*/
     server.loading_process_events_interval_bytes = (1024*1024*2);
@@ -1773,6 +1995,20 @@ int listenToPort(int port, int *fds, int *count) {
     return C_OK;
 }
 
+/* Set TCP_NODELAY and the keep alive settings on the sockets listening
+ * for clients. Accepted sockets inherit them, so acceptCommonHandler()
+ * doesn't need to set them on every new client where accept4() is used.
+ * This is called again when tcp-keepalive is changed at runtime, so that
+ * new clients get the new setting. */
+void setClientListenersOptions(void) {
+    int j;
+
+    for (j = 0; j < server.ipfd_count; j++) {
+        anetEnableTcpNoDelay(NULL,server.ipfd[j]);
+        anetKeepAlive(NULL,server.ipfd[j],server.tcpkeepalive);
+    }
+}
+
 /* Resets the stats that we expose via INFO or other means that we want
  * to reset via CONFIG RESETSTAT. The function is also used in order to
  * initialize these fields in initServer() at server startup. */
@@ -1828,8 +2064,14 @@ void initServer(void) {
     server.slaves = listCreate();
     server.monitors = listCreate();
     server.clients_pending_write = listCreate();
+    server.shared_querybuf = sdsMakeRoomFor(sdsempty(),PROTO_IOBUF_LEN);
+    server.clients_pending_read = listCreate();
     server.slaveseldb = -1; /* Force to emit the first SELECT command. */
     server.unblocked_clients = listCreate();
+    server.clients_timeout_table = raxNew();
+    server.dict_table_jobs = listCreate();
+    server.big_rehash_timer = -1;
+    server.clients_timeout_timer = -1;
     server.ready_keys = listCreate();
     server.clients_waiting_acks = listCreate();
     server.get_ack_from_slaves = 0;
@@ -1851,6 +2093,7 @@ void initServer(void) {
     if (server.port != 0 &&
         listenToPort(server.port,server.ipfd,&server.ipfd_count) == C_ERR)
         exit(1);
+    setClientListenersOptions();
 
     /* Open the listening Unix domain socket. */
     if (server.unixsocket != NULL) {
@@ -1870,6 +2113,14 @@ void initServer(void) {
         exit(1);
     }
 
+    /* The main and expires dicts of a DB must always hash the same way,
+     * since the keys of one are looked up in the other, and the setting
+     * can't change once the first DB was created. */
+    if (server.keyspace_fast_hash) {
+        dbDictType.hashFunction = dictSdsFastHash;
+        keyptrDictType.hashFunction = dictSdsFastHash;
+    }
+
     /* Create the Redis databases, and initialize other internal state. */
     for (j = 0; j < server.dbnum; j++) {
         server.db[j].dict = dictCreate(&dbDictType,NULL);
@@ -1879,12 +2130,13 @@ void initServer(void) {
         server.db[j].watched_keys = dictCreate(&keylistDictType,NULL);
         server.db[j].id = j;
         server.db[j].avg_ttl = 0;
+        server.db[j].keys_index =
+            server.keyspace_prefix_index ? raxNew() : NULL;
     }
     evictionPoolAlloc(); /* Initialize the LRU keys pool. */
     server.pubsub_channels = dictCreate(&keylistDictType,NULL);
-    server.pubsub_patterns = listCreate();
-    listSetFreeMethod(server.pubsub_patterns,freePubsubPattern);
-    listSetMatchMethod(server.pubsub_patterns,listMatchPubsubPattern);
+    server.pubsub_patterns = raxNew();
+    server.pubsub_patterns_count = 0;
     server.cronloops = 0;
     server.rdb_child_pid = -1;
     server.aof_child_pid = -1;
@@ -1968,9 +2220,11 @@ void initServer(void) {
     if (server.cluster_enabled) clusterInit();
     replicationScriptCacheInit();
     scriptingInit(1);
+    if (server.raft_id) raftInit();
     slowlogInit();
     latencyMonitorInit();
     bioInit();
+    initThreadedIO();
     server.initial_memory_usage = zmalloc_used_memory();
 }
 
@@ -2011,6 +2265,7 @@ void populateCommandTable(void) {
         retval2 = dictAdd(server.orig_commands, sdsnew(c->name), c);
         serverAssert(retval1 == DICT_OK && retval2 == DICT_OK);
     }
+    invalidateCommandLookupTable();
 }
 
 void resetCommandTableStats(void) {
@@ -2067,17 +2322,188 @@ void redisOpArrayFree(redisOpArray *oa) {
 
 /* ====================== Commands lookup and execution ===================== */
 
+/* Every command executed is looked up by name. Instead of using the
+ * server.commands dict for that (SipHash of the name, then a chain walk),
+ * lookups use a perfect hash table built from the dict with the "hash and
+ * displace" method: a first hash of the name selects a bucket, and the
+ * displacement stored for the bucket, chosen at build time so that no two
+ * names end in the same slot, selects the slot. A lookup is so just a
+ * cheap hash, two array accesses and a single name comparison.
+ *
+ * server.commands remains the authoritative table: the code changing it
+ * (rename-command, modules, Sentinel) calls
+ * invalidateCommandLookupTable(), and the table is rebuilt at the next
+ * lookup. */
+typedef struct cmdLookupSlot {
+    const char *name;           /* Name (server.commands key) or NULL. */
+    size_t len;
+    struct redisCommand *cmd;
+} cmdLookupSlot;
+
+#define CMD_LOOKUP_MAX_DISP 100000 /* Displacements to try for a bucket. */
+
+static struct {
+    cmdLookupSlot *slots;
+    uint32_t *disp;             /* Displacement of every bucket. */
+    unsigned long mask;         /* Number of slots minus one. */
+    unsigned long buckets;
+    int valid;
+} cmdlookup;
+
+/* Case insensitive FNV-1a hash of the command name. */
+static uint64_t cmdLookupHash(const char *name, size_t len) {
+    uint64_t h = 14695981039346656037ULL;
+    while(len--) {
+        h ^= (unsigned char)tolower((unsigned char)*name++);
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+static unsigned long cmdLookupSlotIndex(uint64_t h, uint32_t disp) {
+    h += (uint64_t)disp * 0x9E3779B97F4A7C15ULL;
+    h ^= h >> 31;
+    h *= 0xBF58476D1CE4E5B9ULL;
+    h ^= h >> 29;
+    return (unsigned long)h & cmdlookup.mask;
+}
+
+static unsigned long cmdLookupBucket(uint64_t h) {
+    return (unsigned long)(h >> 32) % cmdlookup.buckets;
+}
+
+void invalidateCommandLookupTable(void) {
+    cmdlookup.valid = 0;
+}
+
+/* Sort buckets by number of commands, bigger first: they are the hardest
+ * to place, so we do it while the table is still mostly empty. */
+static unsigned long *cmdLookupSortCounts;
+static int cmdLookupBucketCompare(const void *a, const void *b) {
+    unsigned long ca = cmdLookupSortCounts[*(const unsigned long*)a],
+                  cb = cmdLookupSortCounts[*(const unsigned long*)b];
+    return (ca < cb) - (ca > cb);
+}
+
+static void buildCommandLookupTable(void) {
+    unsigned long n = dictSize(server.commands), size = 16, j, k;
+    int failed;
+    cmdLookupSlot *entries = zmalloc(sizeof(cmdLookupSlot)*(n ? n : 1));
+    uint64_t *hashes = zmalloc(sizeof(uint64_t)*(n ? n : 1));
+    unsigned long *members, *start, *counts, *order, *placed;
+    dictIterator *di;
+    dictEntry *de;
+
+    j = 0;
+    di = dictGetIterator(server.commands);
+    while((de = dictNext(di)) != NULL) {
+        sds name = dictGetKey(de);
+        entries[j].name = name;
+        entries[j].len = sdslen(name);
+        entries[j].cmd = dictGetVal(de);
+        hashes[j] = cmdLookupHash(name,sdslen(name));
+        j++;
+    }
+    dictReleaseIterator(di);
+
+    while(size < n*2) size *= 2;
+    zfree(cmdlookup.slots);
+    zfree(cmdlookup.disp);
+    placed = zmalloc(sizeof(unsigned long)*(n ? n : 1));
+
+retry:
+    cmdlookup.mask = size-1;
+    cmdlookup.buckets = n/2+1;
+    cmdlookup.slots = zcalloc(sizeof(cmdLookupSlot)*size);
+    cmdlookup.disp = zcalloc(sizeof(uint32_t)*cmdlookup.buckets);
+
+    /* Group the commands by bucket. */
+    counts = zcalloc(sizeof(unsigned long)*cmdlookup.buckets);
+    start = zcalloc(sizeof(unsigned long)*(cmdlookup.buckets+1));
+    members = zmalloc(sizeof(unsigned long)*(n ? n : 1));
+    order = zmalloc(sizeof(unsigned long)*cmdlookup.buckets);
+    for (j = 0; j < n; j++) counts[cmdLookupBucket(hashes[j])]++;
+    for (j = 0; j < cmdlookup.buckets; j++) {
+        start[j+1] = start[j]+counts[j];
+        order[j] = j;
+    }
+    for (j = 0; j < n; j++) {
+        unsigned long b = cmdLookupBucket(hashes[j]);
+        members[start[b]+(--counts[b])] = j;
+    }
+    for (j = 0; j < cmdlookup.buckets; j++) counts[j] = start[j+1]-start[j];
+    cmdLookupSortCounts = counts;
+    qsort(order,cmdlookup.buckets,sizeof(unsigned long),
+          cmdLookupBucketCompare);
+    cmdLookupSortCounts = NULL;
+
+    /* Find a displacement for every bucket so that all its commands land
+     * in empty slots. */
+    failed = 0;
+    for (j = 0; j < cmdlookup.buckets && counts[order[j]]; j++) {
+        unsigned long b = order[j];
+        uint32_t disp;
+
+        for (disp = 0; disp < CMD_LOOKUP_MAX_DISP; disp++) {
+            unsigned long nplaced = 0;
+
+            for (k = start[b]; k < start[b+1]; k++) {
+                unsigned long slot =
+                    cmdLookupSlotIndex(hashes[members[k]],disp);
+                if (cmdlookup.slots[slot].name) break;
+                cmdlookup.slots[slot] = entries[members[k]];
+                placed[nplaced++] = slot;
+            }
+            if (k == start[b+1]) break;
+            /* Collision: undo and try the next displacement. */
+            while(nplaced) cmdlookup.slots[placed[--nplaced]].name = NULL;
+        }
+        if (disp == CMD_LOOKUP_MAX_DISP) {
+            failed = 1;
+            break;
+        }
+        cmdlookup.disp[b] = disp;
+    }
+    zfree(counts);
+    zfree(start);
+    zfree(members);
+    zfree(order);
+
+    /* Very unlikely, but if some bucket could not be placed, try again
+     * with a sparser table. */
+    if (failed) {
+        zfree(cmdlookup.slots);
+        zfree(cmdlookup.disp);
+        size *= 2;
+        goto retry;
+    }
+    zfree(placed);
+    zfree(entries);
+    zfree(hashes);
+    cmdlookup.valid = 1;
+}
+
+/* Return the command with the specified name (case insensitive), or NULL
+ * if there is no such command. */
+struct redisCommand *lookupCommandByNameLen(const char *name, size_t len) {
+    cmdLookupSlot *slot;
+    uint64_t h;
+
+    if (!cmdlookup.valid) buildCommandLookupTable();
+    h = cmdLookupHash(name,len);
+    slot = &cmdlookup.slots[cmdLookupSlotIndex(h,
+                            cmdlookup.disp[cmdLookupBucket(h)])];
+    if (slot->name && slot->len == len && !strncasecmp(slot->name,name,len))
+        return slot->cmd;
+    return NULL;
+}
+
 struct redisCommand *lookupCommand(sds name) {
-    return dictFetchValue(server.commands, name);
+    return lookupCommandByNameLen(name,sdslen(name));
 }
 
 struct redisCommand *lookupCommandByCString(char *s) {
-    struct redisCommand *cmd;
-    sds name = sdsnew(s);
-
-    cmd = dictFetchValue(server.commands, name);
-    sdsfree(name);
-    return cmd;
+    return lookupCommandByNameLen(s,strlen(s));
 }
 
 /* Lookup the command in the current table, if not found also check in
@@ -2088,7 +2514,7 @@ struct redisCommand *lookupCommandByCString(char *s) {
  * rewriteClientCommandVector() in order to set client->cmd pointer
  * correctly even if the command was renamed. */
 struct redisCommand *lookupCommandOrOriginal(sds name) {
-    struct redisCommand *cmd = dictFetchValue(server.commands, name);
+    struct redisCommand *cmd = lookupCommand(name);
 
     if (!cmd) cmd = dictFetchValue(server.orig_commands,name);
     return cmd;
@@ -2499,6 +2925,10 @@ int processCommand(client *c) {
         return C_OK;
     }
 
+    /* In raft mode writes are proposed to the raft log, and executed once
+     * committed, see raftProcessCommand(). */
+    if (server.raft_id && raftProcessCommand(c)) return C_OK;
+
     /* Exec the command */
     if (c->flags & CLIENT_MULTI &&
         c->cmd->proc != execCommand && c->cmd->proc != discardCommand &&
@@ -3121,7 +3551,8 @@ sds genRedisInfoString(char *section) {
             "active_defrag_hits:%lld\r\n"
             "active_defrag_misses:%lld\r\n"
             "active_defrag_key_hits:%lld\r\n"
-            "active_defrag_key_misses:%lld\r\n",
+            "active_defrag_key_misses:%lld\r\n"
+            "io_threads_active:%d\r\n",
             server.stat_numconnections,
             server.stat_numcommands,
             getInstantaneousMetric(STATS_METRIC_COMMAND),
@@ -3140,14 +3571,15 @@ sds genRedisInfoString(char *section) {
             server.stat_keyspace_hits,
             server.stat_keyspace_misses,
             dictSize(server.pubsub_channels),
-            listLength(server.pubsub_patterns),
+            server.pubsub_patterns_count,
             server.stat_fork_time,
             dictSize(server.migrate_cached_sockets),
             getSlaveKeyWithExpireCount(),
             server.stat_active_defrag_hits,
             server.stat_active_defrag_misses,
             server.stat_active_defrag_key_hits,
-            server.stat_active_defrag_key_misses);
+            server.stat_active_defrag_key_misses,
+            server.io_threads_active);
     }
 
     /* Replication */
@@ -3322,6 +3754,16 @@ sds genRedisInfoString(char *section) {
         server.cluster_enabled);
     }
 
+    /* Raft */
+    if (allsections || defsections || !strcasecmp(section,"raft")) {
+        if (sections++) info = sdscat(info,"\r\n");
+        info = sdscatprintf(info,
+        "# Raft\r\n"
+        "raft_enabled:%d\r\n",
+        server.raft_id != 0);
+        if (server.raft_id) info = raftCatInfoString(info);
+    }
+
     /* Key space */
     if (allsections || defsections || !strcasecmp(section,"keyspace")) {
         if (sections++) info = sdscat(info,"\r\n");
@@ -3725,6 +4167,12 @@ int main(int argc, char **argv) {
             return endianconvTest(argc, argv);
         } else if (!strcasecmp(argv[2], "crc64")) {
             return crc64Test(argc, argv);
+        } else if (!strcasecmp(argv[2], "bitops")) {
+            return bitopsTest(argc, argv);
+        } else if (!strcasecmp(argv[2], "roaring")) {
+            return roaringTest(argc, argv);
+        } else if (!strcasecmp(argv[2], "raft")) {
+            return raftTest(argc, argv);
         }
 
         return -1; /* test not found */
@@ -3867,7 +4315,8 @@ int main(int argc, char **argv) {
         linuxMemoryWarnings();
     #endif
         moduleLoadFromQueue();
-        loadDataFromDisk();
+        /* In raft mode the dataset is rebuilt applying the raft log. */
+        if (!server.raft_id) loadDataFromDisk();
         if (server.cluster_enabled) {
             if (verifyClusterConfigWithData() == C_ERR) {
                 serverLog(LL_WARNING,
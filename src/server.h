@@ -60,6 +60,7 @@ typedef long long mstime_t; /* millisecond time type. */
 #include "anet.h"    /* Networking the easy way */
 #include "ziplist.h" /* Compact list data structure */
 #include "intset.h"  /* Compact integer set structure */
+#include "roaring.h" /* Compressed bitmaps for sparse strings */
 #include "version.h" /* Version macro */
 #include "util.h"    /* Misc functions useful in many places */
 #include "latency.h" /* Latency monitor API */
@@ -113,6 +114,7 @@ typedef long long mstime_t; /* millisecond time type. */
 #define CONFIG_DEFAULT_PID_FILE "/var/run/redis.pid"
 #define CONFIG_DEFAULT_SYSLOG_IDENT "redis"
 #define CONFIG_DEFAULT_CLUSTER_CONFIG_FILE "nodes.conf"
+#define CONFIG_DEFAULT_RAFT_LOG_FILENAME "raft.log"
 #define CONFIG_DEFAULT_CLUSTER_ANNOUNCE_IP NULL         /* Auto detect. */
 #define CONFIG_DEFAULT_CLUSTER_ANNOUNCE_PORT 0          /* Use server.port */
 #define CONFIG_DEFAULT_CLUSTER_ANNOUNCE_BUS_PORT 0      /* Use +10000 offset. */
@@ -143,6 +145,8 @@ typedef long long mstime_t; /* millisecond time type. */
 #define CONFIG_DEFAULT_AOF_LOAD_TRUNCATED 1
 #define CONFIG_DEFAULT_AOF_USE_RDB_PREAMBLE 0
 #define CONFIG_DEFAULT_ACTIVE_REHASHING 1
+#define CONFIG_DEFAULT_KEYSPACE_FAST_HASH 0
+#define CONFIG_DEFAULT_KEYSPACE_PREFIX_INDEX 0
 #define CONFIG_DEFAULT_AOF_REWRITE_INCREMENTAL_FSYNC 1
 #define CONFIG_DEFAULT_MIN_SLAVES_TO_WRITE 0
 #define CONFIG_DEFAULT_MIN_SLAVES_MAX_LAG 10
@@ -163,6 +167,9 @@ typedef long long mstime_t; /* millisecond time type. */
 #define CONFIG_DEFAULT_DEFRAG_CYCLE_MIN 25 /* 25% CPU min (at lower threshold) */
 #define CONFIG_DEFAULT_DEFRAG_CYCLE_MAX 75 /* 75% CPU max (at upper threshold) */
 #define CONFIG_DEFAULT_PROTO_MAX_BULK_LEN (512ll*1024*1024) /* Bulk request max size */
+#define CONFIG_DEFAULT_IO_THREADS_NUM 1 /* Single threaded by default */
+#define CONFIG_DEFAULT_IO_THREADS_DO_READS 0 /* Read + parse from threads? */
+#define CONFIG_MAX_IO_THREADS 128
 
 #define ACTIVE_EXPIRE_CYCLE_LOOKUPS_PER_LOOP 20 /* Loopkups per loop. */
 #define ACTIVE_EXPIRE_CYCLE_FAST_DURATION 1000 /* Microseconds */
@@ -181,8 +188,13 @@ typedef long long mstime_t; /* millisecond time type. */
 #define PROTO_MAX_QUERYBUF_LEN  (1024*1024*1024) /* 1GB max query buffer. */
 #define PROTO_IOBUF_LEN         (1024*16)  /* Generic I/O buffer size */
 #define PROTO_REPLY_CHUNK_BYTES (16*1024) /* 16k output buffer */
+#define PROTO_REPLY_MIN_BYTES   1024 /* Initial size of the output buffer. */
+#define PROTO_REPLY_NOCOPY_BYTES (16*1024) /* Bigger values are referenced. */
+#define PROTO_REPLY_SHARED_MIN_BYTES 1024 /* See addReplyProtoShared(). */
 #define PROTO_INLINE_MAX_SIZE   (1024*64) /* Max size of inline reads */
 #define PROTO_MBULK_BIG_ARG     (1024*32)
+#define PROTO_PREFETCH_CMDS     16  /* Pipelined commands to prefetch keys of. */
+#define PROTO_PREFETCH_KEYLEN   64  /* Longer keys are not prefetched. */
 #define LONG_STR_SIZE      21          /* Bytes needed for long -> str + '\0' */
 #define AOF_AUTOSYNC_BYTES (1024*1024*32) /* fdatasync every 32MB */
 
@@ -194,6 +206,9 @@ typedef long long mstime_t; /* millisecond time type. */
 
 /* Hash table parameters */
 #define HASHTABLE_MIN_FILL        10      /* Minimal hash table fill 10% */
+#define HASHTABLE_BIG_SIZE        (1<<20) /* Buckets of a big keyspace table. */
+#define HASHTABLE_BIG_REHASH_PERC 25      /* CPU max % for rehashing big tables */
+#define HASHTABLE_BIG_REHASH_SLICE_US 1000 /* Duration of a single step. */
 
 /* Command flags. Please check the command table defined in the redis.c file
  * for more information about the meaning of every flag. */
@@ -251,6 +266,14 @@ typedef long long mstime_t; /* millisecond time type. */
 #define CLIENT_LUA_DEBUG (1<<25)  /* Run EVAL in debug mode. */
 #define CLIENT_LUA_DEBUG_SYNC (1<<26)  /* EVAL debugging without fork() */
 #define CLIENT_MODULE (1<<27) /* Non connected client used by some module. */
+#define CLIENT_PENDING_READ (1<<28) /* The client has pending reads and was put
+                                       in the list of clients we can read
+                                       from. */
+#define CLIENT_PENDING_COMMAND (1<<29) /* Used in threaded I/O to signal after
+                                          we return single threaded that the
+                                          client has already pending commands
+                                          to be executed. */
+#define CLIENT_IN_TO_TABLE (1<<30) /* This client is in the timeout table. */
 
 /* Client block type (btype field in client structure)
  * if CLIENT_BLOCKED flag is set. */
@@ -258,6 +281,7 @@ typedef long long mstime_t; /* millisecond time type. */
 #define BLOCKED_LIST 1    /* BLPOP & co. */
 #define BLOCKED_WAIT 2    /* WAIT for synchronous replication. */
 #define BLOCKED_MODULE 3  /* Blocked by a loadable module. */
+#define BLOCKED_RAFT 4    /* Waiting for a raft entry, see raftmode.c. */
 
 /* Client request types */
 #define PROTO_REQ_INLINE 1
@@ -358,6 +382,9 @@ typedef long long mstime_t; /* millisecond time type. */
 /* HyperLogLog defines */
 #define CONFIG_DEFAULT_HLL_SPARSE_MAX_BYTES 3000
 
+/* Bitmap defines */
+#define CONFIG_DEFAULT_BITMAP_ROARING_MIN_BYTES 4096
+
 /* Sets operations codes */
 #define SET_OP_UNION 0
 #define SET_OP_DIFF 1
@@ -578,6 +605,7 @@ typedef struct RedisModuleDigest {
 #define OBJ_ENCODING_SKIPLIST 7  /* Encoded as skiplist */
 #define OBJ_ENCODING_EMBSTR 8  /* Embedded sds string encoding */
 #define OBJ_ENCODING_QUICKLIST 9 /* Encoded as linked list of ziplists */
+#define OBJ_ENCODING_ROARING 10 /* Sparse bitmap as roaring bitmap */
 
 #define LRU_BITS 24
 #define LRU_CLOCK_MAX ((1<<LRU_BITS)-1) /* Max value of obj->lru */
@@ -618,6 +646,8 @@ typedef struct redisDb {
     dict *watched_keys;         /* WATCHED keys for MULTI/EXEC CAS */
     int id;                     /* Database ID */
     long long avg_ttl;          /* Average TTL, just for stats */
+    rax *keys_index;            /* Ordered key names for prefix lookups,
+                                   NULL unless keyspace-prefix-index is on. */
 } redisDb;
 
 /* Client MULTI/EXEC state */
@@ -655,8 +685,25 @@ typedef struct blockingState {
     void *module_blocked_handle; /* RedisModuleBlockedClient structure.
                                     which is opaque for the Redis core, only
                                     handled in module.c. */
+
+    /* BLOCKED_RAFT */
+    uint64_t raft_reqid;    /* Request whose raft entry, or read index, we
+                               are waiting for. */
+    uint64_t raft_read_index; /* Index to apply before the linearizable read
+                                 can be served, 0 until known. */
 } blockingState;
 
+/* Positions of the SCAN iterations of a client using the keys index: the
+ * last key returned by each of its SCAN_INDEX_CURSORS most recent calls.
+ * See scanKeysIndex() in db.c. */
+#define SCAN_INDEX_CURSORS 16
+
+typedef struct scanIndexCursors {
+    unsigned long next_id;
+    unsigned long id[SCAN_INDEX_CURSORS];
+    sds key[SCAN_INDEX_CURSORS];
+} scanIndexCursors;
+
 /* The following structure represents a node in the server.ready_keys list,
  * where we accumulate all the keys that had clients blocked with a blocking
  * operation such as B[LR]POP, but received new data in the context of the
@@ -721,14 +768,20 @@ typedef struct client {
     int btype;              /* Type of blocking op if CLIENT_BLOCKED. */
     blockingState bpop;     /* blocking state */
     long long woff;         /* Last write global replication offset. */
+    int raft_consistency;   /* CONSISTENCY level in raft mode, 0 if unset. */
     list *watched_keys;     /* Keys WATCHED for MULTI/EXEC CAS */
     dict *pubsub_channels;  /* channels a client is interested in (SUBSCRIBE) */
     list *pubsub_patterns;  /* patterns a client is interested in (SUBSCRIBE) */
     sds peerid;             /* Cached peer ID. */
+    struct scanIndexCursors *scan_cursors; /* Positions of the SCANs using
+                                              the keys index, or NULL. */
 
     /* Response buffer */
     int bufpos;
-    char buf[PROTO_REPLY_CHUNK_BYTES];
+    size_t buf_usable_size; /* Allocated size of buf, 0 if not allocated. */
+    size_t buf_peak;        /* Recent peak of bufpos, reset by clientsCron. */
+    char *buf;              /* Allocated on demand, up to
+                               PROTO_REPLY_CHUNK_BYTES. */
 } client;
 
 struct saveparam {
@@ -887,6 +940,10 @@ struct redisServer {
     unsigned int lruclock;      /* Clock for LRU eviction */
     int shutdown_asap;          /* SHUTDOWN needed ASAP */
     int activerehashing;        /* Incremental rehash in serverCron() */
+    int keyspace_fast_hash;     /* Hash keys with the fast non-SipHash hash. */
+    int keyspace_prefix_index;  /* Index key names in a rax for KEYS/SCAN. */
+    list *dict_table_jobs;      /* Keyspace tables allocated by a bio thread. */
+    long long big_rehash_timer; /* rehashBigTablesProc() time event or -1. */
     int active_defrag_running;  /* Active defragmentation running (holds current scan aggressiveness) */
     char *requirepass;          /* Pass for AUTH command, or NULL */
     char *pidfile;              /* PID file path */
@@ -917,6 +974,9 @@ struct redisServer {
     list *clients;              /* List of active clients */
     list *clients_to_close;     /* Clients to close asynchronously */
     list *clients_pending_write; /* There is to write or install handler. */
+    list *clients_pending_read;  /* Client has pending read socket buffers. */
+    sds shared_querybuf;        /* Query buffer lent to clients while reading,
+                                   see readQueryFromClient(). */
     list *slaves, *monitors;    /* List of slaves and MONITORs */
     client *current_client; /* Current client, only used on crash report */
     int clients_paused;         /* True if clients are currently paused */
@@ -963,6 +1023,8 @@ struct redisServer {
     size_t resident_set_size;       /* RSS sampled in serverCron(). */
     long long stat_net_input_bytes; /* Bytes read from network. */
     long long stat_net_output_bytes; /* Bytes written to network. */
+    pthread_mutex_t stat_net_input_bytes_mutex; /* Updated by I/O threads. */
+    pthread_mutex_t stat_net_output_bytes_mutex;
     size_t stat_rdb_cow_bytes;      /* Copy on write bytes during RDB saving. */
     size_t stat_aof_cow_bytes;      /* Copy on write bytes during AOF rewrite. */
     /* The following two are used to track instantaneous metrics, like
@@ -1132,6 +1194,10 @@ struct redisServer {
     /* Blocked clients */
     unsigned int bpop_blocked_clients; /* Number of clients blocked by lists */
     list *unblocked_clients; /* list of clients to unblock before next loop */
+    rax *clients_timeout_table; /* Blocked clients sorted by timeout. */
+    long long clients_timeout_timer; /* Time event ID waking up the loop at
+                                        the nearest timeout, or -1. */
+    mstime_t clients_timeout_timer_when; /* When the above timer fires. */
     list *ready_keys;        /* List of readyList structures for BLPOP & co */
     /* Sort parameters - qsort_r() is only available under BSD so we
      * have to take this state global, in order to pass it to sortCompare() */
@@ -1146,6 +1212,7 @@ struct redisServer {
     size_t zset_max_ziplist_entries;
     size_t zset_max_ziplist_value;
     size_t hll_sparse_max_bytes;
+    size_t bitmap_roaring_min_bytes;
     /* List parameters */
     int list_max_ziplist_size;
     int list_compress_depth;
@@ -1154,7 +1221,8 @@ struct redisServer {
     long long mstime;   /* Like 'unixtime' but with milliseconds resolution. */
     /* Pubsub */
     dict *pubsub_channels;  /* Map channels to list of subscribed clients */
-    list *pubsub_patterns;  /* A list of pubsub_patterns */
+    rax *pubsub_patterns;   /* Lists of pubsubPattern by literal prefix. */
+    unsigned long pubsub_patterns_count; /* Number of pubsubPattern. */
     int notify_keyspace_events; /* Events to propagate via Pub/Sub. This is an
                                    xor of NOTIFY_... flags. */
     /* Cluster */
@@ -1171,6 +1239,11 @@ struct redisServer {
     char *cluster_announce_ip;  /* IP address to announce on cluster bus. */
     int cluster_announce_port;     /* base port to announce on cluster bus. */
     int cluster_announce_bus_port; /* bus port to announce on cluster bus. */
+    /* Raft mode, see raftmode.c */
+    int raft_id;                /* Our raft id, 0 if raft mode is disabled. */
+    char *raft_log_filename;    /* Name of the raft log file. */
+    mstime_t raft_apply_time;   /* Time of the raft entry being applied,
+                                   0 when not applying one. */
     /* Scripting */
     lua_State *lua; /* The Lua interpreter. We use just one for all clients */
     client *lua_client;   /* The "fake client" to query Redis from Lua */
@@ -1189,6 +1262,10 @@ struct redisServer {
                              execution. */
     int lua_kill;         /* Kill the script if true. */
     int lua_always_replicate_commands; /* Default replication type. */
+    /* Threaded I/O */
+    int io_threads_num;         /* Number of I/O threads to use. */
+    int io_threads_do_reads;    /* Read and parse from I/O threads? */
+    int io_threads_active;      /* Are the I/O threads currently spinning? */
     /* Lazy free */
     int lazyfree_lazy_eviction;
     int lazyfree_lazy_expire;
@@ -1215,6 +1292,7 @@ struct redisServer {
 typedef struct pubsubPattern {
     client *client;
     robj *pattern;
+    stringmatchPattern *compiled; /* The pattern compiled for PUBLISH. */
 } pubsubPattern;
 
 typedef void redisCommandProc(client *c);
@@ -1336,10 +1414,17 @@ void moduleNotifyKeyspaceEvent(int type, const char *event, robj *key, int dbid)
 /* Utils */
 long long ustime(void);
 long long mstime(void);
+long long commandTime(void);
 void getRandomHexChars(char *p, unsigned int len);
 uint64_t crc64(uint64_t crc, const unsigned char *s, uint64_t l);
 void exitFromChild(int retcode);
 size_t redisPopcount(void *s, long count);
+long redisBitpos(void *s, unsigned long count, int bit);
+void bitmapTypeConvert(robj *o, int enc);
+#ifdef REDIS_TEST
+int bitopsTest(int argc, char **argv);
+int raftTest(int argc, char **argv);
+#endif
 void redisSetProcTitle(char *title);
 
 /* networking.c -- Networking and Client related operations */
@@ -1351,7 +1436,7 @@ void resetClient(client *c);
 void sendReplyToClient(aeEventLoop *el, int fd, void *privdata, int mask);
 void *addDeferredMultiBulkLength(client *c);
 void setDeferredMultiBulkLength(client *c, void *node, long length);
-void processInputBuffer(client *c);
+int processInputBuffer(client *c);
 void acceptHandler(aeEventLoop *el, int fd, void *privdata, int mask);
 void acceptTcpHandler(aeEventLoop *el, int fd, void *privdata, int mask);
 void acceptUnixHandler(aeEventLoop *el, int fd, void *privdata, int mask);
@@ -1363,6 +1448,7 @@ void addReplyBulkCBuffer(client *c, const void *p, size_t len);
 void addReplyBulkLongLong(client *c, long long ll);
 void addReply(client *c, robj *obj);
 void addReplySds(client *c, sds s);
+void addReplyProtoShared(client *c, robj *proto);
 void addReplyBulkSds(client *c, sds s);
 void addReplyError(client *c, const char *err);
 void addReplyStatus(client *c, const char *status);
@@ -1391,11 +1477,16 @@ char *getClientTypeName(int class);
 void flushSlavesOutputBuffers(void);
 void disconnectSlaves(void);
 int listenToPort(int port, int *fds, int *count);
+void setClientListenersOptions(void);
 void pauseClients(mstime_t duration);
 int clientsArePaused(void);
 int processEventsWhileBlocked(void);
 int handleClientsWithPendingWrites(void);
+int handleClientsWithPendingWritesUsingThreads(void);
+int handleClientsWithPendingReadsUsingThreads(void);
+void initThreadedIO(void);
 int clientHasPendingReplies(client *c);
+void clientInstallWriteHandler(client *c);
 void unlinkClient(client *c);
 int writeToClient(int fd, client *c, int handler_installed);
 
@@ -1465,6 +1556,7 @@ robj *createQuicklistObject(void);
 robj *createZiplistObject(void);
 robj *createSetObject(void);
 robj *createIntsetObject(void);
+robj *createRoaringObject(roaring *r);
 robj *createHashObject(void);
 robj *createZsetObject(void);
 robj *createZsetZiplistObject(void);
@@ -1531,6 +1623,7 @@ int rdbSaveRio(rio *rdb, int *error, int flags, rdbSaveInfo *rsi);
 /* AOF persistence */
 void flushAppendOnlyFile(int force);
 void feedAppendOnlyFile(struct redisCommand *cmd, int dictid, robj **argv, int argc);
+sds catAppendOnlyGenericCommand(sds dst, int argc, robj **argv);
 void aofRemoveTempFile(pid_t childpid);
 int rewriteAppendOnlyFileBackground(void);
 int loadAppendOnlyFile(char *filename);
@@ -1616,6 +1709,8 @@ int processCommand(client *c);
 void setupSignalHandlers(void);
 struct redisCommand *lookupCommand(sds name);
 struct redisCommand *lookupCommandByCString(char *s);
+struct redisCommand *lookupCommandByNameLen(const char *name, size_t len);
+void invalidateCommandLookupTable(void);
 struct redisCommand *lookupCommandOrOriginal(sds name);
 void call(client *c, int flags);
 void propagate(struct redisCommand *cmd, int dbid, robj **argv, int argc, int flags);
@@ -1754,10 +1849,16 @@ int parseScanCursorOrReply(client *c, robj *o, unsigned long *cursor);
 void slotToKeyAdd(robj *key);
 void slotToKeyDel(robj *key);
 void slotToKeyFlush(void);
+void keysIndexAdd(redisDb *db, robj *key);
+void keysIndexDel(redisDb *db, robj *key);
+void keysIndexFlush(redisDb *db);
+void freeScanIndexCursors(client *c);
 int dbAsyncDelete(redisDb *db, robj *key);
 void emptyDbAsync(redisDb *db);
 void slotToKeyFlushAsync(void);
+void keysIndexFlushAsync(redisDb *db);
 size_t lazyfreeGetPendingObjectsCount(void);
+void lazyfreeReleaseSharedObjects(void);
 
 /* API to get key arguments from commands */
 int *getKeysFromCommand(struct redisCommand *cmd, robj **argv, int argc, int *numkeys);
@@ -1784,6 +1885,33 @@ void sentinelTimer(void);
 char *sentinelHandleConfiguration(char **argv, int argc);
 void sentinelIsRunning(void);
 
+/* Raft mode */
+struct raft;
+struct raftMessage;
+
+/* A node of the raft group, see "raft-peer" and "sentinel raft-peer". Raft
+ * messages are sent to it as commands over the 'cc' connection. */
+typedef struct raftPeer {
+    uint8_t id;                 /* Raft id of the peer. */
+    sds ip;                     /* Address of the peer. */
+    int port;
+    struct redisAsyncContext *cc; /* Hiredis context, NULL if disconnected. */
+    int pending_commands;       /* Number of commands waiting for a reply. */
+    mstime_t last_reconn_time;  /* Last reconnection attempt. */
+} raftPeer;
+
+raftPeer *createRaftPeer(uint8_t id, char *ip, int port);
+void raftSendMessage(raftPeer *peer, struct raftMessage *msg, int prefixc, char **prefixv);
+struct raftMessage *raftMessageFromArgv(client *c, int first, struct raft *r);
+char *raftAddPeer(int id, char *ip, int port);
+void raftInit(void);
+void raftCron(void);
+void raftBeforeSleep(void);
+int raftProcessCommand(client *c);
+void raftUnblockClient(client *c);
+void raftBlockedClientTimedOut(client *c);
+sds raftCatInfoString(sds info);
+
 /* redis-check-rdb & aof */
 int redis_check_rdb(char *rdbfilename, FILE *fp);
 int redis_check_rdb_main(int argc, char **argv, FILE *fp);
@@ -1803,6 +1931,9 @@ void unblockClient(client *c);
 void replyToBlockedClientTimedOut(client *c);
 int getTimeoutFromObjectOrReply(client *c, robj *object, mstime_t *timeout, int unit);
 void disconnectAllBlockedClients(void);
+void addClientToTimeoutTable(client *c);
+void removeClientFromTimeoutTable(client *c);
+void handleBlockedClientsTimeout(void);
 
 /* expire.c -- Handling of expired keys */
 void activeExpireCycle(int type);
@@ -1820,6 +1951,8 @@ unsigned long LFUDecrAndReturn(robj *o);
 
 /* Keys hashing / comparison functions for dict.c hash tables. */
 uint64_t dictSdsHash(const void *key);
+uint64_t dictSdsFastHash(const void *key);
+int dictExpandInBackground(dict *d, unsigned long size);
 int dictSdsKeyCompare(void *privdata, const void *key1, const void *key2);
 void dictSdsDestructor(void *privdata, void *val);
 
@@ -1987,6 +2120,8 @@ void bitcountCommand(client *c);
 void bitposCommand(client *c);
 void replconfCommand(client *c);
 void waitCommand(client *c);
+void raftCommand(client *c);
+void consistencyCommand(client *c);
 void geoencodeCommand(client *c);
 void geodecodeCommand(client *c);
 void georadiusbymemberCommand(client *c);
@@ -476,6 +476,9 @@ void sortCommand(client *c) {
                      * integer-encoded (the only encoding supported) so
                      * far. We can just cast it */
                     vector[j].u.score = (long)byval->ptr;
+                } else if (byval->encoding == OBJ_ENCODING_ROARING) {
+                    /* Sparse bitmaps are never valid numbers. */
+                    int_convertion_error = 1;
                 } else {
                     serverAssertWithInfo(c,sortval,1 != 1);
                 }
@@ -1,16 +1,16 @@
 #include "storage.h"
+#include "zmalloc.h"
+#include <stdlib.h>
 #include <assert.h>
 
 memoryStorage* newMemoryStorage()
 {
     memoryStorage* ms = zmalloc(sizeof(memoryStorage));
-    ms->pState->term = 0;
-    ms->pState->commited = 0;
-    ms->pState->voteFor = 0;
+    ms->pState = zcalloc(sizeof(hardState));
     ms->ssmd = createSnapshotMetaData();
+    ms->ssdata = sdsempty();
     raftEntry* entry = createRaftEntry();
-    ms->entries = listCreate();
-    listSetFreeMethod(ms->entries, freeRaftEntry);
+    ms->entries = createRaftEntryList();
     listAddNodeTail(ms->entries, entry);
     return ms;
 }
@@ -22,7 +22,7 @@ hardState getHardState(memoryStorage* ms)
 
 void setHardState(memoryStorage* ms, hardState* ps)
 {
-    ms->pState = ps;
+    *(ms->pState) = *ps;
 }
 
 confState* getConfState(memoryStorage* ms)
@@ -57,7 +57,7 @@ EntriesResult getStorageEntries(memoryStorage* ms, uint64_t lo, uint64_t hi, uin
         result.err = ErrUnavailable;
         return result;
     }
-    result.entries = listCreate();
+    result.entries = createRaftEntryList();
     uint64_t lower = lo - offset;
     uint64_t upper = hi - offset;
     listNode* node = listIndex(ms->entries, lower);
@@ -100,7 +100,19 @@ snapshotMetaData* getStorageSnapshotMD(memoryStorage* ms)
     return dupSnapshotMetaData(ms->ssmd);
 }
 
-StorageError ApplySnapshot(memoryStorage* ms, snapshotMetaData* ssmd)
+/* Return a copy of the last snapshot, metadata and data. */
+snapshot* getStorageSnapshot(memoryStorage* ms)
+{
+    snapshot* ss = createSnapShot();
+    freeSnapshotMetaData(ss->metaData);
+    ss->metaData = dupSnapshotMetaData(ms->ssmd);
+    ss->data = sdscpylen(ss->data, ms->ssdata, sdslen(ms->ssdata));
+    return ss;
+}
+
+/* Replace the content of the storage with the snapshot received from the
+ * leader. 'ssmd' and 'data' are copied. */
+StorageError ApplySnapshot(memoryStorage* ms, snapshotMetaData* ssmd, sds data)
 {
     uint64_t local_ms_index = ms->ssmd->lastLogIndex;
     uint64_t snap_index = ssmd->lastLogIndex;
@@ -110,6 +122,7 @@ StorageError ApplySnapshot(memoryStorage* ms, snapshotMetaData* ssmd)
     }
     freeSnapshotMetaData(ms->ssmd);
     ms->ssmd = dupSnapshotMetaData(ssmd);
+    ms->ssdata = sdscpylen(ms->ssdata, data, sdslen(data));
     listEmpty(ms->entries);
     raftEntry* entry = createRaftEntry();
     entry->index = ssmd->lastLogIndex;
@@ -118,6 +131,29 @@ StorageError ApplySnapshot(memoryStorage* ms, snapshotMetaData* ssmd)
     return StorageOk;
 }
 
+/* Record 'data' as the state of the application once the entries up to
+ * 'index' are applied, with 'cs' the configuration at that point: this is
+ * what the leader sends to the followers that need compacted entries.
+ * 'cs' is copied, 'data' is owned by the storage from now on. The log can
+ * then be compacted up to 'index' with Compact(). */
+StorageError CreateSnapshot(memoryStorage* ms, uint64_t index, confState* cs, sds data)
+{
+    if(index <= ms->ssmd->lastLogIndex)
+    {
+        sdsfree(data);
+        return ErrSnapOutOfDate;
+    }
+    TermResult res = getStorageTermOf(ms, index);
+    assert(res.err == StorageOk);
+    ms->ssmd->lastLogIndex = index;
+    ms->ssmd->lastLogTerm = res.term;
+    freeConfState(ms->ssmd->cs);
+    ms->ssmd->cs = dupConfState(cs);
+    sdsfree(ms->ssdata);
+    ms->ssdata = data;
+    return StorageOk;
+}
+
 StorageError Compact(memoryStorage* ms, uint64_t compact_index)
 {
     uint64_t offset = storageFirstIndex(ms) - 1;
@@ -129,7 +165,7 @@ StorageError Compact(memoryStorage* ms, uint64_t compact_index)
     assert(compact_index <= last_index);
     uint64_t i = compact_index - offset;
 
-    listNode* node = listIndex(ms->entries, i-offset);
+    listNode* node = listIndex(ms->entries, i);
     raftEntry* ent = node->value;
 
     raftEntry* entry = createRaftEntry();
@@ -146,43 +182,44 @@ StorageError Compact(memoryStorage* ms, uint64_t compact_index)
     return StorageOk;
 }
 
+/* Append 'ents' (that must be contiguous) to the storage, taking a new
+ * reference to each of them. Entries the storage already has from the first
+ * index of 'ents' on are replaced: a new leader may overwrite the tail of
+ * the log that was never committed. */
 StorageError AppendEntriesToStorage(memoryStorage* ms, list* ents)
 {
     if(listLength(ents) == 0)
     {
         return StorageOk;
     }
-    list* copy_entries = listDup(ents);
     uint64_t first = storageFirstIndex(ms);
-    listNode* node = listFirst(ms->entries);
+    listNode* node = listFirst(ents);
     raftEntry* import_first_ent = node->value;
-    uint64_t last = import_first_ent->index + listLength(copy_entries) - 1;
+    uint64_t last = import_first_ent->index + listLength(ents) - 1;
     if(last < first)
     {
         return StorageOk;
     }
-    if(first > import_first_ent->index)
+    /* Skip the entries that are already compacted. */
+    while(((raftEntry*)node->value)->index < first)
     {
-        uint64_t count = first - import_first_ent->index;
-        while(count > 0)
-        {
-            listDelNode(copy_entries, listFirst(copy_entries));
-            count--;
-        }       
+        node = listNextNode(node);
     }
-    uint64_t offset = storageFirstIndex(ms) - 1 - import_first_ent->index;
-    if(listLength(ms->entries) >= offset)
-    {
-        uint64_t count =  listLength(ms->entries) - offset;
-        while(count > 0)
-        {
-            listDelNode(ms->entries, listLast(ms->entries));
-            count--;
-        }
-        listJoin(ms->entries, copy_entries);        
-    }else
+    raftEntry* dummy = listFirst(ms->entries)->value;
+    uint64_t offset = ((raftEntry*)node->value)->index - dummy->index;
+    if(listLength(ms->entries) < offset)
     {
+        /* There would be a hole in the log. */
         assert(false);
     }
+    while(listLength(ms->entries) > offset)
+    {
+        listDelNode(ms->entries, listLast(ms->entries));
+    }
+    while(node != NULL)
+    {
+        listAddNodeTail(ms->entries, copyRaftEntry(node->value));
+        node = listNextNode(node);
+    }
     return StorageOk;
 }
\ No newline at end of file
@@ -15,6 +15,7 @@ typedef struct memoryStorage
 {
     hardState* pState;
     snapshotMetaData* ssmd;
+    sds ssdata;             /* State of the application at ssmd->lastLogIndex. */
     list* entries;
 }memoryStorage;
 
@@ -48,7 +49,11 @@ TermResult getStorageTermOf(memoryStorage* ms, uint64_t index);
 
 snapshotMetaData* getStorageSnapshotMD(memoryStorage* ms);
 
-StorageError ApplySnapshot(memoryStorage* ms, snapshotMetaData* ssmd);
+snapshot* getStorageSnapshot(memoryStorage* ms);
+
+StorageError ApplySnapshot(memoryStorage* ms, snapshotMetaData* ssmd, sds data);
+
+StorageError CreateSnapshot(memoryStorage* ms, uint64_t index, confState* cs, sds data);
 
 StorageError Compact(memoryStorage* ms, uint64_t compact_index);
 
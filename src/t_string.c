@@ -85,7 +85,7 @@ void setGenericCommand(client *c, int flags, robj *key, robj *val, robj *expire,
     }
     setKey(c->db,key,val);
     server.dirty++;
-    if (expire) setExpire(c,c->db,key,mstime()+milliseconds);
+    if (expire) setExpire(c,c->db,key,commandTime()+milliseconds);
     notifyKeyspaceEvent(NOTIFY_STRING,"set",key,c->db->id);
     if (expire) notifyKeyspaceEvent(NOTIFY_GENERIC,
         "expire",key,c->db->id);
@@ -257,6 +257,9 @@ void getrangeCommand(client *c) {
     if (o->encoding == OBJ_ENCODING_INT) {
         str = llbuf;
         strlen = ll2string(llbuf,sizeof(llbuf),(long)o->ptr);
+    } else if (o->encoding == OBJ_ENCODING_ROARING) {
+        str = NULL;
+        strlen = stringObjectLen(o);
     } else {
         str = o->ptr;
         strlen = sdslen(str);
@@ -277,6 +280,12 @@ void getrangeCommand(client *c) {
      * nothing can be returned is: start > end. */
     if (start > end || strlen == 0) {
         addReply(c,shared.emptybulk);
+    } else if (str == NULL) {
+        /* Sparse bitmap: extract just the requested range. */
+        sds range = sdsnewlen(NULL,end-start+1);
+
+        roaringGetBytes(o->ptr,start,(unsigned char*)range,sdslen(range));
+        addReplyBulkSds(c,range);
     } else {
         addReplyBulkCBuffer(c,(char*)str+start,end-start+1);
     }
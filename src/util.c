@@ -42,6 +42,7 @@
 
 #include "util.h"
 #include "sha1.h"
+#include "zmalloc.h"
 
 /* Glob-style pattern matching. */
 int stringmatchlen(const char *pattern, int patternLen,
@@ -170,6 +171,291 @@ int stringmatch(const char *pattern, const char *string, int nocase) {
     return stringmatchlen(pattern,strlen(pattern),string,strlen(string),nocase);
 }
 
+/* Compiled glob-style patterns.
+ *
+ * stringmatchlen() parses the pattern again for every string it is matched
+ * against, and backtracks recursively on every '*'. When the same pattern
+ * is matched against many strings (KEYS, SCAN, pattern subscriptions, ...)
+ * it is better to compile it once with stringmatchCompile(), and then use
+ * stringmatchCompiled() that returns exactly the same result.
+ *
+ * A compiled pattern is a sequence of tokens, every one matching exactly a
+ * single character: a literal byte, any byte ('?'), or a set of bytes (a
+ * [...] class, or a letter when matching without case). The runs of '*'
+ * split the tokens in segments of fixed length: the first and the last
+ * segments are anchored to the start and the end of the string, and the
+ * others are searched left to right, taking the leftmost match of each,
+ * without any backtracking. */
+#define STRINGMATCH_LITERAL 0
+#define STRINGMATCH_ANY 1
+#define STRINGMATCH_SET 2
+
+typedef struct stringmatchToken {
+    unsigned char type;
+    unsigned char c;            /* Byte to match for STRINGMATCH_LITERAL. */
+    int set;                    /* Index in sets for STRINGMATCH_SET. */
+} stringmatchToken;
+
+typedef struct stringmatchSegment {
+    int start;                  /* Index of the first token. */
+    int len;                    /* Number of tokens. */
+} stringmatchSegment;
+
+struct stringmatchPattern {
+    int stars;                  /* True if the pattern has any '*'. */
+    int numsegs;
+    int numsets;
+    stringmatchToken *tokens;
+    stringmatchSegment *segs;
+    unsigned char (*sets)[32];  /* Bitmaps of the bytes matched by sets. */
+};
+
+static void stringmatchAddToken(stringmatchPattern *p, int *numtokens,
+                                int type, int c, unsigned char *set)
+{
+    stringmatchToken *t = p->tokens+(*numtokens)++;
+
+    t->type = type;
+    t->c = c;
+    t->set = -1;
+    if (type == STRINGMATCH_SET) {
+        p->sets = zrealloc(p->sets,sizeof(p->sets[0])*(p->numsets+1));
+        memcpy(p->sets[p->numsets],set,sizeof(p->sets[0]));
+        t->set = p->numsets++;
+    }
+}
+
+static void stringmatchAddSegment(stringmatchPattern *p, int start, int end) {
+    p->segs[p->numsegs].start = start;
+    p->segs[p->numsegs].len = end-start;
+    p->numsegs++;
+}
+
+#define stringmatchSetBit(set,b) ((set)[(b)>>3] |= 1<<((b)&7))
+
+stringmatchPattern *stringmatchCompile(const char *pattern, int patternLen,
+                                       int nocase)
+{
+    stringmatchPattern *p = zmalloc(sizeof(*p));
+    int numtokens = 0, segstart = 0, b;
+    unsigned char set[32];
+
+    p->stars = 0;
+    p->numsegs = 0;
+    p->numsets = 0;
+    p->tokens = zmalloc(sizeof(stringmatchToken)*(patternLen+1));
+    p->segs = zmalloc(sizeof(stringmatchSegment)*(patternLen+2));
+    p->sets = NULL;
+
+    /* The parsing follows exactly the one of stringmatchlen(), but all the
+     * bytes a token can match are evaluated at once. */
+    while(patternLen) {
+        switch(pattern[0]) {
+        case '*':
+            while (patternLen > 1 && pattern[1] == '*') {
+                pattern++;
+                patternLen--;
+            }
+            p->stars = 1;
+            stringmatchAddSegment(p,segstart,numtokens);
+            segstart = numtokens;
+            break;
+        case '?':
+            stringmatchAddToken(p,&numtokens,STRINGMATCH_ANY,0,NULL);
+            break;
+        case '[':
+        {
+            int not;
+
+            memset(set,0,sizeof(set));
+            pattern++;
+            patternLen--;
+            not = patternLen && pattern[0] == '^';
+            if (not) {
+                pattern++;
+                patternLen--;
+            }
+            while(1) {
+                if (pattern[0] == '\\' && patternLen >= 2) {
+                    pattern++;
+                    patternLen--;
+                    stringmatchSetBit(set,(unsigned char)pattern[0]);
+                } else if (patternLen == 0) {
+                    pattern--;
+                    patternLen++;
+                    break;
+                } else if (pattern[0] == ']') {
+                    break;
+                } else if (patternLen >= 3 && pattern[1] == '-') {
+                    int start = pattern[0];
+                    int end = pattern[2];
+                    if (start > end) {
+                        int t = start;
+                        start = end;
+                        end = t;
+                    }
+                    if (nocase) {
+                        start = tolower(start);
+                        end = tolower(end);
+                    }
+                    for (b = 0; b < 256; b++) {
+                        int c = (char)b;
+                        if (nocase) c = tolower(c);
+                        if (c >= start && c <= end) stringmatchSetBit(set,b);
+                    }
+                    pattern += 2;
+                    patternLen -= 2;
+                } else {
+                    for (b = 0; b < 256; b++) {
+                        if ((!nocase && (char)b == pattern[0]) ||
+                            (nocase && tolower((int)(char)b) ==
+                                       tolower((int)pattern[0])))
+                            stringmatchSetBit(set,b);
+                    }
+                }
+                pattern++;
+                patternLen--;
+            }
+            if (not) {
+                for (b = 0; b < 32; b++) set[b] = ~set[b];
+            }
+            stringmatchAddToken(p,&numtokens,STRINGMATCH_SET,0,set);
+            break;
+        }
+        case '\\':
+            if (patternLen >= 2) {
+                pattern++;
+                patternLen--;
+            }
+            /* fall through */
+        default:
+        {
+            int count = 0;
+
+            /* Without case a letter matches more than one byte. */
+            if (nocase) {
+                memset(set,0,sizeof(set));
+                for (b = 0; b < 256; b++) {
+                    if (tolower((int)(char)b) == tolower((int)pattern[0])) {
+                        stringmatchSetBit(set,b);
+                        count++;
+                    }
+                }
+            }
+            if (count > 1) {
+                stringmatchAddToken(p,&numtokens,STRINGMATCH_SET,0,set);
+            } else {
+                stringmatchAddToken(p,&numtokens,STRINGMATCH_LITERAL,
+                                    (unsigned char)pattern[0],NULL);
+            }
+            break;
+        }
+        }
+        pattern++;
+        patternLen--;
+    }
+    stringmatchAddSegment(p,segstart,numtokens);
+    return p;
+}
+
+void stringmatchFree(stringmatchPattern *p) {
+    if (p == NULL) return;
+    zfree(p->tokens);
+    zfree(p->segs);
+    zfree(p->sets);
+    zfree(p);
+}
+
+/* Return true if the segment 'seg' matches the string starting at 's', that
+ * must have at least seg->len bytes. */
+static int stringmatchSegmentAt(const stringmatchPattern *p,
+                                const stringmatchSegment *seg,
+                                const unsigned char *s)
+{
+    const stringmatchToken *t = p->tokens+seg->start;
+    int j;
+
+    for (j = 0; j < seg->len; j++, t++, s++) {
+        if (t->type == STRINGMATCH_LITERAL) {
+            if (*s != t->c) return 0;
+        } else if (t->type == STRINGMATCH_SET) {
+            if (!(p->sets[t->set][*s>>3] & (1<<(*s&7)))) return 0;
+        }
+    }
+    return 1;
+}
+
+/* Return the leftmost position of the string between 's' and 'end' where
+ * the segment 'seg' matches, or NULL if there is none. */
+static const unsigned char *stringmatchSegmentFind(
+        const stringmatchPattern *p, const stringmatchSegment *seg,
+        const unsigned char *s, const unsigned char *end)
+{
+    const stringmatchToken *first = p->tokens+seg->start;
+    const unsigned char *last;
+
+    if (end-s < seg->len) return NULL;
+    last = end-seg->len; /* Last position the segment can start at. */
+    if (first->type == STRINGMATCH_LITERAL) {
+        /* Skip to the candidates with memchr(), that is much faster than
+         * trying every position. */
+        while(s <= last) {
+            s = memchr(s,first->c,last-s+1);
+            if (s == NULL) return NULL;
+            if (stringmatchSegmentAt(p,seg,s)) return s;
+            s++;
+        }
+    } else {
+        for (; s <= last; s++)
+            if (stringmatchSegmentAt(p,seg,s)) return s;
+    }
+    return NULL;
+}
+
+/* Like stringmatchlen(), but using a pattern compiled by
+ * stringmatchCompile(), that also stores if the match is case sensitive. */
+int stringmatchCompiled(const stringmatchPattern *p, const char *string,
+                        int stringLen)
+{
+    const unsigned char *s = (const unsigned char*)string;
+    const unsigned char *end = s+stringLen;
+    const stringmatchSegment *first = p->segs, *last = p->segs+p->numsegs-1;
+    int j;
+
+    if (!p->stars)
+        return stringLen == first->len && stringmatchSegmentAt(p,first,s);
+
+    /* Match the anchored segments first: any string shorter than them, or
+     * not starting or ending like the pattern, is rejected right away. */
+    if (stringLen < first->len+last->len ||
+        !stringmatchSegmentAt(p,first,s) ||
+        !stringmatchSegmentAt(p,last,end-last->len)) return 0;
+    s += first->len;
+    end -= last->len;
+
+    for (j = 1; j < p->numsegs-1; j++) {
+        const stringmatchSegment *seg = p->segs+j;
+
+        s = stringmatchSegmentFind(p,seg,s,end);
+        if (s == NULL) return 0;
+        s += seg->len;
+    }
+    return 1;
+}
+
+/* Return the length of the literal prefix of a glob-style pattern, that is,
+ * the number of characters before the first special one. Every string
+ * matched (case sensitively) by the pattern starts with such prefix. */
+int stringmatchprefixlen(const char *pattern, int patternLen) {
+    int j;
+
+    for (j = 0; j < patternLen; j++) {
+        char c = pattern[j];
+        if (c == '*' || c == '?' || c == '[' || c == '\\') break;
+    }
+    return j;
+}
+
 /* Convert a string representing an amount of memory into the number of
  * bytes, so for instance memtoll("1Gb") will return 1073741824 that is
  * (1024*1024*1024).
@@ -822,6 +1108,30 @@ static void test_ll2string(void) {
 }
 
 #define UNUSED(x) (void)(x)
+static void test_stringmatchCompiled(void) {
+    const char *pchars = "ab*?[]^-\\Az";
+    const char *schars = "abAB-]^\\z";
+    char pat[16], str[32];
+    int j, i;
+
+    /* The compiled pattern must always agree with the interpreter, that
+     * expects the pattern and the string to be null terminated. */
+    for (j = 0; j < 1000000; j++) {
+        int plen = rand() % (sizeof(pat)-1);
+        int slen = 1 + rand() % (sizeof(str)-2);
+        int nocase = rand() & 1;
+        stringmatchPattern *p;
+
+        for (i = 0; i < plen; i++) pat[i] = pchars[rand() % strlen(pchars)];
+        for (i = 0; i < slen; i++) str[i] = schars[rand() % strlen(schars)];
+        pat[plen] = str[slen] = '\0';
+        p = stringmatchCompile(pat,plen,nocase);
+        assert(stringmatchCompiled(p,str,slen) ==
+               stringmatchlen(pat,plen,str,slen,nocase));
+        stringmatchFree(p);
+    }
+}
+
 int utilTest(int argc, char **argv) {
     UNUSED(argc);
     UNUSED(argv);
@@ -829,6 +1139,7 @@ int utilTest(int argc, char **argv) {
     test_string2ll();
     test_string2l();
     test_ll2string();
+    test_stringmatchCompiled();
     return 0;
 }
 #endif
@@ -40,6 +40,11 @@
 
 int stringmatchlen(const char *p, int plen, const char *s, int slen, int nocase);
 int stringmatch(const char *p, const char *s, int nocase);
+int stringmatchprefixlen(const char *p, int plen);
+typedef struct stringmatchPattern stringmatchPattern;
+stringmatchPattern *stringmatchCompile(const char *p, int plen, int nocase);
+int stringmatchCompiled(const stringmatchPattern *p, const char *s, int slen);
+void stringmatchFree(stringmatchPattern *p);
 long long memtoll(const char *p, int *err);
 uint32_t digits10(uint64_t v);
 uint32_t sdigits10(int64_t v);
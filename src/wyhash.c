@@ -0,0 +1,133 @@
+/*
+   wyhash C implementation, adapted for Redis.
+
+   Copyright (c) 2019-2020 Wang Yi <godspeed_china@yeah.net>
+
+   This is free and unencumbered software released into the public domain
+   (The Unlicense). See <http://unlicense.org/> for more information.
+
+   ----------------------------------------------------------------------------
+
+   This version is derived from the "final 3" version of wyhash, modified
+   in the following ways:
+
+   1. The 64 bits seed is derived from the same 16 bytes key used by our
+      SipHash implementation, so that a single seed is generated at startup
+      for both the hash functions.
+   2. Only the 64x64 -> 128 bits "mum" mixing is retained, without the
+      optional "condom" modes of the original.
+   3. Provide a case insensitive variant, lowering 8 bytes at a time, that
+      returns the same hash for strings that only differ in the case of
+      the A-Z characters, like siphash_nocase() does.
+
+   The function is several times faster than SipHash on short strings, but
+   it is NOT designed to resist hash flooding attacks: it must only be used
+   in hash tables where the keys are not controlled by the clients.
+ */
+#include <stdint.h>
+#include <string.h>
+
+#define WY_P0 0xa0761d6478bd642fULL
+#define WY_P1 0xe7037ed1a0b428dbULL
+#define WY_P2 0x8ebc6af09c88c6e3ULL
+#define WY_P3 0x589965cc75374cc3ULL
+
+/* Multiply 'a' and 'b' obtaining a 128 bits result, and fold it into
+ * 64 bits xoring the two halves together. */
+static inline uint64_t wymum(uint64_t a, uint64_t b) {
+#ifdef __SIZEOF_INT128__
+    __extension__ typedef unsigned __int128 wyu128;
+    wyu128 r = (wyu128)a * b;
+    return (uint64_t)r ^ (uint64_t)(r >> 64);
+#else
+    uint64_t ha = a >> 32, hb = b >> 32, la = (uint32_t)a, lb = (uint32_t)b;
+    uint64_t rh = ha*hb, rm0 = ha*lb, rm1 = hb*la, rl = la*lb, t, lo, hi, c;
+    t = rl+(rm0<<32); c = t < rl;
+    lo = t+(rm1<<32); c += lo < t;
+    hi = rh+(rm0>>32)+(rm1>>32)+c;
+    return lo ^ hi;
+#endif
+}
+
+/* Turn A-Z into a-z in all the 8 bytes of 'w' at the same time, leaving
+ * every other byte (including the ones with the high bit set) untouched. */
+static inline uint64_t wylower(uint64_t w) {
+    uint64_t h = w & 0x7f7f7f7f7f7f7f7fULL;
+    uint64_t ge_a = h + 0x3f3f3f3f3f3f3f3fULL;  /* High bit set if >= 'A' */
+    uint64_t gt_z = h + 0x2525252525252525ULL;  /* High bit set if > 'Z' */
+    uint64_t upper = (ge_a ^ gt_z) & ~w & 0x8080808080808080ULL;
+    return w | (upper >> 2);
+}
+
+static inline uint64_t wyr8(const uint8_t *p, int nocase) {
+    uint64_t v;
+    memcpy(&v,p,sizeof(v));
+    return nocase ? wylower(v) : v;
+}
+
+static inline uint64_t wyr4(const uint8_t *p, int nocase) {
+    uint32_t v;
+    memcpy(&v,p,sizeof(v));
+    return nocase ? wylower(v) : v;
+}
+
+/* Read 1 to 3 bytes. */
+static inline uint64_t wyr3(const uint8_t *p, size_t k, int nocase) {
+    uint64_t v = (((uint64_t)p[0])<<16)|(((uint64_t)p[k>>1])<<8)|p[k-1];
+    return nocase ? wylower(v) : v;
+}
+
+/* Once inlined with a constant 'nocase' the compiler removes the lowering
+ * from the case sensitive variant entirely. */
+static inline uint64_t wyhash_generic(const uint8_t *in, const size_t inlen,
+                                      const uint8_t *k, const int nocase)
+{
+    const uint8_t *p = in;
+    uint64_t k0, k1, seed, a, b;
+
+    memcpy(&k0,k,sizeof(k0));
+    memcpy(&k1,k+8,sizeof(k1));
+    seed = k0 ^ ((k1 << 32) | (k1 >> 32)) ^ WY_P0;
+
+    if (inlen <= 16) {
+        if (inlen >= 4) {
+            a = (wyr4(p,nocase)<<32)|wyr4(p+((inlen>>3)<<2),nocase);
+            b = (wyr4(p+inlen-4,nocase)<<32)|
+                wyr4(p+inlen-4-((inlen>>3)<<2),nocase);
+        } else if (inlen > 0) {
+            a = wyr3(p,inlen,nocase);
+            b = 0;
+        } else {
+            a = b = 0;
+        }
+    } else {
+        size_t i = inlen;
+        if (i > 48) {
+            uint64_t see1 = seed, see2 = seed;
+            do {
+                seed = wymum(wyr8(p,nocase)^WY_P1,wyr8(p+8,nocase)^seed);
+                see1 = wymum(wyr8(p+16,nocase)^WY_P2,wyr8(p+24,nocase)^see1);
+                see2 = wymum(wyr8(p+32,nocase)^WY_P3,wyr8(p+40,nocase)^see2);
+                p += 48;
+                i -= 48;
+            } while (i > 48);
+            seed ^= see1^see2;
+        }
+        while (i > 16) {
+            seed = wymum(wyr8(p,nocase)^WY_P1,wyr8(p+8,nocase)^seed);
+            i -= 16;
+            p += 16;
+        }
+        a = wyr8(p+i-16,nocase);
+        b = wyr8(p+i-8,nocase);
+    }
+    return wymum(WY_P1^inlen,wymum(a^WY_P1,b^seed));
+}
+
+uint64_t wyhash(const uint8_t *in, const size_t inlen, const uint8_t *k) {
+    return wyhash_generic(in,inlen,k,0);
+}
+
+uint64_t wyhash_nocase(const uint8_t *in, const size_t inlen, const uint8_t *k) {
+    return wyhash_generic(in,inlen,k,1);
+}
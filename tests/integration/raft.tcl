@@ -0,0 +1,177 @@
+# Every server of the raft group needs the address of the others before it
+# starts, so the ports that start_server is going to pick are found first.
+proc raft_ports {} {
+    set ports {}
+    set port $::port
+    for {set j 0} {$j < 3} {incr j} {
+        set port [find_available_port [expr {$port+1}]]
+        lappend ports $port
+    }
+    return $ports
+}
+
+proc raft_overrides {ports id} {
+    set peers {}
+    for {set j 0} {$j < 3} {incr j} {
+        lappend peers "[expr {$j+1}] 127.0.0.1 [lindex $ports $j]"
+    }
+    list port [lindex $ports [expr {$id-1}]] raft-id $id \
+         raft-peer [join $peers "\nraft-peer "]
+}
+
+proc raft_wait_for_leader {} {
+    wait_for_condition 100 100 {
+        [s 0 raft_leader] != 0 &&
+        [s 0 raft_leader] == [s -1 raft_leader] &&
+        [s 0 raft_leader] == [s -2 raft_leader]
+    } else {
+        fail "No raft leader elected"
+    }
+    s 0 raft_leader
+}
+
+set ports [raft_ports]
+start_server [list tags {"raft"} overrides [raft_overrides $ports 1]] {
+start_server [list overrides [raft_overrides $ports 2]] {
+start_server [list overrides [raft_overrides $ports 3]] {
+    # Level of the servers by raft id.
+    set level(1) -2
+    set level(2) -1
+    set level(3) 0
+
+    test {Raft group elects a leader} {
+        set leader [raft_wait_for_leader]
+        assert_equal leader [s $level($leader) raft_state]
+        set follower [expr {$leader%3+1}]
+        assert_equal follower [s $level($follower) raft_state]
+        set f [srv $level($follower) client]
+    }
+
+    test {Writes to a follower are applied by every server} {
+        assert_equal OK [$f set foo bar]
+        assert_equal 3 [$f rpush mylist a b c]
+        # The reply is sent once the follower applied the write.
+        assert_equal bar [$f get foo]
+        foreach l {0 -1 -2} {
+            wait_for_condition 50 100 {
+                [[srv $l client] get foo] eq {bar}
+            } else {
+                fail "The write was not applied by every server"
+            }
+            assert_equal {a b c} [[srv $l client] lrange mylist 0 -1]
+        }
+    }
+
+    test {Pipelined writes to a follower are applied in order} {
+        set rd [redis_deferring_client $level($follower)]
+        for {set j 0} {$j < 100} {incr j} {
+            $rd incr counter
+        }
+        for {set j 1} {$j <= 100} {incr j} {
+            assert_equal $j [$rd read]
+        }
+        $rd close
+        assert_equal 100 [$f get counter]
+    }
+
+    test {MULTI/EXEC on a follower is applied as a whole} {
+        $f multi
+        $f incr tx
+        $f get foo
+        $f incr tx
+        assert_equal {1 bar 2} [$f exec]
+        wait_for_condition 50 100 {
+            [[srv $level($leader) client] get tx] == 2
+        } else {
+            fail "The transaction was not applied by the leader"
+        }
+    }
+
+    test {EVALSHA on a follower is applied by every server} {
+        set sha [$f script load {return redis.call('incrby',KEYS[1],ARGV[1])}]
+        assert_equal 5 [$f evalsha $sha 1 scripted 5]
+        wait_for_condition 50 100 {
+            [[srv $level($leader) client] get scripted] == 5
+        } else {
+            fail "The script was not applied by the leader"
+        }
+    }
+
+    test {Non deterministic writes are refused} {
+        $f sadd myset a b c
+        catch {$f spop myset} e
+        set e
+    } {*raft mode*}
+
+    test {Expired keys are deleted by every server} {
+        $f set volatile 1 px 100
+        after 200
+        assert_equal {} [$f get volatile]
+        foreach l {0 -1 -2} {
+            wait_for_condition 50 100 {
+                [[srv $l client] exists volatile] == 0 &&
+                [[srv $l client] dbsize] == 6
+            } else {
+                fail "The expired key was not deleted"
+            }
+        }
+    }
+
+    test {CONSISTENCY local and leader acknowledge writes before applying them} {
+        assert_equal quorum [$f consistency]
+        assert_equal OK [$f consistency local]
+        assert_equal OK [$f incr acked]
+        assert_equal OK [$f consistency leader]
+        assert_equal OK [$f incr acked]
+        assert_equal leader [$f consistency]
+        catch {$f consistency eventual} e
+        assert_match {*must be one of*} $e
+        assert_equal OK [$f consistency quorum]
+        # Writes are executed in order, whatever their consistency.
+        assert_equal 3 [$f incr acked]
+        wait_for_condition 50 100 {
+            [[srv $level($leader) client] get acked] == 3
+        } else {
+            fail "The acknowledged writes were not applied by the leader"
+        }
+    }
+
+    test {CONSISTENCY linearizable reads on a follower see the leader writes} {
+        set l [srv $level($leader) client]
+        $f consistency linearizable
+        for {set j 1} {$j <= 20} {incr j} {
+            $l set linearizable $j
+            assert_equal $j [$f get linearizable]
+        }
+        # So do the transactions without writes.
+        $l set linearizable tx
+        $f multi
+        $f get linearizable
+        assert_equal {tx} [$f exec]
+        $f consistency quorum
+    } {OK}
+
+    test {The dataset is rebuilt from the raft log after a restart} {
+        set digest [$f debug digest]
+        catch {$f debug restart}
+        wait_for_condition 50 100 {
+            [catch {
+                set f [redis [srv $level($follower) host] \
+                             [srv $level($follower) port]]
+            }] == 0
+        } else {
+            fail "The server was not restarted"
+        }
+        wait_for_condition 50 100 {
+            [$f debug digest] eq $digest
+        } else {
+            fail "The dataset was not rebuilt"
+        }
+        # Restarted servers keep accepting writes.
+        raft_wait_for_leader
+        assert_equal OK [$f set afterrestart 1]
+        $f close
+    }
+}
+}
+}
@@ -0,0 +1,171 @@
+# Failover with the Sentinels running in raft mode.
+
+source "../tests/includes/init-tests.tcl"
+
+proc raft_leader_id {} {
+    set leader {}
+    foreach_sentinel_id id {
+        if {[instance_is_killed sentinel $id]} continue
+        set l [SI $id sentinel_raft_leader]
+        if {$l == 0 || ($leader ne {} && $l != $leader)} {return -1}
+        set leader $l
+    }
+    # Raft ids are the Sentinel ids plus one.
+    expr {$leader-1}
+}
+
+proc wait_for_raft_leader {{old -1}} {
+    wait_for_condition 1000 50 {
+        [raft_leader_id] != -1 && [raft_leader_id] != $old
+    } else {
+        fail "The Sentinels did not agree on a raft leader"
+    }
+    raft_leader_id
+}
+
+proc wait_for_failover {old_port} {
+    foreach_sentinel_id id {
+        if {[instance_is_killed sentinel $id]} continue
+        wait_for_condition 1000 50 {
+            [lindex [S $id SENTINEL GET-MASTER-ADDR-BY-NAME mymaster] 1] != $old_port
+        } else {
+            fail "Sentinel $id did not switch to the new master"
+        }
+    }
+}
+
+test "(init) Restart the Sentinels in raft mode" {
+    foreach_sentinel_id id {
+        kill_instance sentinel $id
+    }
+    foreach_sentinel_id id {
+        set cfg [open "sentinel_$id/sentinel.conf" a]
+        puts $cfg "sentinel raft-id [expr {$id+1}]"
+        foreach_sentinel_id peer {
+            puts $cfg "sentinel raft-peer [expr {$peer+1}] 127.0.0.1 [get_instance_attrib sentinel $peer port]"
+        }
+        close $cfg
+    }
+    foreach_sentinel_id id {
+        restart_instance sentinel $id
+    }
+}
+
+test "The Sentinels elect a raft leader" {
+    set leader [wait_for_raft_leader]
+    foreach_sentinel_id id {
+        assert {[SI $id sentinel_raft_term] == [SI $leader sentinel_raft_term]}
+    }
+}
+
+test "The raft leader fails over the master" {
+    set old_port [RI $master_id tcp_port]
+    set leader [raft_leader_id]
+    kill_instance redis $master_id
+    wait_for_failover $old_port
+    restart_instance redis $master_id
+
+    set addr [S $leader SENTINEL GET-MASTER-ADDR-BY-NAME mymaster]
+    foreach_sentinel_id id {
+        assert {[S $id SENTINEL GET-MASTER-ADDR-BY-NAME mymaster] eq $addr}
+    }
+    set master_id [get_instance_id_by_port redis [lindex $addr 1]]
+    wait_for_condition 1000 50 {
+        [RI $master_id role] eq {master}
+    } else {
+        fail "New master [join $addr {:}] is not a master"
+    }
+}
+
+test "We can failover with the raft leader crashed" {
+    set killed [raft_leader_id]
+    kill_instance sentinel $killed
+    set leader [wait_for_raft_leader $killed]
+
+    set old_port [RI $master_id tcp_port]
+    kill_instance redis $master_id
+    wait_for_failover $old_port
+    restart_instance redis $master_id
+
+    set addr [S $leader SENTINEL GET-MASTER-ADDR-BY-NAME mymaster]
+    set master_id [get_instance_id_by_port redis [lindex $addr 1]]
+}
+
+test "After the old raft leader is restarted, it catches up from the log" {
+    restart_instance sentinel $killed
+    wait_for_condition 1000 50 {
+        [S $killed SENTINEL GET-MASTER-ADDR-BY-NAME mymaster] eq $addr
+    } else {
+        fail "Restarted Sentinel did not apply the failover"
+    }
+    wait_for_condition 1000 50 {
+        [SI $killed sentinel_raft_applied] == [SI $leader sentinel_raft_applied]
+    } else {
+        fail "Restarted Sentinel did not catch up with the raft log"
+    }
+}
+
+test "SENTINEL MONITOR, SET and REMOVE are applied by every Sentinel" {
+    set addr [S $leader SENTINEL GET-MASTER-ADDR-BY-NAME mymaster]
+    set follower [expr {($leader+1) % [llength $::sentinel_instances]}]
+    if {$follower == $killed} {
+        set follower [expr {($follower+1) % [llength $::sentinel_instances]}]
+    }
+    # The change is made by the Sentinels once the raft entry is committed.
+    S $follower SENTINEL MONITOR raftmaster [lindex $addr 0] [lindex $addr 1] 2
+    wait_for_condition 1000 50 {
+        [catch {S $follower SENTINEL MASTER raftmaster}] == 0
+    } else {
+        fail "Sentinel $follower did not apply MONITOR"
+    }
+    S $follower SENTINEL SET raftmaster down-after-milliseconds 12345
+    foreach_sentinel_id id {
+        wait_for_condition 1000 50 {
+            [catch {S $id SENTINEL MASTER raftmaster} info] == 0 &&
+            [dict get $info down-after-milliseconds] == 12345
+        } else {
+            fail "Sentinel $id did not apply MONITOR and SET"
+        }
+    }
+    assert_error "*Duplicated*" {S $leader SENTINEL MONITOR raftmaster 127.0.0.1 1 2}
+
+    S $leader SENTINEL REMOVE raftmaster
+    foreach_sentinel_id id {
+        wait_for_condition 1000 50 {
+            [catch {S $id SENTINEL MASTER raftmaster}] == 1
+        } else {
+            fail "Sentinel $id did not apply REMOVE"
+        }
+    }
+}
+
+test "The raft log is compacted" {
+    kill_instance sentinel $killed
+    for {set j 0} {$j < 150} {incr j} {
+        S $leader SENTINEL SET mymaster failover-timeout [expr {20000+$j}]
+    }
+    S $leader SENTINEL SET mymaster failover-timeout 20000
+    foreach_sentinel_id id {
+        if {[instance_is_killed sentinel $id]} continue
+        wait_for_condition 1000 50 {
+            [SI $id sentinel_raft_snapshot] > 0 &&
+            [dict get [S $id SENTINEL MASTER mymaster] failover-timeout] == 20000
+        } else {
+            fail "Sentinel $id did not compact its raft log"
+        }
+        set entries [exec grep -c "raft-entry" "sentinel_$id/sentinel.conf"]
+        assert {$entries < 150}
+    }
+}
+
+test "A Sentinel missing compacted entries catches up from the snapshot" {
+    restart_instance sentinel $killed
+    wait_for_condition 1000 50 {
+        [SI $killed sentinel_raft_applied] == [SI $leader sentinel_raft_applied] &&
+        [SI $killed sentinel_raft_snapshot] > 0
+    } else {
+        fail "Restarted Sentinel did not catch up with the raft leader"
+    }
+    assert {[dict get [S $killed SENTINEL MASTER mymaster] failover-timeout] == 20000}
+    assert {[S $killed SENTINEL GET-MASTER-ADDR-BY-NAME mymaster] eq $addr}
+}
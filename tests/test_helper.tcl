@@ -43,6 +43,7 @@ set ::all_tests {
     integration/logging
     integration/psync2
     integration/psync2-reg
+    integration/raft
     unit/pubsub
     unit/slowlog
     unit/scripting
@@ -58,6 +59,7 @@ set ::all_tests {
     unit/hyperloglog
     unit/lazyfree
     unit/wait
+    unit/networking
 }
 # Index to the next test to run in the ::all_tests list.
 set ::next_test 0
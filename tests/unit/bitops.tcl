@@ -348,4 +348,129 @@ start_server {tags {"bitops"}} {
             }
         }
     }
+
+    test {SETBIT at a large offset uses the roaring encoding} {
+        r del sparse
+        r setbit sparse 4000000000 1
+        list [r object encoding sparse] [r strlen sparse] \
+             [r getbit sparse 4000000000] [r getbit sparse 3999999999] \
+             [r bitcount sparse] [r bitpos sparse 1]
+    } {roaring 500000001 1 0 1 4000000000}
+
+    test {Roaring bitmaps only use memory for the set bits} {
+        assert {[r memory usage sparse] < 1000}
+    }
+
+    test {Small bitmaps are never encoded as roaring} {
+        r del small
+        r setbit small 100 1
+        r object encoding small
+    } {raw}
+
+    test {Roaring bitmaps read like the plain string they represent} {
+        r del sparse
+        set max 1000000
+        for {set j 0} {$j < 500} {incr j} {
+            r setbit sparse [randomInt $max] [randomInt 2]
+        }
+        assert_encoding roaring sparse
+        set plain [r get sparse]
+        r set plain $plain
+        assert_encoding raw plain
+        assert_equal [r strlen sparse] [string length $plain]
+        assert_equal [r getrange sparse 1000 60000] [r getrange plain 1000 60000]
+        assert_equal [r getrange sparse -100 -1] [r getrange plain -100 -1]
+        foreach {start end} {0 -1 10 20000 -5000 -1 100000 99 5 5} {
+            assert_equal [r bitcount sparse $start $end] \
+                         [r bitcount plain $start $end]
+            assert_equal [r bitpos sparse 1 $start $end] \
+                         [r bitpos plain 1 $start $end]
+            assert_equal [r bitpos sparse 0 $start $end] \
+                         [r bitpos plain 0 $start $end]
+        }
+        for {set j 0} {$j < 100} {incr j} {
+            set pos [randomInt $max]
+            assert_equal [r getbit sparse $pos] [r getbit plain $pos]
+        }
+        assert_equal [r bitfield sparse get u8 80000 get i5 123456] \
+                     [r bitfield plain get u8 80000 get i5 123456]
+        assert_encoding roaring sparse
+    }
+
+    test {BITOP against roaring bitmaps} {
+        r del a b
+        for {set j 0} {$j < 200} {incr j} {
+            r setbit a [randomInt 2000000] 1
+            r setbit b [randomInt 3000000] 1
+        }
+        r set plaina [r get a]
+        r set plainb [r get b]
+        foreach op {and or xor} {
+            r bitop $op dest a b
+            r bitop $op plaindest plaina plainb
+            assert_equal [r get dest] [r get plaindest]
+            r bitop $op dest a plainb
+            assert_equal [r get dest] [r get plaindest]
+        }
+        r bitop or dest a b
+        assert_encoding roaring dest
+        r bitop not dest a
+        r bitop not plaindest plaina
+        assert_equal [r get dest] [r get plaindest]
+    }
+
+    test {Roaring bitmaps are converted to raw when they get dense} {
+        r del sparse
+        r setbit sparse 65535 1
+        assert_encoding roaring sparse
+        for {set j 0} {$j < 8192} {incr j} {
+            r setbit sparse [expr {$j*8}] 1
+        }
+        assert_encoding raw sparse
+        r bitcount sparse
+    } {8193}
+
+    test {Writing a roaring bitmap as a string converts it to raw} {
+        r del sparse
+        r setbit sparse 100000 1
+        r bitfield sparse set u8 0 255
+        assert_encoding raw sparse
+        assert_equal 9 [r bitcount sparse]
+        r del sparse
+        r setbit sparse 100000 1
+        r append sparse foo
+        assert_encoding raw sparse
+        assert_equal 12504 [r strlen sparse]
+        r del sparse
+        r setbit sparse 100000 1
+        r setrange sparse 0 foo
+        assert_encoding raw sparse
+        r getrange sparse 0 2
+    } {foo}
+
+    test {Roaring bitmaps survive DEBUG RELOAD and DUMP/RESTORE} {
+        r del sparse
+        foreach pos {7 100000 4000000 4000001 4000002 90000000} {
+            r setbit sparse $pos 1
+        }
+        set plain [r get sparse]
+        r debug reload
+        assert_encoding roaring sparse
+        assert_equal $plain [r get sparse]
+        set dump [r dump sparse]
+        r del sparse
+        r restore sparse 0 $dump
+        assert_encoding roaring sparse
+        assert_equal $plain [r get sparse]
+        r bitcount sparse
+    } {6}
+
+    test {bitmap-roaring-min-bytes 0 disables the roaring encoding} {
+        r config set bitmap-roaring-min-bytes 0
+        r del sparse
+        r setbit sparse 100000 1
+        set enc [r object encoding sparse]
+        r config set bitmap-roaring-min-bytes 4096
+        set enc
+    } {raw}
 }
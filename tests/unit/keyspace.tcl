@@ -273,3 +273,25 @@ start_server {tags {"keyspace"}} {
         r keys *
     } {dlskeriewrioeuwqoirueioqwrueoqwrueqw}
 }
+
+start_server {tags {"keyspace"} overrides {keyspace-fast-hash yes}} {
+    test {Keys, expires and rehashing with keyspace-fast-hash} {
+        assert_equal {keyspace-fast-hash yes} [r config get keyspace-fast-hash]
+        catch {r config set keyspace-fast-hash no} e
+        assert_match {*Unsupported*} $e
+        for {set j 0} {$j < 5000} {incr j} {
+            r set key:$j $j
+            if {$j % 2} {r expire key:$j 1000}
+        }
+        r debug reload
+        set err {}
+        for {set j 0} {$j < 5000} {incr j} {
+            if {[r get key:$j] ne $j} {set err "key:$j missing"; break}
+            set ttl [r ttl key:$j]
+            if {($j % 2 && $ttl <= 0) || (!($j % 2) && $ttl != -1)} {
+                set err "key:$j has TTL $ttl"; break
+            }
+        }
+        list $err [r dbsize] [llength [r keys key:4*]]
+    } {{} 5000 1111}
+}
@@ -37,3 +37,34 @@ start_server {tags {"lazyfree"}} {
         }
     }
 }
+
+start_server {tags {"lazyfree"}} {
+    test "FLUSHALL ASYNC while big values are being sent to a client" {
+        set big [string repeat x 200000]
+        r set big $big
+        r config resetstat
+        set rd [redis_deferring_client]
+        for {set j 0} {$j < 100} {incr j} {
+            $rd get big
+        }
+        $rd flush
+        # Wait for all the replies to be queued: most of them remain
+        # referenced by the client output list, since we are not reading.
+        wait_for_condition 50 100 {
+            [string match {*cmdstat_get:calls=100,*} [r info commandstats]]
+        } else {
+            fail "Replies not queued"
+        }
+        r flushall async
+        for {set j 0} {$j < 100} {incr j} {
+            assert_equal $big [$rd read]
+        }
+        $rd close
+        wait_for_condition 50 100 {
+            [s lazyfree_pending_objects] == 0
+        } else {
+            fail "Lazy free pending objects not released"
+        }
+        r dbsize
+    } {0}
+}
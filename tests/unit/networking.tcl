@@ -0,0 +1,71 @@
+start_server {tags {"networking"} overrides {io-threads 2 io-threads-do-reads yes}} {
+    test {CONFIG GET io-threads} {
+        list [lindex [r config get io-threads] 1] \
+             [lindex [r config get io-threads-do-reads] 1]
+    } {2 yes}
+
+    test {Many clients with pipelined commands using I/O threads} {
+        set clients {}
+        for {set j 0} {$j < 20} {incr j} {
+            lappend clients [redis_deferring_client]
+        }
+        # Enough clients with pending writes at the same time to make
+        # the server activate the I/O threads.
+        for {set i 0} {$i < 50} {incr i} {
+            set j 0
+            foreach rd $clients {
+                $rd set key:$j:$i [string repeat x $i]
+                $rd incr counter:$j
+                incr j
+            }
+        }
+        set j 0
+        foreach rd $clients {
+            for {set i 0} {$i < 50} {incr i} {
+                assert_equal OK [$rd read]
+                assert_equal [expr {$i+1}] [$rd read]
+            }
+            incr j
+        }
+        foreach rd $clients {$rd close}
+        list [r get key:19:49] [r get counter:7] [r dbsize]
+    } [list [string repeat x 49] 50 1020]
+
+    test {Large replies are fully delivered using I/O threads} {
+        r set big [string repeat abcdefghij 100000]
+        set clients {}
+        for {set j 0} {$j < 10} {incr j} {
+            set rd [redis_deferring_client]
+            $rd get big
+            $rd get big
+            lappend clients $rd
+        }
+        foreach rd $clients {
+            assert_equal 1000000 [string length [$rd read]]
+            assert_equal 1000000 [string length [$rd read]]
+            $rd close
+        }
+        r ping
+    } {PONG}
+
+    test {Pending big replies are not affected by later writes to the key} {
+        set payload [string repeat abcdefghij 500000]
+        r set big $payload
+        set clients {}
+        for {set j 0} {$j < 10} {incr j} {
+            set rd [redis_deferring_client]
+            $rd get big
+            lappend clients $rd
+        }
+        # Make sure the replies are queued (but can't be fully written since
+        # nobody is reading them) before modifying the value in place.
+        r ping
+        r setrange big 0 XXXXX
+        r append big YYYYY
+        foreach rd $clients {
+            assert {[$rd read] eq $payload}
+            $rd close
+        }
+        list [r getrange big 0 4] [r strlen big]
+    } {XXXXX 5000005}
+}
@@ -68,6 +68,29 @@ start_server {tags {"protocol"}} {
         assert_error "*unbalanced*" {r read}
     }
 
+    test "Pipelined commands touching the same keys run in order" {
+        reconnect
+        r del pk1 pk2 pk3
+        set proto ""
+        foreach cmd {{SET pk1 a} {GET pk1} {MSET pk2 b pk3 c} {MGET pk1 pk2 pk3}
+                     {DEL pk1} {GET pk1} {PING} {APPEND pk2 x} {GET pk2}} {
+            append proto "*[llength $cmd]\r\n"
+            foreach arg $cmd {
+                append proto "\$[string length $arg]\r\n$arg\r\n"
+            }
+        }
+        # Send the pipeline split in the middle of a command.
+        set half [expr {[string length $proto]/2}]
+        r write [string range $proto 0 $half]
+        r flush
+        after 100
+        r write [string range $proto [expr {$half+1}] end]
+        r flush
+        set res {}
+        for {set j 0} {$j < 9} {incr j} {lappend res [r read]}
+        set res
+    } {OK a OK {a b c} 1 {} PONG 2 bx}
+
     set c 0
     foreach seq [list "\x00" "*\x00" "$\x00"] {
         incr c
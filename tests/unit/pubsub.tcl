@@ -161,6 +161,68 @@ start_server {tags {"pubsub"}} {
         $rd1 close
     }
 
+    test "PUBLISH/PSUBSCRIBE with patterns with different literal prefixes" {
+        set rd1 [redis_deferring_client]
+        set patterns {* f* fo?.* foo.* foo.b[aeiou]r foo.bar foo.bar* x\\* h[ae]llo}
+        assert_equal {1 2 3 4 5 6 7 8 9} [psubscribe $rd1 $patterns]
+        assert_equal 9 [r pubsub numpat]
+        assert_equal 7 [r publish foo.bar hi]
+        assert_equal 2 [r publish fo hi]
+        assert_equal 2 [r publish x* hi]
+        assert_equal 1 [r publish xy hi]
+        assert_equal 2 [r publish hello hi]
+        assert_equal 1 [r publish {} hi]
+        set got {}
+        for {set j 0} {$j < 15} {incr j} {
+            set msg [$rd1 read]
+            lappend got "[lindex $msg 1]|[lindex $msg 2]"
+        }
+        assert_equal [lsort {
+            *|foo.bar f*|foo.bar fo?.*|foo.bar foo.*|foo.bar
+            foo.b[aeiou]r|foo.bar foo.bar|foo.bar foo.bar*|foo.bar
+            *|fo f*|fo *|x* x\\*|x* *|xy *|hello h[ae]llo|hello *|
+        }] [lsort $got]
+        assert_equal {8 7 6 6} [punsubscribe $rd1 {foo.bar fo?.* x\\* missing}]
+        assert_equal 6 [r pubsub numpat]
+        assert_equal 5 [r publish foo.bar hi]
+        $rd1 close
+        wait_for_condition 50 100 {
+            [r pubsub numpat] == 0
+        } else {
+            fail "Patterns not removed when the client was freed"
+        }
+    }
+
+    test "PUBLISH of big messages to many channel and pattern subscribers" {
+        set clients {}
+        for {set j 0} {$j < 10} {incr j} {
+            set rd [redis_deferring_client]
+            if {$j % 2} {
+                psubscribe $rd {big.*}
+            } else {
+                subscribe $rd {big.chan}
+            }
+            lappend clients $rd
+        }
+        set small [string repeat x 100]
+        set big [string repeat y 50000]
+        assert_equal 10 [r publish big.chan $small]
+        assert_equal 10 [r publish big.chan $big]
+        assert_equal 10 [r publish big.chan 12345]
+        set j 0
+        foreach rd $clients {
+            foreach payload [list $small $big 12345] {
+                if {$j % 2} {
+                    assert_equal [list pmessage big.* big.chan $payload] [$rd read]
+                } else {
+                    assert_equal [list message big.chan $payload] [$rd read]
+                }
+            }
+            $rd close
+            incr j
+        }
+    }
+
     test "PUBLISH/PSUBSCRIBE with two clients" {
         set rd1 [redis_deferring_client]
         set rd2 [redis_deferring_client]
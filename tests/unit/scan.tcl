@@ -237,3 +237,138 @@ start_server {tags {"scan"}} {
         assert {$first_score != 0}
     }
 }
+
+start_server {tags {"scan"} overrides {keyspace-prefix-index yes}} {
+    test "SCAN MATCH with a prefix using the keys index" {
+        r flushdb
+        r debug populate 1000
+        for {set j 0} {$j < 100} {incr j} {
+            r set user:$j:name foo
+            r set user:$j:age 10
+        }
+
+        set cur 0
+        set keys {}
+        while 1 {
+            set res [r scan $cur match user:1*:name count 3]
+            set cur [lindex $res 0]
+            set k [lindex $res 1]
+            lappend keys {*}$k
+            if {$cur == 0} break
+        }
+
+        assert_equal 11 [llength $keys]
+        assert_equal [lsort $keys] $keys
+        assert_equal [lsort [r keys user:1*:name]] $keys
+        assert_equal 0 [llength [r keys user:x*]]
+        assert_equal {key:10} [r keys key:10]
+        assert_equal 1000 [llength [r keys key:*]]
+    }
+
+    test "SCAN with the keys index returns keys present during the whole iteration" {
+        r flushdb
+        for {set j 0} {$j < 500} {incr j} {
+            r set tenant:$j x
+        }
+
+        set cur 0
+        set keys {}
+        set j 0
+        while 1 {
+            set res [r scan $cur match tenant:* count 10]
+            set cur [lindex $res 0]
+            set k [lindex $res 1]
+            lappend keys {*}$k
+            # Delete the keys just returned and add new ones.
+            foreach key $k {r del $key}
+            r set tenant:new:[incr j] x
+            if {$cur == 0} break
+        }
+
+        set keys [lsort -unique $keys]
+        for {set j 0} {$j < 500} {incr j} {
+            assert {[lsearch -exact $keys tenant:$j] != -1}
+        }
+    }
+
+    test "SCAN with the keys index skips expired keys" {
+        r flushdb
+        r debug set-active-expire 0
+        for {set j 0} {$j < 20} {incr j} {
+            r set exp:$j x
+            if {$j % 2} {r pexpire exp:$j 1}
+        }
+        after 10
+        set res [r scan 0 match exp:* count 100]
+        r debug set-active-expire 1
+        list [lindex $res 0] [llength [lindex $res 1]] [r dbsize]
+    } {0 10 10}
+
+    test "SCAN with the keys index can be resumed after many SCANs of other clients" {
+        r flushdb
+        for {set j 0} {$j < 100} {incr j} {
+            r set page:$j x
+        }
+        set rd [redis_deferring_client]
+
+        set cur 0
+        set keys {}
+        while 1 {
+            set res [r scan $cur match page:* count 40]
+            set cur [lindex $res 0]
+            lappend keys {*}[lindex $res 1]
+            if {$cur == 0} break
+            # Other clients going through more than 4096 pages.
+            for {set j 0} {$j < 5000} {incr j} {
+                $rd scan 0 match page:* count 1
+            }
+            for {set j 0} {$j < 5000} {incr j} {
+                $rd read
+            }
+        }
+        $rd close
+
+        # Not restarted: every key is returned once, in order.
+        assert_equal 100 [llength $keys]
+        assert_equal [lsort $keys] $keys
+    }
+
+    test "SCAN with an unknown keys index cursor restarts the iteration" {
+        r flushdb
+        for {set j 0} {$j < 100} {incr j} {
+            r set other:$j x
+        }
+
+        # A cursor of another client, and one that was never returned.
+        set rd [redis_deferring_client]
+        $rd scan 0 match other:* count 10
+        set other_cur [lindex [$rd read] 0]
+        $rd close
+
+        foreach start [list $other_cur 9223372036854775813] {
+            set cur $start
+            set keys {}
+            while 1 {
+                set res [r scan $cur match other:* count 10]
+                set cur [lindex $res 0]
+                lappend keys {*}[lindex $res 1]
+                if {$cur == 0} break
+            }
+            assert_equal 100 [llength [lsort -unique $keys]]
+        }
+    }
+
+    test "The keys index follows FLUSHDB and SWAPDB" {
+        r flushdb
+        r set a:1 x
+        r select 10
+        r flushdb
+        r set a:2 x
+        r swapdb 9 10
+        set r1 [r keys a:*]
+        r flushdb async
+        set r2 [r keys a:*]
+        r select 9
+        list $r1 $r2 [r keys a:*]
+    } {a:1 {} a:2}
+}
@@ -395,6 +395,31 @@ start_server {
       $rd read
     } {}
 
+    test {Blocked clients time out in order of timeout} {
+        r del blist
+        set rd1 [redis_deferring_client]
+        set rd2 [redis_deferring_client]
+        set rd3 [redis_deferring_client]
+        $rd1 blpop blist 10
+        $rd2 blpop blist 4
+        $rd3 blpop blist 1
+        wait_for_condition 50 100 {
+            [s blocked_clients] == 3
+        } else {
+            fail "Clients are not blocked"
+        }
+        # The served client must not time out later.
+        r rpush blist foo
+        assert_equal {blist foo} [$rd1 read]
+        assert_equal {} [$rd3 read]
+        assert_equal 1 [s blocked_clients]
+        assert_equal {} [$rd2 read]
+        assert_equal 0 [s blocked_clients]
+        $rd1 close
+        $rd2 close
+        $rd3 close
+    }
+
     test "BLPOP when new key is moved into place" {
         set rd [redis_deferring_client]
 